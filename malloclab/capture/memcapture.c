@@ -0,0 +1,767 @@
+//------------------------------------------------------------------------------
+//
+// memcapture
+//
+// record the dynamic memory requests of a program as an mdriver trace
+//
+// The library is interposed with LD_PRELOAD the same way as the memtrace
+// library of the link lab. Every successful malloc/calloc/realloc/free is
+// turned into an 'a', 'r' or 'f' request of the mdriver trace format:
+//
+//   - each block gets a stable id when it is allocated; a realloc keeps the
+//     id of the original block, a free refers to it
+//   - the calling thread appends the request to its own single-producer ring
+//     buffer; no locks are taken on the allocation path
+//   - a background thread drains the ring buffers into a spool file
+//   - when the program exits, the spool is sorted by sequence number and
+//     written out as <out>.rep together with the trace header
+//
+// environment variables
+//
+//   MEMCAPTURE_OUT     name of the trace file (default: memcapture.rep);
+//                      a "%p" is replaced by the process id, which keeps
+//                      the traces of programs that exec children apart
+//   MEMCAPTURE_SLOTS   number of slots of the address->id table
+//                      (default: 1<<22, rounded up to a power of two)
+//
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+//
+// tunables
+//
+#define RING_EVENTS     (1<<14)       // events per thread buffer (power of 2)
+#define DEFAULT_SLOTS   (1<<22)       // default size of the address->id table
+#define SEEN_BITS       4             // bits of the seen filter per table slot
+#define BOOT_HEAP       (1<<16)       // bytes served before dlsym() completed
+#define FLUSH_USEC      1000          // flusher sleep time when idle
+#define DEFAULT_OUT     "memcapture.rep"
+
+//
+// event record
+//
+// The request type lives in the two top bits of the sequence number so that a
+// record stays 16 bytes large.
+//
+#define EV_ALLOC        1ULL
+#define EV_REALLOC      2ULL
+#define EV_FREE         3ULL
+#define EV_SHIFT        62
+#define EV_PACK(type, seq)  (((type) << EV_SHIFT) | (seq))
+#define EV_TYPE(s)      ((s) >> EV_SHIFT)
+#define EV_SEQ(s)       ((s) & ((1ULL << EV_SHIFT) - 1))
+
+typedef struct {
+  uint64_t seq;                 // type and global sequence number
+  uint32_t id;                  // block id
+  uint32_t size;                // requested size (alloc/realloc only)
+} event;
+
+//
+// per-thread ring buffer
+//
+// head is only written by the owning thread, tail only by the flusher.
+// Buffers are never unmapped; the buffer of an exited thread is handed to the
+// next new thread once the flusher has drained it.
+//
+typedef struct __tbuf {
+  _Atomic uint64_t head;        // next slot the producer writes
+  char pad1[64 - sizeof(uint64_t)];
+  _Atomic uint64_t tail;        // next slot the flusher reads
+  char pad2[64 - sizeof(uint64_t)];
+  _Atomic int in_use;           // owned by a live thread
+  struct __tbuf *next;          // next buffer in the global list
+  event ev[RING_EVENTS];
+} tbuf;
+
+//
+// address->id table (open addressing, linear probing)
+//
+// A slot is claimed with a CAS on its key. Since the allocator never hands out
+// the same address twice while it is live, only the thread that got an
+// address from malloc inserts it and only the thread freeing it removes it.
+//
+#define KEY_EMPTY       ((uintptr_t)0)
+#define KEY_DELETED     ((uintptr_t)1)
+
+typedef struct {
+  _Atomic uintptr_t key;
+  _Atomic uint32_t id;          // stored once the key is claimed
+} slot;
+
+//
+// function pointers to stdlib's memory management functions
+//
+static void *(*mallocp)(size_t size) = NULL;
+static void (*freep)(void *ptr) = NULL;
+static void *(*callocp)(size_t nmemb, size_t size) = NULL;
+static void *(*reallocp)(void *ptr, size_t size) = NULL;
+
+//
+// global state
+//
+static _Atomic int capturing = 0;           // record requests?
+static _Atomic int stop_flusher = 0;        // ask the flusher to terminate
+static _Atomic uint64_t next_seq = 0;       // global request sequence number
+static _Atomic uint32_t next_id = 0;        // next block id
+static _Atomic uint64_t n_stalls = 0;       // producer waited for the flusher
+static _Atomic uint64_t n_dropped = 0;      // requests that could not be recorded
+static _Atomic(tbuf *) buffers = NULL;      // list of all thread buffers
+
+static slot *table = NULL;
+static size_t table_mask = 0;
+static _Atomic size_t max_probe = 0;        // longest probe of an insert so far
+static _Atomic uint64_t *seen = NULL;       // one bit per hash of every address
+static size_t seen_mask = 0;                // ever inserted (SEEN_BITS per slot)
+
+static pthread_t flusher;
+static pthread_key_t buf_key;
+static int spool_fd = -1;
+static char out_path[PATH_MAX];
+static char spool_path[PATH_MAX + 32];
+
+static char boot_heap[BOOT_HEAP] __attribute__((aligned(16)));
+static size_t boot_used = 0;
+
+static __thread tbuf *my_buf __attribute__((tls_model("initial-exec"))) = NULL;
+static __thread int in_hook __attribute__((tls_model("initial-exec"))) = 0;
+
+//------------------------------------------------------------------------------
+// bootstrap allocator
+//
+// dlsym() may call calloc before we know where the real one is; those requests
+// are served from a static arena and never recorded.
+//
+static void *boot_alloc(size_t size)
+{
+  size_t asize = (size + 15) & ~(size_t)15;
+
+  if (boot_used + asize > BOOT_HEAP)
+    return NULL;
+  void *p = boot_heap + boot_used;
+  boot_used += asize;
+  return p;
+}
+
+static int is_boot(void *ptr)
+{
+  return (char *)ptr >= boot_heap && (char *)ptr < boot_heap + BOOT_HEAP;
+}
+
+//------------------------------------------------------------------------------
+// address->id table
+//
+static uint64_t mix_ptr(uintptr_t p)
+{
+  uint64_t h = p;
+
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static size_t hash_ptr(uintptr_t p)
+{
+  return (size_t)mix_ptr(p) & table_mask;
+}
+
+// the bit of the seen filter for p, taken from other bits of the hash than
+// its slot
+static size_t seen_bit(uintptr_t p)
+{
+  return (size_t)(mix_ptr(p) >> 32) & seen_mask;
+}
+
+//
+// table_insert - remember the id of a newly allocated block
+//
+// returns 0 if the table is full
+//
+// Removed entries leave tombstones that are reused by later inserts but never
+// end a search, so searches are bounded by the longest probe any insert made
+// rather than by the next empty slot. The seen filter lets table_remove skip
+// the search for most addresses that were never inserted (blocks allocated
+// before the capture, zero-size blocks, dropped inserts).
+//
+static int table_insert(void *ptr, uint32_t id)
+{
+  uintptr_t key = (uintptr_t)ptr;
+  size_t i = hash_ptr(key);
+
+  for (size_t n = 0; n <= table_mask; n++, i = (i + 1) & table_mask) {
+    uintptr_t cur = atomic_load_explicit(&table[i].key, memory_order_relaxed);
+    // claim the slot first, so that a thread losing the race for it
+    // cannot overwrite the id of the winner
+    if ((cur == KEY_EMPTY || cur == KEY_DELETED) &&
+        atomic_compare_exchange_strong_explicit(&table[i].key, &cur, key,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+      atomic_store_explicit(&table[i].id, id, memory_order_release);
+      size_t max = atomic_load_explicit(&max_probe, memory_order_relaxed);
+      while (n > max &&
+             !atomic_compare_exchange_weak_explicit(&max_probe, &max, n,
+                                                    memory_order_relaxed,
+                                                    memory_order_relaxed))
+        ;
+      size_t bit = seen_bit(key);
+      if (!(atomic_load_explicit(&seen[bit / 64], memory_order_relaxed) &
+            (1ULL << (bit % 64))))
+        atomic_fetch_or_explicit(&seen[bit / 64], 1ULL << (bit % 64),
+                                 memory_order_relaxed);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+//
+// table_remove - forget a block and return its id
+//
+// returns 0 if the block is unknown (e.g., allocated before capturing started)
+//
+static int table_remove(void *ptr, uint32_t *id)
+{
+  uintptr_t key = (uintptr_t)ptr;
+  size_t i = hash_ptr(key);
+  size_t bit = seen_bit(key);
+  size_t max = atomic_load_explicit(&max_probe, memory_order_relaxed);
+
+  if (!(atomic_load_explicit(&seen[bit / 64], memory_order_relaxed) &
+        (1ULL << (bit % 64))))
+    return 0;
+  for (size_t n = 0; n <= max; n++, i = (i + 1) & table_mask) {
+    uintptr_t cur = atomic_load_explicit(&table[i].key, memory_order_acquire);
+    if (cur == KEY_EMPTY)
+      return 0;
+    if (cur == key) {
+      *id = atomic_load_explicit(&table[i].id, memory_order_acquire);
+      atomic_store_explicit(&table[i].key, KEY_DELETED, memory_order_relaxed);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// per-thread buffers
+//
+
+//
+// release_buf - pthread key destructor; hand the buffer of an exiting thread
+//               back to the pool
+//
+static void release_buf(void *arg)
+{
+  tbuf *b = arg;
+
+  my_buf = NULL;
+  atomic_store_explicit(&b->in_use, 0, memory_order_release);
+}
+
+//
+// get_buf - return the buffer of the calling thread, creating it if necessary
+//
+static tbuf *get_buf(void)
+{
+  tbuf *b;
+
+  if (my_buf)
+    return my_buf;
+
+  // try to reuse a drained buffer of an exited thread
+  for (b = atomic_load(&buffers); b; b = b->next) {
+    int expected = 0;
+    if (atomic_load(&b->head) == atomic_load(&b->tail) &&
+        atomic_compare_exchange_strong(&b->in_use, &expected, 1))
+      break;
+  }
+
+  // otherwise map a new one and push it onto the global list
+  if (!b) {
+    b = mmap(NULL, sizeof(tbuf), PROT_READ|PROT_WRITE,
+             MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (b == MAP_FAILED)
+      return NULL;
+    atomic_store(&b->in_use, 1);
+    b->next = atomic_load(&buffers);
+    while (!atomic_compare_exchange_weak(&buffers, &b->next, b))
+      ;
+  }
+
+  my_buf = b;
+  pthread_setspecific(buf_key, b);
+  return b;
+}
+
+//
+// record - append a request to the buffer of the calling thread
+//
+// The sequence number is drawn here, i.e., after the address->id table has
+// been updated for allocations and before the block is released for frees.
+// This keeps the requests of every block in causal order across threads.
+//
+static void record(tbuf *b, uint64_t type, uint32_t id, size_t size)
+{
+  uint64_t seq = atomic_fetch_add_explicit(&next_seq, 1, memory_order_relaxed);
+  uint64_t head = atomic_load_explicit(&b->head, memory_order_relaxed);
+
+  if (head - atomic_load_explicit(&b->tail, memory_order_acquire) >= RING_EVENTS) {
+    atomic_fetch_add_explicit(&n_stalls, 1, memory_order_relaxed);
+    while (head - atomic_load_explicit(&b->tail, memory_order_acquire) >= RING_EVENTS)
+      sched_yield();
+  }
+
+  event *e = &b->ev[head & (RING_EVENTS-1)];
+  e->seq = EV_PACK(type, seq);
+  e->id = id;
+  e->size = (uint32_t)size;
+  atomic_store_explicit(&b->head, head + 1, memory_order_release);
+}
+
+//------------------------------------------------------------------------------
+// flusher
+//
+
+//
+// write_all - write n bytes to fd, retrying on short writes
+//
+static int write_all(int fd, const void *buf, size_t n)
+{
+  const char *p = buf;
+
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += w;
+    n -= w;
+  }
+  return 0;
+}
+
+//
+// drain - move all pending events of all buffers to the spool file
+//
+// returns the number of events written
+//
+static size_t drain(void)
+{
+  size_t total = 0;
+
+  for (tbuf *b = atomic_load(&buffers); b; b = b->next) {
+    uint64_t tail = atomic_load_explicit(&b->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&b->head, memory_order_acquire);
+
+    while (tail != head) {
+      size_t first = tail & (RING_EVENTS-1);
+      size_t n = head - tail;
+      if (first + n > RING_EVENTS)
+        n = RING_EVENTS - first;
+      if (write_all(spool_fd, &b->ev[first], n * sizeof(event)) < 0)
+        atomic_fetch_add(&n_dropped, n);
+      tail += n;
+      total += n;
+    }
+    atomic_store_explicit(&b->tail, tail, memory_order_release);
+  }
+  return total;
+}
+
+//
+// flush_thread - periodically drain the thread buffers
+//
+static void *flush_thread(void *arg)
+{
+  struct timespec idle = { 0, FLUSH_USEC * 1000 };
+
+  in_hook = 1;  // never record anything done by this thread
+  while (!atomic_load(&stop_flusher)) {
+    if (drain() == 0)
+      nanosleep(&idle, NULL);
+  }
+  drain();
+  return NULL;
+}
+
+//------------------------------------------------------------------------------
+// trace output
+//
+
+//
+// cmp_event - order events by sequence number
+//
+static int cmp_event(const void *a, const void *b)
+{
+  uint64_t sa = EV_SEQ(((const event *)a)->seq);
+  uint64_t sb = EV_SEQ(((const event *)b)->seq);
+
+  return (sa > sb) - (sa < sb);
+}
+
+//
+// write_trace - sort the spool and write it out in mdriver format
+//
+// Block ids are renumbered densely in order of allocation so that the trace
+// satisfies mdriver's requirement that ids run from 0 to num_ids-1.
+//
+static int write_trace(void)
+{
+  struct stat st;
+  event *ev;
+  size_t n, i;
+  uint32_t n_cap = atomic_load(&next_id);
+  uint32_t *remap, *sizes;
+  uint32_t n_ids = 0;
+  uint64_t live = 0, peak = 0;
+  FILE *out;
+
+  if (fstat(spool_fd, &st) < 0)
+    return -1;
+  n = st.st_size / sizeof(event);
+
+  ev = NULL;
+  if (n > 0) {
+    ev = mmap(NULL, n * sizeof(event), PROT_READ|PROT_WRITE, MAP_PRIVATE,
+              spool_fd, 0);
+    if (ev == MAP_FAILED)
+      return -1;
+    qsort(ev, n, sizeof(event), cmp_event);
+  }
+
+  remap = mmap(NULL, ((size_t)n_cap + 1) * 2 * sizeof(uint32_t),
+               PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (remap == MAP_FAILED)
+    return -1;
+  sizes = remap + n_cap + 1;
+
+  // first pass: assign trace ids and compute the peak number of live bytes
+  for (i = 0; i < n; i++) {
+    uint32_t id = ev[i].id;
+    switch (EV_TYPE(ev[i].seq)) {
+    case EV_ALLOC:
+      remap[id] = n_ids++;
+      sizes[id] = ev[i].size;
+      live += ev[i].size;
+      break;
+    case EV_REALLOC:
+      live += ev[i].size;
+      live -= sizes[id];
+      sizes[id] = ev[i].size;
+      break;
+    case EV_FREE:
+      live -= sizes[id];
+      sizes[id] = 0;
+      break;
+    }
+    if (live > peak)
+      peak = live;
+  }
+
+  if ((out = fopen(out_path, "w")) == NULL)
+    return -1;
+
+  // header: suggested heap size, number of ids, number of ops, weight
+  fprintf(out, "%llu\n%u\n%zu\n1\n", (unsigned long long)peak, n_ids, n);
+
+  // second pass: the requests
+  for (i = 0; i < n; i++) {
+    switch (EV_TYPE(ev[i].seq)) {
+    case EV_ALLOC:
+      fprintf(out, "a %u %u\n", remap[ev[i].id], ev[i].size);
+      break;
+    case EV_REALLOC:
+      fprintf(out, "r %u %u\n", remap[ev[i].id], ev[i].size);
+      break;
+    case EV_FREE:
+      fprintf(out, "f %u\n", remap[ev[i].id]);
+      break;
+    }
+  }
+  fclose(out);
+
+  fprintf(stderr, "memcapture: %zu requests, %u blocks, peak %llu bytes live "
+          "-> %s (%llu stalls, %llu dropped)\n",
+          n, n_ids, (unsigned long long)peak, out_path,
+          (unsigned long long)atomic_load(&n_stalls),
+          (unsigned long long)atomic_load(&n_dropped));
+
+  munmap(remap, ((size_t)n_cap + 1) * 2 * sizeof(uint32_t));
+  if (ev)
+    munmap(ev, n * sizeof(event));
+  return 0;
+}
+
+//------------------------------------------------------------------------------
+// init/fini
+//
+
+//
+// atfork_child - the flusher does not survive fork(); stop recording in the
+// child so that it does not scribble into the parent's spool
+//
+static void atfork_child(void)
+{
+  atomic_store(&capturing, 0);
+}
+
+//
+// expand_path - copy the trace file name, replacing "%p" by the process id
+//
+static void expand_path(char *dst, size_t len, const char *src)
+{
+  size_t n = 0;
+
+  for (; *src && n + 1 < len; src++) {
+    if (src[0] == '%' && src[1] == 'p') {
+      n += snprintf(dst + n, len - n, "%d", (int)getpid());
+      src++;
+    }
+    else
+      dst[n++] = *src;
+  }
+  dst[n < len ? n : len - 1] = '\0';
+}
+
+//
+// init - this function is called once when the shared library is loaded
+//
+__attribute__((constructor))
+void init(void)
+{
+  char *env;
+  size_t slots = DEFAULT_SLOTS, n;
+
+  in_hook = 1;
+
+  mallocp  = dlsym(RTLD_NEXT, "malloc");
+  freep    = dlsym(RTLD_NEXT, "free");
+  callocp  = dlsym(RTLD_NEXT, "calloc");
+  reallocp = dlsym(RTLD_NEXT, "realloc");
+  if (!mallocp || !freep || !callocp || !reallocp) {
+    fprintf(stderr, "memcapture: cannot resolve the libc allocator\n");
+    exit(1);
+  }
+
+  env = getenv("MEMCAPTURE_OUT");
+  expand_path(out_path, sizeof(out_path), env ? env : DEFAULT_OUT);
+  snprintf(spool_path, sizeof(spool_path), "%s.%d.spool", out_path,
+           (int)getpid());
+
+  if ((env = getenv("MEMCAPTURE_SLOTS")) != NULL && atol(env) > 0)
+    slots = atol(env);
+  for (n = 1; n < slots; n <<= 1)
+    ;
+  table = mmap(NULL, n * sizeof(slot), PROT_READ|PROT_WRITE,
+               MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  if (table == MAP_FAILED) {
+    fprintf(stderr, "memcapture: cannot map address table\n");
+    in_hook = 0;
+    return;
+  }
+  table_mask = n - 1;
+  seen = mmap(NULL, (n * SEEN_BITS + 63) / 64 * sizeof(uint64_t), PROT_READ|PROT_WRITE,
+              MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+  if (seen == MAP_FAILED) {
+    fprintf(stderr, "memcapture: cannot map address table\n");
+    in_hook = 0;
+    return;
+  }
+  seen_mask = n * SEEN_BITS - 1;
+
+  if ((spool_fd = open(spool_path, O_RDWR|O_CREAT|O_TRUNC, 0644)) < 0) {
+    fprintf(stderr, "memcapture: cannot open %s: %s\n", spool_path,
+            strerror(errno));
+    in_hook = 0;
+    return;
+  }
+
+  pthread_key_create(&buf_key, release_buf);
+  pthread_atfork(NULL, NULL, atfork_child);
+  if (pthread_create(&flusher, NULL, flush_thread, NULL) != 0) {
+    fprintf(stderr, "memcapture: cannot start flusher thread\n");
+    in_hook = 0;
+    return;
+  }
+
+  atomic_store(&capturing, 1);
+  in_hook = 0;
+}
+
+//
+// fini - this function is called once when the shared library is unloaded
+//
+__attribute__((destructor))
+void fini(void)
+{
+  if (!atomic_exchange(&capturing, 0))
+    return;
+
+  in_hook = 1;
+  atomic_store(&stop_flusher, 1);
+  pthread_join(flusher, NULL);
+
+  if (write_trace() < 0)
+    fprintf(stderr, "memcapture: cannot write %s: %s\n", out_path,
+            strerror(errno));
+  close(spool_fd);
+  unlink(spool_path);
+}
+
+//------------------------------------------------------------------------------
+// interposed functions
+//
+
+//
+// hook_enter - decide whether the current request should be recorded
+//
+static tbuf *hook_enter(void)
+{
+  tbuf *b;
+
+  if (in_hook || !atomic_load_explicit(&capturing, memory_order_relaxed))
+    return NULL;
+  in_hook = 1;
+  if ((b = get_buf()) == NULL) {
+    atomic_fetch_add(&n_dropped, 1);
+    in_hook = 0;
+  }
+  return b;
+}
+
+//
+// new_block - assign an id to a fresh block and record its allocation
+//
+static void new_block(tbuf *b, void *ptr, size_t size)
+{
+  uint32_t id;
+
+  if (!ptr || size == 0 || size > INT_MAX)
+    return;                     // mdriver cannot replay these
+  id = atomic_fetch_add_explicit(&next_id, 1, memory_order_relaxed);
+  if (!table_insert(ptr, id)) {
+    atomic_fetch_add(&n_dropped, 1);
+    return;
+  }
+  record(b, EV_ALLOC, id, size);
+}
+
+void *malloc(size_t size)
+{
+  tbuf *b;
+  void *ptr;
+
+  if (!mallocp)
+    return boot_alloc(size);
+  if ((b = hook_enter()) == NULL)
+    return mallocp(size);
+
+  ptr = mallocp(size);
+  new_block(b, ptr, size);
+
+  in_hook = 0;
+  return ptr;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+  tbuf *b;
+  void *ptr;
+
+  if (!callocp)
+    return boot_alloc(nmemb * size);    // static arena is zero-initialized
+  if ((b = hook_enter()) == NULL)
+    return callocp(nmemb, size);
+
+  ptr = callocp(nmemb, size);
+  new_block(b, ptr, nmemb * size);
+
+  in_hook = 0;
+  return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  tbuf *b;
+  void *newp;
+  uint32_t id;
+
+  if (is_boot(ptr)) {
+    // move blocks of the bootstrap arena to the real heap
+    size_t avail = boot_heap + BOOT_HEAP - (char *)ptr;
+    if ((newp = malloc(size)) != NULL)
+      memcpy(newp, ptr, size < avail ? size : avail);
+    return newp;
+  }
+  if (!reallocp)
+    return boot_alloc(size);
+  if ((b = hook_enter()) == NULL)
+    return reallocp(ptr, size);
+
+  if (ptr == NULL) {
+    newp = reallocp(ptr, size);
+    new_block(b, newp, size);
+  }
+  else if (!table_remove(ptr, &id)) {
+    // block not known to us; treat the result as a new allocation
+    newp = reallocp(ptr, size);
+    new_block(b, newp, size);
+  }
+  else if (size == 0 || size > INT_MAX) {
+    record(b, EV_FREE, id, 0);
+    newp = reallocp(ptr, size);
+    if (newp)
+      new_block(b, newp, size);
+  }
+  else {
+    newp = reallocp(ptr, size);
+    if (newp == NULL) {
+      // failed reallocs leave the old block untouched
+      table_insert(ptr, id);
+    }
+    else {
+      table_insert(newp, id);
+      record(b, EV_REALLOC, id, size);
+    }
+  }
+
+  in_hook = 0;
+  return newp;
+}
+
+void free(void *ptr)
+{
+  tbuf *b;
+  uint32_t id;
+
+  if (ptr == NULL || is_boot(ptr))
+    return;
+  if ((b = hook_enter()) == NULL) {
+    freep(ptr);
+    return;
+  }
+
+  if (table_remove(ptr, &id))
+    record(b, EV_FREE, id, 0);
+  freep(ptr);
+
+  in_hook = 0;
+}
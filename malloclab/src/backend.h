@@ -0,0 +1,56 @@
+/*
+ * backend.h - Allocator backends that the driver can evaluate side by side
+ *
+ * Every backend is a malloc package with its own function prefix that is
+ * linked into mdriver next to the student's mm.c. To add one, implement
+ * <prefix>_init, <prefix>_malloc, <prefix>_free and <prefix>_realloc with 
+ * the same semantics as the mm_* functions, declare them below with 
+ * DECLARE_BACKEND, add an entry to the backends[] table in backends.c, 
+ * and add the object file to the Makefile.
+ */
+#ifndef __BACKEND_H_
+#define __BACKEND_H_
+
+#include <stddef.h>
+#include "mm.h"
+
+typedef struct {
+    char *name;                             /* name used with mdriver -b */
+    int memlib;                             /* heap lives in memlib? */
+    int (*init)(void);
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    void (*walk)(mm_walk_funct f, void *argp); /* optional, for -s */
+} backend_t;
+
+/* Declares the functions of a backend with the given prefix */
+#define DECLARE_BACKEND(prefix) \
+    int prefix##_init(void); \
+    void *prefix##_malloc(size_t size); \
+    void prefix##_free(void *ptr); \
+    void *prefix##_realloc(void *ptr, size_t size)
+
+/* Builds a backends[] entry for a backend with the given prefix */
+#define BACKEND(name, prefix, memlib, walk) \
+    { name, memlib, prefix##_init, prefix##_malloc, prefix##_free, \
+      prefix##_realloc, walk }
+
+/* segfit.c - segregated free lists */
+DECLARE_BACKEND(seg);
+void seg_walk(mm_walk_funct f, void *argp);
+
+/* slab.c - size-class slabs and page runs */
+DECLARE_BACKEND(slab);
+void slab_walk(mm_walk_funct f, void *argp);
+
+/* backends.c - the system malloc (glibc, or whatever is preloaded) */
+DECLARE_BACKEND(libc);
+
+/* All backends known to the driver, terminated by an entry without name */
+extern backend_t backends[];
+
+/* Return the backend with the given name, or NULL */
+backend_t *find_backend(char *name);
+
+#endif /* __BACKEND_H_ */
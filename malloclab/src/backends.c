@@ -0,0 +1,56 @@
+/*
+ * backends.c - The table of allocator backends known to the driver
+ *
+ * The first entry is the student's package in mm.c, which the driver
+ * evaluates unless told otherwise with -b.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include "backend.h"
+
+backend_t backends[] = {
+    BACKEND("mm",     mm,   1, mm_walk),
+    BACKEND("segfit", seg,  1, seg_walk),
+    BACKEND("slab",   slab, 1, slab_walk),
+    BACKEND("libc",   libc, 0, NULL),
+    { NULL }
+};
+
+/*
+ * find_backend - Look up a backend by name
+ */
+backend_t *find_backend(char *name)
+{
+    backend_t *b;
+
+    for (b = backends; b->name != NULL; b++)
+        if (!strcmp(b->name, name))
+            return b;
+    return NULL;
+}
+
+/*
+ * The libc backend: the system malloc package. Its heap is not part of
+ * memlib, so the driver cannot compute its utilization. Run mdriver with 
+ * LD_PRELOAD set to evaluate another system allocator such as jemalloc.
+ */
+int libc_init(void)
+{
+    return 0;
+}
+
+void *libc_malloc(size_t size)
+{
+    return malloc(size);
+}
+
+void libc_free(void *ptr)
+{
+    free(ptr);
+}
+
+void *libc_realloc(void *ptr, size_t size)
+{
+    return realloc(ptr, size);
+}
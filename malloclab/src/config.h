@@ -61,13 +61,22 @@
 /* 
  * Maximum heap size in bytes 
  */
-#define MAX_HEAP (20*(1<<20))  /* 20 MB */
+#define MAX_HEAP (20*(1<<20))  /* 20 MB by default; change with mdriver -m */
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
 #define USE_FCYC   0   /* cycle counter w/K-best scheme (x86 & Alpha only) */
 #define USE_ITIMER 0   /* interval timer (any Unix box) */
-#define USE_GETTOD 1   /* gettimeofday (any Unix box) */
+#define USE_GETTOD 0   /* gettimeofday (any Unix box) */
+#define USE_PERF   1   /* monotonic clock + perf_event_open counters (Linux) */
+
+/*
+ * Size of the buffer that is written to flush the caches (mdriver -c cold)
+ * or to pollute them (-c pollute), and the cache block size. The buffer
+ * should be larger than the last level cache.
+ */
+#define CACHE_BYTES (32*(1<<20))
+#define CACHE_BLOCK 64
 
 #endif /* __CONFIG_H */
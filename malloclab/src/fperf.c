@@ -0,0 +1,168 @@
+/*
+ * fperf.c - Estimate the time (in seconds) used by a function f and the
+ *     hardware events it causes
+ *
+ * The events are counted with one perf_event_open counter each, limited
+ * to user mode so that they also work with perf_event_paranoid = 2. If
+ * the kernel has to multiplex the counters, the counts are scaled by the
+ * fraction of the time each counter was actually running. Events that
+ * the CPU (or a virtual machine, or a container) does not support are
+ * left out and reported as -1; the running time is measured with the
+ * monotonic clock either way.
+ *
+ * Counters count the process that opened them, so a process created by
+ * fork opens its own set before its first measurement.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "fperf.h"
+
+/* What perf_event_open is asked to count for each event */
+static const struct {
+    const char *name;
+    unsigned int type;
+    unsigned long long config;
+} events[NUM_EVENTS] = {
+    {"cycles",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instrs",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"LLC-miss",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"dTLB-miss", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+                                      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {"br-miss",   PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+static int fds[NUM_EVENTS];       /* counter of each event, or -1 */
+static pid_t owner = -1;          /* process the counters belong to */
+static char error[128] = "not initialized";
+
+/* function prototypes */
+static int open_counters(void);
+static double read_counter(int fd);
+
+/*
+ * init_fperf - Open the counters and return how many events can be counted
+ */
+int init_fperf(void)
+{
+    return open_counters();
+}
+
+/*
+ * fperf_error - Why the first unavailable event could not be counted
+ */
+const char *fperf_error(void)
+{
+    return error;
+}
+
+/*
+ * fperf_event_name - Short name of event i
+ */
+const char *fperf_event_name(int i)
+{
+    return events[i].name;
+}
+
+/*
+ * fperf - Run f(argp) n times with the counters enabled. Return the
+ * average running time and store the average event counts in counts.
+ */
+double fperf(fperf_test_funct f, void *argp, int n, double *counts)
+{
+    struct timespec start, end;
+    int i;
+
+    if (owner != getpid())
+	open_counters();
+
+    for (i = 0; i < NUM_EVENTS; i++) {
+	if (fds[i] >= 0) {
+	    ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+	    ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < n; i++)
+	f(argp);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    for (i = 0; i < NUM_EVENTS; i++)
+	if (fds[i] >= 0)
+	    ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+
+    for (i = 0; i < NUM_EVENTS; i++) {
+	counts[i] = (fds[i] >= 0) ? read_counter(fds[i]) : -1;
+	if (counts[i] >= 0)
+	    counts[i] /= n;
+    }
+    return ((end.tv_sec - start.tv_sec) + 1e-9 * (end.tv_nsec - start.tv_nsec)) / n;
+}
+
+/*
+ * fperf_pause - Stop the counters of the run being measured, or start
+ *     them again, so that f can leave some of its own work uncounted
+ */
+void fperf_pause(int pause)
+{
+    int i;
+
+    for (i = 0; i < NUM_EVENTS; i++)
+	if (fds[i] >= 0)
+	    ioctl(fds[i], pause ? PERF_EVENT_IOC_DISABLE : PERF_EVENT_IOC_ENABLE, 0);
+}
+
+/*
+ * open_counters - (Re)open a disabled counter for every event that the
+ *     calling process can count, and return how many there are
+ */
+static int open_counters(void)
+{
+    struct perf_event_attr attr;
+    int i, count = 0, failed = 0;
+
+    for (i = 0; i < NUM_EVENTS; i++) {
+	if (owner >= 0 && fds[i] >= 0)
+	    close(fds[i]);
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = events[i].type;
+	attr.config = events[i].config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+	    PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+	fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+	if (fds[i] >= 0)
+	    count++;
+	else if (failed++ == 0)
+	    snprintf(error, sizeof(error), "%s: %s",
+		     events[i].name, strerror(errno));
+    }
+    owner = getpid();
+    return count;
+}
+
+/*
+ * read_counter - Return the value of a counter, scaled up if it was not
+ *     running the whole time it was enabled, or -1 if it never ran
+ */
+static double read_counter(int fd)
+{
+    unsigned long long val[3];  /* value, time enabled, time running */
+
+    if (read(fd, val, sizeof(val)) != sizeof(val) || val[2] == 0)
+	return -1;
+    if (val[2] < val[1])
+	return (double)val[0] * val[1] / val[2];
+    return (double)val[0];
+}
@@ -0,0 +1,36 @@
+/*
+ * fperf.h - Count hardware events while running a function f, using the
+ *     Linux perf_event_open interface
+ */
+
+/* The hardware events counted by fperf */
+#define EV_CYCLES        0   /* CPU cycles */
+#define EV_INSTRUCTIONS  1   /* instructions retired */
+#define EV_CACHE_MISSES  2   /* last level cache misses */
+#define EV_DTLB_MISSES   3   /* data TLB read misses */
+#define EV_BRANCH_MISSES 4   /* mispredicted branches */
+#define NUM_EVENTS       5
+
+typedef void (*fperf_test_funct)(void *);
+
+/*
+ * Open the event counters. Return the number of events that can be
+ * counted on this machine; when it is 0, fperf_error tells why.
+ */
+int init_fperf(void);
+
+/* Reason why the first unavailable event could not be counted */
+const char *fperf_error(void);
+
+/* Short name of event i */
+const char *fperf_event_name(int i);
+
+/*
+ * Estimate the running time (in seconds) of f(argp) and the number of
+ * events it causes. Return the average time of n runs and store the
+ * average count of each event in counts[] (-1 if it is not counted).
+ */
+double fperf(fperf_test_funct f, void *argp, int n, double *counts);
+
+/* Stop (pause = 1) or restart the counters during a run of fperf */
+void fperf_pause(int pause);
@@ -2,13 +2,24 @@
  * High-level timing wrappers
  ****************************/
 #include <stdio.h>
+#include <stdlib.h>
 #include "fsecs.h"
 #include "fcyc.h"
 #include "clock.h"
 #include "ftimer.h"
+#include "fperf.h"
 #include "config.h"
 
 static double Mhz;  /* estimated CPU clock frequency */
+static double events[NUM_EVENTS]; /* event counts of the last fsecs call */
+static int clear_cache = 0;       /* flush the caches before each run */
+
+#if !USE_FCYC
+static volatile char *cache_buf;  /* buffer that is touched to flush them */
+
+static double ftimer(fsecs_test_funct f, void *argp, int n, double *counts);
+static void clear(void);
+#endif
 
 extern int verbose; /* -v option in mdriver.c */
 
@@ -25,7 +36,7 @@ void init_fsecs(void)
 
     /* set key parameters for the fcyc package */
     set_fcyc_maxsamples(20); 
-    set_fcyc_clear_cache(1);
+    set_fcyc_clear_cache(1); /* cold unless mdriver -c says otherwise */
     set_fcyc_compensate(1);
     set_fcyc_epsilon(0.01);
     set_fcyc_k(3);
@@ -36,6 +47,31 @@ void init_fsecs(void)
 #elif USE_GETTOD
     if (verbose)
 	printf("Measuring performance with gettimeofday().\n");
+#elif USE_PERF
+    {
+	int n = init_fperf();
+
+	if (verbose && n == NUM_EVENTS)
+	    printf("Measuring performance with perf_event_open counters.\n");
+	else if (verbose && n > 0)
+	    printf("Measuring performance with perf_event_open counters "
+		   "(%d of %d events; %s).\n", n, NUM_EVENTS, fperf_error());
+	else if (verbose)
+	    printf("Measuring performance with the monotonic clock "
+		   "(no hardware counters; %s).\n", fperf_error());
+    }
+#endif
+}
+
+/*
+ * fsecs_clear_cache - When set, the caches are flushed before every run
+ *     of the function that fsecs measures, outside of the measurement
+ */
+void fsecs_clear_cache(int clear)
+{
+    clear_cache = clear;
+#if USE_FCYC
+    set_fcyc_clear_cache(clear);
 #endif
 }
 
@@ -47,11 +83,85 @@ double fsecs(fsecs_test_funct f, void *argp)
 #if USE_FCYC
     double cycles = fcyc(f, argp);
     return cycles/(Mhz*1e6);
-#elif USE_ITIMER
-    return ftimer_itimer(f, argp, 10);
-#elif USE_GETTOD
-    return ftimer_gettod(f, argp, 10);
+#else
+    double secs = 0, counts[NUM_EVENTS];
+    int i, e;
+
+    if (!clear_cache)
+	return ftimer(f, argp, 10, events);
+
+    /* Time the runs one by one, each after a flush */
+    for (e = 0; e < NUM_EVENTS; e++)
+	events[e] = 0;
+    for (i = 0; i < 10; i++) {
+	clear();
+	secs += ftimer(f, argp, 1, counts);
+	for (e = 0; e < NUM_EVENTS; e++)
+	    events[e] = (counts[e] < 0 || events[e] < 0) ? 
+		-1 : events[e] + counts[e] / 10;
+    }
+    return secs / 10;
 #endif 
 }
 
+#if !USE_FCYC
+/*
+ * ftimer - Return the average running time of n runs of f with the 
+ *     selected timer (event counts are only stored with USE_PERF)
+ */
+static double ftimer(fsecs_test_funct f, void *argp, int n, double *counts)
+{
+#if USE_ITIMER
+    return ftimer_itimer(f, argp, n);
+#elif USE_GETTOD
+    return ftimer_gettod(f, argp, n);
+#elif USE_PERF
+    return fperf(f, argp, n, counts);
+#else
+    return 0;
+#endif
+}
+
+/*
+ * clear - Flush the caches by writing to every block of a buffer that
+ *     is larger than the last level cache
+ */
+static void clear(void)
+{
+    int i;
+
+    if (cache_buf == NULL && (cache_buf = malloc(CACHE_BYTES)) == NULL) {
+	fprintf(stderr, "Fatal error.  Malloc returned null when trying to clear cache\n");
+	exit(1);
+    }
+    for (i = 0; i < CACHE_BYTES; i += CACHE_BLOCK)
+	cache_buf[i]++;
+}
+#endif
+
+/*
+ * fsecs_pause - Stop (pause = 1) or restart the event counters while the
+ *     function that fsecs measures does work that is not to be counted
+ */
+void fsecs_pause(int pause)
+{
+#if USE_PERF
+    fperf_pause(pause);
+#endif
+}
+
+/*
+ * fsecs_events - Copy the hardware event counts per run of the last fsecs
+ *     call into counts (-1 for events that were not counted). Return 0 if
+ *     the timing package doesn't count events at all.
+ */
+int fsecs_events(double *counts)
+{
+    int i;
+
+    for (i = 0; i < NUM_EVENTS; i++)
+	counts[i] = USE_PERF ? events[i] : -1;
+    return USE_PERF;
+}
+
 
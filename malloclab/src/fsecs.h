@@ -2,3 +2,6 @@ typedef void (*fsecs_test_funct)(void *);
 
 void init_fsecs(void);
 double fsecs(fsecs_test_funct f, void *argp);
+int fsecs_events(double *counts);
+void fsecs_clear_cache(int clear);
+void fsecs_pause(int pause);
@@ -7,9 +7,14 @@
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
@@ -17,8 +22,10 @@
 #include <time.h>
 
 #include "mm.h"
+#include "backend.h"
 #include "memlib.h"
 #include "fsecs.h"
+#include "fperf.h"
 #include "config.h"
 
 /**********************
@@ -29,6 +36,7 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define MAPCELLS     128 /* number of cells in a heap occupancy map */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
@@ -37,11 +45,17 @@
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* 
+ * Records the extent of each block's payload. The ranges of a trace 
+ * are kept in an AVL tree ordered by payload address, so that overlap 
+ * checks only need to look at the two neighbors of a new payload.
+ */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    struct range_t *left;  /* subtree with lower payload addresses */
+    struct range_t *right; /* subtree with higher payload addresses */
+    int height;            /* height of the subtree rooted here */
 } range_t;
 
 /* Characterizes a single trace operation (allocator request) */
@@ -70,8 +84,25 @@ typedef struct {
 typedef struct {
     trace_t *trace;  
     range_t *ranges;
+    double secs;            /* with -c pollute, the time of the runs with */
+    int runs;               /* the pollution left out, and their number... */
+    struct timespec mark;   /* ... and when the current stretch began */
 } speed_t;
 
+/* 
+ * Collects the result of one walk over the heap blocks of mm.c, 
+ * taken by eval_mm_frag every few operations 
+ */
+typedef struct {
+    char *heap_lo;           /* first byte of the heap */
+    double cellsize;         /* bytes covered by one cell of the heap map */
+    double cells[MAPCELLS];  /* allocated bytes in each cell of the heap map */
+    int alloc_blocks;        /* number of allocated blocks */
+    int free_blocks;         /* number of free blocks */
+    size_t free_bytes;       /* total size of the free blocks */
+    size_t largest_free;     /* size of the largest free block */
+} frag_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -81,10 +112,28 @@ typedef struct {
 
     /* defined only for the student malloc package */
     double util;     /* space utilization for this trace (always 0 for libc) */
+    double heap;     /* heap size at the end of the trace in bytes */
+    double commits;  /* times memlib committed heap pages during the trace */
+    double faults;   /* page faults taken during the trace */
+
+    /* defined only when comparing backends (-b with several names) */
+    double p50;      /* median request latency in ns */
+    double p99;      /* 99th percentile request latency in ns */
+    double p999;     /* 99.9th percentile request latency in ns */
+
+    /* defined only if the timing package counts events (USE_PERF) */
+    double events[NUM_EVENTS]; /* event counts per run (-1 if not counted) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/* What a worker process reports back for its trace in parallel mode (-j) */
+typedef struct {
+    stats_t libc;    /* libc stats (if -l) */
+    stats_t mm;      /* mm stats */
+    int errors;      /* number of errs found when running student malloc */
+} result_t;
+
 /********************
  * Global variables
  *******************/
@@ -95,6 +144,30 @@ char msg[MAXLINE];      /* for whenever we need to compose an error message */
 /* Directory where default tracefiles are found */
 static char tracedir[MAXLINE] = TRACEDIR;
 
+/* The malloc package being evaluated (mm.c unless changed with -b) */
+static backend_t *backend = &backends[0];
+
+/* Cache state during the timed runs (-c); by default, the one the timer
+ * package uses on its own (cold with fcyc, warm with the others) */
+static enum {CACHE_DEFAULT, CACHE_WARM, CACHE_COLD, CACHE_POLLUTE} 
+    cache_mode = CACHE_DEFAULT;
+static size_t pollute_bytes = 256*(1<<10); /* bytes touched per pollution... */
+static int pollute_every = 1;              /* ... every so many requests */
+static volatile char *pollute_buf = NULL;  /* CACHE_BYTES touched in turn */
+static size_t pollute_pos = 0;             /* where the next pollution starts */
+
+/* Fragmentation sampling (-s, -o) */
+static int frag_interval = 0;       /* sample the heap every so many ops */
+static char *frag_prefix = "frag";  /* prefix of the fragmentation files */
+
+/* 
+ * In parallel mode, workers hold a read lock on this file while they
+ * check their trace, and a write lock while they time it, so that a
+ * timing run has the machine to itself. The kernel releases the lock
+ * of a worker that dies.
+ */
+static int timing_fd = -1;
+
 /* The filenames of the default tracefiles */
 static char *default_tracefiles[] = {  
     DEFAULT_TRACEFILES, NULL
@@ -105,16 +178,44 @@ static char *default_tracefiles[] = {
  * Function prototypes 
  *********************/
 
-/* these functions manipulate range lists */
+/* these functions manipulate range trees */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static range_t *range_insert(range_t *root, range_t *node);
+static range_t *range_delete(range_t *root, char *lo);
+static range_t *range_balance(range_t *r);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
 static void free_trace(trace_t *trace);
 
+/* These functions evaluate one trace in the current process... */
+static void eval_libc_trace(char *tracefile, int tracenum, stats_t *stats);
+static void eval_mm_trace(char *tracefile, int tracenum, stats_t *stats,
+			  range_t **ranges);
+
+/* ... and these evaluate all traces in worker processes */
+static void eval_parallel(char **tracefiles, int num_tracefiles, int jobs,
+			  int pin, int run_libc, stats_t *libc_stats, 
+			  stats_t *mm_stats);
+static void timing_begin(void);
+static void timing_end(void);
+static void timing_lock(short type, char *fn);
+
+/* Evaluates several backends on every trace (-b with several names) */
+static void eval_compare(char **tracefiles, int num_tracefiles,
+			 backend_t **list, int nbackends);
+static int cmp_double(const void *a, const void *b);
+
+/* Time the xxx_speed functions under the selected cache mode (-c) */
+static double time_speed(fsecs_test_funct f, speed_t *params, 
+			 double *events);
+static void pollute(void);
+static void pollute_timed(speed_t *params);
+static void lap(speed_t *params);
+
 /* Routines for evaluating the correctness and speed of libc malloc */
 static int eval_libc_valid(trace_t *trace, int tracenum);
 static void eval_libc_speed(void *ptr);
@@ -124,13 +225,25 @@ static void eval_libc_speed(void *ptr);
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_frag(trace_t *trace, char *tracename, int interval,
+			 char *prefix);
+static void eval_mm_latency(trace_t *trace, stats_t *stats);
+static void frag_block(void *lo, size_t size, int alloc, void *argp);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
+static void printcompare(int n, backend_t **list, int nbackends, 
+			 stats_t *stats);
+static void printevents(int n, backend_t **list, int nbackends, 
+			stats_t *stats);
+static void printheap(int n, backend_t **list, int nbackends, 
+		      stats_t *stats);
+static size_t parse_size(char *str);
 static void usage(void);
 static void unix_error(char *msg);
 static void malloc_error(int tracenum, int opnum, char *msg);
 static void app_error(char *msg);
+static void backend_error(char *what, char *fn);
 
 /**************
  * Main routine
@@ -141,15 +254,20 @@ int main(int argc, char **argv)
     char c;
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
-    trace_t *trace = NULL;     /* stores a single trace file in memory */
     range_t *ranges = NULL;    /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
-    speed_t speed_params;      /* input parameters to the xx_speed routines */ 
 
    // int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    int jobs = 1;        /* Number of traces evaluated at once (-j) */
+    int pin = 0;         /* If set, pin worker processes to CPUs (-P) */
+    backend_t **compare = NULL; /* Backends to compare (-b) ... */
+    int num_compare = 0;        /* ... and their number */
+    char *name;
+    int found;
+    size_t heap_size;
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,7 +276,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:s:o:j:b:m:c:PhvVgal")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -181,6 +299,70 @@ int main(int argc, char **argv)
         //case 'a': /* Don't check team structure */
             //team_check = 0;
            // break;
+	case 's': /* Sample fragmentation every frag_interval ops */
+	    frag_interval = atoi(optarg);
+	    if (frag_interval <= 0)
+		app_error("ERROR: the -s interval must be positive");
+	    break;
+	case 'o': /* Prefix of the fragmentation output files */
+	    frag_prefix = strdup(optarg);
+	    break;
+	case 'j': /* Evaluate up to jobs traces at once */
+	    jobs = atoi(optarg);
+	    if (jobs <= 0)
+		app_error("ERROR: the -j job count must be positive");
+	    break;
+	case 'P': /* Pin the worker processes to CPUs */
+	    pin = 1;
+	    break;
+	case 'b': /* Evaluate or compare other malloc packages */
+	    for (name = strtok(optarg, ","); name; name = strtok(NULL, ",")) {
+		found = 0;
+		for (i = 0; backends[i].name != NULL; i++) {
+		    if (strcmp(name, "all") && strcmp(name, backends[i].name))
+			continue;
+		    compare = realloc(compare, 
+				      (num_compare+1) * sizeof(backend_t *));
+		    if (compare == NULL)
+			unix_error("ERROR: realloc failed in main");
+		    compare[num_compare++] = &backends[i];
+		    found = 1;
+		}
+		if (!found) {
+		    sprintf(msg, "ERROR: unknown backend %s", name);
+		    app_error(msg);
+		}
+	    }
+	    if (num_compare == 0)
+		app_error("ERROR: -b needs at least one backend");
+	    backend = compare[0];
+	    break;
+	case 'c': /* Cache state during the timed runs */
+	    if (!strcmp(optarg, "warm"))
+		cache_mode = CACHE_WARM;
+	    else if (!strcmp(optarg, "cold"))
+		cache_mode = CACHE_COLD;
+	    else if (!strncmp(optarg, "pollute", 7) && 
+		     (optarg[7] == '\0' || optarg[7] == ':')) {
+		cache_mode = CACHE_POLLUTE;
+		if (optarg[7] == ':' && 
+		    (name = strtok(optarg + 8, ":")) != NULL) {
+		    pollute_bytes = parse_size(name);
+		    if ((name = strtok(NULL, ":")) != NULL)
+			pollute_every = atoi(name);
+		}
+		if (pollute_bytes == 0 || pollute_bytes > CACHE_BYTES ||
+		    pollute_every <= 0)
+		    app_error("ERROR: bad -c pollute:<bytes>:<ops> setting");
+	    }
+	    else
+		app_error("ERROR: the -c mode must be warm, cold or pollute");
+	    break;
+	case 'm': /* Size of the heap that memlib reserves */
+	    if ((heap_size = parse_size(optarg)) == 0)
+		app_error("ERROR: bad -m heap size");
+	    mem_set_max_heap(heap_size);
+	    break;
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
@@ -238,12 +420,31 @@ int main(int argc, char **argv)
 
     /* Initialize the timing package */
     init_fsecs();
+    if (cache_mode != CACHE_DEFAULT)
+	fsecs_clear_cache(cache_mode == CACHE_COLD);
+    if (verbose && cache_mode == CACHE_COLD)
+	printf("Flushing the caches before every timed run.\n");
+    else if (verbose && cache_mode == CACHE_POLLUTE)
+	printf("Polluting the caches with %lu bytes every %d requests.\n",
+	       (unsigned long)pollute_bytes, pollute_every);
+
+    /*
+     * With several backends, evaluate each of them on every trace and
+     * print them side by side instead of computing a performance index
+     */
+    if (num_compare > 1) {
+	mem_init();
+	eval_compare(tracefiles, num_tracefiles, compare, num_compare);
+	exit(errors ? 1 : 0);
+    }
+    if (backend != &backends[0])
+	printf("Evaluating backend %s\n", backend->name);
 
     /*
      * Optionally run and evaluate the libc malloc package 
      */
     if (run_libc) {
-	if (verbose > 1)
+	if (verbose > 1 && jobs == 1)
 	    printf("\nTesting libc malloc\n");
 	
 	/* Allocate libc stats array, with one stats_t struct per tracefile */
@@ -252,34 +453,12 @@ int main(int argc, char **argv)
 	    unix_error("libc_stats calloc in main failed");
 	
 	/* Evaluate the libc malloc package using the K-best scheme */
-	for (i=0; i < num_tracefiles; i++) {
-	    trace = read_trace(tracedir, tracefiles[i]);
-	    libc_stats[i].ops = trace->num_ops;
-	    if (verbose > 1)
-		printf("Checking libc malloc for correctness, ");
-	    libc_stats[i].valid = eval_libc_valid(trace, i);
-	    if (libc_stats[i].valid) {
-		speed_params.trace = trace;
-		if (verbose > 1)
-		    printf("and performance.\n");
-		libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
-	    }
-	    free_trace(trace);
-	}
-
-	/* Display the libc results in a compact table */
-	if (verbose) {
-	    printf("\nResults for libc malloc:\n");
-	    printresults(num_tracefiles, libc_stats);
+	if (jobs == 1) {
+	    for (i=0; i < num_tracefiles; i++)
+		eval_libc_trace(tracefiles[i], i, &libc_stats[i]);
 	}
     }
 
-    /*
-     * Always run and evaluate the student's mm package
-     */
-    if (verbose > 1)
-	printf("\nTesting mm malloc\n");
-
     /* Allocate the mm stats array, with one stats_t struct per tracefile */
     mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
     if (mm_stats == NULL)
@@ -288,29 +467,35 @@ int main(int argc, char **argv)
     /* Initialize the simulated memory system in memlib.c */
     mem_init(); 
 
-    /* Evaluate student's mm malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
+    /* 
+     * In parallel mode, every trace is evaluated (libc and mm) by its 
+     * own worker process, which gets its own copy of the memlib heap
+     */
+    if (jobs > 1)
+	eval_parallel(tracefiles, num_tracefiles, jobs, pin, run_libc,
+		      libc_stats, mm_stats);
+
+    /* Display the libc results in a compact table */
+    if (run_libc && verbose) {
+	printf("\nResults for libc malloc:\n");
+	printresults(num_tracefiles, libc_stats);
+    }
+
+    /*
+     * Always run and evaluate the student's mm package
+     */
+    if (jobs == 1) {
 	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-	if (mm_stats[i].valid) {
-	    if (verbose > 1)
-		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
-	    speed_params.trace = trace;
-	    speed_params.ranges = ranges;
-	    if (verbose > 1)
-		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
-	}
-	free_trace(trace);
+	    printf("\nTesting %s malloc\n", backend->name);
+
+	/* Evaluate student's mm malloc package using the K-best scheme */
+	for (i=0; i < num_tracefiles; i++)
+	    eval_mm_trace(tracefiles[i], i, &mm_stats[i], &ranges);
     }
 
     /* Display the mm results in a compact table */
     if (verbose) {
-	printf("\nResults for mm malloc:\n");
+	printf("\nResults for %s malloc:\n", backend->name);
 	printresults(num_tracefiles, mm_stats);
 	printf("\n");
     }
@@ -368,22 +553,22 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range tree, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks.
  ****************************************************************/
 
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we create a range struct for this block and add it to the range tree. 
  */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum)
 {
     char *hi = lo + size - 1;
-    range_t *p;
+    range_t *p, *pred, *succ;
     char msg[MAXLINE];
 
     assert(size > 0);
@@ -397,35 +582,50 @@ static int add_range(range_t **ranges, char *lo, int size,
     }
 
     /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
-	(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+    if (backend->memlib && 
+	((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) || 
+	 (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi()))) {
 	sprintf(msg, "Payload (%p:%p) lies outside heap (%p:%p)",
 		lo, hi, mem_heap_lo(), mem_heap_hi());
 	malloc_error(tracenum, opnum, msg);
         return 0;
     }
 
-    /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    /* 
+     * The payload must not overlap any other payloads. Since the 
+     * payloads in the tree are disjoint, it is enough to check the 
+     * closest payload at or below lo and the closest one above lo.
+     */
+    pred = succ = NULL;
+    for (p = *ranges;  p != NULL; ) {
+	if (p->lo <= lo) {
+	    pred = p;
+	    p = p->right;
+	}
+	else {
+	    succ = p;
+	    p = p->left;
+	}
+    }
+    if ((p = (pred && pred->hi >= lo) ? pred : 
+	     (succ && succ->lo <= hi) ? succ : NULL) != NULL) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, p->lo, p->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
 	unix_error("malloc error in add_range");
-    p->next = *ranges;
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    p->left = p->right = NULL;
+    p->height = 1;
+    *ranges = range_insert(*ranges, p);
     return 1;
 }
 
@@ -434,34 +634,130 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
-    int size;
-
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
-    }
+    *ranges = range_delete(*ranges, lo);
 }
 
 /*
  * clear_ranges - free all of the range records for a trace 
  */
 static void clear_ranges(range_t **ranges)
+{
+    range_t *p = *ranges;
+
+    if (p == NULL)
+	return;
+    clear_ranges(&p->left);
+    clear_ranges(&p->right);
+    free(p);
+    *ranges = NULL;
+}
+
+/* Height of a (possibly empty) range subtree */
+#define RHEIGHT(r) ((r) ? (r)->height : 0)
+
+/*
+ * range_fix - recompute the height of r from its children
+ */
+static void range_fix(range_t *r)
+{
+    int hl = RHEIGHT(r->left);
+    int hr = RHEIGHT(r->right);
+
+    r->height = 1 + ((hl > hr) ? hl : hr);
+}
+
+/*
+ * range_rotate - rotate the subtree rooted at r to the left (dir=0) 
+ *     or to the right (dir=1) and return its new root
+ */
+static range_t *range_rotate(range_t *r, int dir)
+{
+    range_t *c;
+
+    if (dir) {
+	c = r->left;
+	r->left = c->right;
+	c->right = r;
+    }
+    else {
+	c = r->right;
+	r->right = c->left;
+	c->left = r;
+    }
+    range_fix(r);
+    range_fix(c);
+    return c;
+}
+
+/*
+ * range_balance - restore the AVL property at r after one of its 
+ *     subtrees grew or shrank by one level, and return the new root
+ */
+static range_t *range_balance(range_t *r)
+{
+    int diff;
+
+    range_fix(r);
+    diff = RHEIGHT(r->left) - RHEIGHT(r->right);
+    if (diff > 1) {
+	if (RHEIGHT(r->left->left) < RHEIGHT(r->left->right))
+	    r->left = range_rotate(r->left, 0);
+	return range_rotate(r, 1);
+    }
+    if (diff < -1) {
+	if (RHEIGHT(r->right->right) < RHEIGHT(r->right->left))
+	    r->right = range_rotate(r->right, 1);
+	return range_rotate(r, 0);
+    }
+    return r;
+}
+
+/*
+ * range_insert - insert node into the tree rooted at root and return 
+ *     the new root
+ */
+static range_t *range_insert(range_t *root, range_t *node)
+{
+    if (root == NULL)
+	return node;
+    if (node->lo < root->lo)
+	root->left = range_insert(root->left, node);
+    else
+	root->right = range_insert(root->right, node);
+    return range_balance(root);
+}
+
+/*
+ * range_delete - free the range starting at lo in the tree rooted at 
+ *     root (if there is one) and return the new root
+ */
+static range_t *range_delete(range_t *root, char *lo)
 {
     range_t *p;
-    range_t *pnext;
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
+    if (root == NULL)
+	return NULL;
+    if (lo < root->lo) {
+	root->left = range_delete(root->left, lo);
+	return range_balance(root);
     }
-    *ranges = NULL;
+    if (lo > root->lo) {
+	root->right = range_delete(root->right, lo);
+	return range_balance(root);
+    }
+
+    /* Found it: replace the node by its in-order successor, if any */
+    if (root->left == NULL || root->right == NULL) {
+	p = root->left ? root->left : root->right;
+	free(root);
+	return p;
+    }
+    for (p = root->right; p->left != NULL; p = p->left)
+	;
+    root->lo = p->lo;
+    root->hi = p->hi;
+    root->right = range_delete(root->right, p->lo);
+    return range_balance(root);
 }
 
 
@@ -572,6 +868,284 @@ void free_trace(trace_t *trace)
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * eval_libc_trace - Check libc malloc on one trace for correctness and 
+ *    measure its performance
+ */
+static void eval_libc_trace(char *tracefile, int tracenum, stats_t *stats)
+{
+    trace_t *trace;
+    speed_t speed_params;
+
+    trace = read_trace(tracedir, tracefile);
+    stats->ops = trace->num_ops;
+    if (verbose > 1)
+	printf("Checking libc malloc for correctness, ");
+    stats->valid = eval_libc_valid(trace, tracenum);
+    if (stats->valid) {
+	speed_params.trace = trace;
+	if (verbose > 1)
+	    printf("and performance.\n");
+	timing_begin();
+	stats->secs = time_speed(eval_libc_speed, &speed_params, 
+				 stats->events);
+	timing_end();
+    }
+    free_trace(trace);
+}
+
+/*
+ * eval_mm_trace - Check the mm malloc package on one trace for 
+ *    correctness and measure its space utilization and performance
+ */
+static void eval_mm_trace(char *tracefile, int tracenum, stats_t *stats,
+			  range_t **ranges)
+{
+    trace_t *trace;
+    speed_t speed_params;
+    size_t commits, faults;
+
+    trace = read_trace(tracedir, tracefile);
+    stats->ops = trace->num_ops;
+    if (verbose > 1)
+	printf("Checking %s_malloc for correctness, ", backend->name);
+    stats->valid = eval_mm_valid(trace, tracenum, ranges);
+    if (stats->valid) {
+	if (verbose > 1)
+	    printf("efficiency, ");
+	if (backend->memlib) {
+	    commits = mem_commits();
+	    faults = mem_faults();
+	    stats->util = eval_mm_util(trace, tracenum, ranges);
+	    stats->heap = mem_heapsize();
+	    stats->commits = mem_commits() - commits;
+	    stats->faults = mem_faults() - faults;
+	}
+	if (frag_interval > 0 && backend->walk != NULL) {
+	    if (verbose > 1)
+		printf("fragmentation, ");
+	    eval_mm_frag(trace, tracefile, frag_interval, frag_prefix);
+	}
+	speed_params.trace = trace;
+	speed_params.ranges = *ranges;
+	if (verbose > 1)
+	    printf("and performance.\n");
+	timing_begin();
+	stats->secs = time_speed(eval_mm_speed, &speed_params, stats->events);
+	timing_end();
+    }
+    free_trace(trace);
+}
+
+/*
+ * eval_compare - Evaluate each backend in list on every trace: check it
+ *    for correctness, measure its space utilization (memlib backends 
+ *    only), throughput and request latencies, and print the results of 
+ *    all backends side by side.
+ */
+static void eval_compare(char **tracefiles, int num_tracefiles,
+			 backend_t **list, int nbackends)
+{
+    int i, b;
+    trace_t *trace;
+    stats_t *stats, *st;
+    speed_t speed_params;
+    range_t *ranges = NULL;
+    size_t commits, faults;
+
+    stats = (stats_t *)calloc(num_tracefiles * nbackends, sizeof(stats_t));
+    if (stats == NULL)
+	unix_error("stats calloc in eval_compare failed");
+
+    for (i = 0; i < num_tracefiles; i++) {
+	trace = read_trace(tracedir, tracefiles[i]);
+	for (b = 0; b < nbackends; b++) {
+	    backend = list[b];
+	    st = &stats[i * nbackends + b];
+	    st->ops = trace->num_ops;
+	    if (verbose > 1)
+		printf("Checking %s for correctness, ", backend->name);
+	    st->valid = eval_mm_valid(trace, i, &ranges);
+	    if (!st->valid) {
+		if (verbose > 1)
+		    printf("\n");
+		continue;
+	    }
+	    if (backend->memlib) {
+		if (verbose > 1)
+		    printf("efficiency, ");
+		commits = mem_commits();
+		faults = mem_faults();
+		st->util = eval_mm_util(trace, i, &ranges);
+		st->heap = mem_heapsize();
+		st->commits = mem_commits() - commits;
+		st->faults = mem_faults() - faults;
+	    }
+	    if (verbose > 1)
+		printf("performance, and latency.\n");
+	    speed_params.trace = trace;
+	    speed_params.ranges = ranges;
+	    st->secs = time_speed(eval_mm_speed, &speed_params, st->events);
+	    eval_mm_latency(trace, st);
+	}
+	clear_ranges(&ranges);
+	free_trace(trace);
+    }
+
+    printcompare(num_tracefiles, list, nbackends, stats);
+    free(stats);
+}
+
+/*
+ * eval_parallel - Evaluate every trace in a worker process of its own, 
+ *    running at most jobs workers at once. Each worker inherits a private 
+ *    copy of the memlib heap, evaluates libc (if run_libc) and mm on its 
+ *    trace, and sends the results back through a pipe. Validity and 
+ *    utilization checks run concurrently, but a timing measurement waits
+ *    until no other worker is checking or timing (see timing_fd). 
+ *    If pin is set, worker k is pinned to CPU k modulo the CPU count.
+ */
+static void eval_parallel(char **tracefiles, int num_tracefiles, int jobs,
+			  int pin, int run_libc, stats_t *libc_stats, 
+			  stats_t *mm_stats)
+{
+    int i, next, running, status, ncpus;
+    int *fds;
+    pid_t pid, *pids;
+    result_t result;
+    range_t *ranges = NULL;
+    cpu_set_t cpus;
+    char lockname[] = "/tmp/mdriver-timing-XXXXXX";
+
+    if ((pids = (pid_t *)calloc(num_tracefiles, sizeof(pid_t))) == NULL ||
+	(fds = (int *)calloc(num_tracefiles, sizeof(int))) == NULL)
+	unix_error("calloc failed in eval_parallel");
+    if ((timing_fd = mkstemp(lockname)) < 0)
+	unix_error("mkstemp failed in eval_parallel");
+    unlink(lockname);
+    ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ncpus < 1)
+	ncpus = 1;
+
+    if (verbose > 1)
+	printf("\nTesting in %d worker processes\n", jobs);
+
+    next = running = 0;
+    while (next < num_tracefiles || running > 0) {
+
+	/* Start another worker if there is a free slot */
+	if (next < num_tracefiles && running < jobs) {
+	    int fd[2];
+
+	    i = next++;
+	    if (pipe(fd) < 0)
+		unix_error("pipe failed in eval_parallel");
+	    fflush(stdout);
+	    if ((pid = fork()) < 0)
+		unix_error("fork failed in eval_parallel");
+
+	    if (pid == 0) { /* worker */
+		close(fd[0]);
+		timing_lock(F_RDLCK, "eval_parallel");
+		if (pin) {
+		    CPU_ZERO(&cpus);
+		    CPU_SET(i % ncpus, &cpus);
+		    if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0)
+			unix_error("sched_setaffinity failed in eval_parallel");
+		}
+		memset(&result, 0, sizeof(result));
+		if (run_libc)
+		    eval_libc_trace(tracefiles[i], i, &result.libc);
+		eval_mm_trace(tracefiles[i], i, &result.mm, &ranges);
+		result.errors = errors;
+		if (write(fd[1], &result, sizeof(result)) != sizeof(result))
+		    unix_error("write failed in eval_parallel");
+		exit(0);
+	    }
+
+	    close(fd[1]);
+	    pids[i] = pid;
+	    fds[i] = fd[0];
+	    running++;
+	    continue;
+	}
+
+	/* Otherwise collect the results of the next worker to finish */
+	if ((pid = wait(&status)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    unix_error("wait failed in eval_parallel");
+	}
+	for (i = 0; i < num_tracefiles && pids[i] != pid; i++)
+	    ;
+	if (i == num_tracefiles)
+	    continue;
+	running--;
+
+	if (read(fds[i], &result, sizeof(result)) == sizeof(result)) {
+	    if (run_libc)
+		libc_stats[i] = result.libc;
+	    mm_stats[i] = result.mm;
+	    errors += result.errors;
+	}
+	else { /* the worker died, most likely in the mm package */
+	    errors++;
+	    if (WIFSIGNALED(status))
+		sprintf(msg, "worker killed by signal %d", WTERMSIG(status));
+	    else
+		sprintf(msg, "worker exited with status %d", 
+			WEXITSTATUS(status));
+	    printf("ERROR [trace %d]: %s\n", i, msg);
+	}
+	close(fds[i]);
+    }
+
+    close(timing_fd);
+    timing_fd = -1;
+    free(pids);
+    free(fds);
+}
+
+/*
+ * timing_begin - In parallel mode, wait until no other worker is 
+ *    checking or timing its trace
+ */
+static void timing_begin(void)
+{
+    /* Two workers upgrading their read locks would deadlock */
+    timing_lock(F_UNLCK, "timing_begin");
+    timing_lock(F_WRLCK, "timing_begin");
+}
+
+/*
+ * timing_end - In parallel mode, let the other workers go on
+ */
+static void timing_end(void)
+{
+    timing_lock(F_RDLCK, "timing_end");
+}
+
+/*
+ * timing_lock - Set the lock of the worker on timing_fd to type, 
+ *    waiting for it if need be; fn names the caller in errors
+ */
+static void timing_lock(short type, char *fn)
+{
+    struct flock lock;
+
+    if (timing_fd < 0)
+	return;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    while (fcntl(timing_fd, F_SETLKW, &lock) < 0) {
+	if (errno != EINTR) {
+	    sprintf(msg, "fcntl failed in %s", fn);
+	    unix_error(msg);
+	}
+    }
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
@@ -585,13 +1159,14 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
     char *oldp;
     char *p;
     
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range tree */
     mem_reset_brk();
     clear_ranges(ranges);
 
     /* Call the mm package's init function */
-    if (mm_init() < 0) {
-	malloc_error(tracenum, 0, "mm_init failed.");
+    if (backend->init() < 0) {
+	sprintf(msg, "%s_init failed.", backend->name);
+	malloc_error(tracenum, 0, msg);
 	return 0;
     }
 
@@ -605,14 +1180,15 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
         case ALLOC: /* mm_malloc */
 
 	    /* Call the student's malloc */
-	    if ((p = mm_malloc(size)) == NULL) {
-		malloc_error(tracenum, i, "mm_malloc failed.");
+	    if ((p = backend->malloc(size)) == NULL) {
+		sprintf(msg, "%s_malloc failed.", backend->name);
+		malloc_error(tracenum, i, msg);
 		return 0;
 	    }
 	    
 	    /* 
 	     * Test the range of the new block for correctness and add it 
-	     * to the range list if OK. The block must be  be aligned properly,
+	     * to the range tree if OK. The block must be  be aligned properly,
 	     * and must not overlap any currently allocated block. 
 	     */ 
 	    if (add_range(ranges, p, size, tracenum, i) == 0)
@@ -634,15 +1210,16 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    
 	    /* Call the student's realloc */
 	    oldp = trace->blocks[index];
-	    if ((newp = mm_realloc(oldp, size)) == NULL) {
-		malloc_error(tracenum, i, "mm_realloc failed.");
+	    if ((newp = backend->realloc(oldp, size)) == NULL) {
+		sprintf(msg, "%s_realloc failed.", backend->name);
+		malloc_error(tracenum, i, msg);
 		return 0;
 	    }
 	    
-	    /* Remove the old region from the range list */
+	    /* Remove the old region from the range tree */
 	    remove_range(ranges, oldp);
 	    
-	    /* Check new block for correctness and add it to range list */
+	    /* Check new block for correctness and add it to range tree */
 	    if (add_range(ranges, newp, size, tracenum, i) == 0)
 		return 0;
 	    
@@ -654,9 +1231,10 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
-		malloc_error(tracenum, i, "mm_realloc did not preserve the "
-			     "data from old block");
+	      if ((unsigned char)newp[j] != (index & 0xFF)) {
+		sprintf(msg, "%s_realloc did not preserve the data from old "
+			"block", backend->name);
+		malloc_error(tracenum, i, msg);
 		return 0;
 	      }
 	    }
@@ -669,10 +1247,10 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 
         case FREE: /* mm_free */
 	    
-	    /* Remove region from list and call student's free function */
+	    /* Remove region from tree and call student's free function */
 	    p = trace->blocks[index];
 	    remove_range(ranges, p);
-	    mm_free(p);
+	    backend->free(p);
 	    break;
 
 	default:
@@ -708,8 +1286,8 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 
     /* initialize the heap and the mm malloc package */
     mem_reset_brk();
-    if (mm_init() < 0)
-	app_error("mm_init failed in eval_mm_util");
+    if (backend->init() < 0)
+	backend_error("init failed", "eval_mm_util");
 
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
@@ -718,8 +1296,8 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    index = trace->ops[i].index;
 	    size = trace->ops[i].size;
 
-	    if ((p = mm_malloc(size)) == NULL) 
-		app_error("mm_malloc failed in eval_mm_util");
+	    if ((p = backend->malloc(size)) == NULL) 
+		backend_error("malloc failed", "eval_mm_util");
 	    
 	    /* Remember region and size */
 	    trace->blocks[index] = p;
@@ -740,8 +1318,8 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 
 	    oldp = trace->blocks[index];
-	    if ((newp = mm_realloc(oldp,newsize)) == NULL)
-		app_error("mm_realloc failed in eval_mm_util");
+	    if ((newp = backend->realloc(oldp,newsize)) == NULL)
+		backend_error("realloc failed", "eval_mm_util");
 
 	    /* Remember region and size */
 	    trace->blocks[index] = newp;
@@ -761,7 +1339,7 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 	    size = trace->block_sizes[index];
 	    p = trace->blocks[index];
 	    
-	    mm_free(p);
+	    backend->free(p);
 	    
 	    /* Keep track of current total size
 	     * of all allocated blocks */
@@ -779,6 +1357,294 @@ static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges)
 }
 
 
+/*
+ * eval_mm_frag - Replay the trace with the student's package and walk 
+ *   the heap with mm_walk every interval ops (and after the last op). 
+ *   Each sample records the live payload bytes, the heap size, and the 
+ *   number, total size and largest size of the free blocks. It also 
+ *   records a compact occupancy map of the heap: MAPCELLS characters, 
+ *   each telling how much of its share of the heap is covered by 
+ *   allocated blocks ('.' = nothing, '1'-'9' = tenths, '#' = all).
+ *   The samples go to <prefix>-<trace>.csv, the maps to 
+ *   <prefix>-<trace>.json.
+ */
+static void eval_mm_frag(trace_t *trace, char *tracename, int interval,
+			 char *prefix)
+{
+    int i, j;
+    int index;
+    int size, newsize, oldsize;
+    int total_size = 0;
+    char *p;
+    char *newp, *oldp;
+    char name[MAXLINE], path[MAXLINE], map[MAPCELLS+1];
+    FILE *csv, *json;
+    frag_t frag;
+    double level;
+    size_t heapsize;
+    int nsamples = 0;
+
+    /* Derive the output file names from the trace file name */
+    if ((p = strrchr(tracename, '/')) != NULL)
+	tracename = p + 1;
+    strcpy(name, tracename);
+    if ((p = strstr(name, ".rep")) != NULL)
+	*p = '\0';
+    snprintf(path, MAXLINE, "%s-%s.csv", prefix, name);
+    if ((csv = fopen(path, "w")) == NULL) {
+	snprintf(msg, sizeof(msg), "Could not open %.900s in eval_mm_frag", path);
+	unix_error(msg);
+    }
+    snprintf(path, MAXLINE, "%s-%s.json", prefix, name);
+    if ((json = fopen(path, "w")) == NULL) {
+	snprintf(msg, sizeof(msg), "Could not open %.900s in eval_mm_frag", path);
+	unix_error(msg);
+    }
+    fprintf(csv, "op,live_bytes,heap_bytes,util,alloc_blocks,"
+	    "free_blocks,free_bytes,largest_free\n");
+    fprintf(json, "{\"trace\": \"%s\", \"interval\": %d, \"cells\": %d,\n"
+	    " \"samples\": [", name, interval, MAPCELLS);
+
+    /* initialize the heap and the mm malloc package */
+    mem_reset_brk();
+    if (backend->init() < 0)
+	backend_error("init failed", "eval_mm_frag");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* mm_alloc */
+	    index = trace->ops[i].index;
+	    size = trace->ops[i].size;
+	    if ((p = backend->malloc(size)) == NULL) 
+		backend_error("malloc failed", "eval_mm_frag");
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    total_size += size;
+	    break;
+
+	case REALLOC: /* mm_realloc */
+	    index = trace->ops[i].index;
+	    newsize = trace->ops[i].size;
+	    oldsize = trace->block_sizes[index];
+	    oldp = trace->blocks[index];
+	    if ((newp = backend->realloc(oldp,newsize)) == NULL)
+		backend_error("realloc failed", "eval_mm_frag");
+	    trace->blocks[index] = newp;
+	    trace->block_sizes[index] = newsize;
+	    total_size += (newsize - oldsize);
+	    break;
+
+        case FREE: /* mm_free */
+	    index = trace->ops[i].index;
+	    backend->free(trace->blocks[index]);
+	    total_size -= trace->block_sizes[index];
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in eval_mm_frag");
+        }
+
+	if ((i+1) % interval != 0 && i != trace->num_ops - 1)
+	    continue;
+
+	/* Take a sample by walking the heap */
+	memset(&frag, 0, sizeof(frag));
+	heapsize = mem_heapsize();
+	frag.heap_lo = (char *)mem_heap_lo();
+	frag.cellsize = (heapsize > 0) ? (double)heapsize / MAPCELLS : 1;
+	backend->walk(frag_block, &frag);
+
+	for (j = 0; j < MAPCELLS; j++) {
+	    level = frag.cells[j] / frag.cellsize;
+	    if (level <= 0)
+		map[j] = '.';
+	    else if (level >= 1)
+		map[j] = '#';
+	    else 
+		map[j] = '1' + (int)(level * 9);
+	}
+	map[MAPCELLS] = '\0';
+
+	fprintf(csv, "%d,%d,%u,%.4f,%d,%d,%u,%u\n", 
+		i+1, total_size, (unsigned)heapsize, 
+		(heapsize > 0) ? (double)total_size / heapsize : 0.0,
+		frag.alloc_blocks, frag.free_blocks, 
+		(unsigned)frag.free_bytes, (unsigned)frag.largest_free);
+	fprintf(json, "%s\n  {\"op\": %d, \"live_bytes\": %d, "
+		"\"heap_bytes\": %u, \"map\": \"%s\"}", 
+		nsamples++ ? "," : "", i+1, total_size, 
+		(unsigned)heapsize, map);
+    }
+
+    fprintf(json, "\n ]}\n");
+    fclose(csv);
+    fclose(json);
+}
+
+/*
+ * frag_block - mm_walk callback of eval_mm_frag: account for one 
+ *    heap block in the fragmentation sample argp
+ */
+static void frag_block(void *lo, size_t size, int alloc, void *argp)
+{
+    frag_t *frag = (frag_t *)argp;
+    double start, end, cellend;
+    int cell;
+
+    if (!alloc) {
+	frag->free_blocks++;
+	frag->free_bytes += size;
+	if (size > frag->largest_free)
+	    frag->largest_free = size;
+	return;
+    }
+    frag->alloc_blocks++;
+
+    /* Spread the block over the cells of the heap map it covers */
+    start = (char *)lo - frag->heap_lo;
+    end = start + size;
+    for (cell = (int)(start / frag->cellsize); 
+	 cell < MAPCELLS && start < end; cell++) {
+	cellend = (cell + 1) * frag->cellsize;
+	frag->cells[cell] += ((end < cellend) ? end : cellend) - start;
+	start = cellend;
+    }
+}
+
+/*
+ * eval_mm_latency - Replay the trace once more, timing every request
+ *    on its own, and record the median, 99th and 99.9th percentile of 
+ *    the request latencies in ns. The latencies include the cost of 
+ *    reading the clock, which is the same for every backend.
+ */
+static void eval_mm_latency(trace_t *trace, stats_t *stats)
+{
+    int i, index;
+    char *p;
+    double *lat;
+    struct timespec t0, t1;
+
+    if ((lat = (double *)malloc(trace->num_ops * sizeof(double))) == NULL)
+	unix_error("malloc failed in eval_mm_latency");
+
+    mem_reset_brk();
+    if (backend->init() < 0) 
+	app_error("init failed in eval_mm_latency");
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	if (cache_mode == CACHE_POLLUTE && i % pollute_every == 0)
+	    pollute();
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+        switch (trace->ops[i].type) {
+        case ALLOC: /* malloc */
+            if ((p = backend->malloc(trace->ops[i].size)) == NULL)
+		app_error("malloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            break;
+	case REALLOC: /* realloc */
+            if ((p = backend->realloc(trace->blocks[index], 
+				      trace->ops[i].size)) == NULL)
+		app_error("realloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            break;
+        case FREE: /* free */
+            backend->free(trace->blocks[index]);
+            break;
+	default:
+	    app_error("Nonexistent request type in eval_mm_latency");
+        }
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	lat[i] = 1e9 * (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec);
+    }
+
+    qsort(lat, trace->num_ops, sizeof(double), cmp_double);
+    stats->p50 = lat[(int)(0.5 * (trace->num_ops - 1))];
+    stats->p99 = lat[(int)(0.99 * (trace->num_ops - 1))];
+    stats->p999 = lat[(int)(0.999 * (trace->num_ops - 1))];
+    free(lat);
+}
+
+/*
+ * cmp_double - qsort comparison function for doubles
+ */
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * time_speed - Time one of the xxx_speed functions with fsecs and store
+ *    the event counts of the runs in events. When the caches are polluted
+ *    between requests, the pollution is kept out of the measurement: 
+ *    the xxx_speed function adds up the clock between pollutions itself,
+ *    and the event counters are stopped while it pollutes. What is left 
+ *    is what the allocator costs under that cache pressure.
+ */
+static double time_speed(fsecs_test_funct f, speed_t *params, 
+			 double *events)
+{
+    double secs;
+
+    params->secs = 0;
+    params->runs = 0;
+    secs = fsecs(f, params);
+    fsecs_events(events);
+    if (cache_mode != CACHE_POLLUTE)
+	return secs;
+    if (params->runs == 0 || params->secs <= 0)
+	app_error("no time left for the requests with -c pollute");
+    return params->secs / params->runs;
+}
+
+/*
+ * pollute_timed - Pollute the caches in the middle of a timed run,
+ *    with the clock and the event counters of the run stopped
+ */
+static void pollute_timed(speed_t *params)
+{
+    lap(params);
+    fsecs_pause(1);
+    pollute();
+    fsecs_pause(0);
+    clock_gettime(CLOCK_MONOTONIC, &params->mark);
+}
+
+/*
+ * lap - Add the time since params->mark to the time of the runs
+ */
+static void lap(speed_t *params)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    params->secs += (now.tv_sec - params->mark.tv_sec) + 
+	1e-9 * (now.tv_nsec - params->mark.tv_nsec);
+}
+
+/*
+ * pollute - Write to pollute_bytes of the pollution buffer, one byte per
+ *    cache block, continuing where the last call stopped. This stands for
+ *    the work a program does between two calls to the allocator.
+ */
+static void pollute(void)
+{
+    size_t i;
+
+    if (pollute_buf == NULL && 
+	(pollute_buf = (char *)malloc(CACHE_BYTES)) == NULL)
+	unix_error("malloc failed in pollute");
+    for (i = 0; i < pollute_bytes; i += CACHE_BLOCK) {
+	pollute_buf[pollute_pos]++;
+	if ((pollute_pos += CACHE_BLOCK) >= CACHE_BYTES)
+	    pollute_pos = 0;
+    }
+}
+
 /*
  * eval_mm_speed - This is the function that is used by fcyc()
  *    to measure the running time of the mm malloc package.
@@ -787,22 +1653,28 @@ static void eval_mm_speed(void *ptr)
 {
     int i, index, size, newsize;
     char *p, *newp, *oldp, *block;
-    trace_t *trace = ((speed_t *)ptr)->trace;
+    speed_t *params = (speed_t *)ptr;
+    trace_t *trace = params->trace;
+
+    if (cache_mode == CACHE_POLLUTE)
+	clock_gettime(CLOCK_MONOTONIC, &params->mark);
 
     /* Reset the heap and initialize the mm package */
     mem_reset_brk();
-    if (mm_init() < 0) 
-	app_error("mm_init failed in eval_mm_speed");
+    if (backend->init() < 0) 
+	backend_error("init failed", "eval_mm_speed");
 
     /* Interpret each trace request */
-    for (i = 0;  i < trace->num_ops;  i++)
+    for (i = 0;  i < trace->num_ops;  i++) {
+	if (cache_mode == CACHE_POLLUTE && i % pollute_every == 0)
+	    pollute_timed(params);
         switch (trace->ops[i].type) {
 
         case ALLOC: /* mm_malloc */
             index = trace->ops[i].index;
             size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
-		app_error("mm_malloc error in eval_mm_speed");
+            if ((p = backend->malloc(size)) == NULL)
+		backend_error("malloc error", "eval_mm_speed");
             trace->blocks[index] = p;
             break;
 
@@ -810,20 +1682,25 @@ static void eval_mm_speed(void *ptr)
 	    index = trace->ops[i].index;
             newsize = trace->ops[i].size;
 	    oldp = trace->blocks[index];
-            if ((newp = mm_realloc(oldp,newsize)) == NULL)
-		app_error("mm_realloc error in eval_mm_speed");
+            if ((newp = backend->realloc(oldp,newsize)) == NULL)
+		backend_error("realloc error", "eval_mm_speed");
             trace->blocks[index] = newp;
             break;
 
         case FREE: /* mm_free */
             index = trace->ops[i].index;
             block = trace->blocks[index];
-            mm_free(block);
+            backend->free(block);
             break;
 
 	default:
 	    app_error("Nonexistent request type in eval_mm_valid");
         }
+    }
+    if (cache_mode == CACHE_POLLUTE) {
+	lap(params);
+	params->runs++;
+    }
 }
 
 /*
@@ -880,9 +1757,14 @@ static void eval_libc_speed(void *ptr)
     int i;
     int index, size, newsize;
     char *p, *newp, *oldp, *block;
-    trace_t *trace = ((speed_t *)ptr)->trace;
+    speed_t *params = (speed_t *)ptr;
+    trace_t *trace = params->trace;
 
+    if (cache_mode == CACHE_POLLUTE)
+	clock_gettime(CLOCK_MONOTONIC, &params->mark);
     for (i = 0;  i < trace->num_ops;  i++) {
+	if (cache_mode == CACHE_POLLUTE && i % pollute_every == 0)
+	    pollute_timed(params);
         switch (trace->ops[i].type) {
         case ALLOC: /* malloc */
 	    index = trace->ops[i].index;
@@ -909,6 +1791,10 @@ static void eval_libc_speed(void *ptr)
 	    break;
 	}
     }
+    if (cache_mode == CACHE_POLLUTE) {
+	lap(params);
+	params->runs++;
+    }
 }
 
 /*************************************
@@ -971,6 +1857,176 @@ static void printresults(int n, stats_t *stats)
 	       "-");
     }
 
+    printheap(n, NULL, 1, stats);
+    printevents(n, NULL, 1, stats);
+}
+
+/*
+ * printcompare - prints the results of several malloc packages side by
+ *    side, one line per trace and package
+ */
+static void printcompare(int n, backend_t **list, int nbackends, 
+			 stats_t *stats)
+{
+    int i, b;
+    stats_t *st;
+    double secs, ops, util;
+
+    printf("%5s %-8s%6s%6s%8s%9s%9s%9s\n", 
+	   "trace", "backend", "valid", "util", "Kops", 
+	   "p50(ns)", "p99(ns)", "p999(ns)");
+    for (i = 0; i < n; i++) {
+	for (b = 0; b < nbackends; b++) {
+	    st = &stats[i * nbackends + b];
+	    if (st->valid && list[b]->memlib)
+		printf("%5d %-8s%6s%5.0f%%%8.0f%9.0f%9.0f%9.0f\n",
+		       i, list[b]->name, "yes", st->util*100.0,
+		       (st->ops/1e3)/st->secs, st->p50, st->p99, st->p999);
+	    else if (st->valid)
+		printf("%5d %-8s%6s%6s%8.0f%9.0f%9.0f%9.0f\n",
+		       i, list[b]->name, "yes", "-",
+		       (st->ops/1e3)/st->secs, st->p50, st->p99, st->p999);
+	    else
+		printf("%5d %-8s%6s%6s%8s%9s%9s%9s\n",
+		       i, list[b]->name, "no", "-", "-", "-", "-", "-");
+	}
+    }
+
+    /* Print the aggregate results of each package */
+    for (b = 0; b < nbackends; b++) {
+	secs = ops = util = 0;
+	for (i = 0; i < n; i++) {
+	    st = &stats[i * nbackends + b];
+	    if (!st->valid)
+		break;
+	    secs += st->secs;
+	    ops += st->ops;
+	    util += st->util;
+	}
+	if (i < n)
+	    printf("%5s %-8s%6s%6s%8s\n", "Total", list[b]->name, 
+		   "", "-", "-");
+	else if (list[b]->memlib)
+	    printf("%5s %-8s%6s%5.0f%%%8.0f\n", "Total", list[b]->name, 
+		   "", (util/n)*100.0, (ops/1e3)/secs);
+	else 
+	    printf("%5s %-8s%6s%6s%8.0f\n", "Total", list[b]->name, 
+		   "", "-", (ops/1e3)/secs);
+    }
+
+    printheap(n, list, nbackends, stats);
+    printevents(n, list, nbackends, stats);
+}
+
+/*
+ * printheap - prints how much heap each trace needed and what growing 
+ *    it cost, if the package allocates from memlib. With a list of 
+ *    backends, stats is laid out as in printcompare.
+ */
+static void printheap(int n, backend_t **list, int nbackends, 
+		      stats_t *stats)
+{
+    int i, b, any = 0;
+    stats_t *st;
+
+    for (i = 0; i < n * nbackends; i++)
+	if (stats[i].valid && stats[i].heap > 0)
+	    any = 1;
+    if (!any)
+	return;
+
+    printf("\nHeap growth:\n%5s ", "trace");
+    if (list != NULL)
+	printf("%-8s", "backend");
+    printf("%10s%9s%9s\n", "heap(KB)", "commits", "faults");
+    for (i = 0; i < n; i++) {
+	for (b = 0; b < nbackends; b++) {
+	    st = &stats[i * nbackends + b];
+	    printf("%5d ", i);
+	    if (list != NULL)
+		printf("%-8s", list[b]->name);
+	    if (st->valid && st->heap > 0)
+		printf("%10.0f%9.0f%9.0f\n", st->heap / 1024, st->commits, 
+		       st->faults);
+	    else
+		printf("%10s%9s%9s\n", "-", "-", "-");
+	}
+    }
+}
+
+/*
+ * printevents - prints the hardware events per request counted while 
+ *    timing each trace, if any were counted. With a list of backends,
+ *    stats holds nbackends results per trace as in printcompare.
+ */
+static void printevents(int n, backend_t **list, int nbackends, 
+			stats_t *stats)
+{
+    int i, b, e, counted = 0;
+    stats_t *st;
+
+    for (i = 0; i < n * nbackends; i++)
+	for (e = 0; e < NUM_EVENTS; e++)
+	    if (stats[i].valid && stats[i].events[e] >= 0)
+		counted = 1;
+    if (!counted)
+	return;
+
+    printf("\nHardware events per request:\n%5s ", "trace");
+    if (list != NULL)
+	printf("%-8s", "backend");
+    for (e = 0; e < NUM_EVENTS; e++)
+	printf("%10s", fperf_event_name(e));
+    printf("%6s\n", "IPC");
+
+    for (i = 0; i < n; i++) {
+	for (b = 0; b < nbackends; b++) {
+	    st = &stats[i * nbackends + b];
+	    printf("%5d ", i);
+	    if (list != NULL)
+		printf("%-8s", list[b]->name);
+	    for (e = 0; e < NUM_EVENTS; e++) {
+		if (st->valid && st->events[e] >= 0)
+		    printf("%10.2f", st->events[e] / st->ops);
+		else
+		    printf("%10s", "-");
+	    }
+	    if (st->valid && st->events[EV_CYCLES] > 0 && 
+		st->events[EV_INSTRUCTIONS] >= 0)
+		printf("%6.2f\n", 
+		       st->events[EV_INSTRUCTIONS] / st->events[EV_CYCLES]);
+	    else
+		printf("%6s\n", "-");
+	}
+    }
+}
+
+/*
+ * parse_size - Convert a byte count with an optional k, m or g suffix
+ *    (0 if it is malformed or does not fit in a size_t)
+ */
+static size_t parse_size(char *str)
+{
+    char *end;
+    double n = strtod(str, &end);
+
+    switch (*end) {
+    case 'k': case 'K': n *= 1<<10; end++; break;
+    case 'm': case 'M': n *= 1<<20; end++; break;
+    case 'g': case 'G': n *= 1<<30; end++; break;
+    }
+    /* Too large for a size_t (or NaN) would be undefined in the cast */
+    return (*end != '\0' || !(n >= 1 && n < SIZE_MAX)) ? 0 : (size_t)n;
+}
+
+/* 
+ * backend_error - Report that a call of the backend being evaluated
+ *    failed in function fn, e.g. "segfit_malloc failed in eval_mm_util"
+ */
+static void backend_error(char *what, char *fn)
+{
+    sprintf(msg, "%s_%s in %s", backend->name, what, fn);
+    app_error(msg);
 }
 
 /* 
@@ -1005,13 +2061,26 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>] [-s <n> [-o <pfx>]] [-j <n> [-P]]\n");
+    fprintf(stderr, "               [-b <backend>[,<backend>...]] [-m <size>]\n");
+    fprintf(stderr, "               [-c warm|cold|pollute[:<bytes>[:<n>]]]\n");
     fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-b <list>  Evaluate the given backend instead of mm.c, or compare\n");
+    fprintf(stderr, "\t           several backends side by side (\"all\" for every one).\n");
+    fprintf(stderr, "\t-c <mode>  Time with the caches warm, cold (flushed before every\n");
+    fprintf(stderr, "\t           run) or pollute[:<bytes>[:<n>]] (<bytes> of other data\n");
+    fprintf(stderr, "\t           touched every <n> requests, default 256k:1).\n");
+    fprintf(stderr, "\t           Without -c, cold with the fcyc timer, warm otherwise.\n");
 //    fprintf(stderr, "\t-a         Don't check the team structure.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-j <n>     Evaluate up to <n> traces at once in worker processes.\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-m <size>  Reserve <size> bytes (k, M, G suffix) for the heap.\n");
+    fprintf(stderr, "\t-o <pfx>   Write fragmentation samples to <pfx>-<trace>.{csv,json}.\n");
+    fprintf(stderr, "\t-P         Pin the worker processes of -j to CPUs.\n");
+    fprintf(stderr, "\t-s <n>     Sample heap fragmentation every <n> ops.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
@@ -2,6 +2,12 @@
  * memlib.c - a module that simulates the memory system.  Needed because it 
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
+ *
+ * The heap is a range of virtual memory that is reserved with PROT_NONE
+ * when the model is initialized. mem_sbrk commits pages (makes them
+ * readable and writable) in chunks of COMMIT_CHUNK bytes as the brk
+ * pointer moves past them, and mem_reset_brk gives them back, so every
+ * run of a trace pays for growing its heap like a fresh process would.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,28 +16,46 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/resource.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/* Granularity of committing heap pages (a multiple of the page size) */
+#define COMMIT_CHUNK (1<<16)
+
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static char *mem_commit_brk; /* first byte past the committed pages */
+static size_t mem_max_heap = MAX_HEAP; /* size of the reserved range */
+static size_t mem_num_commits = 0;     /* number of commits so far */
+
+/*
+ * mem_set_max_heap - set the size of the heap reserved by mem_init
+ */
+void mem_set_max_heap(size_t bytes)
+{
+    mem_max_heap = bytes;
+}
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    /* reserve (but don't commit) the VM that models the available heap */
+    mem_start_brk = mmap(NULL, mem_max_heap, PROT_NONE, 
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error: %s\n", strerror(errno));
 	exit(1);
     }
 
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-    mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_max_addr = mem_start_brk + mem_max_heap; /* max legal heap address */
+    mem_brk = mem_start_brk;                     /* heap is empty initially */
+    mem_commit_brk = mem_start_brk;              /* nothing committed yet */
 }
 
 /* 
@@ -39,7 +63,7 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    munmap(mem_start_brk, mem_max_heap);
 }
 
 /*
@@ -47,7 +71,17 @@ void mem_deinit(void)
  */
 void mem_reset_brk()
 {
+    size_t committed = mem_commit_brk - mem_start_brk;
+
+    /* drop the contents of the committed pages and uncommit them */
+    if (committed > 0 && 
+	(madvise(mem_start_brk, committed, MADV_DONTNEED) < 0 ||
+	 mprotect(mem_start_brk, committed, PROT_NONE) < 0)) {
+	fprintf(stderr, "mem_reset_brk: %s\n", strerror(errno));
+	exit(1);
+    }
     mem_brk = mem_start_brk;
+    mem_commit_brk = mem_start_brk;
 }
 
 /* 
@@ -59,11 +93,29 @@ void *mem_sbrk(int incr)
 {
     char *old_brk = mem_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    size_t len;
+
+    if ( (incr < 0) || (incr > mem_max_addr - mem_brk)) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
+
+    /* commit the chunks that the new brk pointer reaches into */
+    if (mem_brk + incr > mem_commit_brk) {
+	len = ((mem_brk + incr - mem_commit_brk + COMMIT_CHUNK - 1) /
+	       COMMIT_CHUNK) * COMMIT_CHUNK;
+	if (len > (size_t)(mem_max_addr - mem_commit_brk))
+	    len = mem_max_addr - mem_commit_brk;
+	if (mprotect(mem_commit_brk, len, PROT_READ | PROT_WRITE) < 0) {
+	    fprintf(stderr, "ERROR: mem_sbrk failed to commit memory: %s\n",
+		    strerror(errno));
+	    return (void *)-1;
+	}
+	mem_commit_brk += len;
+	mem_num_commits++;
+    }
+
     mem_brk += incr;
     return (void *)old_brk;
 }
@@ -99,3 +151,23 @@ size_t mem_pagesize()
 {
     return (size_t)getpagesize();
 }
+
+/*
+ * mem_commits() - returns the number of times mem_sbrk committed pages
+ */
+size_t mem_commits()
+{
+    return mem_num_commits;
+}
+
+/*
+ * mem_faults() - returns the number of page faults taken by the process
+ */
+size_t mem_faults()
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) < 0)
+	return 0;
+    return (size_t)(ru.ru_minflt + ru.ru_majflt);
+}
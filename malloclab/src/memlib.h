@@ -1,6 +1,7 @@
 #include <unistd.h>
 
 void mem_init(void);               
+void mem_set_max_heap(size_t bytes);
 void mem_deinit(void);
 void *mem_sbrk(int incr);
 void mem_reset_brk(void); 
@@ -8,4 +9,6 @@ void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+size_t mem_commits(void);
+size_t mem_faults(void);
 
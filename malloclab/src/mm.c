@@ -463,6 +463,18 @@ static void delete_free(void *bp){
     }
 }
 
+/*
+* mm_walk - Visit every block between the prologue and the epilogue in address order
+*/
+void mm_walk(mm_walk_funct f, void *argp){
+    void *bp;
+
+    if (heap_listp == NULL)
+        return;
+    for (bp = NEXT_BLKP(heap_listp); GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp))
+        f(HDRP(bp), GET_SIZE(HDRP(bp)), GET_ALLOC(HDRP(bp)), argp);
+}
+
 /*
 * mm_check - Scan the heap and check it for its consistency
 * It checkes whether every blcok in the free list is mared as free, whether there are contiguous free blocks that somehow escaped coalescing,
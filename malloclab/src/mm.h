@@ -1,3 +1,6 @@
+#ifndef __MM_H_
+#define __MM_H_
+
 #include <stdio.h>
 
 extern int mm_init (void);
@@ -5,6 +8,15 @@ extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 
+/*
+ * mm_walk - Calls f once for every block of the heap, in address order.
+ *     lo is the first byte of the block (including its header), size 
+ *     is the total size of the block in bytes, and alloc tells whether 
+ *     the block is allocated. The driver uses it to sample fragmentation.
+ */
+typedef void (*mm_walk_funct)(void *lo, size_t size, int alloc, void *argp);
+extern void mm_walk(mm_walk_funct f, void *argp);
+
 
 /* 
  * Students work in teams of one or two.  Teams enter their team name, 
@@ -21,3 +33,4 @@ typedef struct {
 
 extern team_t team;
 
+#endif /* __MM_H_ */
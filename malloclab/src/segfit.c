@@ -0,0 +1,328 @@
+/*
+ * segfit.c - A segregated-fit allocator backend for the driver (-b segfit)
+ *
+ * Free blocks are kept in NUM_CLASSES explicit free lists, one per size class.
+ * Class c holds the free blocks whose size lies in [MIN_CLASS<<c, MIN_CLASS<<(c+1)),
+ * the last class holds everything larger. malloc searches the class of the
+ * request first-fit and then takes the first block of the next non-empty class,
+ * which always fits. Freed blocks are coalesced immediately with their neighbors.
+ *
+ * The block layout follows mm.c: a one-word header and footer that hold the
+ * block size and the allocated bit. Free blocks store full pointers to their
+ * predecessor and successor, so the allocator works on 32-bit and 64-bit hosts.
+ * When the heap must grow and the last block is free, only the missing part is
+ * requested from mem_sbrk. mm_realloc-style growth in place is done by absorbing
+ * a free next block or by extending the heap when the block is the last one.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memlib.h"
+#include "backend.h"
+
+/* Basic constants and macros */
+#define WSIZE 4
+#define DSIZE 8
+#define CHUNKSIZE (1<<12)
+#define NUM_CLASSES 20
+#define MIN_CLASS 16
+
+/* rounds up to the nearest multiple of DSIZE */
+#define ALIGN(size) (((size) + (DSIZE-1)) & ~(size_t)(DSIZE-1))
+
+/* Smallest block: header, two list pointers and footer */
+#define MIN_BLOCK ALIGN(2*WSIZE + 2*sizeof(void *))
+
+/* Return Maximum value */
+#define MAX(x, y) ((x) > (y) ? (x) : (y))
+
+/* Pack a size and allocated bit into a word */
+#define PACK(size, alloc) ((size) | (alloc))
+
+/* Read or write a word */
+#define GET(p) (*(unsigned int *)(p))
+#define PUT(p, val) (*(unsigned int *)(p) = (val))
+
+/* Read the size and allocated fields from address p */
+#define GET_SIZE(p) (GET(p) & ~0x7)
+#define GET_ALLOC(p) (GET(p) & 0x1)
+
+/* Given a block ptr bp, compute address of its header and footer */
+#define HDRP(bp) ((char *)(bp) - WSIZE)
+#define FTRP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)) - DSIZE)
+
+/* Given block ptr bp, compute address of next and previous blocks */
+#define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(((char *)(bp) - WSIZE)))
+#define PREV_BLKP(bp) ((char *)(bp) - GET_SIZE(((char *)(bp) - DSIZE)))
+
+/* Free list links of a free block */
+#define PRED(bp) (*(char **)(bp))
+#define SUCC(bp) (*(char **)((char *)(bp) + sizeof(void *)))
+
+static char *heap_listp = NULL;            /* prologue block */
+static char *seg_lists[NUM_CLASSES];       /* heads of the free lists */
+
+/* Helper functions */
+static int size_class(size_t size);
+static void *extend_heap(size_t size);
+static void *coalesce(void *bp);
+static void place(void *bp, size_t asize);
+static void insert_free(void *bp);
+static void delete_free(void *bp);
+
+/*
+ * seg_init - Create a heap with a prologue and an epilogue block
+ */
+int seg_init(void)
+{
+    int i;
+
+    for (i = 0; i < NUM_CLASSES; i++)
+        seg_lists[i] = NULL;
+
+    if ((heap_listp = mem_sbrk(4*WSIZE)) == (void *)-1)
+        return -1;
+    PUT(heap_listp, 0);                            /* Alignment padding */
+    PUT(heap_listp + (1*WSIZE), PACK(DSIZE, 1));   /* Prologue header */
+    PUT(heap_listp + (2*WSIZE), PACK(DSIZE, 1));   /* Prologue footer */
+    PUT(heap_listp + (3*WSIZE), PACK(0, 1));       /* Epilogue header */
+    heap_listp += (2*WSIZE);
+    return 0;
+}
+
+/*
+ * seg_malloc - Take the first fitting block of the segregated lists,
+ *     growing the heap if there is none
+ */
+void *seg_malloc(size_t size)
+{
+    size_t asize;
+    char *bp;
+    int c;
+
+    if (size == 0)
+        return NULL;
+    asize = MAX(ALIGN(size + DSIZE), MIN_BLOCK);
+
+    /* First fit within the class of the request... */
+    c = size_class(asize);
+    for (bp = seg_lists[c]; bp != NULL; bp = SUCC(bp))
+        if (GET_SIZE(HDRP(bp)) >= asize)
+            break;
+
+    /* ... otherwise any block of a larger class will do */
+    while (bp == NULL && ++c < NUM_CLASSES)
+        bp = seg_lists[c];
+
+    if (bp == NULL && (bp = extend_heap(MAX(asize, CHUNKSIZE))) == NULL)
+        return NULL;
+    place(bp, asize);
+    return bp;
+}
+
+/*
+ * seg_free - Mark the block free and merge it with free neighbors
+ */
+void seg_free(void *ptr)
+{
+    size_t size;
+
+    if (ptr == NULL)
+        return;
+    size = GET_SIZE(HDRP(ptr));
+    PUT(HDRP(ptr), PACK(size, 0));
+    PUT(FTRP(ptr), PACK(size, 0));
+    coalesce(ptr);
+}
+
+/*
+ * seg_realloc - Resize in place when the block itself, a free next block or
+ *     the end of the heap has room; move the block otherwise
+ */
+void *seg_realloc(void *ptr, size_t size)
+{
+    size_t asize, cursize, nextsize, need;
+    char *next, *newptr;
+
+    if (ptr == NULL)
+        return seg_malloc(size);
+    if (size == 0) {
+        seg_free(ptr);
+        return NULL;
+    }
+
+    asize = MAX(ALIGN(size + DSIZE), MIN_BLOCK);
+    cursize = GET_SIZE(HDRP(ptr));
+    next = NEXT_BLKP(ptr);
+    nextsize = GET_ALLOC(HDRP(next)) ? 0 : GET_SIZE(HDRP(next));
+
+    if (asize > cursize + nextsize) {
+        /* The block (plus a free next block) ends the heap: grow the heap */
+        if (GET_SIZE(HDRP(next)) == 0 ||
+            (nextsize > 0 && GET_SIZE(HDRP(NEXT_BLKP(next))) == 0)) {
+            need = asize - cursize - nextsize;
+            if (mem_sbrk(need) == (void *)-1)
+                return NULL;
+            if (nextsize > 0)
+                delete_free(next);
+            cursize += nextsize + need;
+            PUT(HDRP(ptr), PACK(cursize, 1));
+            PUT(FTRP(ptr), PACK(cursize, 1));
+            PUT(HDRP(NEXT_BLKP(ptr)), PACK(0, 1));  /* New epilogue header */
+            return ptr;
+        }
+
+        /* Otherwise move the block */
+        if ((newptr = seg_malloc(size)) == NULL)
+            return NULL;
+        memcpy(newptr, ptr, cursize - DSIZE);
+        seg_free(ptr);
+        return newptr;
+    }
+
+    /* Absorb the free next block if the block alone is too small */
+    if (asize > cursize) {
+        delete_free(next);
+        cursize += nextsize;
+        PUT(HDRP(ptr), PACK(cursize, 1));
+        PUT(FTRP(ptr), PACK(cursize, 1));
+    }
+
+    /* Give back the tail if it is large enough to be a block */
+    if (cursize - asize >= MIN_BLOCK) {
+        PUT(HDRP(ptr), PACK(asize, 1));
+        PUT(FTRP(ptr), PACK(asize, 1));
+        next = NEXT_BLKP(ptr);
+        PUT(HDRP(next), PACK(cursize - asize, 0));
+        PUT(FTRP(next), PACK(cursize - asize, 0));
+        coalesce(next);
+    }
+    return ptr;
+}
+
+/*
+ * size_class - Return the free list for blocks of the given size
+ */
+static int size_class(size_t size)
+{
+    int c = 0;
+
+    while (c < NUM_CLASSES - 1 && size >= ((size_t)MIN_CLASS << (c + 1)))
+        c++;
+    return c;
+}
+
+/*
+ * extend_heap - Grow the heap so that its last block is a free block of at
+ *     least size bytes, and return that block
+ */
+static void *extend_heap(size_t size)
+{
+    char *bp;
+    char *last_ftr = (char *)mem_heap_hi() + 1 - DSIZE;
+
+    /* Only ask for the missing part if the last block is already free */
+    if (!GET_ALLOC(last_ftr) && GET_SIZE(last_ftr) < size)
+        size -= GET_SIZE(last_ftr);
+    size = MAX(ALIGN(size), MIN_BLOCK);
+
+    if ((bp = mem_sbrk(size)) == (void *)-1)
+        return NULL;
+    PUT(HDRP(bp), PACK(size, 0));           /* Free block header */
+    PUT(FTRP(bp), PACK(size, 0));           /* Free block footer */
+    PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));   /* New epilogue header */
+    return coalesce(bp);
+}
+
+/*
+ * coalesce - Merge a free block with its free neighbors and put the result
+ *     on its free list
+ */
+static void *coalesce(void *bp)
+{
+    size_t prev_alloc = GET_ALLOC(HDRP(bp) - WSIZE);
+    size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+    size_t size = GET_SIZE(HDRP(bp));
+
+    if (!next_alloc) {
+        delete_free(NEXT_BLKP(bp));
+        size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
+        PUT(HDRP(bp), PACK(size, 0));
+        PUT(FTRP(bp), PACK(size, 0));
+    }
+    if (!prev_alloc) {
+        bp = PREV_BLKP(bp);
+        delete_free(bp);
+        size += GET_SIZE(HDRP(bp));
+        PUT(HDRP(bp), PACK(size, 0));
+        PUT(FTRP(bp), PACK(size, 0));
+    }
+    insert_free(bp);
+    return bp;
+}
+
+/*
+ * place - Allocate asize bytes at the start of the free block bp and
+ *     split off the rest if it is large enough to be a block
+ */
+static void place(void *bp, size_t asize)
+{
+    size_t csize = GET_SIZE(HDRP(bp));
+
+    delete_free(bp);
+    if (csize - asize >= MIN_BLOCK) {
+        PUT(HDRP(bp), PACK(asize, 1));
+        PUT(FTRP(bp), PACK(asize, 1));
+        bp = NEXT_BLKP(bp);
+        PUT(HDRP(bp), PACK(csize - asize, 0));
+        PUT(FTRP(bp), PACK(csize - asize, 0));
+        insert_free(bp);
+    }
+    else {
+        PUT(HDRP(bp), PACK(csize, 1));
+        PUT(FTRP(bp), PACK(csize, 1));
+    }
+}
+
+/*
+ * insert_free - Push a free block on the front of its list
+ */
+static void insert_free(void *bp)
+{
+    int c = size_class(GET_SIZE(HDRP(bp)));
+
+    PRED(bp) = NULL;
+    SUCC(bp) = seg_lists[c];
+    if (seg_lists[c] != NULL)
+        PRED(seg_lists[c]) = bp;
+    seg_lists[c] = bp;
+}
+
+/*
+ * delete_free - Unlink a free block from its list
+ */
+static void delete_free(void *bp)
+{
+    int c = size_class(GET_SIZE(HDRP(bp)));
+
+    if (PRED(bp) != NULL)
+        SUCC(PRED(bp)) = SUCC(bp);
+    else
+        seg_lists[c] = SUCC(bp);
+    if (SUCC(bp) != NULL)
+        PRED(SUCC(bp)) = PRED(bp);
+}
+
+/*
+ * seg_walk - Visit every block between the prologue and the epilogue
+ */
+void seg_walk(mm_walk_funct f, void *argp)
+{
+    char *bp;
+
+    if (heap_listp == NULL)
+        return;
+    for (bp = NEXT_BLKP(heap_listp); GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp))
+        f(HDRP(bp), GET_SIZE(HDRP(bp)), GET_ALLOC(HDRP(bp)), argp);
+}
@@ -0,0 +1,360 @@
+/*
+ * slab.c - A slab allocator backend for the driver (-b slab)
+ *
+ * The heap is carved into pages of PAGE_SIZE bytes, aligned to PAGE_SIZE so
+ * that the page of any payload can be found by masking its address. A run of
+ * one or more pages starts with a page header:
+ *
+ *   - Small requests (up to the largest entry of class_sizes) are served from
+ *     one-page slabs. All objects of a slab have the same size class; free
+ *     objects are chained through their first word. Each class keeps a list
+ *     of the slabs that still have free objects.
+ *   - Larger requests get a run of whole pages of their own, with the payload
+ *     right after the page header.
+ *
+ * Slabs that become empty and freed large runs go back to an address-ordered
+ * list of free runs, where they are merged with adjacent free runs. The list
+ * is searched first-fit (splitting off the unused pages) before the heap is
+ * grown; a free run at the end of the heap is grown in place. There is no
+ * per-object header, so small objects cost no space beyond the rounding to
+ * their class size.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "memlib.h"
+#include "backend.h"
+
+#define PAGE_SIZE 4096
+#define PAGE_OF(p) ((page_t *)((uintptr_t)(p) & ~(uintptr_t)(PAGE_SIZE-1)))
+
+/* Header at the start of every run of pages */
+typedef struct page_t {
+    int cls;                 /* size class, LARGE or FREE_RUN */
+    int npages;              /* number of pages in the run */
+    int nfree;               /* free objects left (slabs only) */
+    void *free;              /* first free object (slabs only) */
+    struct page_t *prev;     /* neighbors in the class or free-run list */
+    struct page_t *next;
+} page_t;
+
+#define LARGE    -1
+#define FREE_RUN -2
+
+/* Payloads start after the header, 16-byte aligned */
+#define HDR_SIZE ((sizeof(page_t) + 15) & ~(size_t)15)
+
+/* Object sizes of the small classes; all multiples of 16 */
+static const size_t class_sizes[] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1008
+};
+#define NUM_CLASSES (int)(sizeof(class_sizes) / sizeof(class_sizes[0]))
+#define MAX_SMALL 1008
+
+static page_t *partial[NUM_CLASSES];  /* slabs with free objects, per class */
+static page_t *free_runs;             /* free runs of pages */
+static char *heap_start;              /* first page of the heap */
+
+/* Helper functions */
+static page_t *get_run(int npages);
+static void put_run(page_t *pg);
+static void list_push(page_t **list, page_t *pg);
+static void list_remove(page_t **list, page_t *pg);
+static void *small_alloc(int cls);
+static void small_free(page_t *pg, void *ptr);
+
+/*
+ * slab_init - Reset the class lists and align the heap to a page boundary
+ */
+int slab_init(void)
+{
+    int i;
+    size_t pad;
+
+    for (i = 0; i < NUM_CLASSES; i++)
+        partial[i] = NULL;
+    free_runs = NULL;
+
+    heap_start = mem_sbrk(0);
+    pad = (PAGE_SIZE - (uintptr_t)heap_start % PAGE_SIZE) % PAGE_SIZE;
+    if (pad > 0 && mem_sbrk(pad) == (void *)-1)
+        return -1;
+    heap_start += pad;
+    return 0;
+}
+
+/*
+ * slab_malloc - Serve small requests from a slab of their class and large
+ *     requests from a run of pages
+ */
+void *slab_malloc(size_t size)
+{
+    int cls, npages;
+    page_t *pg;
+
+    if (size == 0)
+        return NULL;
+
+    if (size <= MAX_SMALL) {
+        for (cls = 0; class_sizes[cls] < size; cls++)
+            ;
+        return small_alloc(cls);
+    }
+
+    npages = (HDR_SIZE + size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if ((pg = get_run(npages)) == NULL)
+        return NULL;
+    pg->cls = LARGE;
+    return (char *)pg + HDR_SIZE;
+}
+
+/*
+ * slab_free - Return an object to its slab, or a large run to the free runs
+ */
+void slab_free(void *ptr)
+{
+    page_t *pg;
+
+    if (ptr == NULL)
+        return;
+    pg = PAGE_OF(ptr);
+    if (pg->cls == LARGE)
+        put_run(pg);
+    else
+        small_free(pg, ptr);
+}
+
+/*
+ * slab_realloc - Keep the object if it still fits its class or run, grow a
+ *     large run in place at the end of the heap, and move it otherwise
+ */
+void *slab_realloc(void *ptr, size_t size)
+{
+    page_t *pg;
+    size_t oldsize;
+    int npages;
+    char *newptr;
+
+    if (ptr == NULL)
+        return slab_malloc(size);
+    if (size == 0) {
+        slab_free(ptr);
+        return NULL;
+    }
+
+    pg = PAGE_OF(ptr);
+    if (pg->cls == LARGE) {
+        oldsize = (size_t)pg->npages * PAGE_SIZE - HDR_SIZE;
+        if (size <= oldsize && size > MAX_SMALL)
+            return ptr;
+
+        /* The run ends the heap: just grow it */
+        npages = (HDR_SIZE + size + PAGE_SIZE - 1) / PAGE_SIZE;
+        if (size > oldsize &&
+            (char *)pg + (size_t)pg->npages * PAGE_SIZE == (char *)mem_heap_hi() + 1) {
+            if (mem_sbrk((npages - pg->npages) * PAGE_SIZE) == (void *)-1)
+                return NULL;
+            pg->npages = npages;
+            return ptr;
+        }
+    }
+    else {
+        oldsize = class_sizes[pg->cls];
+        if (size <= oldsize && (pg->cls == 0 || size > class_sizes[pg->cls - 1]))
+            return ptr;
+    }
+
+    if ((newptr = slab_malloc(size)) == NULL)
+        return NULL;
+    memcpy(newptr, ptr, (size < oldsize) ? size : oldsize);
+    slab_free(ptr);
+    return newptr;
+}
+
+/*
+ * small_alloc - Take an object of class cls, starting a new slab if no slab
+ *     of the class has free objects
+ */
+static void *small_alloc(int cls)
+{
+    page_t *pg = partial[cls];
+    char *obj;
+    size_t osize = class_sizes[cls];
+    int i, n;
+
+    if (pg == NULL) {
+        if ((pg = get_run(1)) == NULL)
+            return NULL;
+        pg->cls = cls;
+        n = (PAGE_SIZE - HDR_SIZE) / osize;
+
+        /* Chain all objects of the new slab into its free list */
+        obj = (char *)pg + HDR_SIZE;
+        pg->free = obj;
+        for (i = 0; i < n - 1; i++, obj += osize)
+            *(void **)obj = obj + osize;
+        *(void **)obj = NULL;
+        pg->nfree = n;
+        list_push(&partial[cls], pg);
+    }
+
+    obj = pg->free;
+    pg->free = *(void **)obj;
+    if (--pg->nfree == 0)
+        list_remove(&partial[cls], pg);
+    return obj;
+}
+
+/*
+ * small_free - Put an object back on its slab; empty slabs become free runs
+ */
+static void small_free(page_t *pg, void *ptr)
+{
+    int n = (PAGE_SIZE - HDR_SIZE) / class_sizes[pg->cls];
+
+    *(void **)ptr = pg->free;
+    pg->free = ptr;
+    if (pg->nfree++ == 0)
+        list_push(&partial[pg->cls], pg);
+    if (pg->nfree == n) {
+        list_remove(&partial[pg->cls], pg);
+        put_run(pg);
+    }
+}
+
+/*
+ * get_run - Take a run of npages pages from the free runs (first fit,
+ *     splitting off the rest) or from the end of the heap
+ */
+static page_t *get_run(int npages)
+{
+    page_t *pg, *last = NULL, *rest;
+    char *brk = (char *)mem_heap_hi() + 1;
+
+    for (pg = free_runs; pg != NULL; last = pg, pg = pg->next)
+        if (pg->npages >= npages)
+            break;
+
+    if (pg != NULL) {
+        if (pg->npages > npages) {
+            /* The rest takes the place of pg in the free runs */
+            rest = (page_t *)((char *)pg + (size_t)npages * PAGE_SIZE);
+            rest->cls = FREE_RUN;
+            rest->npages = pg->npages - npages;
+            rest->prev = pg->prev;
+            rest->next = pg->next;
+            if (rest->prev != NULL)
+                rest->prev->next = rest;
+            else
+                free_runs = rest;
+            if (rest->next != NULL)
+                rest->next->prev = rest;
+        }
+        else
+            list_remove(&free_runs, pg);
+    }
+    else if (last != NULL &&
+             (char *)last + (size_t)last->npages * PAGE_SIZE == brk) {
+        /* The last free run ends the heap: grow it to the right size */
+        if (mem_sbrk((npages - last->npages) * PAGE_SIZE) == (void *)-1)
+            return NULL;
+        pg = last;
+        list_remove(&free_runs, pg);
+    }
+    else if ((pg = mem_sbrk(npages * PAGE_SIZE)) == (void *)-1)
+        return NULL;
+
+    pg->npages = npages;
+    pg->nfree = 0;
+    pg->free = NULL;
+    pg->prev = pg->next = NULL;
+    return pg;
+}
+
+/*
+ * put_run - Give a run of pages back to the free runs, merging it with
+ *     the free runs right before and after it
+ */
+static void put_run(page_t *pg)
+{
+    page_t *prev = NULL, *next = free_runs;
+
+    while (next != NULL && next < pg) {
+        prev = next;
+        next = next->next;
+    }
+    pg->cls = FREE_RUN;
+
+    /* Merge with the following run */
+    if (next != NULL &&
+        (char *)pg + (size_t)pg->npages * PAGE_SIZE == (char *)next) {
+        pg->npages += next->npages;
+        list_remove(&free_runs, next);
+        next = (prev != NULL) ? prev->next : free_runs;
+    }
+
+    /* Merge into the preceding run */
+    if (prev != NULL &&
+        (char *)prev + (size_t)prev->npages * PAGE_SIZE == (char *)pg) {
+        prev->npages += pg->npages;
+        return;
+    }
+
+    pg->prev = prev;
+    pg->next = next;
+    if (prev != NULL)
+        prev->next = pg;
+    else
+        free_runs = pg;
+    if (next != NULL)
+        next->prev = pg;
+}
+
+/*
+ * list_push - Insert a run at the front of a doubly linked list
+ */
+static void list_push(page_t **list, page_t *pg)
+{
+    pg->prev = NULL;
+    pg->next = *list;
+    if (*list != NULL)
+        (*list)->prev = pg;
+    *list = pg;
+}
+
+/*
+ * list_remove - Unlink a run from a doubly linked list
+ */
+static void list_remove(page_t **list, page_t *pg)
+{
+    if (pg->prev != NULL)
+        pg->prev->next = pg->next;
+    else
+        *list = pg->next;
+    if (pg->next != NULL)
+        pg->next->prev = pg->prev;
+    pg->prev = pg->next = NULL;
+}
+
+/*
+ * slab_walk - Visit every run of pages in address order. Slabs are reported
+ *     as allocated when they hold at least one object.
+ */
+void slab_walk(mm_walk_funct f, void *argp)
+{
+    char *p, *end = (char *)mem_heap_hi() + 1;
+    page_t *pg;
+    int n;
+
+    for (p = heap_start; p != NULL && p < end; p += (size_t)pg->npages * PAGE_SIZE) {
+        pg = (page_t *)p;
+        if (pg->cls >= 0) {
+            n = (PAGE_SIZE - HDR_SIZE) / class_sizes[pg->cls];
+            f(p, PAGE_SIZE, pg->nfree < n, argp);
+        }
+        else
+            f(p, (size_t)pg->npages * PAGE_SIZE, pg->cls == LARGE, argp);
+    }
+}
@@ -0,0 +1,736 @@
+/*
+ * tracegen.c - Generate synthetic malloc lab traces of any length
+ *
+ * A trace is generated as a sequence of phases. Each phase draws the size
+ * and the lifetime of its blocks from its own distributions, can resize
+ * live blocks with realloc, and can free its blocks in FIFO order
+ * (producer/consumer) or all at once when it ends. The whole sequence of
+ * phases is repeated -c times, so that phase changes recur throughout a
+ * long trace. The trace ends by freeing every block that is still live.
+ *
+ * A phase is described by a string of key=value settings:
+ *
+ *   ops=<n>        share of the operations that the phase gets, relative
+ *                  to the other phases (default 1)
+ *   size=<mix>     size distribution of new blocks (default exp:64)
+ *   life=<mix>     lifetime distribution in operations (default exp:1000);
+ *                  "inf" blocks live until they are evicted or freed at
+ *                  the end of the phase or trace
+ *   realloc=<p>    probability that an operation resizes a live block
+ *   grow=<g>       how a realloc computes the new size: mul:<f>,
+ *                  add:<n> or rand (a new size from the size distribution)
+ *   fifo=<depth>   producer/consumer: once the phase holds depth blocks,
+ *                  each new block frees the oldest one (overrides life)
+ *   drain=1        free all blocks of the phase when it ends
+ *
+ * A mix is a comma separated list of distributions with optional weights,
+ * e.g. "70*lognorm:48:0.8,30*uniform:512-4096". The distributions are
+ * const:<n>, uniform:<lo>-<hi>, exp:<mean>, lognorm:<median>:<sigma>,
+ * pow2:<lo>-<hi> and (for lifetimes) inf.
+ *
+ * The number of live bytes is kept below -m bytes by freeing the block
+ * that is due first (or a random block if all are immortal), so that the
+ * traces fit the heap of mdriver regardless of their length.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+
+/* Limits */
+#define MAXLINE   1024     /* max string size */
+#define MAXDIST     16     /* max distributions in a mix */
+#define MAXPHASES   32     /* max phases of a trace */
+#define INF         -1     /* lifetime of blocks that never expire */
+
+/* Defaults */
+#define DEF_OPS     1000000
+#define DEF_LIVE    (8 << 20)  /* fits the default 20 MB mdriver heap */
+
+/* A single distribution of a mix */
+typedef struct {
+    enum {CONST, UNIFORM, EXP, LOGNORM, POW2, IMMORTAL} kind;
+    double a, b;           /* parameters (see parse_dist) */
+    double weight;         /* relative weight within the mix */
+} dist_t;
+
+/* A weighted mix of distributions */
+typedef struct {
+    int n;
+    double total;          /* sum of the weights */
+    dist_t d[MAXDIST];
+} mix_t;
+
+/* The settings of one phase */
+typedef struct {
+    char spec[MAXLINE];    /* the phase string it was parsed from */
+    double share;          /* relative share of the operations */
+    mix_t size;            /* sizes of new blocks */
+    mix_t life;            /* lifetimes of new blocks in ops */
+    double realloc_p;      /* probability of a realloc */
+    enum {GROW_MUL, GROW_ADD, GROW_RAND} grow;
+    double grow_arg;       /* factor or increment of the realloc */
+    int fifo;              /* producer/consumer queue depth (0 = off) */
+    int drain;             /* free the blocks of the phase at its end */
+} phase_t;
+
+/* A preset is a named list of phases and the number of cycles */
+typedef struct {
+    char *name;
+    char *desc;
+    int cycles;
+    char *phases[MAXPHASES];
+} preset_t;
+
+/*
+ * The presets. They are rough models of the allocation behavior of the
+ * named programs, not measurements; use memcapture to record the real thing.
+ */
+static preset_t presets[] = {
+    {"web", "web server: short-lived request data, I/O buffers, a cache", 1,
+     {"ops=5 size=lognorm:96:1.0 life=60*inf,40*exp:200",
+      "ops=95 size=70*lognorm:40:0.8,22*uniform:64-512,6*pow2:1024-16384,"
+      "2*uniform:32768-131072 life=75*exp:40,20*exp:3000,5*inf "
+      "realloc=0.02 grow=mul:2",
+      NULL}},
+    {"compiler", "compiler: per-function AST, optimizer temporaries, vectors", 16,
+     {"ops=40 size=70*uniform:16-64,25*lognorm:96:0.6,5*uniform:256-2048 "
+      "life=85*inf,15*exp:20",
+      "ops=45 size=60*uniform:16-128,40*pow2:64-8192 life=exp:300 "
+      "realloc=0.08 grow=mul:1.5",
+      "ops=15 size=uniform:8-256 life=exp:50 realloc=0.05 grow=add:64 drain=1",
+      NULL}},
+    {"db", "database: buffer pool pages, tuple streams, growing sort runs", 4,
+     {"ops=10 size=const:8192 life=inf",
+      "ops=60 size=70*lognorm:120:0.7,30*uniform:16-64 fifo=2000 "
+      "realloc=0.01 grow=rand",
+      "ops=30 size=uniform:32-256 life=exp:5000 realloc=0.1 grow=add:4096 "
+      "drain=1",
+      NULL}},
+    {NULL}
+};
+
+/*
+ * The state of the generator
+ */
+static int *block_size;      /* size of each id, 0 once freed */
+static int *block_pos;       /* position of each live id in live[] */
+static int *block_phase;     /* phase instance that allocated each id */
+static int *live;            /* ids of the live blocks */
+static int num_live;
+static int ids_max;          /* capacity of the per-id arrays */
+static int num_ids;          /* ids handed out so far */
+static long long num_ops;    /* ops written so far */
+static long long live_bytes, peak_bytes, max_live;
+static int max_size;         /* largest block size that is generated */
+
+/* Min-heap of the (death, id) pairs of blocks with a finite lifetime */
+typedef struct {
+    long long death;
+    int id;
+} event_t;
+static event_t *events;
+static int num_events, events_max;
+
+/* FIFO of the producer/consumer phase */
+static int *fifo;
+static int fifo_head, fifo_tail, fifo_max;
+
+static FILE *body;           /* the requests, before the header is known */
+static unsigned long long rng_state;
+
+/* Function prototypes */
+static void parse_phase(char *spec, phase_t *p);
+static void parse_mix(char *str, mix_t *mix, int lifetime);
+static void parse_dist(char *str, dist_t *d, int lifetime);
+static long long parse_size(char *str);
+static void run_phase(phase_t *p, int instance, long long ops);
+static void do_alloc(phase_t *p, int instance);
+static void do_realloc(phase_t *p);
+static void do_free(int id);
+static void make_room(long long bytes);
+static int sample_size(mix_t *mix);
+static double sample(mix_t *mix);
+static void event_push(long long death, int id);
+static int event_pop(void);
+static double rnd(void);
+static void usage(void);
+static void app_error(char *msg);
+static void unix_error(char *msg);
+
+/**************
+ * Main routine
+ **************/
+int main(int argc, char **argv)
+{
+    int c, i, j, cycles = 0, nphases = 0, verbose = 0;
+    long long target = DEF_OPS, done, ops;
+    double shares, cum;
+    char *outfile = NULL, msg[MAXLINE];
+    preset_t *preset = NULL;
+    phase_t *phases;
+    FILE *out;
+    size_t n;
+    char buf[1 << 16];
+
+    max_live = DEF_LIVE;
+    rng_state = 0x2545f4914f6cdd1dULL;
+    if ((phases = calloc(MAXPHASES, sizeof(phase_t))) == NULL)
+	unix_error("calloc failed in main");
+
+    while ((c = getopt(argc, argv, "P:p:n:c:m:S:o:lvh")) != EOF) {
+	switch (c) {
+	case 'P': /* Use a preset */
+	    for (preset = presets; preset->name != NULL; preset++)
+		if (!strcmp(preset->name, optarg))
+		    break;
+	    if (preset->name == NULL) {
+		sprintf(msg, "Unknown preset %.100s (see -l)", optarg);
+		app_error(msg);
+	    }
+	    for (i = 0; preset->phases[i] != NULL; i++)
+		parse_phase(preset->phases[i], &phases[nphases++]);
+	    if (cycles == 0)
+		cycles = preset->cycles;
+	    break;
+	case 'p': /* Add a phase */
+	    if (nphases == MAXPHASES)
+		app_error("Too many phases");
+	    parse_phase(optarg, &phases[nphases++]);
+	    break;
+	case 'n': /* Number of ops (accepts 1e7) */
+	    target = (long long)strtod(optarg, NULL);
+	    break;
+	case 'c': /* Number of times the phases are repeated */
+	    cycles = atoi(optarg);
+	    break;
+	case 'm': /* Max live bytes */
+	    max_live = parse_size(optarg);
+	    break;
+	case 'S': /* Random seed */
+	    rng_state = strtoull(optarg, NULL, 0) * 0x9e3779b97f4a7c15ULL + 1;
+	    break;
+	case 'o': /* Output file */
+	    outfile = optarg;
+	    break;
+	case 'l': /* List the presets */
+	    for (preset = presets; preset->name != NULL; preset++) {
+		printf("%s: %s (%d cycles)\n", preset->name, preset->desc,
+		       preset->cycles);
+		for (i = 0; preset->phases[i] != NULL; i++)
+		    printf("  -p \"%s\"\n", preset->phases[i]);
+	    }
+	    exit(0);
+	case 'v':
+	    verbose = 1;
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (nphases == 0)
+	parse_phase("", &phases[nphases++]);
+    if (cycles < 1)
+	cycles = 1;
+    if (target < 1 || max_live < 16)
+	app_error("The number of ops and the live bytes must be positive");
+    max_size = (max_live / 4 < (1 << 24)) ? (int)(max_live / 4) : (1 << 24);
+
+    if ((body = tmpfile()) == NULL)
+	unix_error("tmpfile failed in main");
+
+    /*
+     * Generate the requests. Every phase instance gets its share of the
+     * ops; the frees of the blocks left at the end come on top of them.
+     */
+    for (shares = 0, i = 0; i < nphases; i++)
+	shares += phases[i].share;
+    done = 0;
+    for (j = 0, cum = 0; j < cycles; j++) {
+	for (i = 0; i < nphases; i++) {
+	    cum += phases[i].share;
+	    ops = (long long)(target * cum / (shares * cycles)) - done;
+	    run_phase(&phases[i], j * nphases + i, ops);
+	    done += ops;
+	}
+    }
+    while (num_live > 0)
+	do_free(live[num_live - 1]);
+
+    /* Write the header followed by the requests */
+    if (outfile == NULL)
+	out = stdout;
+    else if ((out = fopen(outfile, "w")) == NULL) {
+	sprintf(msg, "Could not open %.900s for writing", outfile);
+	unix_error(msg);
+    }
+    fprintf(out, "%lld\n%d\n%lld\n1\n", peak_bytes, num_ids, num_ops);
+    rewind(body);
+    while ((n = fread(buf, 1, sizeof(buf), body)) > 0)
+	if (fwrite(buf, 1, n, out) != n)
+	    unix_error("write failed in main");
+    if (ferror(body) || fclose(out) != 0)
+	unix_error("Could not write the trace");
+
+    if (verbose)
+	fprintf(stderr, "%lld ops, %d ids, peak %lld live bytes\n",
+		num_ops, num_ids, peak_bytes);
+    exit(0);
+}
+
+/*****************************************************
+ * Parsing of phases, distributions and sizes
+ *****************************************************/
+
+/*
+ * parse_phase - Fill in p from a phase string of key=value settings
+ */
+static void parse_phase(char *spec, phase_t *p)
+{
+    char str[MAXLINE], msg[MAXLINE], *tok, *val, *save;
+
+    if (strlen(spec) >= MAXLINE)
+	app_error("Phase string too long");
+    strcpy(p->spec, spec);
+    strcpy(str, spec);
+
+    p->share = 1;
+    parse_mix("exp:64", &p->size, 0);
+    parse_mix("exp:1000", &p->life, 1);
+    p->realloc_p = 0;
+    p->grow = GROW_MUL;
+    p->grow_arg = 2;
+    p->fifo = 0;
+    p->drain = 0;
+
+    for (tok = strtok_r(str, " \t", &save); tok != NULL;
+	 tok = strtok_r(NULL, " \t", &save)) {
+	if ((val = strchr(tok, '=')) == NULL) {
+	    sprintf(msg, "Bad phase setting \"%.100s\"", tok);
+	    app_error(msg);
+	}
+	*val++ = '\0';
+	if (!strcmp(tok, "ops"))
+	    p->share = atof(val);
+	else if (!strcmp(tok, "size"))
+	    parse_mix(val, &p->size, 0);
+	else if (!strcmp(tok, "life"))
+	    parse_mix(val, &p->life, 1);
+	else if (!strcmp(tok, "realloc"))
+	    p->realloc_p = atof(val);
+	else if (!strncmp(val, "mul:", 4) && !strcmp(tok, "grow")) {
+	    p->grow = GROW_MUL;
+	    p->grow_arg = atof(val + 4);
+	}
+	else if (!strncmp(val, "add:", 4) && !strcmp(tok, "grow")) {
+	    p->grow = GROW_ADD;
+	    p->grow_arg = atof(val + 4);
+	}
+	else if (!strcmp(val, "rand") && !strcmp(tok, "grow"))
+	    p->grow = GROW_RAND;
+	else if (!strcmp(tok, "fifo"))
+	    p->fifo = atoi(val);
+	else if (!strcmp(tok, "drain"))
+	    p->drain = atoi(val);
+	else {
+	    sprintf(msg, "Bad phase setting \"%.100s=%.100s\"", tok, val);
+	    app_error(msg);
+	}
+    }
+    if (p->share <= 0 || p->realloc_p < 0 || p->realloc_p >= 1 || p->fifo < 0)
+	app_error("Phase settings out of range");
+}
+
+/*
+ * parse_mix - Parse a comma separated list of [weight*]distribution
+ */
+static void parse_mix(char *str, mix_t *mix, int lifetime)
+{
+    char buf[MAXLINE], *tok, *star, *save;
+
+    strncpy(buf, str, MAXLINE - 1);
+    buf[MAXLINE - 1] = '\0';
+    mix->n = 0;
+    mix->total = 0;
+    for (tok = strtok_r(buf, ",", &save); tok != NULL;
+	 tok = strtok_r(NULL, ",", &save)) {
+	if (mix->n == MAXDIST)
+	    app_error("Too many distributions in a mix");
+	if ((star = strchr(tok, '*')) != NULL) {
+	    *star = '\0';
+	    mix->d[mix->n].weight = atof(tok);
+	    tok = star + 1;
+	}
+	else
+	    mix->d[mix->n].weight = 1;
+	if (mix->d[mix->n].weight <= 0)
+	    app_error("Weights of a mix must be positive");
+	parse_dist(tok, &mix->d[mix->n], lifetime);
+	mix->total += mix->d[mix->n].weight;
+	mix->n++;
+    }
+    if (mix->n == 0)
+	app_error("Empty distribution");
+}
+
+/*
+ * parse_dist - Parse one distribution. Parameters a and b are the bounds
+ *     of uniform and pow2, the mean of exp, the median and sigma of lognorm
+ */
+static void parse_dist(char *str, dist_t *d, int lifetime)
+{
+    char msg[MAXLINE];
+
+    d->a = d->b = 0;
+    if (sscanf(str, "const:%lf", &d->a) == 1)
+	d->kind = CONST;
+    else if (sscanf(str, "uniform:%lf-%lf", &d->a, &d->b) == 2)
+	d->kind = UNIFORM;
+    else if (sscanf(str, "exp:%lf", &d->a) == 1)
+	d->kind = EXP;
+    else if (sscanf(str, "lognorm:%lf:%lf", &d->a, &d->b) == 2)
+	d->kind = LOGNORM;
+    else if (sscanf(str, "pow2:%lf-%lf", &d->a, &d->b) == 2) {
+	d->kind = POW2;
+	d->a = floor(log2(d->a));
+	d->b = floor(log2(d->b));
+    }
+    else if (lifetime && !strcmp(str, "inf"))
+	d->kind = IMMORTAL;
+    else {
+	sprintf(msg, "Bad distribution \"%.100s\"", str);
+	app_error(msg);
+    }
+    if (d->kind != IMMORTAL && (d->a < 0 || d->b < 0 ||
+				((d->kind == UNIFORM || d->kind == POW2) &&
+				 d->b < d->a))) {
+	sprintf(msg, "Bad parameters in \"%.100s\"", str);
+	app_error(msg);
+    }
+}
+
+/*
+ * parse_size - Parse a byte count with an optional k, m or g suffix
+ */
+static long long parse_size(char *str)
+{
+    char *end;
+    double n = strtod(str, &end);
+
+    switch (*end) {
+    case 'k': case 'K': n *= 1 << 10; break;
+    case 'm': case 'M': n *= 1 << 20; break;
+    case 'g': case 'G': n *= 1 << 30; break;
+    }
+    return (long long)n;
+}
+
+/*****************************************************
+ * Generation of the requests
+ *****************************************************/
+
+/*
+ * run_phase - Generate ops requests of a phase. Blocks that are due are
+ *     freed first; otherwise a live block is resized with probability
+ *     realloc_p, or a new block is allocated.
+ */
+static void run_phase(phase_t *p, int instance, long long ops)
+{
+    long long end = num_ops + ops;
+    int i, id;
+
+    fifo_head = fifo_tail = 0;
+    while (num_ops < end) {
+	if (num_events > 0 && events[0].death <= num_ops) {
+	    if ((id = event_pop()) >= 0 && block_size[id] > 0)
+		do_free(id);
+	}
+	else if (num_live > 0 && rnd() < p->realloc_p)
+	    do_realloc(p);
+	else
+	    do_alloc(p, instance);
+    }
+
+    /* Free the blocks of the phase if it is drained */
+    if (p->drain) {
+	for (i = num_live - 1; i >= 0; i--) {
+	    if (i < num_live && block_phase[live[i]] == instance)
+		do_free(live[i]);
+	}
+    }
+}
+
+/*
+ * do_alloc - Allocate a block of the phase and decide when it dies
+ */
+static void do_alloc(phase_t *p, int instance)
+{
+    int id, size;
+    double life;
+
+    size = sample_size(&p->size);
+    make_room(size);
+
+    /* Make room for another id */
+    if (num_ids == ids_max) {
+	ids_max = ids_max ? 2 * ids_max : 1 << 16;
+	if ((block_size = realloc(block_size, ids_max * sizeof(int))) == NULL ||
+	    (block_pos = realloc(block_pos, ids_max * sizeof(int))) == NULL ||
+	    (block_phase = realloc(block_phase, ids_max * sizeof(int))) == NULL ||
+	    (live = realloc(live, ids_max * sizeof(int))) == NULL)
+	    unix_error("realloc failed in do_alloc");
+    }
+    id = num_ids++;
+    block_size[id] = size;
+    block_phase[id] = instance;
+    block_pos[id] = num_live;
+    live[num_live++] = id;
+    live_bytes += size;
+    if (live_bytes > peak_bytes)
+	peak_bytes = live_bytes;
+    fprintf(body, "a %d %d\n", id, size);
+    num_ops++;
+
+    if (p->fifo > 0) {
+	/* Producer/consumer: the consumer frees the oldest block */
+	if (fifo_tail == fifo_max) {
+	    /* Move the queue to the front, or grow it if it is half full */
+	    if (fifo_tail - fifo_head < fifo_max / 2) {
+		memmove(fifo, fifo + fifo_head,
+			(fifo_tail - fifo_head) * sizeof(int));
+		fifo_tail -= fifo_head;
+		fifo_head = 0;
+	    }
+	    else {
+		fifo_max = fifo_max ? 2 * fifo_max : 1 << 12;
+		if ((fifo = realloc(fifo, fifo_max * sizeof(int))) == NULL)
+		    unix_error("realloc failed in do_alloc");
+	    }
+	}
+	fifo[fifo_tail++] = id;
+	while (fifo_tail - fifo_head > p->fifo) {
+	    id = fifo[fifo_head++];
+	    if (block_size[id] > 0)
+		do_free(id);
+	}
+    }
+    else if ((life = sample(&p->life)) != INF)
+	event_push(num_ops + (long long)life, id);
+}
+
+/*
+ * do_realloc - Resize a random live block following the growth pattern
+ */
+static void do_realloc(phase_t *p)
+{
+    int id = live[(int)(rnd() * num_live)];
+    double size = block_size[id];
+
+    switch (p->grow) {
+    case GROW_MUL: size *= p->grow_arg; break;
+    case GROW_ADD: size += p->grow_arg; break;
+    case GROW_RAND: size = sample_size(&p->size); break;
+    }
+    if (size < 1)
+	size = 1;
+    if (size > max_size)
+	size = max_size;
+
+    /* The block itself must not be evicted to make room for it */
+    live_bytes -= block_size[id];
+    block_size[id] = -block_size[id];
+    make_room((long long)size);
+    block_size[id] = (int)size;
+    live_bytes += block_size[id];
+    if (live_bytes > peak_bytes)
+	peak_bytes = live_bytes;
+    fprintf(body, "r %d %d\n", id, block_size[id]);
+    num_ops++;
+}
+
+/*
+ * do_free - Free a live block
+ */
+static void do_free(int id)
+{
+    int last = live[--num_live];
+
+    live[block_pos[id]] = last;
+    block_pos[last] = block_pos[id];
+    live_bytes -= block_size[id];
+    block_size[id] = 0;
+    fprintf(body, "f %d\n", id);
+    num_ops++;
+}
+
+/*
+ * make_room - Free the blocks that are due first (or random blocks if
+ *     none is due) until bytes more fit below max_live. Blocks with a
+ *     negative size are being resized and are left alone.
+ */
+static void make_room(long long bytes)
+{
+    int id;
+    long long death;
+
+    while (live_bytes + bytes > max_live && num_live > 0) {
+	id = -1;
+	while (num_events > 0 && (id < 0 || block_size[id] <= 0)) {
+	    death = events[0].death;
+	    if ((id = event_pop()) >= 0 && block_size[id] < 0) {
+		/* Keep the event of the block being resized for later */
+		make_room(bytes);
+		event_push(death, id);
+		return;
+	    }
+	}
+	if (id < 0 || block_size[id] <= 0)
+	    id = live[(int)(rnd() * num_live)];
+	if (block_size[id] > 0)
+	    do_free(id);
+	else if (num_live == 1)
+	    break;
+    }
+}
+
+/*
+ * sample_size - Draw a block size from a mix
+ */
+static int sample_size(mix_t *mix)
+{
+    double size = sample(mix);
+
+    if (size < 1)
+	return 1;
+    if (size > max_size)
+	return max_size;
+    return (int)size;
+}
+
+/*
+ * sample - Draw a value from a mix (INF for immortal lifetimes)
+ */
+static double sample(mix_t *mix)
+{
+    double w = rnd() * mix->total, u1, u2;
+    dist_t *d = mix->d;
+    int i;
+
+    for (i = 0; i < mix->n - 1 && w >= mix->d[i].weight; i++)
+	w -= mix->d[i].weight;
+    d = &mix->d[i];
+
+    switch (d->kind) {
+    case CONST:
+	return d->a;
+    case UNIFORM:
+	return floor(d->a + rnd() * (d->b - d->a + 1));
+    case EXP:
+	return floor(-d->a * log(1 - rnd()));
+    case LOGNORM:
+	/* Box-Muller transform of two uniform numbers */
+	u1 = 1 - rnd();
+	u2 = rnd();
+	return floor(d->a * exp(d->b * sqrt(-2 * log(u1)) * cos(2 * M_PI * u2)));
+    case POW2:
+	return pow(2, d->a + floor(rnd() * (d->b - d->a + 1)));
+    default:
+	return INF;
+    }
+}
+
+/*
+ * event_push - Add a (death, id) pair to the heap of due blocks
+ */
+static void event_push(long long death, int id)
+{
+    int i, parent;
+
+    if (num_events == events_max) {
+	events_max = events_max ? 2 * events_max : 1 << 16;
+	if ((events = realloc(events, events_max * sizeof(event_t))) == NULL)
+	    unix_error("realloc failed in event_push");
+    }
+    for (i = num_events++; i > 0; i = parent) {
+	parent = (i - 1) / 2;
+	if (events[parent].death <= death)
+	    break;
+	events[i] = events[parent];
+    }
+    events[i].death = death;
+    events[i].id = id;
+}
+
+/*
+ * event_pop - Remove the earliest pair from the heap and return its id
+ */
+static int event_pop(void)
+{
+    int id = events[0].id, i, child;
+    event_t last = events[--num_events];
+
+    for (i = 0; (child = 2 * i + 1) < num_events; i = child) {
+	if (child + 1 < num_events && events[child + 1].death < events[child].death)
+	    child++;
+	if (last.death <= events[child].death)
+	    break;
+	events[i] = events[child];
+    }
+    events[i] = last;
+    return id;
+}
+
+/*
+ * rnd - Return a uniform random number in [0, 1) (xorshift64*)
+ */
+static double rnd(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return ((rng_state * 0x2545f4914f6cdd1dULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tracegen [-lvh] [-P <preset>] [-p <phase>]... [-n <ops>] [-c <n>]\n");
+    fprintf(stderr, "                [-m <bytes>] [-S <seed>] [-o <file>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-P <preset> Use the phases of a preset (web, compiler, db).\n");
+    fprintf(stderr, "\t-p <phase>  Add a phase, e.g. -p \"size=exp:64 life=exp:500\".\n");
+    fprintf(stderr, "\t-n <ops>    Number of requests (default 1e6, plus final frees).\n");
+    fprintf(stderr, "\t-c <n>      Repeat the phases n times.\n");
+    fprintf(stderr, "\t-m <bytes>  Max live bytes (default 8M).\n");
+    fprintf(stderr, "\t-S <seed>   Seed of the random numbers.\n");
+    fprintf(stderr, "\t-o <file>   Write the trace to file instead of stdout.\n");
+    fprintf(stderr, "\t-l          List the presets and their phases.\n");
+    fprintf(stderr, "\t-v          Print a summary of the trace to stderr.\n");
+    fprintf(stderr, "\t-h          Print this message.\n");
+}
+
+/*
+ * app_error - Report an arbitrary application error
+ */
+static void app_error(char *msg)
+{
+    fprintf(stderr, "%s\n", msg);
+    exit(1);
+}
+
+/*
+ * unix_error - Report a Unix-style error
+ */
+static void unix_error(char *msg)
+{
+    fprintf(stderr, "%s: %s\n", msg, strerror(errno));
+    exit(1);
+}
@@ -0,0 +1,93 @@
+/*
+ * acceptor.c - prethreaded mode: one thread accepts, the loops serve
+ *
+ * With "-A", the event loops do not accept connections themselves. The
+ * acceptor thread accepts them on the only listening socket and queues
+ * them in a lock-free ring (the sbuf of the CS:APP prethreaded server,
+ * without its mutex and semaphores), waking the loops in turn through
+ * their eventfd; a loop takes every connection queued when it wakes up.
+ * A connection that finds the ring full is not queued: the loops are
+ * already behind, so it is answered with a 503 and closed.
+ */
+#include <sys/resource.h>
+#include "acceptor.h"
+#include "ring.h"
+#include "loop.h"
+
+static const char *unavailable =
+    "HTTP/1.0 503 Service Unavailable\r\n"
+    "Retry-After: 1\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n\r\n";
+
+static ring_t ring;
+static loop_t *loops;
+static int nloops;
+static unsigned long accepted, shed;
+static unsigned long *stamps;   /* when each descriptor was accepted */
+static size_t nstamps;
+
+/* acceptor_init : queue at most slots connections for the nloops loops */
+void acceptor_init(loop_t *l, int n, size_t slots){
+    struct rlimit rl;
+
+    ring_init(&ring, slots);
+    // the ring holds descriptors only: their accept times go by number
+    if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+        unix_error("getrlimit error");
+    nstamps = rl.rlim_cur == RLIM_INFINITY ? 65536 : rl.rlim_cur;
+    stamps = (unsigned long *)Calloc(nstamps, sizeof(unsigned long));
+    loops = l;
+    nloops = n;
+}
+
+/* acceptor_run : accept connections on port and hand them to the loops */
+void acceptor_run(char *port){
+    uint64_t one = 1;
+    int listenfd, connfd, next = 0;
+
+    listenfd = Open_listenfd(port);
+    while(1){
+        if ((connfd = accept(listenfd, NULL, NULL)) < 0){
+            // out of descriptors: give the loops time to close some
+            if (errno == EMFILE || errno == ENFILE)
+                usleep(10000);
+            else if (errno != EINTR && errno != ECONNABORTED)
+                fprintf(stderr, "accept error: %s\n", strerror(errno));
+            continue;
+        }
+        if ((size_t)connfd < nstamps)
+            stamps[connfd] = stats_now();
+        if (ring_push(&ring, connfd) < 0){
+            // best effort, like the 502 of the loops
+            write(connfd, unavailable, strlen(unavailable));
+            close(connfd);
+            __atomic_add_fetch(&shed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        __atomic_add_fetch(&accepted, 1, __ATOMIC_RELAXED);
+        if (write(loops[next].notify.fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            unix_error("eventfd write error");
+        next = (next + 1) % nloops;
+    }
+}
+
+/* acceptor_take : a queued connection, or -1 if there is none; when it
+ * was accepted in *acceptedp (stats_now, 0 if not known) */
+int acceptor_take(unsigned long *acceptedp){
+    int connfd;
+
+    if (!loops || ring_pop(&ring, &connfd) < 0)
+        return -1;
+    *acceptedp = (size_t)connfd < nstamps ? stamps[connfd] : 0;
+    return connfd;
+}
+
+/* acceptor_print_stats : print the counters of the acceptor */
+void acceptor_print_stats(FILE *fp){
+    if (!loops)
+        return;
+    fprintf(fp, "acceptor: %lu connections queued, %lu shed with 503\n",
+            __atomic_load_n(&accepted, __ATOMIC_RELAXED),
+            __atomic_load_n(&shed, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,18 @@
+/*
+ * acceptor.h - prethreaded mode: one thread accepts, the loops serve
+ */
+#ifndef __ACCEPTOR_H__
+#define __ACCEPTOR_H__
+
+#include "csapp.h"
+
+#define ACCEPT_SLOTS 1024       /* accepted connections queued at most */
+
+struct loop;
+
+void acceptor_init(struct loop *loops, int nloops, size_t slots);
+void acceptor_run(char *port);
+int acceptor_take(unsigned long *acceptedp);
+void acceptor_print_stats(FILE *fp);
+
+#endif /* __ACCEPTOR_H__ */
@@ -0,0 +1,20 @@
+/*
+ * affinity.c - pinning threads to cores
+ *
+ * In a file of its own for the same reason as zcopy.c: the CPU set
+ * macros need _GNU_SOURCE, which clashes with csapp.h.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include "affinity.h"
+
+/* pin_thread : run the calling thread only on core cpu; return 0, or an
+ * error number */
+int pin_thread(int cpu){
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
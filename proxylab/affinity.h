@@ -0,0 +1,9 @@
+/*
+ * affinity.h - pinning threads to cores
+ */
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+int pin_thread(int cpu);
+
+#endif /* __AFFINITY_H__ */
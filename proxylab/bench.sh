@@ -0,0 +1,183 @@
+#!/bin/bash
+#
+# bench.sh - Load scenarios for the proxy and tiny, measured with
+#     loadgen: throughput and p50/p99/p999 latency.
+#
+#     usage: ./bench.sh [small|large|hits|slow|rate]...
+#
+#     small - home.html from tiny directly, then through the proxy with
+#             a connection per request and with keep-alive
+#     large - a file larger than MAX_OBJECT_SIZE, so never cached
+#     hits  - a few cacheable files, then CGI requests that all miss
+#     slow  - small requests while other clients wait on nop-server.py,
+#             an origin that never answers
+#     rate  - small requests at a fixed rate (open loop)
+#
+#     With no arguments, every scenario is run. CONNS and REQUESTS in
+#     the environment change the load (default 8 and 2000).
+#
+
+CONNS=${CONNS:-8}
+REQUESTS=${REQUESTS:-2000}
+LARGE_FILE="bench-large.bin"
+LARGE_SIZE=1048576
+HITS_LIST="home.html
+           csapp.c
+           tiny.c
+           godzilla.gif"
+MAX_PORT_TRIES=10
+
+#####
+# Helper functions
+#
+
+#
+# wait_for_port_use - Spins until the TCP port number passed as an
+#     argument is actually being used. Gives up after 10 tries.
+#
+function wait_for_port_use() {
+    tries="0"
+    until netstat --numeric-ports --numeric-hosts -a --protocol=tcpip \
+        | grep tcp | cut -c21- | cut -d':' -f2 | cut -d' ' -f1 \
+        | grep -wq "${1}"
+    do
+        tries=`expr ${tries} + 1`
+        if [ "${tries}" == "${MAX_PORT_TRIES}" ]; then
+            echo "Error: nothing is listening on port ${1}"
+            cleanup
+            exit 1
+        fi
+        sleep 1
+    done
+}
+
+#
+# start_server - start a server in the background on a free port
+# usage: start_server <dir> <command>; sets port and pid
+#
+function start_server {
+    port=`./free-port.sh`
+    (cd $1; exec $2 ${port} &> /dev/null) &
+    pid=$!
+    wait_for_port_use ${port}
+}
+
+#
+# cleanup - stop the servers and remove the large file
+#
+function cleanup {
+    kill ${tiny_pid} ${proxy_pid} ${nop_pid} 2> /dev/null
+    rm -f ./tiny/${LARGE_FILE}
+}
+
+#
+# run - print a title and run loadgen
+# usage: run <title> <loadgen arguments>
+#
+function run {
+    echo "--- $1"
+    shift
+    ./loadgen "$@"
+    echo ""
+}
+
+#####
+# Scenarios
+#
+
+function small {
+    run "small: tiny, no proxy, connection per request" \
+        -s localhost:${tiny_port} -c ${CONNS} -n ${REQUESTS}
+    run "small: proxy, connection per request" \
+        -s localhost:${tiny_port} -P ${proxy_port} -c ${CONNS} -n ${REQUESTS}
+    run "small: proxy, keep-alive" \
+        -s localhost:${tiny_port} -P ${proxy_port} -c ${CONNS} -n ${REQUESTS} -k
+}
+
+function large {
+    head -c ${LARGE_SIZE} /dev/urandom > ./tiny/${LARGE_FILE}
+    run "large: ${LARGE_SIZE} bytes through the proxy, keep-alive" \
+        -s localhost:${tiny_port} -P ${proxy_port} -c ${CONNS} \
+        -n $((REQUESTS / 10)) -k -u /${LARGE_FILE}
+    rm -f ./tiny/${LARGE_FILE}
+}
+
+function hits {
+    uris=""
+    for file in ${HITS_LIST}
+    do
+        uris="${uris} -u /${file}"
+    done
+    # one round to fill the cache
+    ./loadgen -s localhost:${tiny_port} -P ${proxy_port} -n 4 ${uris} > /dev/null
+    run "hits: cached files, keep-alive" \
+        -s localhost:${tiny_port} -P ${proxy_port} -c ${CONNS} -n ${REQUESTS} -k ${uris}
+    run "hits: every request misses (CGI), keep-alive" \
+        -s localhost:${tiny_port} -P ${proxy_port} -c ${CONNS} \
+        -n $((REQUESTS / 4)) -k -u "/cgi-bin/adder?%d&${RANDOM}"
+}
+
+function slow {
+    start_server . ./nop-server.py
+    nop_port=${port}
+    nop_pid=${pid}
+    # clients stuck on the origin that never answers (nop-server.py also
+    # spins on a core, as in the driver's concurrency test)
+    ./loadgen -s localhost:${nop_port} -P ${proxy_port} -c ${CONNS} -n ${CONNS} \
+        -t 10 > /dev/null &
+    stuck_pid=$!
+    sleep 1
+    run "slow: proxy, keep-alive, ${CONNS} other clients waiting on a dead origin" \
+        -s localhost:${tiny_port} -P ${proxy_port} -c ${CONNS} -n ${REQUESTS} -k
+    kill ${stuck_pid} ${nop_pid} 2> /dev/null
+    wait ${stuck_pid} ${nop_pid} 2> /dev/null
+    nop_pid=""
+}
+
+function rate {
+    run "rate: proxy, keep-alive, 2000 requests/s for 5s" \
+        -s localhost:${tiny_port} -P ${proxy_port} -c ${CONNS} -d 5 -r 2000 -k
+}
+
+#######
+# Main
+#######
+
+if [ ! -x ./proxy ] || [ ! -x ./tiny/tiny ]
+then
+    echo "Error: build the proxy and tiny first (make; cd tiny; make)."
+    exit 1
+fi
+if [ ! -x ./loadgen ]
+then
+    make loadgen || exit 1
+fi
+
+scenarios="$@"
+if [ -z "${scenarios}" ]; then
+    scenarios="small large hits slow rate"
+fi
+for scenario in ${scenarios}
+do
+    case ${scenario} in
+        small|large|hits|slow|rate) ;;
+        *) echo "usage: $0 [small|large|hits|slow|rate]..."; exit 1 ;;
+    esac
+done
+
+trap 'cleanup; exit 1' INT TERM
+
+start_server ./tiny ./tiny
+tiny_port=${port}
+tiny_pid=${pid}
+start_server . ./proxy
+proxy_port=${port}
+proxy_pid=${pid}
+echo "tiny on port ${tiny_port}, proxy on port ${proxy_port}"
+echo ""
+
+for scenario in ${scenarios}
+do
+    ${scenario}
+done
+cleanup
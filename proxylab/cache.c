@@ -0,0 +1,292 @@
+/*
+ * cache.c - sharded in-memory cache of web objects
+ *
+ * Objects are looked up by normalized URI. The cache is split into
+ * CACHE_SHARDS shards by the hash of the key, each with a reader-writer
+ * lock of its own, so lookups run in parallel and only contend with
+ * inserts into the same shard.
+ *
+ * Eviction is CLOCK, an approximation of LRU that lets hits run under
+ * the read lock: a hit only sets the referenced bit of the object. The
+ * objects of a shard form a ring; to make room, the hand of a shard
+ * clears the bits of the objects it passes and evicts the first object
+ * whose bit is already clear. The shards are visited in turn, and the
+ * total size of the objects never exceeds MAX_CACHE_SIZE.
+ *
+ * A newer response for a key replaces the object cached for it. An
+ * object the server said is still current (304) keeps its response and
+ * is only given a new expiry.
+ */
+#include "cache.h"
+
+typedef struct {
+    pthread_rwlock_t lock;
+    cache_obj_t *buckets[CACHE_BUCKETS];
+    cache_obj_t *hand;          /* clock hand, NULL if the shard is empty */
+} shard_t;
+
+static shard_t shards[CACHE_SHARDS];
+static pthread_mutex_t evict_lock;  /* serializes inserts and evictions */
+static unsigned int next_shard;     /* shard to evict from next */
+static cache_stats_t stats;         /* updated with atomic operations */
+
+static unsigned long hash_key(char *key);
+static int evict_one(void);
+static void unlink_obj(shard_t *s, cache_obj_t *obj);
+
+#define STAT_ADD(field, n) __atomic_add_fetch(&stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_SUB(field, n) __atomic_sub_fetch(&stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_GET(field) __atomic_load_n(&stats.field, __ATOMIC_RELAXED)
+
+/* cache_init : initialize the locks of an empty cache */
+void cache_init(void){
+    int i, rc;
+
+    for (i = 0; i < CACHE_SHARDS; i++){
+        if ((rc = pthread_rwlock_init(&shards[i].lock, NULL)) != 0)
+            posix_error(rc, "pthread_rwlock_init error");
+        memset(shards[i].buckets, 0, sizeof(shards[i].buckets));
+        shards[i].hand = NULL;
+    }
+    if ((rc = pthread_mutex_init(&evict_lock, NULL)) != 0)
+        posix_error(rc, "pthread_mutex_init error");
+}
+
+/* cache_key : return the normalized URI "host:port/path" in a malloc'ed
+ * string, path being path_len bytes. Host names are case-insensitive, so
+ * the host is lowercased. */
+char *cache_key(char *host, char *portn, const char *path, size_t path_len){
+    size_t len = strlen(host) + strlen(portn) + path_len + 2;
+    char *key = (char *)Malloc(len);
+    char *p;
+
+    sprintf(key, "%s:%s%.*s", host, portn, (int)path_len, path);
+    for (p = key; *p != ':'; p++)
+        *p = tolower((unsigned char)*p);
+    return key;
+}
+
+/* cache_lookup : find the object cached for key and take a reference to
+ * it, or return NULL. Release the object with cache_release. */
+cache_obj_t *cache_lookup(char *key){
+    unsigned long h = hash_key(key);
+    shard_t *s = &shards[h % CACHE_SHARDS];
+    cache_obj_t *obj;
+
+    pthread_rwlock_rdlock(&s->lock);
+    for (obj = s->buckets[(h / CACHE_SHARDS) % CACHE_BUCKETS]; obj; obj = obj->hnext)
+        if (obj->hash == h && !strcmp(obj->key, key))
+            break;
+    if (obj){
+        __atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&obj->referenced, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&s->lock);
+
+    if (obj)
+        STAT_ADD(hits, 1);
+    else
+        STAT_ADD(misses, 1);
+    return obj;
+}
+
+/* cache_contains : true if an object is cached for key; neither takes a
+ * reference nor counts as a hit or a miss */
+int cache_contains(char *key){
+    unsigned long h = hash_key(key);
+    shard_t *s = &shards[h % CACHE_SHARDS];
+    cache_obj_t *obj;
+
+    pthread_rwlock_rdlock(&s->lock);
+    for (obj = s->buckets[(h / CACHE_SHARDS) % CACHE_BUCKETS]; obj; obj = obj->hnext)
+        if (obj->hash == h && !strcmp(obj->key, key))
+            break;
+    pthread_rwlock_unlock(&s->lock);
+    return obj != NULL;
+}
+
+/* cache_hold : take one more reference to an object already referenced */
+void cache_hold(cache_obj_t *obj){
+    __atomic_add_fetch(&obj->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+/* cache_release : drop a reference; the last one frees the object */
+void cache_release(cache_obj_t *obj){
+    if (__atomic_sub_fetch(&obj->refcnt, 1, __ATOMIC_ACQ_REL) == 0){
+        Free(obj->key);
+        Free(obj->data);
+        Free(obj);
+    }
+}
+
+/* cache_insert : cache the malloc'ed response data of size bytes under key,
+ * the first hdr_len of them being the head up to the empty line, fresh
+ * until expires and then for swr seconds while it is revalidated. It
+ * replaces the object cached for key, if any. Evict objects as needed.
+ * The cache takes over data in any case; return 1 if it was cached, 0 if
+ * it was too large. */
+int cache_insert(char *key, char *data, size_t size, size_t hdr_len,
+                 time_t expires, int swr){
+    unsigned long h = hash_key(key);
+    shard_t *s = &shards[h % CACHE_SHARDS];
+    cache_obj_t **bucket = &s->buckets[(h / CACHE_SHARDS) % CACHE_BUCKETS];
+    cache_obj_t *obj, *old;
+
+    if (size > MAX_OBJECT_SIZE){
+        STAT_ADD(rejects, 1);
+        Free(data);
+        return 0;
+    }
+
+    pthread_mutex_lock(&evict_lock);
+    // an older response, or one another connection fetched meanwhile
+    pthread_rwlock_wrlock(&s->lock);
+    for (old = *bucket; old; old = old->hnext)
+        if (old->hash == h && !strcmp(old->key, key))
+            break;
+    if (old)
+        unlink_obj(s, old);
+    pthread_rwlock_unlock(&s->lock);
+    if (old){
+        STAT_SUB(bytes, old->size);
+        STAT_SUB(objects, 1);
+        STAT_ADD(replaced, 1);
+        cache_release(old);
+    }
+
+    while (STAT_GET(bytes) + size > MAX_CACHE_SIZE)
+        if (!evict_one())
+            break;
+
+    obj = (cache_obj_t *)Malloc(sizeof(cache_obj_t));
+    obj->key = (char *)Malloc(strlen(key) + 1);
+    strcpy(obj->key, key);
+    obj->hash = h;
+    obj->data = data;
+    obj->size = size;
+    obj->hdr_len = hdr_len;
+    obj->expires = expires;
+    obj->swr = swr;
+    obj->revalidating = 0;
+    obj->refcnt = 1;
+    obj->referenced = 0;
+
+    pthread_rwlock_wrlock(&s->lock);
+    obj->hnext = *bucket;
+    *bucket = obj;
+    // insert behind the hand, so that the hand reaches it last
+    if (!s->hand){
+        obj->prev = obj->next = obj;
+        s->hand = obj;
+    }
+    else{
+        obj->next = s->hand;
+        obj->prev = s->hand->prev;
+        obj->prev->next = obj;
+        s->hand->prev = obj;
+    }
+    pthread_rwlock_unlock(&s->lock);
+
+    STAT_ADD(bytes, size);
+    STAT_ADD(objects, 1);
+    STAT_ADD(inserts, 1);
+    pthread_mutex_unlock(&evict_lock);
+    return 1;
+}
+
+/* cache_refresh : the server said the object is still current; it is now
+ * fresh until expires, then for swr seconds while it is revalidated */
+void cache_refresh(cache_obj_t *obj, time_t expires, int swr){
+    __atomic_store_n(&obj->expires, expires, __ATOMIC_RELAXED);
+    __atomic_store_n(&obj->swr, swr, __ATOMIC_RELAXED);
+    __atomic_store_n(&obj->revalidating, 0, __ATOMIC_RELEASE);
+    STAT_ADD(refreshes, 1);
+}
+
+/* cache_get_stats : take a snapshot of the counters of the cache */
+void cache_get_stats(cache_stats_t *st){
+    st->hits = STAT_GET(hits);
+    st->misses = STAT_GET(misses);
+    st->inserts = STAT_GET(inserts);
+    st->evictions = STAT_GET(evictions);
+    st->rejects = STAT_GET(rejects);
+    st->replaced = STAT_GET(replaced);
+    st->refreshes = STAT_GET(refreshes);
+    st->objects = STAT_GET(objects);
+    st->bytes = STAT_GET(bytes);
+}
+
+/* cache_print_stats : print the hit rate and eviction counters */
+void cache_print_stats(FILE *fp){
+    cache_stats_t st;
+    unsigned long lookups;
+
+    cache_get_stats(&st);
+    lookups = st.hits + st.misses;
+    fprintf(fp, "cache: %lu objects, %zu/%d bytes\n", st.objects, st.bytes, MAX_CACHE_SIZE);
+    fprintf(fp, "cache: %lu hits, %lu misses, hit rate %.1f%%\n", st.hits, st.misses,
+            lookups ? 100.0 * st.hits / lookups : 0.0);
+    fprintf(fp, "cache: %lu inserts, %lu evictions, %lu too large\n",
+            st.inserts, st.evictions, st.rejects);
+    fprintf(fp, "cache: %lu replaced, %lu revalidated (304)\n", st.replaced, st.refreshes);
+}
+
+/* hash_key : FNV-1a hash of a key */
+static unsigned long hash_key(char *key){
+    unsigned long h = 14695981039346656037UL;
+
+    while (*key){
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/* evict_one : evict one object, taking the shards in turn; return 0 if the
+ * cache is empty. Called with evict_lock held. */
+static int evict_one(void){
+    int i;
+
+    for (i = 0; i < CACHE_SHARDS; i++){
+        shard_t *s = &shards[next_shard++ % CACHE_SHARDS];
+        cache_obj_t *victim;
+
+        pthread_rwlock_wrlock(&s->lock);
+        if (!s->hand){
+            pthread_rwlock_unlock(&s->lock);
+            continue;
+        }
+        // second chance for the objects used since the hand last passed
+        while (__atomic_exchange_n(&s->hand->referenced, 0, __ATOMIC_RELAXED))
+            s->hand = s->hand->next;
+        victim = s->hand;
+        unlink_obj(s, victim);
+        pthread_rwlock_unlock(&s->lock);
+
+        STAT_SUB(bytes, victim->size);
+        STAT_SUB(objects, 1);
+        STAT_ADD(evictions, 1);
+        cache_release(victim);
+        return 1;
+    }
+    return 0;
+}
+
+/* unlink_obj : take an object out of the hash table and the ring of its
+ * shard. Called with the write lock of the shard held. */
+static void unlink_obj(shard_t *s, cache_obj_t *obj){
+    cache_obj_t **pp = &s->buckets[(obj->hash / CACHE_SHARDS) % CACHE_BUCKETS];
+
+    while (*pp != obj)
+        pp = &(*pp)->hnext;
+    *pp = obj->hnext;
+
+    if (obj->next == obj)
+        s->hand = NULL;
+    else{
+        obj->prev->next = obj->next;
+        obj->next->prev = obj->prev;
+        if (s->hand == obj)
+            s->hand = obj->next;
+    }
+}
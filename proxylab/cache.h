@@ -0,0 +1,54 @@
+/*
+ * cache.h - sharded in-memory cache of web objects
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "proxy.h"
+
+#define CACHE_SHARDS 16         /* independently locked parts of the cache */
+#define CACHE_BUCKETS 256       /* hash buckets per shard */
+
+/* A cached web object. The response never changes once cached, only
+ * how long it stays fresh; a lookup holds a reference that keeps the
+ * object alive after it has been evicted or replaced. */
+typedef struct cache_obj {
+    char *key;                  /* normalized URI */
+    unsigned long hash;
+    char *data;                 /* the response, headers included */
+    size_t size;
+    size_t hdr_len;             /* status line and headers, up to the empty line */
+    time_t expires;             /* fresh until then... */
+    int swr;                    /* ... then served for that many seconds more
+                                 * while it is revalidated */
+    int revalidating;           /* a revalidation is under way */
+    int refcnt;                 /* the cache's reference + lookups */
+    int referenced;             /* CLOCK bit: used since the hand passed */
+    struct cache_obj *hnext;    /* next object in the hash bucket */
+    struct cache_obj *prev, *next;  /* clock ring of the shard */
+} cache_obj_t;
+
+/* Counters reported by the cache */
+typedef struct {
+    unsigned long hits, misses;
+    unsigned long inserts, evictions;
+    unsigned long rejects;      /* objects too large to cache */
+    unsigned long replaced;     /* by a newer response */
+    unsigned long refreshes;    /* revalidated by the server (304) */
+    unsigned long objects;
+    size_t bytes;
+} cache_stats_t;
+
+void cache_init(void);
+char *cache_key(char *host, char *portn, const char *path, size_t path_len);
+cache_obj_t *cache_lookup(char *key);
+int cache_contains(char *key);
+void cache_hold(cache_obj_t *obj);
+void cache_release(cache_obj_t *obj);
+int cache_insert(char *key, char *data, size_t size, size_t hdr_len,
+                 time_t expires, int swr);
+void cache_refresh(cache_obj_t *obj, time_t expires, int swr);
+void cache_get_stats(cache_stats_t *st);
+void cache_print_stats(FILE *fp);
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,236 @@
+/*
+ * clients.c - bounded table of client addresses
+ *
+ * Every connection is counted against the address of its client, so that
+ * one client cannot hold any number of connections ("-N") or make
+ * requests at any rate ("-R"): each address has a token bucket that
+ * fills at <rate> requests per second, up to <burst>, and a request finds
+ * a token in it or is answered with 429.
+ *
+ * The table never holds more than CLIENTS_MAX addresses. An address with
+ * open connections stays; the others are kept in LRU order and the least
+ * recently seen is reused for a new address when the shard is full, which
+ * only forgets a bucket that had time to refill. When a shard is full of
+ * addresses with open connections, a new client is served untracked.
+ *
+ * The table is split into CLIENT_SHARDS shards by the hash of the address,
+ * each with a mutex of its own; with no rate set, admitting a request
+ * takes no lock.
+ */
+#include "clients.h"
+#include "stats.h"
+
+typedef struct {
+    pthread_mutex_t lock;
+    client_t *buckets[CLIENT_BUCKETS];
+    client_t *lru, *mru;        /* clients no connection pins */
+    int count;
+} shard_t;
+
+static shard_t shards[CLIENT_SHARDS];
+static double rate, burst;      /* of the token buckets, 0 for no limit */
+static int max_conns;           /* per client, 0 for no limit */
+static clients_stats_t stats;   /* updated with atomic operations */
+
+static void to_addr(struct sockaddr *sa, unsigned char *addr);
+static void lru_unlink(shard_t *s, client_t *cl);
+static void unlink_client(shard_t *s, client_t *cl);
+static void refill(client_t *cl, unsigned long now);
+
+#define STAT_ADD(field, n) __atomic_add_fetch(&stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_SUB(field, n) __atomic_sub_fetch(&stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_GET(field) __atomic_load_n(&stats.field, __ATOMIC_RELAXED)
+
+/* clients_init : limit each client to r requests per second (bursts of
+ * b) and to conns open connections; 0 for no limit */
+void clients_init(double r, double b, int conns){
+    int i, rc;
+
+    rate = r;
+    burst = b > 1 ? b : 1;
+    max_conns = conns;
+    for (i = 0; i < CLIENT_SHARDS; i++){
+        if ((rc = pthread_mutex_init(&shards[i].lock, NULL)) != 0)
+            posix_error(rc, "pthread_mutex_init error");
+        memset(shards[i].buckets, 0, sizeof(shards[i].buckets));
+        shards[i].lru = shards[i].mru = NULL;
+        shards[i].count = 0;
+    }
+}
+
+/* client_open : count a new connection from the address sa. Return its
+ * client, or NULL if it is not tracked; *refusedp is set if it is over
+ * the connection limit of its client, and must be closed. */
+client_t *client_open(struct sockaddr *sa, int *refusedp){
+    unsigned char addr[16];
+    unsigned long h = 5381;
+    shard_t *s;
+    client_t *cl;
+    int i;
+
+    *refusedp = 0;
+    to_addr(sa, addr);
+    for (i = 0; i < 16; i++)
+        h = h * 33 + addr[i];
+    s = &shards[h % CLIENT_SHARDS];
+
+    pthread_mutex_lock(&s->lock);
+    for (cl = s->buckets[(h / CLIENT_SHARDS) % CLIENT_BUCKETS]; cl; cl = cl->hnext)
+        if (cl->hash == h && !memcmp(cl->addr, addr, 16))
+            break;
+    if (!cl){
+        if (s->count < CLIENTS_MAX / CLIENT_SHARDS){
+            cl = (client_t *)Malloc(sizeof(client_t));
+            s->count++;
+            STAT_ADD(tracked, 1);
+        }
+        else if ((cl = s->lru)){
+            // reuse the client seen least recently
+            lru_unlink(s, cl);
+            unlink_client(s, cl);
+            STAT_ADD(evicted, 1);
+        }
+        else{
+            pthread_mutex_unlock(&s->lock);
+            STAT_ADD(untracked, 1);
+            return NULL;
+        }
+        memcpy(cl->addr, addr, 16);
+        cl->hash = h;
+        cl->shard = h % CLIENT_SHARDS;
+        cl->conns = 0;
+        cl->tokens = burst;
+        cl->last = stats_now();
+        cl->prev = cl->next = NULL;
+        cl->hnext = s->buckets[(h / CLIENT_SHARDS) % CLIENT_BUCKETS];
+        s->buckets[(h / CLIENT_SHARDS) % CLIENT_BUCKETS] = cl;
+    }
+    else if (max_conns && cl->conns >= max_conns){
+        pthread_mutex_unlock(&s->lock);
+        STAT_ADD(refused, 1);
+        *refusedp = 1;
+        return NULL;
+    }
+    else if (!cl->conns)
+        lru_unlink(s, cl);
+    cl->conns++;
+    pthread_mutex_unlock(&s->lock);
+    return cl;
+}
+
+/* client_close : a connection of cl is closed */
+void client_close(client_t *cl){
+    shard_t *s;
+
+    if (!cl)
+        return;
+    s = &shards[cl->shard];
+    pthread_mutex_lock(&s->lock);
+    // the last one: cl may be reused from now on, the oldest first
+    if (--cl->conns == 0){
+        cl->prev = s->mru;
+        cl->next = NULL;
+        if (s->mru)
+            s->mru->next = cl;
+        else
+            s->lru = cl;
+        s->mru = cl;
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* client_admit : take a token for a request of cl. Return 1 if it had
+ * one, 0 if the request is over its rate. */
+int client_admit(client_t *cl){
+    shard_t *s;
+    int ok;
+
+    if (!cl || rate <= 0)
+        return 1;
+    s = &shards[cl->shard];
+    pthread_mutex_lock(&s->lock);
+    refill(cl, stats_now());
+    if ((ok = cl->tokens >= 1))
+        cl->tokens -= 1;
+    pthread_mutex_unlock(&s->lock);
+    if (!ok)
+        STAT_ADD(limited, 1);
+    return ok;
+}
+
+/* client_refund : give back the token of a request that will be admitted
+ * again */
+void client_refund(client_t *cl){
+    shard_t *s;
+
+    if (!cl || rate <= 0)
+        return;
+    s = &shards[cl->shard];
+    pthread_mutex_lock(&s->lock);
+    if ((cl->tokens += 1) > burst)
+        cl->tokens = burst;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/* clients_get_stats : copy the counters of the table into st */
+void clients_get_stats(clients_stats_t *st){
+    st->tracked = STAT_GET(tracked);
+    st->evicted = STAT_GET(evicted);
+    st->untracked = STAT_GET(untracked);
+    st->refused = STAT_GET(refused);
+    st->limited = STAT_GET(limited);
+}
+
+/* clients_print_stats : print the counters of the table */
+void clients_print_stats(FILE *fp){
+    clients_stats_t st;
+
+    clients_get_stats(&st);
+    fprintf(fp, "clients: %lu tracked, %lu evicted, %lu connections untracked\n",
+            st.tracked, st.evicted, st.untracked);
+    fprintf(fp, "clients: %lu connections refused, %lu requests limited (429)\n",
+            st.refused, st.limited);
+}
+
+/* to_addr : the IP address of sa, IPv4 as IPv4-mapped IPv6 */
+static void to_addr(struct sockaddr *sa, unsigned char *addr){
+    memset(addr, 0, 16);
+    if (sa->sa_family == AF_INET6)
+        memcpy(addr, &((struct sockaddr_in6 *)sa)->sin6_addr, 16);
+    else if (sa->sa_family == AF_INET){
+        addr[10] = addr[11] = 0xff;
+        memcpy(addr + 12, &((struct sockaddr_in *)sa)->sin_addr, 4);
+    }
+}
+
+/* lru_unlink : take cl out of the LRU list of its shard */
+static void lru_unlink(shard_t *s, client_t *cl){
+    if (cl->prev)
+        cl->prev->next = cl->next;
+    else
+        s->lru = cl->next;
+    if (cl->next)
+        cl->next->prev = cl->prev;
+    else
+        s->mru = cl->prev;
+    cl->prev = cl->next = NULL;
+}
+
+/* unlink_client : take cl out of its hash bucket */
+static void unlink_client(shard_t *s, client_t *cl){
+    client_t **pp = &s->buckets[(cl->hash / CLIENT_SHARDS) % CLIENT_BUCKETS];
+
+    while (*pp != cl)
+        pp = &(*pp)->hnext;
+    *pp = cl->hnext;
+}
+
+/* refill : add the tokens cl earned since it was last looked at */
+static void refill(client_t *cl, unsigned long now){
+    if (now > cl->last){
+        cl->tokens += (now - cl->last) / 1e9 * rate;
+        if (cl->tokens > burst)
+            cl->tokens = burst;
+    }
+    cl->last = now;
+}
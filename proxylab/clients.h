@@ -0,0 +1,44 @@
+/*
+ * clients.h - bounded table of client addresses, with a token bucket and
+ *             a count of open connections for each
+ */
+#ifndef __CLIENTS_H__
+#define __CLIENTS_H__
+
+#include "proxy.h"
+
+#define CLIENT_SHARDS 16        /* independently locked parts of the table */
+#define CLIENT_BUCKETS 1024     /* hash buckets per shard */
+#define CLIENTS_MAX 16384       /* clients tracked at most */
+
+/* A client address. Its open connections pin it in the table; one with
+ * none may be evicted, least recently used first. */
+typedef struct client {
+    unsigned char addr[16];     /* IPv6, or IPv4-mapped */
+    unsigned long hash;
+    int shard;
+    int conns;                  /* open connections */
+    double tokens;              /* requests it may make now... */
+    unsigned long last;         /* ... as of then (stats_now) */
+    struct client *hnext;       /* next client in the hash bucket */
+    struct client *prev, *next; /* LRU of the shard, if no connection pins it */
+} client_t;
+
+/* Counters reported by the table */
+typedef struct {
+    unsigned long tracked;      /* clients in the table */
+    unsigned long evicted;
+    unsigned long untracked;    /* connections of clients with no room left */
+    unsigned long refused;      /* connections over the limit of a client */
+    unsigned long limited;      /* requests over the rate of a client */
+} clients_stats_t;
+
+void clients_init(double rate, double burst, int max_conns);
+client_t *client_open(struct sockaddr *sa, int *refusedp);
+void client_close(client_t *cl);
+int client_admit(client_t *cl);
+void client_refund(client_t *cl);
+void clients_get_stats(clients_stats_t *st);
+void clients_print_stats(FILE *fp);
+
+#endif /* __CLIENTS_H__ */
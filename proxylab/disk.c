@@ -0,0 +1,525 @@
+/*
+ * disk.c - on-disk second tier of the cache, for objects too large for
+ *          the memory cache
+ *
+ * The tier is a log of segment files ("-D <dir>"), each DISK_SEGMENT_SIZE
+ * bytes at most. A response is stored by appending a record to the
+ * active segment: a record header, the key, the response head and the
+ * body, written at the offset reserved for it while the body is relayed
+ * to the client. The header says "pending" until the whole body is in,
+ * and only then is the object put in the in-memory index (key -> segment,
+ * offset). Nothing is ever overwritten: a newer copy of an object just
+ * makes the index point past the old one.
+ *
+ * Space is reclaimed a whole segment at a time. When a new segment would
+ * take the tier past its budget ("-B <MB>"), the segment that was hit
+ * least recently is deleted with every object it holds. Hits are sent
+ * with sendfile straight from the segment file, which stays open for the
+ * hits in progress when it is evicted.
+ *
+ * A revalidated object (304) keeps its record; only the expiry in the
+ * record header is rewritten.
+ *
+ * On startup, the index is rebuilt by reading only the record headers,
+ * keys and heads of the segments left by the last run, skipping bodies
+ * and records never completed.
+ */
+#include <dirent.h>
+#include <sys/stat.h>
+#include "disk.h"
+
+#define DISK_MAGIC 0x50585932   /* "PXY2" */
+#define REC_PENDING 0
+#define REC_VALID 1
+
+/* What precedes the key, head and body of an object in a segment file */
+typedef struct {
+    uint32_t magic;
+    uint32_t state;
+    uint32_t key_len, hdr_len;
+    uint64_t body_len;
+    int64_t expires;
+    uint32_t swr, unused;
+} disk_rec_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char *dir;               /* NULL: the tier is off */
+static int max_segs;
+static disk_seg_t *segs, *last_seg;    /* oldest first; the last is active */
+static int nsegs, next_id;
+static disk_obj_t *buckets[DISK_BUCKETS];
+static disk_stats_t stats;
+static double rebuild_ms;
+
+static unsigned long hash_key(char *key);
+static disk_seg_t *open_seg(int id, int create);
+static void new_seg(void);
+static void evict_seg(void);
+static void release_seg(disk_seg_t *seg);
+static void scan_seg(disk_seg_t *seg);
+static void index_insert(disk_obj_t *obj);
+static void rebuild(void);
+
+/* disk_init : use the segment files in directory d, at most budget_mb
+ * megabytes of them, and rebuild the index from those already there */
+void disk_init(char *d, size_t budget_mb){
+    dir = d;
+    max_segs = budget_mb * 1024 * 1024 / DISK_SEGMENT_SIZE;
+    if (max_segs < 2)
+        max_segs = 2;
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+        unix_error("disk: mkdir error");
+    rebuild();
+    pthread_mutex_lock(&lock);
+    new_seg();
+    pthread_mutex_unlock(&lock);
+}
+
+/* disk_enabled : true if the tier is in use */
+int disk_enabled(void){
+    return dir != NULL;
+}
+
+/* disk_lookup : find the object stored for key and take a reference to
+ * it, or return NULL. Release the object with disk_release. */
+disk_obj_t *disk_lookup(char *key){
+    unsigned long h;
+    disk_obj_t *obj;
+
+    if (!dir)
+        return NULL;
+    h = hash_key(key);
+    pthread_mutex_lock(&lock);
+    for (obj = buckets[h % DISK_BUCKETS]; obj; obj = obj->hnext)
+        if (obj->hash == h && !strcmp(obj->key, key))
+            break;
+    if (obj){
+        obj->refcnt++;
+        obj->seg->last_used = time(NULL);
+        stats.hits++;
+    }
+    else
+        stats.misses++;
+    pthread_mutex_unlock(&lock);
+    return obj;
+}
+
+/* disk_contains : true if an object is stored for key; neither takes a
+ * reference nor counts as a hit or a miss */
+int disk_contains(char *key){
+    unsigned long h;
+    disk_obj_t *obj;
+
+    if (!dir)
+        return 0;
+    h = hash_key(key);
+    pthread_mutex_lock(&lock);
+    for (obj = buckets[h % DISK_BUCKETS]; obj; obj = obj->hnext)
+        if (obj->hash == h && !strcmp(obj->key, key))
+            break;
+    pthread_mutex_unlock(&lock);
+    return obj != NULL;
+}
+
+/* disk_hold : take one more reference to an object already referenced */
+void disk_hold(disk_obj_t *obj){
+    pthread_mutex_lock(&lock);
+    obj->refcnt++;
+    pthread_mutex_unlock(&lock);
+}
+
+/* disk_release : drop a reference; the last one frees the object */
+void disk_release(disk_obj_t *obj){
+    int left;
+
+    pthread_mutex_lock(&lock);
+    left = --obj->refcnt;
+    if (!left)
+        release_seg(obj->seg);
+    pthread_mutex_unlock(&lock);
+    if (left)
+        return;
+    Free(obj->key);
+    Free(obj->hdr);
+    Free(obj);
+}
+
+/* disk_refresh : the server said the object is still current; it is now
+ * fresh until expires, then for swr seconds while it is revalidated */
+void disk_refresh(disk_obj_t *obj, time_t expires, int swr){
+    disk_rec_t rec;
+    off_t off = obj->body_off - obj->hdr_len - strlen(obj->key) - sizeof(rec);
+
+    pthread_mutex_lock(&lock);
+    obj->expires = expires;
+    obj->swr = swr;
+    __atomic_store_n(&obj->revalidating, 0, __ATOMIC_RELEASE);
+    stats.refreshes++;
+    pthread_mutex_unlock(&lock);
+
+    // best effort: the next run would revalidate it again
+    rec.expires = expires;
+    rec.swr = swr;
+    if (!obj->seg->dead)
+        pwrite(obj->seg->fd, (char *)&rec + offsetof(disk_rec_t, expires),
+               offsetof(disk_rec_t, unused) - offsetof(disk_rec_t, expires),
+               off + offsetof(disk_rec_t, expires));
+}
+
+/* disk_begin : start storing the response for key: hdr (hdr_len bytes,
+ * up to the empty line) and a body of body_len bytes, passed to
+ * disk_append as it arrives, fresh until expires and then for swr
+ * seconds while it is revalidated. Return NULL if it is not stored. */
+disk_write_t *disk_begin(char *key, char *hdr, size_t hdr_len, size_t body_len,
+                         time_t expires, int swr){
+    disk_rec_t rec;
+    disk_write_t *w;
+    size_t key_len = strlen(key), meta = sizeof(rec) + key_len + hdr_len;
+    char *buf;
+    off_t off;
+    disk_seg_t *seg;
+
+    if (!dir || meta + body_len > DISK_SEGMENT_SIZE)
+        return NULL;
+
+    // reserve the room of the whole record in the active segment
+    pthread_mutex_lock(&lock);
+    if (last_seg->used + meta + body_len > DISK_SEGMENT_SIZE)
+        new_seg();
+    seg = last_seg;
+    off = seg->used;
+    seg->used += meta + body_len;
+    seg->refcnt++;
+    pthread_mutex_unlock(&lock);
+
+    rec.magic = DISK_MAGIC;
+    rec.state = REC_PENDING;
+    rec.key_len = key_len;
+    rec.hdr_len = hdr_len;
+    rec.body_len = body_len;
+    rec.expires = expires;
+    rec.swr = swr;
+    rec.unused = 0;
+    buf = (char *)Malloc(meta);
+    memcpy(buf, &rec, sizeof(rec));
+    memcpy(buf + sizeof(rec), key, key_len);
+    memcpy(buf + sizeof(rec) + key_len, hdr, hdr_len);
+    if (pwrite(seg->fd, buf, meta, off) != (ssize_t)meta){
+        Free(buf);
+        pthread_mutex_lock(&lock);
+        stats.aborted++;
+        release_seg(seg);
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    Free(buf);
+
+    w = (disk_write_t *)Malloc(sizeof(disk_write_t));
+    w->seg = seg;
+    w->off = off;
+    w->pos = off + meta;
+    w->obj = (disk_obj_t *)Malloc(sizeof(disk_obj_t));
+    w->obj->key = (char *)Malloc(key_len + 1);
+    strcpy(w->obj->key, key);
+    w->obj->hash = hash_key(key);
+    w->obj->hdr = (char *)Malloc(hdr_len);
+    memcpy(w->obj->hdr, hdr, hdr_len);
+    w->obj->hdr_len = hdr_len;
+    w->obj->body_off = off + meta;
+    w->obj->body_len = body_len;
+    w->obj->expires = expires;
+    w->obj->swr = swr;
+    w->obj->revalidating = 0;
+    w->obj->refcnt = 1;
+    return w;
+}
+
+/* disk_append : write the next n body bytes; return -1 on an error, or if
+ * they go past the body */
+int disk_append(disk_write_t *w, char *data, size_t n){
+    ssize_t rc;
+
+    if (w->pos + n > w->obj->body_off + w->obj->body_len)
+        return -1;
+    while (n > 0){
+        if ((rc = pwrite(w->seg->fd, data, n, w->pos)) < 0){
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += rc;
+        n -= rc;
+        w->pos += rc;
+    }
+    return 0;
+}
+
+/* disk_commit : the whole body was written; mark the record complete and
+ * index the object */
+void disk_commit(disk_write_t *w){
+    uint32_t state = REC_VALID;
+
+    if (w->pos != w->obj->body_off + (off_t)w->obj->body_len ||
+        pwrite(w->seg->fd, &state, sizeof(state),
+               w->off + offsetof(disk_rec_t, state)) != sizeof(state)){
+        disk_abort(w);
+        return;
+    }
+    pthread_mutex_lock(&lock);
+    if (w->seg->dead){
+        // evicted while it was written
+        stats.aborted++;
+        release_seg(w->seg);
+        pthread_mutex_unlock(&lock);
+        Free(w->obj->key);
+        Free(w->obj->hdr);
+        Free(w->obj);
+        Free(w);
+        return;
+    }
+    // the object takes over the reference of the writer to the segment
+    w->obj->seg = w->seg;
+    index_insert(w->obj);
+    stats.stored++;
+    pthread_mutex_unlock(&lock);
+    Free(w);
+}
+
+/* disk_abort : give up storing the object; its record stays pending */
+void disk_abort(disk_write_t *w){
+    pthread_mutex_lock(&lock);
+    stats.aborted++;
+    release_seg(w->seg);
+    pthread_mutex_unlock(&lock);
+    Free(w->obj->key);
+    Free(w->obj->hdr);
+    Free(w->obj);
+    Free(w);
+}
+
+/* disk_print_stats : print the counters of the tier */
+void disk_print_stats(FILE *fp){
+    disk_stats_t st;
+    disk_seg_t *seg;
+    size_t bytes = 0;
+    int n;
+
+    if (!dir)
+        return;
+    pthread_mutex_lock(&lock);
+    st = stats;
+    n = nsegs;
+    for (seg = segs; seg; seg = seg->next)
+        bytes += seg->used;
+    pthread_mutex_unlock(&lock);
+    fprintf(fp, "disk: %lu objects, %zu/%d MB in %d segments, index rebuilt in %.1f ms\n",
+            st.objects, bytes >> 20, max_segs * (DISK_SEGMENT_SIZE >> 20), n, rebuild_ms);
+    fprintf(fp, "disk: %lu hits, %lu misses, %lu stored, %lu aborted, %lu segments evicted\n",
+            st.hits, st.misses, st.stored, st.aborted, st.evictions);
+    fprintf(fp, "disk: %lu revalidated (304)\n", st.refreshes);
+}
+
+/* hash_key : FNV-1a hash of a key */
+static unsigned long hash_key(char *key){
+    unsigned long h = 14695981039346656037UL;
+
+    while (*key){
+        h ^= (unsigned char)*key++;
+        h *= 1099511628211UL;
+    }
+    return h;
+}
+
+/* open_seg : open (or create, empty) the segment file of id, and add it
+ * to the tier as the newest segment. Called with lock held, or alone. */
+static disk_seg_t *open_seg(int id, int create){
+    char path[MAXLINE];
+    disk_seg_t *seg;
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/seg-%08d", dir, id);
+    if ((fd = open(path, create ? O_RDWR | O_CREAT | O_TRUNC : O_RDWR, 0644)) < 0)
+        unix_error("disk: open error");
+    seg = (disk_seg_t *)Malloc(sizeof(disk_seg_t));
+    seg->id = id;
+    seg->fd = fd;
+    seg->used = 0;
+    seg->refcnt = 1;
+    seg->dead = 0;
+    seg->last_used = time(NULL);
+    seg->next = NULL;
+    if (last_seg)
+        last_seg->next = seg;
+    else
+        segs = seg;
+    last_seg = seg;
+    nsegs++;
+    if (id >= next_id)
+        next_id = id + 1;
+    return seg;
+}
+
+/* new_seg : start a new active segment, evicting to stay in the budget
+ * (which may also have shrunk since the last run). Called with lock held. */
+static void new_seg(void){
+    open_seg(next_id, 1);
+    while (nsegs > max_segs)
+        evict_seg();
+}
+
+/* evict_seg : delete the segment hit least recently (never the active
+ * one) and the objects in it. Called with lock held. */
+static void evict_seg(void){
+    disk_seg_t *seg, *victim = NULL, **pp;
+    disk_obj_t **op, *obj;
+    char path[MAXLINE];
+    int i;
+
+    for (seg = segs; seg != last_seg; seg = seg->next)
+        if (!victim || seg->last_used < victim->last_used)
+            victim = seg;
+    if (!victim)
+        return;
+
+    for (i = 0; i < DISK_BUCKETS; i++)
+        for (op = &buckets[i]; (obj = *op); ){
+            if (obj->seg != victim){
+                op = &obj->hnext;
+                continue;
+            }
+            *op = obj->hnext;
+            stats.objects--;
+            if (--obj->refcnt == 0){
+                release_seg(obj->seg);
+                Free(obj->key);
+                Free(obj->hdr);
+                Free(obj);
+            }
+        }
+
+    for (pp = &segs; *pp != victim; pp = &(*pp)->next)
+        ;
+    *pp = victim->next;
+    nsegs--;
+    snprintf(path, sizeof(path), "%s/seg-%08d", dir, victim->id);
+    unlink(path);
+    victim->dead = 1;
+    stats.evictions++;
+    release_seg(victim);
+}
+
+/* release_seg : drop a reference to a segment; the last one closes its
+ * file. Called with lock held. */
+static void release_seg(disk_seg_t *seg){
+    if (--seg->refcnt)
+        return;
+    close(seg->fd);
+    Free(seg);
+}
+
+/* index_insert : index obj, in place of an older copy of the object.
+ * Called with lock held. */
+static void index_insert(disk_obj_t *obj){
+    disk_obj_t **op, *old;
+
+    for (op = &buckets[obj->hash % DISK_BUCKETS]; (old = *op); op = &old->hnext)
+        if (old->hash == obj->hash && !strcmp(old->key, obj->key))
+            break;
+    if (old){
+        *op = old->hnext;
+        stats.objects--;
+        if (--old->refcnt == 0){
+            release_seg(old->seg);
+            Free(old->key);
+            Free(old->hdr);
+            Free(old);
+        }
+    }
+    obj->hnext = buckets[obj->hash % DISK_BUCKETS];
+    buckets[obj->hash % DISK_BUCKETS] = obj;
+    stats.objects++;
+}
+
+/* scan_seg : index the complete records of a segment left by an earlier
+ * run, reading only their headers, keys and heads */
+static void scan_seg(disk_seg_t *seg){
+    struct stat st;
+    disk_rec_t rec;
+    disk_obj_t *obj;
+    off_t off = 0, size;
+
+    if (fstat(seg->fd, &st) < 0)
+        return;
+    seg->last_used = st.st_mtime;
+    while (pread(seg->fd, &rec, sizeof(rec), off) == sizeof(rec)){
+        size = sizeof(rec) + rec.key_len + rec.hdr_len + rec.body_len;
+        // the end of the log, or a record cut short by a crash
+        if (rec.magic != DISK_MAGIC || rec.key_len > MAXLINE ||
+            rec.hdr_len > DISK_SEGMENT_SIZE || off + size > st.st_size)
+            break;
+        if (rec.state == REC_VALID){
+            obj = (disk_obj_t *)Malloc(sizeof(disk_obj_t));
+            obj->key = (char *)Malloc(rec.key_len + 1);
+            obj->hdr = (char *)Malloc(rec.hdr_len);
+            if (pread(seg->fd, obj->key, rec.key_len, off + sizeof(rec)) != rec.key_len ||
+                pread(seg->fd, obj->hdr, rec.hdr_len, off + sizeof(rec) + rec.key_len)
+                    != rec.hdr_len){
+                Free(obj->key);
+                Free(obj->hdr);
+                Free(obj);
+                break;
+            }
+            obj->key[rec.key_len] = 0;
+            obj->hash = hash_key(obj->key);
+            obj->hdr_len = rec.hdr_len;
+            obj->body_off = off + sizeof(rec) + rec.key_len + rec.hdr_len;
+            obj->body_len = rec.body_len;
+            obj->expires = rec.expires;
+            obj->swr = rec.swr;
+            obj->revalidating = 0;
+            obj->refcnt = 1;
+            obj->seg = seg;
+            seg->refcnt++;
+            index_insert(obj);
+        }
+        off += size;
+    }
+    seg->used = off;
+}
+
+/* rebuild : index the segments found in the directory, oldest first */
+static void rebuild(void){
+    struct timeval start, end;
+    struct dirent *de;
+    DIR *dp;
+    int *ids = NULL, n = 0, cap = 0, id, i, j;
+
+    gettimeofday(&start, NULL);
+    if (!(dp = opendir(dir)))
+        unix_error("disk: opendir error");
+    while ((de = readdir(dp))){
+        if (sscanf(de->d_name, "seg-%d", &id) != 1)
+            continue;
+        if (n == cap){
+            cap = cap ? 2 * cap : 16;
+            ids = (int *)Realloc(ids, cap * sizeof(int));
+        }
+        ids[n++] = id;
+    }
+    closedir(dp);
+
+    // insertion sort: a newer copy of an object must replace an older one
+    for (i = 1; i < n; i++){
+        id = ids[i];
+        for (j = i; j > 0 && ids[j - 1] > id; j--)
+            ids[j] = ids[j - 1];
+        ids[j] = id;
+    }
+    for (i = 0; i < n; i++)
+        scan_seg(open_seg(ids[i], 0));
+    if (ids)
+        Free(ids);
+
+    gettimeofday(&end, NULL);
+    rebuild_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_usec - start.tv_usec) / 1e3;
+}
@@ -0,0 +1,76 @@
+/*
+ * disk.h - on-disk second tier of the cache, for objects too large for
+ *          the memory cache
+ */
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "proxy.h"
+
+#define DISK_SEGMENT_SIZE (16 * 1024 * 1024)    /* bytes per segment file */
+#define DISK_BUDGET 256                 /* default size of the tier, MB */
+#define DISK_BUCKETS 4096               /* hash buckets of the index */
+
+/* A segment file: records are only ever appended to it, and it is
+ * deleted as a whole */
+typedef struct disk_seg {
+    int id;                     /* the file is seg-<id> */
+    int fd;
+    size_t used;                /* bytes taken by records */
+    int refcnt;                 /* the tier's reference + objects + writers */
+    int dead;                   /* evicted: the file is gone */
+    time_t last_used;           /* last hit, for choosing the victim */
+    struct disk_seg *next;      /* segments of the tier, oldest first */
+} disk_seg_t;
+
+/* An object in the index. Its body is body_len bytes at body_off of
+ * the segment file; a lookup holds a reference that keeps the object
+ * and the segment file open after eviction. */
+typedef struct disk_obj {
+    char *key;
+    unsigned long hash;
+    disk_seg_t *seg;
+    char *hdr;                  /* status line and headers, up to the empty line */
+    size_t hdr_len;
+    off_t body_off;
+    size_t body_len;
+    time_t expires;             /* fresh until then... */
+    int swr;                    /* ... then served for that many seconds more
+                                 * while it is revalidated */
+    int revalidating;           /* a revalidation is under way */
+    int refcnt;                 /* the index's reference + lookups */
+    struct disk_obj *hnext;
+} disk_obj_t;
+
+/* A record being written */
+typedef struct {
+    disk_seg_t *seg;
+    off_t off;                  /* of the record */
+    off_t pos;                  /* where the next body bytes go */
+    disk_obj_t *obj;            /* indexed once complete */
+} disk_write_t;
+
+/* Counters reported by the tier */
+typedef struct {
+    unsigned long hits, misses;
+    unsigned long stored, aborted;
+    unsigned long evictions;    /* segments evicted */
+    unsigned long refreshes;    /* revalidated by the server (304) */
+    unsigned long objects;
+} disk_stats_t;
+
+void disk_init(char *dir, size_t budget_mb);
+int disk_enabled(void);
+disk_obj_t *disk_lookup(char *key);
+int disk_contains(char *key);
+void disk_hold(disk_obj_t *obj);
+void disk_release(disk_obj_t *obj);
+void disk_refresh(disk_obj_t *obj, time_t expires, int swr);
+disk_write_t *disk_begin(char *key, char *hdr, size_t hdr_len, size_t body_len,
+                         time_t expires, int swr);
+int disk_append(disk_write_t *w, char *data, size_t n);
+void disk_commit(disk_write_t *w);
+void disk_abort(disk_write_t *w);
+void disk_print_stats(FILE *fp);
+
+#endif /* __DISK_H__ */
@@ -0,0 +1,225 @@
+/*
+ * fill.c - responses being fetched into the cache, shared by the requests
+ *          that arrive meanwhile
+ *
+ * When many clients ask for the same object at once, only the first
+ * request that misses the cache goes to the server. It starts a fill; the
+ * requests for the same key that miss the cache before the object is
+ * cached join the fill instead of fetching the object again, and send
+ * its bytes to their clients as they arrive, from whichever loop they
+ * live in.
+ *
+ * The body is kept in a buffer of a fixed size (the Content-Length, or
+ * what is left of MAX_OBJECT_SIZE), so that readers can use the bytes
+ * below len while the fetching connection appends more. A response that
+ * cannot be cached aborts the fill, and the requests that joined it fetch
+ * the object themselves. Only bodies of known length are streamed: one
+ * that is chunked or ends with the connection may yet turn out too large
+ * to cache, so its readers wait until it is complete and send it with a
+ * Content-Length.
+ */
+#include "fill.h"
+#include "loop.h"
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static fill_t *buckets[FILL_BUCKETS];
+static fill_stats_t stats;
+
+static void unlink_fill(fill_t *f);
+static void wake(struct conn *c);
+
+/* fill_join : join the fill of key, or start one if there is none; set
+ * *startedp to 1 if it was started, in which case the caller has to fetch
+ * the object. Release the fill with fill_release. */
+fill_t *fill_join(char *key, int *startedp){
+    unsigned long h = 5381;
+    fill_t *f;
+    char *p;
+
+    for (p = key; *p; p++)
+        h = h * 33 + (unsigned char)*p;
+
+    pthread_mutex_lock(&table_lock);
+    for (f = buckets[h % FILL_BUCKETS]; f; f = f->hnext)
+        if (f->hash == h && !strcmp(f->key, key))
+            break;
+    if (f){
+        pthread_mutex_lock(&f->lock);
+        f->refcnt++;
+        pthread_mutex_unlock(&f->lock);
+        stats.joined++;
+        *startedp = 0;
+    }
+    else{
+        f = (fill_t *)Malloc(sizeof(fill_t));
+        memset(f, 0, sizeof(fill_t));
+        f->key = (char *)Malloc(strlen(key) + 1);
+        strcpy(f->key, key);
+        f->hash = h;
+        pthread_mutex_init(&f->lock, NULL);
+        f->state = FILL_HEAD;
+        // one reference for the table, one for the caller
+        f->refcnt = 2;
+        f->hnext = buckets[h % FILL_BUCKETS];
+        buckets[h % FILL_BUCKETS] = f;
+        stats.started++;
+        *startedp = 1;
+    }
+    pthread_mutex_unlock(&table_lock);
+    return f;
+}
+
+/* fill_head : the response head is known; hdr (malloc'ed, taken over, with
+ * room for a Content-Length if length_known is 0) is the head as cached,
+ * and the body will take at most cap bytes */
+void fill_head(fill_t *f, char *hdr, size_t hdr_len, int length_known, size_t cap){
+    struct conn *c;
+
+    pthread_mutex_lock(&f->lock);
+    f->hdr = hdr;
+    f->hdr_len = hdr_len;
+    f->length_known = length_known;
+    f->body = (char *)Malloc(cap ? cap : 1);
+    f->cap = cap;
+    f->state = FILL_BODY;
+    c = f->waiters;
+    f->waiters = NULL;
+    pthread_mutex_unlock(&f->lock);
+    wake(c);
+}
+
+/* fill_append : add n bytes to the body and wake the waiting readers */
+void fill_append(fill_t *f, char *data, size_t n){
+    struct conn *c;
+
+    if (f->state != FILL_BODY)
+        return;
+    if (f->len + n > f->cap){
+        fill_abort(f);
+        return;
+    }
+    // only this thread writes past len, so the copy needs no lock
+    memcpy(f->body + f->len, data, n);
+    pthread_mutex_lock(&f->lock);
+    f->len += n;
+    c = NULL;
+    if (f->length_known){
+        c = f->waiters;
+        f->waiters = NULL;
+    }
+    pthread_mutex_unlock(&f->lock);
+    wake(c);
+}
+
+/* fill_done : the whole body is in (and cached); later requests find the
+ * object in the cache */
+void fill_done(fill_t *f){
+    struct conn *c;
+
+    unlink_fill(f);
+    pthread_mutex_lock(&f->lock);
+    if (f->state == FILL_BODY){
+        // the readers have waited for the length
+        if (!f->length_known)
+            f->hdr_len += sprintf(f->hdr + f->hdr_len, "Content-Length: %zu\r\n", f->len);
+        f->state = FILL_DONE;
+    }
+    c = f->waiters;
+    f->waiters = NULL;
+    pthread_mutex_unlock(&f->lock);
+    wake(c);
+}
+
+/* fill_abort : give up the fill; later requests fetch the object again */
+void fill_abort(fill_t *f){
+    struct conn *c;
+
+    unlink_fill(f);
+    pthread_mutex_lock(&f->lock);
+    if (f->state == FILL_DONE || f->state == FILL_ABORTED){
+        pthread_mutex_unlock(&f->lock);
+        return;
+    }
+    f->state = FILL_ABORTED;
+    c = f->waiters;
+    f->waiters = NULL;
+    pthread_mutex_unlock(&f->lock);
+    __atomic_add_fetch(&stats.aborted, 1, __ATOMIC_RELAXED);
+    wake(c);
+}
+
+/* fill_release : drop a reference; the last one frees the fill */
+void fill_release(fill_t *f){
+    int left;
+
+    pthread_mutex_lock(&f->lock);
+    left = --f->refcnt;
+    pthread_mutex_unlock(&f->lock);
+    if (left)
+        return;
+    pthread_mutex_destroy(&f->lock);
+    Free(f->key);
+    if (f->hdr)
+        Free(f->hdr);
+    if (f->body)
+        Free(f->body);
+    Free(f);
+}
+
+/* fill_poll : return the state of the fill, and in *availp how many body
+ * bytes can be sent. A reader that has sent the first sent of them and has
+ * nothing new to send waits: if the result is FILL_HEAD, or FILL_BODY with
+ * *availp == sent, c was queued and is handed back to its loop with
+ * loop_wake() when there is more. */
+fill_state_t fill_poll(fill_t *f, struct conn *c, size_t sent, size_t *availp){
+    fill_state_t state;
+
+    pthread_mutex_lock(&f->lock);
+    state = f->state;
+    if (state == FILL_BODY && !f->length_known)
+        state = FILL_HEAD;
+    *availp = f->len;
+    if (state == FILL_HEAD || (state == FILL_BODY && f->len == sent)){
+        c->next_woken = f->waiters;
+        f->waiters = c;
+    }
+    pthread_mutex_unlock(&f->lock);
+    return state;
+}
+
+/* fill_print_stats : print the counters of the fills */
+void fill_print_stats(FILE *fp){
+    pthread_mutex_lock(&table_lock);
+    fprintf(fp, "fill: %lu fetches, %lu requests joined them, %lu aborted\n",
+            stats.started, stats.joined,
+            __atomic_load_n(&stats.aborted, __ATOMIC_RELAXED));
+    pthread_mutex_unlock(&table_lock);
+}
+
+/* unlink_fill : take a fill out of the table, dropping its reference */
+static void unlink_fill(fill_t *f){
+    fill_t **pp;
+
+    pthread_mutex_lock(&table_lock);
+    for (pp = &buckets[f->hash % FILL_BUCKETS]; *pp; pp = &(*pp)->hnext)
+        if (*pp == f)
+            break;
+    if (!*pp){
+        // already taken out
+        pthread_mutex_unlock(&table_lock);
+        return;
+    }
+    *pp = f->hnext;
+    pthread_mutex_unlock(&table_lock);
+    fill_release(f);
+}
+
+/* wake : hand a list of waiting readers back to their loops */
+static void wake(struct conn *c){
+    struct conn *next;
+
+    for (; c; c = next){
+        next = c->next_woken;
+        loop_wake(c->loop, c);
+    }
+}
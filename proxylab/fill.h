@@ -0,0 +1,56 @@
+/*
+ * fill.h - responses being fetched into the cache, shared by the requests
+ *          that arrive meanwhile
+ */
+#ifndef __FILL_H__
+#define __FILL_H__
+
+#include "proxy.h"
+
+#define FILL_BUCKETS 256
+
+/* States of a fill */
+typedef enum {
+    FILL_HEAD,      /* waiting for the response head */
+    FILL_BODY,      /* head known, body bytes arriving */
+    FILL_DONE,      /* the whole body is in */
+    FILL_ABORTED    /* not cacheable after all, or the fetch failed */
+} fill_state_t;
+
+struct conn;
+
+/* A response being fetched for the cache. The connection that started it
+ * appends the bytes; the connections that joined it send them on to their
+ * clients as they arrive. */
+typedef struct fill {
+    char *key;                  /* cache key of the object */
+    unsigned long hash;
+    pthread_mutex_t lock;
+    fill_state_t state;
+    char *hdr;                  /* head as cached: no framing headers, and */
+    size_t hdr_len;             /* Content-Length if the length is known */
+    int length_known;
+    char *body;                 /* body bytes so far, at most cap of them */
+    size_t len, cap;
+    struct conn *waiters;       /* connections waiting for more bytes */
+    int refcnt;
+    struct fill *hnext;         /* next fill in the hash bucket */
+} fill_t;
+
+/* Counters reported by the fills */
+typedef struct {
+    unsigned long started;      /* fetches that others could join */
+    unsigned long joined;       /* requests served by another's fetch */
+    unsigned long aborted;      /* fills given up */
+} fill_stats_t;
+
+fill_t *fill_join(char *key, int *startedp);
+void fill_head(fill_t *f, char *hdr, size_t hdr_len, int length_known, size_t cap);
+void fill_append(fill_t *f, char *data, size_t n);
+void fill_done(fill_t *f);
+void fill_abort(fill_t *f);
+void fill_release(fill_t *f);
+fill_state_t fill_poll(fill_t *f, struct conn *c, size_t sent, size_t *availp);
+void fill_print_stats(FILE *fp);
+
+#endif /* __FILL_H__ */
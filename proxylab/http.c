@@ -0,0 +1,368 @@
+/*
+ * http.c - HTTP/1.x response headers, message framing and freshness
+ *
+ * The proxy keeps connections open on both sides, so it has to know
+ * where each response ends: after Content-Length bytes, after the last
+ * chunk of a chunked body, or only when the server closes. body_consume
+ * follows a body through the reads that carry it and hands its payload,
+ * with the chunk framing removed, to a callback.
+ *
+ * get_freshness reads how long a response stays fresh from its
+ * Cache-Control, Expires, Date and Age headers; a response that says
+ * nothing but has a Last-Modified is given a tenth of its age since the
+ * modification, as browsers do. Once stale, a cached response is
+ * revalidated with the conditional request make_conditional builds from
+ * its ETag and Last-Modified.
+ */
+#include "http.h"
+
+/* States of the chunked decoder */
+enum {
+    CH_SIZE,        /* hex digits of the chunk size */
+    CH_EXT,         /* rest of the size line */
+    CH_DATA,        /* chunk data */
+    CH_DATA_END,    /* CRLF after the chunk data */
+    CH_TRAILER,     /* start of a trailer line or of the final CRLF */
+    CH_TRAILER_LINE,/* rest of a trailer line */
+    CH_LAST         /* LF of the final CRLF */
+};
+
+/* Headers that only concern one connection and are never forwarded */
+static const char *hop_headers[] = {
+    "Connection", "Keep-Alive", "Proxy-Connection", NULL
+};
+
+static const char *months[] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+    "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+static int has_token(char *value, char *end, const char *token);
+static long directive(char *value, char *end, const char *name);
+static time_t parse_date(char *value);
+static char *header_value(char *hdr, size_t len, const char *name, size_t *lenp);
+
+/* parse_response : parse the response head in buf (len bytes ending with
+ * the empty line, then a NUL). Return 0, or -1 if it is not an HTTP/1.x
+ * response. resp->hdr is malloc'ed. */
+int parse_response(char *buf, size_t len, response_t *resp){
+    char *line, *end, *next, *value;
+    int minor, chunked = 0, closing = 0, keepalive = 0;
+    long length = -1;
+
+    if (sscanf(buf, "HTTP/1.%d %d", &minor, &resp->status) != 2)
+        return -1;
+
+    end = buf + len;
+    for (line = strstr(buf, "\r\n") + 2; line < end - 2; line = next + 2){
+        if (!(next = strstr(line, "\r\n")))
+            return -1;
+        if (!(value = memchr(line, ':', next - line)))
+            continue;
+        if (header_is(line, "Content-Length"))
+            length = strtol(value + 1, NULL, 10);
+        else if (header_is(line, "Transfer-Encoding"))
+            chunked = has_token(value + 1, next, "chunked");
+        else if (header_is(line, "Connection")){
+            closing |= has_token(value + 1, next, "close");
+            keepalive |= has_token(value + 1, next, "keep-alive");
+        }
+    }
+
+    resp->body.left = 0;
+    resp->body.chunk_state = CH_SIZE;
+    resp->body.done = 0;
+    if (resp->status / 100 == 1 || resp->status == 204 || resp->status == 304){
+        resp->body.mode = BODY_NONE;
+        resp->body.done = 1;
+    }
+    else if (chunked)
+        resp->body.mode = BODY_CHUNKED;
+    else if (length >= 0){
+        resp->body.mode = BODY_LENGTH;
+        resp->body.left = length;
+        resp->body.done = (length == 0);
+    }
+    else
+        resp->body.mode = BODY_EOF;
+
+    // HTTP/1.1 connections persist unless closed, HTTP/1.0 ones if asked to
+    resp->keepalive = (minor >= 1 ? !closing : keepalive) &&
+                      resp->body.mode != BODY_EOF;
+
+    // drop the empty line and the hop-by-hop headers
+    resp->hdr = (char *)Malloc(len);
+    resp->hdr_len = strip_headers(resp->hdr, buf, len - 2, hop_headers);
+    return 0;
+}
+
+/* body_consume : take the next n bytes of a message body. Return how many
+ * of them belong to the body (fewer than n when it ends in them) and pass
+ * the payload they carry to payload(arg, ...), if it is not NULL. */
+size_t body_consume(body_t *body, char *data, size_t n,
+                    payload_func_t payload, void *arg){
+    size_t i = 0, k;
+    int d;
+
+    if (body->mode == BODY_EOF){
+        if (payload && n)
+            payload(arg, data, n);
+        body->done = (n == 0);
+        return n;
+    }
+    if (body->mode == BODY_LENGTH){
+        k = (n < body->left) ? n : body->left;
+        if (payload && k)
+            payload(arg, data, k);
+        body->left -= k;
+        body->done = (body->left == 0);
+        return k;
+    }
+    if (body->mode == BODY_NONE)
+        return 0;
+
+    // BODY_CHUNKED
+    while (i < n && !body->done){
+        char ch = data[i];
+
+        switch (body->chunk_state){
+        case CH_SIZE:
+            if (isxdigit((unsigned char)ch)){
+                d = isdigit((unsigned char)ch) ? ch - '0' : tolower(ch) - 'a' + 10;
+                // a size that does not fit is a broken response
+                if (body->left >> (8 * sizeof(size_t) - 8))
+                    body->done = -1;
+                body->left = body->left * 16 + d;
+                i++;
+                break;
+            }
+            body->chunk_state = CH_EXT;
+            // fall through
+        case CH_EXT:
+            if (data[i++] == '\n')
+                body->chunk_state = body->left ? CH_DATA : CH_TRAILER;
+            break;
+        case CH_DATA:
+            k = (n - i < body->left) ? n - i : body->left;
+            if (payload)
+                payload(arg, data + i, k);
+            i += k;
+            if ((body->left -= k) == 0)
+                body->chunk_state = CH_DATA_END;
+            break;
+        case CH_DATA_END:
+            if (data[i++] == '\n')
+                body->chunk_state = CH_SIZE;
+            break;
+        case CH_TRAILER:
+            body->chunk_state = (data[i++] == '\r') ? CH_LAST : CH_TRAILER_LINE;
+            if (data[i - 1] == '\n')
+                body->done = 1;
+            break;
+        case CH_TRAILER_LINE:
+            if (data[i++] == '\n')
+                body->chunk_state = CH_TRAILER;
+            break;
+        case CH_LAST:
+            if (data[i++] == '\n')
+                body->done = 1;
+            break;
+        }
+    }
+    return i;
+}
+
+/* strip_headers : copy the message head src (len bytes of lines ending in
+ * CRLF) to dst, leaving out the headers named in the NULL terminated list
+ * names. The first (request or status) line is always kept. Return the
+ * length of the copy. */
+size_t strip_headers(char *dst, char *src, size_t len, const char **names){
+    char *line, *next, *end = src + len;
+    size_t n = 0;
+    int i, skip;
+
+    for (line = src; line < end; line = next){
+        if (!(next = memchr(line, '\n', end - line)))
+            next = end;
+        else
+            next++;
+        skip = 0;
+        for (i = 0; line != src && names[i]; i++)
+            if (header_is(line, names[i]))
+                skip = 1;
+        if (!skip){
+            memcpy(dst + n, line, next - line);
+            n += next - line;
+        }
+    }
+    return n;
+}
+
+/* header_is : true if line is a header with the given (case-insensitive) name */
+int header_is(char *line, const char *name){
+    size_t n = strlen(name);
+
+    return !strncasecmp(line, name, n) && line[n] == ':';
+}
+
+/* get_freshness : the freshness of the response head hdr (len bytes of
+ * lines ending in CRLF), received at now */
+void get_freshness(char *hdr, size_t len, time_t now, freshness_t *f){
+    char *line, *next, *value, *end = hdr + len;
+    long max_age = -1, s_maxage = -1, age = 0, n;
+    time_t date = -1, expires = -1, modified = -1;
+    int has_expires = 0, no_cache = 0;
+
+    f->store = 1;
+    f->lifetime = f->swr = -1;
+    f->revalidate = 0;
+    for (line = hdr; line < end; line = next){
+        if (!(next = memchr(line, '\n', end - line)))
+            break;
+        next++;
+        if (!(value = memchr(line, ':', next - line)))
+            continue;
+        value++;
+        if (header_is(line, "Cache-Control")){
+            if (has_token(value, next, "no-store") || has_token(value, next, "private"))
+                f->store = 0;
+            no_cache |= has_token(value, next, "no-cache");
+            if (has_token(value, next, "must-revalidate") ||
+                has_token(value, next, "proxy-revalidate"))
+                f->revalidate = 1;
+            if ((n = directive(value, next, "max-age")) >= 0)
+                max_age = n;
+            if ((n = directive(value, next, "s-maxage")) >= 0)
+                s_maxage = n;
+            if ((n = directive(value, next, "stale-while-revalidate")) >= 0)
+                f->swr = n;
+        }
+        else if (header_is(line, "Expires")){
+            // an invalid date, like "0", means already expired
+            has_expires = 1;
+            expires = parse_date(value);
+        }
+        else if (header_is(line, "Date"))
+            date = parse_date(value);
+        else if (header_is(line, "Last-Modified"))
+            modified = parse_date(value);
+        else if (header_is(line, "Age"))
+            age = strtol(value, NULL, 10);
+    }
+
+    // times are taken on the clock of the server when it gives its own
+    if (date < 0)
+        date = now;
+    if (s_maxage >= 0)
+        f->lifetime = s_maxage;
+    else if (max_age >= 0)
+        f->lifetime = max_age;
+    else if (has_expires)
+        f->lifetime = expires > date ? expires - date : 0;
+    else if (modified >= 0 && modified <= date){
+        f->lifetime = (date - modified) / 10;
+        if (f->lifetime > HEURISTIC_MAX)
+            f->lifetime = HEURISTIC_MAX;
+    }
+    if (f->lifetime >= 0)
+        f->lifetime = f->lifetime > age ? f->lifetime - age : 0;
+    // no-cache: stored, but revalidated before every use
+    if (no_cache){
+        f->lifetime = 0;
+        f->revalidate = 1;
+    }
+}
+
+/* make_conditional : the If-None-Match and If-Modified-Since headers that
+ * revalidate a cached response with head hdr, in a malloc'ed string, or
+ * NULL if it has neither an ETag nor a Last-Modified */
+char *make_conditional(char *hdr, size_t len){
+    char *etag, *modified, *cond;
+    size_t etag_len, modified_len, n = 0;
+
+    etag = header_value(hdr, len, "ETag", &etag_len);
+    modified = header_value(hdr, len, "Last-Modified", &modified_len);
+    if (!etag && !modified)
+        return NULL;
+    cond = (char *)Malloc(etag_len + modified_len + 64);
+    if (etag)
+        n += sprintf(cond + n, "If-None-Match: %.*s\r\n", (int)etag_len, etag);
+    if (modified)
+        n += sprintf(cond + n, "If-Modified-Since: %.*s\r\n", (int)modified_len, modified);
+    return cond;
+}
+
+/* has_token : true if the comma separated list in [value, end) has token */
+static int has_token(char *value, char *end, const char *token){
+    size_t n = strlen(token);
+    char *p;
+
+    for (p = value; p + n <= end; p++){
+        if (strncasecmp(p, token, n))
+            continue;
+        // whole tokens only
+        if ((p == value || p[-1] == ' ' || p[-1] == ',' || p[-1] == '\t') &&
+            (p + n == end || p[n] == ',' || p[n] == ' ' || p[n] == ';' ||
+             p[n] == '\r' || p[n] == '\t'))
+            return 1;
+    }
+    return 0;
+}
+
+/* directive : the value of the Cache-Control directive name=<seconds> in
+ * [value, end), or -1 if it is not there */
+static long directive(char *value, char *end, const char *name){
+    size_t n = strlen(name);
+    char *p;
+
+    for (p = value; p + n < end; p++){
+        if (strncasecmp(p, name, n) || p[n] != '=')
+            continue;
+        if (p == value || p[-1] == ' ' || p[-1] == ',' || p[-1] == '\t')
+            return strtol(p + n + 1 + (p[n + 1] == '"'), NULL, 10);
+    }
+    return -1;
+}
+
+/* parse_date : the time of an HTTP date in the preferred format, e.g.
+ * "Sun, 06 Nov 1994 08:49:37 GMT", or -1 */
+static time_t parse_date(char *value){
+    struct tm tm;
+    char month[4];
+    int i;
+
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(value, " %*3s, %d %3s %d %d:%d:%d GMT", &tm.tm_mday, month,
+               &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+        return -1;
+    for (i = 0; i < 12 && strcmp(month, months[i]); i++)
+        ;
+    if (i == 12)
+        return -1;
+    tm.tm_mon = i;
+    tm.tm_year -= 1900;
+    return timegm(&tm);
+}
+
+/* header_value : the value of the header name in the head hdr (len bytes),
+ * without the blanks around it and its length in *lenp, or NULL and 0 */
+static char *header_value(char *hdr, size_t len, const char *name, size_t *lenp){
+    char *line, *next, *value, *end = hdr + len;
+
+    *lenp = 0;
+    for (line = hdr; line < end; line = next){
+        if (!(next = memchr(line, '\n', end - line)))
+            break;
+        next++;
+        if (!header_is(line, name))
+            continue;
+        value = line + strlen(name) + 1;
+        while (value < next && (*value == ' ' || *value == '\t'))
+            value++;
+        *lenp = next - value;
+        while (*lenp && isspace((unsigned char)value[*lenp - 1]))
+            (*lenp)--;
+        return value;
+    }
+    return NULL;
+}
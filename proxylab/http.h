@@ -0,0 +1,56 @@
+/*
+ * http.h - HTTP/1.x response headers, message framing and freshness
+ */
+#ifndef __HTTP_H__
+#define __HTTP_H__
+
+#include "csapp.h"
+
+#define HEURISTIC_MAX 86400     /* longest freshness guessed from Last-Modified, s */
+
+/* How the end of a message body is found */
+typedef enum {
+    BODY_NONE,      /* no body (204, 304) */
+    BODY_LENGTH,    /* Content-Length bytes */
+    BODY_CHUNKED,   /* Transfer-Encoding: chunked */
+    BODY_EOF        /* until the server closes the connection */
+} body_mode_t;
+
+/* Progress through a message body */
+typedef struct {
+    body_mode_t mode;
+    size_t left;                /* bytes left in the body or chunk */
+    int chunk_state;            /* where in the chunked encoding we are */
+    int done;                   /* 1: body complete, -1: malformed */
+} body_t;
+
+/* Called with the payload bytes of a body, with the chunking removed */
+typedef void (*payload_func_t)(void *arg, char *data, size_t n);
+
+/* A parsed response head */
+typedef struct {
+    int status;
+    int keepalive;              /* the server keeps the connection open */
+    char *hdr;                  /* status line and end-to-end headers */
+    size_t hdr_len;
+    body_t body;
+} response_t;
+
+/* How long a response may be served from the cache (RFC 7234) */
+typedef struct {
+    int store;                  /* neither "no-store" nor "private" */
+    long lifetime;              /* seconds fresh once received, -1: not said */
+    long swr;                   /* seconds it may then be served while it is
+                                 * revalidated, -1: not said */
+    int revalidate;             /* no-cache, must-revalidate: never served stale */
+} freshness_t;
+
+int parse_response(char *buf, size_t len, response_t *resp);
+size_t body_consume(body_t *body, char *data, size_t n,
+                    payload_func_t payload, void *arg);
+size_t strip_headers(char *dst, char *src, size_t len, const char **names);
+int header_is(char *line, const char *name);
+void get_freshness(char *hdr, size_t len, time_t now, freshness_t *f);
+char *make_conditional(char *hdr, size_t len);
+
+#endif /* __HTTP_H__ */
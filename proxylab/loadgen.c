@@ -0,0 +1,482 @@
+/*
+ * loadgen.c - HTTP load generator for the proxy and tiny
+ *
+ * usage: ./loadgen -s <host:port> [-P <proxy port>] [-u <uri>]...
+ *                  [-c <connections>] [-n <requests> | -d <seconds>]
+ *                  [-r <rate>] [-k] [-t <timeout>]
+ *
+ * Sends GETs for the uris (in turn) to the server <host:port>, or through
+ * the proxy on localhost:<proxy port>, and prints the throughput and the
+ * latency percentiles of the responses.
+ *   -c  connections open at once (default 1)
+ *   -n  requests to send (default 1000), or
+ *   -d  send requests for that many seconds
+ *   -r  open loop: start <rate> requests per second in all, whether or
+ *       not earlier ones were answered. A request waiting for a free
+ *       connection counts as late: its latency is taken from when it
+ *       should have started. Without -r the load is closed loop: each
+ *       connection sends its next request as soon as it has a response.
+ *   -k  keep connections open between requests (when the response lets
+ *       it); by default each request opens a connection of its own
+ *   -t  seconds after which a request fails (default 10)
+ * A "%d" in a uri is replaced by the number of the request, so that no
+ * two requests are for the same object.
+ *
+ * One thread drives all the connections with epoll. Latencies are kept
+ * in a log-linear histogram (32 buckets per power of two of
+ * microseconds), so percentiles are within about 3%.
+ */
+#define _GNU_SOURCE             /* memmem, SOCK_NONBLOCK */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+
+#define BUFSIZE 65536
+#define MAX_URIS 64
+#define HIST_BUCKETS (64 + 40 * 32)
+
+/* States of a connection */
+enum { LC_FREE, LC_CONNECT, LC_SEND, LC_READ, LC_IDLE };
+
+/* A connection and the request it carries */
+typedef struct {
+    int state;
+    int fd;                     /* -1 when closed */
+    double start;               /* when the request started (or should have) */
+    char req[2048];
+    size_t req_len, req_off;
+    char buf[BUFSIZE];
+    size_t len;                 /* bytes in buf */
+    int head_done;
+    int status;
+    int keepalive;              /* the response lets the connection be reused */
+    int until_eof;              /* the body ends when the server closes */
+    size_t body_left;
+} lconn_t;
+
+static char *server, *proxy_port;
+static char *uris[MAX_URIS];
+static int nuris;
+static int nconns = 1, keepalive;
+static long nrequests = 1000;
+static double duration, rate, timeout = 10;
+static struct addrinfo *target;
+static int epfd;
+
+static long started, done, serial;
+static long ok, failed, timeouts, bad_status;
+static unsigned long long bytes;
+static unsigned long hist[HIST_BUCKETS];
+
+static double now(void);
+static int more_to_start(double t);
+static void start_request(lconn_t *c, double start);
+static void open_conn(lconn_t *c);
+static void send_request(lconn_t *c);
+static void read_response(lconn_t *c);
+static int parse_head(lconn_t *c, size_t head_len);
+static void finish(lconn_t *c, int success);
+static void close_lconn(lconn_t *c);
+static void watch(lconn_t *c, unsigned int events);
+static int bucket(unsigned long us);
+static double bucket_value(int b);
+static double percentile(double p);
+static void report(double secs);
+
+int main(int argc, char **argv){
+    struct addrinfo hints;
+    struct epoll_event events[64];
+    lconn_t *conns;
+    char *host, *port, *colon;
+    double t0, next, t, wait;
+    int opt, i, n, rc;
+
+    while ((opt = getopt(argc, argv, "s:P:u:c:n:d:r:kt:")) != -1){
+        switch (opt){
+        case 's':
+            server = optarg;
+            break;
+        case 'P':
+            proxy_port = optarg;
+            break;
+        case 'u':
+            if (nuris == MAX_URIS){
+                fprintf(stderr, "%s: at most %d uris\n", argv[0], MAX_URIS);
+                exit(1);
+            }
+            uris[nuris++] = optarg;
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 'n':
+            nrequests = atol(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'k':
+            keepalive = 1;
+            break;
+        case 't':
+            timeout = atof(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s -s <host:port> [-P <proxy port>] [-u <uri>]... "
+                    "[-c <connections>] [-n <requests> | -d <seconds>] [-r <rate>] "
+                    "[-k] [-t <timeout>]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (!server || !(colon = strrchr(server, ':')) || nconns < 1 || nrequests < 1 ||
+        duration < 0 || rate < 0 || timeout <= 0){
+        fprintf(stderr, "%s: need -s <host:port>; counts and times must be positive\n", argv[0]);
+        exit(1);
+    }
+    if (!nuris)
+        uris[nuris++] = "/home.html";
+
+    // requests go to the proxy if there is one, else to the server
+    host = proxy_port ? "localhost" : strndup(server, colon - server);
+    port = proxy_port ? proxy_port : colon + 1;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rc = getaddrinfo(host, port, &hints, &target)) != 0){
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(rc));
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN);
+    if ((epfd = epoll_create1(0)) < 0 ||
+        !(conns = calloc(nconns, sizeof(lconn_t)))){
+        perror("setup");
+        exit(1);
+    }
+    for (i = 0; i < nconns; i++)
+        conns[i].fd = -1;
+
+    t0 = next = now();
+    while (1){
+        t = now();
+        // start what is due on the free connections
+        for (i = 0; i < nconns; i++){
+            lconn_t *c = &conns[i];
+
+            if (c->state != LC_FREE && c->state != LC_IDLE)
+                continue;
+            if (!more_to_start(t - t0))
+                break;
+            if (rate){
+                if (next > t)
+                    break;
+                start_request(c, next);
+                next = t0 + started / rate;
+            }
+            else
+                start_request(c, t);
+        }
+        if (!more_to_start(t - t0) && done == started)
+            break;
+
+        // fail the requests that took too long
+        for (i = 0; i < nconns; i++)
+            if (conns[i].state != LC_FREE && conns[i].state != LC_IDLE &&
+                t - conns[i].start > timeout){
+                timeouts++;
+                finish(&conns[i], 0);
+            }
+
+        wait = 0.1;
+        if (rate && more_to_start(t - t0) && next - t < wait)
+            wait = next > t ? next - t : 0;
+        n = epoll_wait(epfd, events, 64, (int)(wait * 1000));
+        for (i = 0; i < n; i++){
+            lconn_t *c = events[i].data.ptr;
+
+            if (c->state == LC_CONNECT || c->state == LC_SEND)
+                send_request(c);
+            else if (c->state == LC_READ)
+                read_response(c);
+            else if (c->state == LC_IDLE){
+                // the server closed an idle connection
+                close_lconn(c);
+                c->state = LC_FREE;
+            }
+        }
+    }
+    report(now() - t0);
+    return failed ? 2 : 0;
+}
+
+/* more_to_start : true if more requests are to be started, elapsed
+ * seconds after the start */
+static int more_to_start(double elapsed){
+    if (duration)
+        return elapsed < duration;
+    return started < nrequests;
+}
+
+/* start_request : send the next request on c; start is when it started */
+static void start_request(lconn_t *c, double start){
+    char path[1024];
+    char *uri = uris[started % nuris];
+
+    started++;
+    snprintf(path, sizeof(path), uri, ++serial);
+    if (proxy_port)
+        c->req_len = snprintf(c->req, sizeof(c->req),
+                              "GET http://%s%s HTTP/1.1\r\nHost: %s\r\n%s\r\n", server, path,
+                              server, keepalive ? "" : "Connection: close\r\n");
+    else
+        c->req_len = snprintf(c->req, sizeof(c->req),
+                              "GET %s HTTP/1.1\r\nHost: %s\r\n%s\r\n", path,
+                              server, keepalive ? "" : "Connection: close\r\n");
+    c->req_off = 0;
+    c->len = 0;
+    c->head_done = 0;
+    c->start = start;
+    if (c->fd < 0)
+        open_conn(c);
+    else{
+        c->state = LC_SEND;
+        send_request(c);
+    }
+}
+
+/* open_conn : connect to the target without blocking */
+static void open_conn(lconn_t *c){
+    int optval = 1;
+
+    if ((c->fd = socket(target->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0)) < 0){
+        perror("socket");
+        exit(1);
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    c->state = LC_CONNECT;
+    if (connect(c->fd, target->ai_addr, target->ai_addrlen) < 0 && errno != EINPROGRESS){
+        finish(c, 0);
+        return;
+    }
+    watch(c, EPOLLOUT);
+}
+
+/* send_request : write the request once the connection is open */
+static void send_request(lconn_t *c){
+    int err = 0;
+    socklen_t len = sizeof(err);
+    ssize_t n;
+
+    if (c->state == LC_CONNECT){
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err){
+            finish(c, 0);
+            return;
+        }
+        c->state = LC_SEND;
+    }
+    while (c->req_off < c->req_len){
+        n = write(c->fd, c->req + c->req_off, c->req_len - c->req_off);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            watch(c, EPOLLOUT);
+            return;
+        }
+        if (n < 0){
+            finish(c, 0);
+            return;
+        }
+        c->req_off += n;
+    }
+    c->state = LC_READ;
+    watch(c, EPOLLIN);
+}
+
+/* read_response : read what has come of the response */
+static void read_response(lconn_t *c){
+    char *end;
+    ssize_t n;
+
+    while (1){
+        n = read(c->fd, c->buf + c->len, BUFSIZE - c->len);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0){
+            // the end of a body that runs until the server closes
+            finish(c, n == 0 && c->head_done && c->until_eof);
+            return;
+        }
+        bytes += n;
+        c->len += n;
+
+        if (!c->head_done){
+            if (!(end = memmem(c->buf, c->len, "\r\n\r\n", 4))){
+                if (c->len == BUFSIZE){
+                    finish(c, 0);
+                    return;
+                }
+                continue;
+            }
+            if (parse_head(c, end + 4 - c->buf) < 0){
+                finish(c, 0);
+                return;
+            }
+            c->head_done = 1;
+            n = c->len - (end + 4 - c->buf);
+        }
+        c->len = 0;
+        if (c->until_eof)
+            continue;
+        // anything after the body is not expected: a request is sent
+        // only when the last response is complete
+        if ((size_t)n >= c->body_left){
+            finish(c, 1);
+            return;
+        }
+        c->body_left -= n;
+    }
+}
+
+/* parse_head : the status, framing and keep-alive of a response head */
+static int parse_head(lconn_t *c, size_t head_len){
+    char *p = c->buf, *end = c->buf + head_len;
+    int length_known = 0, minor;
+
+    if (sscanf(c->buf, "HTTP/1.%d %d", &minor, &c->status) != 2)
+        return -1;
+    c->keepalive = keepalive && minor >= 1;
+    c->until_eof = 0;
+    while ((p = memchr(p, '\n', end - p)) && ++p < end){
+        if (!strncasecmp(p, "Content-Length:", 15)){
+            c->body_left = strtoul(p + 15, NULL, 10);
+            length_known = 1;
+        }
+        else if (!strncasecmp(p, "Connection:", 11)){
+            char *eol = memchr(p, '\n', end - p);
+
+            if (memmem(p, eol - p, "close", 5))
+                c->keepalive = 0;
+            else if (memmem(p, eol - p, "keep-alive", 10))
+                c->keepalive = keepalive;
+        }
+        // (chunked bodies are not handled: no server here sends one)
+        else if (!strncasecmp(p, "Transfer-Encoding:", 18))
+            return -1;
+    }
+    if (!length_known){
+        c->until_eof = 1;
+        c->keepalive = 0;
+    }
+    return 0;
+}
+
+/* finish : the request of c is over; record how it went */
+static void finish(lconn_t *c, int success){
+    done++;
+    if (success && c->status == 200){
+        ok++;
+        hist[bucket((now() - c->start) * 1e6)]++;
+    }
+    else if (success)
+        bad_status++;
+    else
+        failed++;
+
+    if (success && c->keepalive){
+        c->state = LC_IDLE;
+        watch(c, EPOLLIN);
+        return;
+    }
+    close_lconn(c);
+    c->state = LC_FREE;
+}
+
+/* close_lconn : close the socket of c */
+static void close_lconn(lconn_t *c){
+    if (c->fd >= 0)
+        close(c->fd);
+    c->fd = -1;
+}
+
+/* watch : wait for events on c (EPOLL_CTL_MOD, or ADD on a new socket) */
+static void watch(lconn_t *c, unsigned int events){
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev) < 0 &&
+        epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev) < 0){
+        perror("epoll_ctl");
+        exit(1);
+    }
+}
+
+/* bucket : the histogram bucket of a latency in microseconds */
+static int bucket(unsigned long us){
+    int shift;
+
+    if (us < 64)
+        return us;
+    shift = 63 - __builtin_clzl(us) - 5;
+    if (shift > 40)
+        return HIST_BUCKETS - 1;
+    return 64 + (shift - 1) * 32 + (int)((us >> shift) - 32);
+}
+
+/* bucket_value : the middle of a bucket, in microseconds */
+static double bucket_value(int b){
+    int shift;
+
+    if (b < 64)
+        return b + 0.5;
+    shift = (b - 64) / 32 + 1;
+    return ((double)((b - 64) % 32 + 32) + 0.5) * (1UL << shift);
+}
+
+/* percentile : the latency (ms) below which p percent of the requests were */
+static double percentile(double p){
+    unsigned long want = (unsigned long)(ok * p / 100), seen = 0;
+    int b;
+
+    for (b = 0; b < HIST_BUCKETS; b++){
+        seen += hist[b];
+        if (seen > want)
+            return bucket_value(b) / 1e3;
+    }
+    return 0;
+}
+
+/* report : print what the run did in secs seconds */
+static void report(double secs){
+    int b, max = 0;
+
+    for (b = 0; b < HIST_BUCKETS; b++)
+        if (hist[b])
+            max = b;
+    printf("requests: %ld ok, %ld not 200, %ld failed (%ld timed out)\n",
+           ok, bad_status, failed, timeouts);
+    printf("time: %.3f s, %.0f requests/s, %.1f MB/s\n",
+           secs, done / secs, bytes / secs / 1e6);
+    if (ok)
+        printf("latency (ms): p50 %.3f  p90 %.3f  p99 %.3f  p999 %.3f  max %.3f\n",
+               percentile(50), percentile(90), percentile(99), percentile(99.9),
+               bucket_value(max) / 1e3);
+}
+
+/* now : seconds on the monotonic clock */
+static double now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
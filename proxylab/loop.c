@@ -0,0 +1,1996 @@
+/*
+ * loop.c - per-core epoll event loops of the proxy
+ *
+ * Every loop has a listening socket of its own, bound to the same port
+ * with SO_REUSEPORT so that the kernel spreads new connections over the
+ * loops; in the prethreaded mode ("-A"), the loops are pinned to cores
+ * and take the connections one acceptor thread queues (acceptor.c). A
+ * loop never blocks on a connection: each connection is a small
+ * state machine (read request -> resolve -> connect -> send request ->
+ * read response head -> relay) that is advanced whenever one of its non-blocking
+ * descriptors is ready. A connection only ever lives in the loop that
+ * accepted it, so the loops share nothing but the cache.
+ *
+ * Bodies that are not cached are moved from the server to the client
+ * with splice, through a pipe of the connection, so that their bytes
+ * never reach user space. The others are read into a large buffer.
+ *
+ * Connections are persistent on both sides. After a response whose end
+ * is known (Content-Length or chunked), the server connection goes back
+ * to the pool of the loop and the client connection waits for its next
+ * request.
+ *
+ * Responses too large for the memory cache, but with a Content-Length,
+ * are also written to the disk tier if there is one ("-D", disk.c) as
+ * they are relayed, and later hits are sent from it with sendfile.
+ *
+ * Cached objects are served while they are fresh (http.c). A stale one
+ * is revalidated with a conditional request: its client waits for the
+ * 304 (or for the new response) unless the object is still within its
+ * stale-while-revalidate window, in which case it is served at once and
+ * a connection with no client revalidates it in the background.
+ *
+ * A request for an object that another connection (of any loop) is
+ * already fetching into the cache does not go to the server: it follows
+ * that fetch, and sends the bytes to its client as they arrive (fill.c).
+ *
+ * Fetches are under deadlines (proxy.h): for connecting, for the response
+ * head, and between reads of the body. All the fetches under one kind
+ * of deadline have the same timeout, so a list per kind in the order the
+ * deadlines were set is also in the order they expire, and the loop only
+ * looks at the heads to find its epoll_wait timeout. With "-E <pct>", a
+ * request whose head takes longer than that percentile of the loop's
+ * times to first byte is sent again, over a new connection to another
+ * address of the server; whichever connection answers first is kept.
+ *
+ * A loop runs at most fetch_max fetches at once ("-S"). The requests that
+ * find them all taken wait in a queue per client address (a flow), and
+ * a fetch that ends starts the first request of the next flow in turn,
+ * so a client with many connections gets no more of the loop than a
+ * client with one. Clients are also held to a number of connections and
+ * a rate of requests if "-N" and "-R" are given (clients.c).
+ *
+ * Each loop times the stages of its requests (stats.c); a request for
+ * STATS_URI is answered by the proxy itself with the sums of all loops.
+ *
+ * Pipelined requests are fetched concurrently. The requests a client has
+ * queued behind the one being served are each given a connection of
+ * their own that fetches "ahead": it has no client socket, and queues
+ * what it would send to the client (up to AHEAD_BUFSIZE bytes, then it
+ * stops reading the server). The client connection sends the queues in
+ * the order of the requests.
+ */
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
+#include <limits.h>
+#include "loop.h"
+#include "zcopy.h"
+#include "acceptor.h"
+#include "affinity.h"
+
+#define RELAY_ROUNDS 16         /* reads relayed per event before yielding */
+
+/* How fresh a cached copy is */
+enum {
+    HIT_FRESH,      /* served as it is */
+    HIT_SWR,        /* stale, served while revalidated in the background */
+    HIT_STALE       /* revalidated before it is served */
+};
+
+/* Headers left out of cached objects; hits get their own Content-Length */
+static const char *framing_headers[] = {
+    "Content-Length", "Transfer-Encoding", NULL
+};
+
+static const char *bad_gateway =
+    "HTTP/1.0 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char *too_many_conns =
+    "HTTP/1.0 429 Too Many Requests\r\nRetry-After: 1\r\nContent-Length: 0\r\n"
+    "Connection: close\r\n\r\n";
+
+static int open_listenfd_reuseport(char *port);
+static void accept_conns(loop_t *loop);
+static void adopt(loop_t *loop, int connfd, unsigned long accepted);
+static conn_t *new_conn(loop_t *loop, int fd);
+static void clear_request(conn_t *c);
+static void close_conn(conn_t *c);
+static void fail_conn(conn_t *c);
+static void read_request(conn_t *c);
+static int start_request(conn_t *c);
+static int is_stats_request(req_parser_t *rp, int *jsonp);
+static void start_stats(conn_t *c, int json);
+static void too_many(conn_t *c);
+static void start_local(conn_t *c, const char *status, const char *hdrs, char *body, size_t len);
+static void serve_local(conn_t *c);
+static void look_ahead(conn_t *c, int keepalive);
+static void send_ahead(conn_t *c);
+static void drop_ahead(conn_t *p);
+static void wake_owner(conn_t *p);
+static int queue_out(conn_t *p, char *data, size_t len, size_t *offp);
+static void fetch(conn_t *c);
+static void start_fetch(conn_t *c);
+static void end_fetch(conn_t *c);
+static void enqueue(conn_t *c);
+static void dequeue(conn_t *c);
+static void run_queued(loop_t *loop);
+static void connect_server(conn_t *c);
+static void take_woken(loop_t *loop);
+static void resolved(conn_t *c);
+static void start_connect(conn_t *c);
+static void finish_connect(conn_t *c);
+static void retry_fresh(conn_t *c);
+static void arm(conn_t *c, timer_kind_t kind);
+static void disarm(conn_t *c);
+static unsigned long timeout_ns(timer_kind_t kind);
+static int next_timeout(loop_t *loop);
+static void expire_timers(loop_t *loop);
+static void timed_out(conn_t *c, timer_kind_t kind);
+static void update_hedge(loop_t *loop, unsigned long now);
+static void start_hedge(conn_t *c);
+static void hedge_event(conn_t *c);
+static void drop_hedge(conn_t *c);
+static void send_request(conn_t *c);
+static void read_response(conn_t *c);
+static int take_body(conn_t *c, size_t n);
+static int can_splice(conn_t *c);
+static int splice_body(conn_t *c);
+static int drain_pipe(conn_t *c);
+static void relay(conn_t *c);
+static void finish_response(conn_t *c);
+static int hit_freshness(conn_t *c, time_t now);
+static char *cached_head(conn_t *c, size_t *lenp);
+static void serve_cached(conn_t *c);
+static void drop_cached(conn_t *c);
+static void revalidate_later(conn_t *c, strview_t path);
+static void revalidated(conn_t *c, freshness_t *f, time_t now);
+static void set_expiry(conn_t *c, freshness_t *f, time_t now);
+static void release_server(conn_t *c);
+static void serve_hit(conn_t *c);
+static void serve_disk(conn_t *c);
+static void follow(conn_t *c);
+static void drop_fill(conn_t *c);
+static void next_request(conn_t *c);
+static int write_out(conn_t *c, char *data, size_t len, size_t *offp);
+static int write_pair(conn_t *c, char *head, size_t head_len, size_t *head_offp,
+                      char *body, size_t body_len, size_t *body_offp);
+static char *make_head(char *hdr, size_t hdr_len, int keepalive, size_t *lenp);
+static void keep_copy(void *arg, char *data, size_t n);
+static void start_fill(conn_t *c);
+static void start_disk(conn_t *c);
+static void cache_response(conn_t *c);
+
+/* loop_init : create the epoll instance and the listening socket of a
+ * loop; with no port, the loop is handed its connections by the acceptor */
+void loop_init(loop_t *loop, int id, char *port){
+    loop->id = id;
+    loop->cpu = -1;
+    loop->dead = NULL;
+    pool_init(&loop->pool);
+    if ((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("epoll_create1 error");
+
+    loop->listen.fd = -1;
+    loop->listen.kind = EP_LISTEN;
+    loop->listen.events = 0;
+    loop->listen.conn = NULL;
+    if (port){
+        if ((loop->listen.fd = open_listenfd_reuseport(port)) < 0)
+            unix_error("Open_listenfd error");
+        set_events(loop, &loop->listen, EPOLLIN);
+    }
+
+    if ((loop->notify.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        unix_error("eventfd error");
+    loop->notify.kind = EP_NOTIFY;
+    loop->notify.events = 0;
+    loop->notify.conn = NULL;
+    set_events(loop, &loop->notify, EPOLLIN);
+    loop->woken = NULL;
+    pthread_mutex_init(&loop->woken_lock, NULL);
+    stats_register(&loop->stats);
+    memset(loop->timers, 0, sizeof(loop->timers));
+    loop->hedge_after = loop->hedge_taken = 0;
+    loop->fetching = 0;
+    loop->flows = loop->flows_tail = NULL;
+    memset(loop->flow_buckets, 0, sizeof(loop->flow_buckets));
+}
+
+/* loop_wake : hand a connection that waited for another thread (its lookup
+ * is done, or the fill it follows has more) back to its loop */
+void loop_wake(loop_t *loop, conn_t *c){
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&loop->woken_lock);
+    c->next_woken = loop->woken;
+    loop->woken = c;
+    pthread_mutex_unlock(&loop->woken_lock);
+    if (write(loop->notify.fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        unix_error("eventfd write error");
+}
+
+/* loop_run : wait for ready descriptors and advance their connections */
+void *loop_run(void *vargp){
+    loop_t *loop = (loop_t *)vargp;
+    struct epoll_event events[MAX_EVENTS];
+    int i, n, rc;
+
+    if (loop->cpu >= 0 && (rc = pin_thread(loop->cpu)) != 0)
+        fprintf(stderr, "loop %d not pinned to cpu %d: %s\n", loop->id, loop->cpu,
+                strerror(rc));
+    while(1){
+        if ((n = epoll_wait(loop->epfd, events, MAX_EVENTS, next_timeout(loop))) < 0){
+            if (errno != EINTR)
+                unix_error("epoll_wait error");
+            n = 0;
+        }
+        // SIGUSR1 interrupts one of the loops; the first to see it reports
+        if (print_stats && __atomic_exchange_n(&print_stats, 0, __ATOMIC_RELAXED)){
+            cache_print_stats(stderr);
+            disk_print_stats(stderr);
+            fill_print_stats(stderr);
+            resolver_print_stats(stderr);
+            acceptor_print_stats(stderr);
+            clients_print_stats(stderr);
+        }
+
+        for (i = 0; i < n; i++){
+            endpoint_t *ep = events[i].data.ptr;
+            conn_t *c = ep->conn;
+
+            if (ep->kind == EP_LISTEN){
+                accept_conns(loop);
+                continue;
+            }
+            if (ep->kind == EP_IDLE){
+                pool_event(loop, (idle_t *)ep);
+                continue;
+            }
+            if (ep->kind == EP_NOTIFY){
+                take_woken(loop);
+                continue;
+            }
+            // closed by an earlier event of this batch
+            if (c->state == ST_CLOSED)
+                continue;
+            if (ep->kind == EP_HEDGE){
+                if (c->hedge.fd >= 0)
+                    hedge_event(c);
+                continue;
+            }
+
+            switch (c->state){
+            case ST_READ_REQ:
+                read_request(c);
+                break;
+            case ST_CONNECT:
+                finish_connect(c);
+                break;
+            case ST_SEND_REQ:
+                send_request(c);
+                break;
+            case ST_READ_RESP:
+                read_response(c);
+                break;
+            case ST_RELAY:
+                relay(c);
+                break;
+            case ST_SERVE_HIT:
+                serve_hit(c);
+                break;
+            case ST_SERVE_DISK:
+                serve_disk(c);
+                break;
+            case ST_SERVE_LOCAL:
+                serve_local(c);
+                break;
+            case ST_FOLLOW:
+                follow(c);
+                break;
+            case ST_PIPELINED:
+                send_ahead(c);
+                break;
+            default:
+                break;
+            }
+        }
+        expire_timers(loop);
+        run_queued(loop);
+        // events of the batch may still point into closed connections
+        while (loop->dead){
+            conn_t *c = loop->dead;
+            loop->dead = c->next_dead;
+            if (c->q)
+                Free(c->q);
+            Free(c);
+        }
+        pool_free_dead(&loop->pool);
+    }
+    return NULL;
+}
+
+/* set_events : change the events epoll reports for a descriptor (0: none) */
+void set_events(loop_t *loop, endpoint_t *ep, unsigned int events){
+    struct epoll_event ev;
+    int op;
+
+    if (ep->events == events)
+        return;
+    if (!ep->events)
+        op = EPOLL_CTL_ADD;
+    else if (!events)
+        op = EPOLL_CTL_DEL;
+    else
+        op = EPOLL_CTL_MOD;
+
+    ev.events = events;
+    ev.data.ptr = ep;
+    if (epoll_ctl(loop->epfd, op, ep->fd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    ep->events = events;
+}
+
+/* open_listenfd_reuseport : open_listenfd with SO_REUSEPORT, non-blocking */
+static int open_listenfd_reuseport(char *port){
+    struct addrinfo hints, *listp, *p;
+    int listenfd, rc, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    if ((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0){
+        fprintf(stderr, "getaddrinfo failed (port %s): %s\n", port, gai_strerror(rc));
+        return -2;
+    }
+
+    for (p = listp; p; p = p->ai_next){
+        listenfd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                          p->ai_protocol);
+        if (listenfd < 0)
+            continue;
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+        // every loop binds the same port; the kernel balances between them
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int));
+        if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(listenfd);
+    }
+    freeaddrinfo(listp);
+    if (!p)
+        return -1;
+
+    if (listen(listenfd, LISTENQ) < 0){
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
+
+/* accept_conns : accept every pending connection and start reading it */
+static void accept_conns(loop_t *loop){
+    unsigned long start = stats_now();
+    int connfd;
+
+    while((connfd = accept(loop->listen.fd, NULL, NULL)) >= 0){
+        adopt(loop, connfd, start);
+        start = stats_now();
+    }
+    // running out of descriptors only delays the remaining connections
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+        errno != ECONNABORTED)
+        fprintf(stderr, "accept error: %s\n", strerror(errno));
+}
+
+/* adopt : serve the client socket connfd in loop, accepted at accepted
+ * (stats_now, 0 if not known) */
+static void adopt(loop_t *loop, int connfd, unsigned long accepted){
+    struct sockaddr_storage sa;
+    socklen_t len = sizeof(sa);
+    client_t *cl = NULL;
+    int optval = 1, refused;
+    conn_t *c;
+
+    // (accept4 needs _GNU_SOURCE, whose gai_error clashes with csapp.h)
+    if (fcntl(connfd, F_SETFL, O_NONBLOCK) < 0){
+        close(connfd);
+        return;
+    }
+    // a response goes out in several writes (head, then body, or the
+    // queues of pipelined responses): Nagle would hold each one back
+    // until the client acknowledges the last, which it delays
+    setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    // the connections of a client are counted, and its requests queued, together
+    if (getpeername(connfd, (SA *)&sa, &len) == 0 && !(cl = client_open((SA *)&sa, &refused)) &&
+        refused){
+        // best effort, like the 502
+        write(connfd, too_many_conns, strlen(too_many_conns));
+        close(connfd);
+        return;
+    }
+    c = new_conn(loop, connfd);
+    c->cl = cl;
+    set_events(loop, &c->client, EPOLLIN);
+    if (accepted)
+        stats_record(&loop->stats, STAGE_ACCEPT, stats_now() - accepted);
+}
+
+/* new_conn : a connection for the client socket fd (-1 for a request
+ * fetched ahead), waiting for a request */
+static conn_t *new_conn(loop_t *loop, int fd){
+    conn_t *c = (conn_t *)Malloc(sizeof(conn_t));
+
+    memset(c, 0, sizeof(conn_t));
+    c->state = ST_READ_REQ;
+    c->loop = loop;
+    c->client.fd = fd;
+    c->client.kind = EP_CLIENT;
+    c->client.conn = c;
+    c->server.fd = -1;
+    c->server.kind = EP_SERVER;
+    c->server.conn = c;
+    c->hedge.fd = -1;
+    c->hedge.kind = EP_HEDGE;
+    c->hedge.conn = c;
+    c->timer = TM_NONE;
+    c->pipe[0] = c->pipe[1] = -1;
+    req_init(&c->rp);
+    return c;
+}
+
+/* clear_request : release what was allocated for the current request */
+static void clear_request(conn_t *c){
+    if (c->host)
+        Free(c->host);
+    if (c->pool_key)
+        Free(c->pool_key);
+    if (c->out)
+        Free(c->out);
+    if (c->resp.hdr)
+        Free(c->resp.hdr);
+    if (c->head)
+        Free(c->head);
+    if (c->key)
+        Free(c->key);
+    drop_cached(c);
+    if (c->dw)
+        disk_abort(c->dw);
+    if (c->obj)
+        Free(c->obj);
+    drop_fill(c);
+    disarm(c);
+    drop_hedge(c);
+    end_fetch(c);
+    if (c->flow)
+        dequeue(c);
+    c->hedged = 0;
+    c->host = c->pool_key = c->out = c->head = c->key = c->obj = NULL;
+    c->resp.hdr = NULL;
+    c->addrs.n = c->addr_i = 0;
+    c->dw = NULL;
+    c->out_len = c->out_off = 0;
+    c->head_len = c->head_off = 0;
+    c->buf_len = c->buf_off = 0;
+    c->piped = 0;
+    c->relayed = 0;
+    c->hit_off = 0;
+    c->obj_len = c->obj_cap = 0;
+    c->reused = 0;
+    c->cacheable = 0;
+}
+
+/* close_conn : close both sides of a connection; it is freed after the
+ * batch, or for a request fetched ahead, once its queue was sent */
+static void close_conn(conn_t *c){
+    // close() also takes the descriptors out of the epoll set; the
+    // requests fetched ahead only borrow the client of theirs
+    if (c->client.fd >= 0){
+        close(c->client.fd);
+        client_close(c->cl);
+    }
+    if (c->server.fd >= 0)
+        close(c->server.fd);
+    if (c->pipe[0] >= 0){
+        close(c->pipe[0]);
+        close(c->pipe[1]);
+    }
+    if (c->buf)
+        Free(c->buf);
+    c->buf = NULL;
+    clear_request(c);
+    // the requests fetched ahead are not wanted any more
+    if (c->sending)
+        drop_ahead(c->sending);
+    c->sending = NULL;
+    while (c->ahead){
+        conn_t *p = c->ahead;
+
+        c->ahead = p->next_ahead;
+        drop_ahead(p);
+    }
+    c->state = ST_CLOSED;
+    if (c->owner){
+        wake_owner(c);
+        return;
+    }
+    c->next_dead = c->loop->dead;
+    c->loop->dead = c;
+}
+
+/* fail_conn : tell the client that the server could not be used, unless
+ * part of a response was sent already, and close the connection */
+static void fail_conn(conn_t *c){
+    size_t off = 0;
+
+    // best effort: the client has not been sent anything it must read first
+    if (c->state != ST_RELAY && c->state != ST_SERVE_HIT && c->state != ST_SERVE_DISK){
+        if (c->owner)
+            queue_out(c, (char *)bad_gateway, strlen(bad_gateway), &off);
+        else if (!c->background)
+            write(c->client.fd, bad_gateway, strlen(bad_gateway));
+    }
+    close_conn(c);
+}
+
+/* read_request : read the next request up to the empty line, serve it from
+ * the cache or send it to the server */
+static void read_request(conn_t *c){
+    ssize_t n;
+    int rc;
+
+    // a request may already be waiting behind the previous one; the
+    // parser goes on from where the last read stopped
+    if (!c->t_req && c->req_len)
+        c->t_req = stats_now();
+    while ((rc = req_parse(&c->rp, c->req, c->req_len)) == REQ_PARTIAL){
+        if (c->req_len == REQ_BUFSIZE){
+            // headers too long for the buffer
+            close_conn(c);
+            return;
+        }
+        n = read(c->client.fd, c->req + c->req_len, REQ_BUFSIZE - c->req_len);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0){
+            close_conn(c);
+            return;
+        }
+        c->req_len += n;
+        if (!c->t_req)
+            c->t_req = stats_now();
+    }
+    if (rc == REQ_ERROR){
+        close_conn(c);
+        return;
+    }
+    c->req_end = c->rp.head_len;
+    stats_record(&c->loop->stats, STAGE_PARSE, stats_now() - c->t_req);
+    stats_count(&c->loop->stats.requests, 1);
+    c->t_req = 0;
+    // over the rate of its client: the client is told to come back
+    if (!client_admit(c->cl)){
+        too_many(c);
+        return;
+    }
+
+    // the requests queued behind this one are fetched meanwhile
+    look_ahead(c, req_keepalive(&c->rp));
+    if (start_request(c) < 0)
+        close_conn(c);
+}
+
+/* start_request : serve the parsed request from the cache or send it to
+ * the server. Return -1 if it cannot be served. A request fetched ahead
+ * is only sent to the server; return 1 if it is left to the client
+ * connection instead (it is cached, or being fetched already). */
+static int start_request(conn_t *c){
+    strview_t host, port, path, *host_hdr;
+    char *cond = NULL, *hdr;
+    size_t hdr_len;
+    unsigned long start;
+    int fresh, json;
+
+    // Only 'GET' method is implemented in this lab
+    if (!sv_caseeq(c->rp.method, "GET")){
+        if (!c->owner)
+            printf("%.*s is not implemented\n", (int)c->rp.method.len, c->rp.method.p);
+        return -1;
+    }
+    // the proxy answers this one itself
+    if (is_stats_request(&c->rp, &json)){
+        if (c->owner)
+            return 1;
+        start_stats(c, json);
+        return 0;
+    }
+    // e.g. "http://localhost:12345/home.html"; a bare path is on the
+    // server named by the Host header
+    req_split_uri(c->rp.uri, &host, &port, &path);
+    if (!host.len && (host_hdr = req_header(&c->rp, "Host")))
+        req_split_host(*host_hdr, &host, &port);
+    if (!host.len || port.len >= sizeof(c->portn))
+        return -1;
+    c->keepalive = req_keepalive(&c->rp);
+    c->host = (char *)Malloc(host.len + 1);
+    memcpy(c->host, host.p, host.len);
+    c->host[host.len] = 0;
+    memcpy(c->portn, port.p, port.len);
+    c->portn[port.len] = 0;
+
+    // nothing more is read from the client until the response is sent
+    set_events(c->loop, &c->client, 0);
+
+    // a cached copy is served without contacting the server
+    c->key = cache_key(c->host, c->portn, path.p, path.len);
+    if (c->owner){
+        if (cache_contains(c->key) || disk_contains(c->key))
+            return 1;
+    }
+    else{
+        start = stats_now();
+        if (!(c->hit = cache_lookup(c->key)))
+            c->dhit = disk_lookup(c->key);
+        stats_record(&c->loop->stats, STAGE_LOOKUP, stats_now() - start);
+    }
+    if (c->hit || c->dhit){
+        fresh = hit_freshness(c, time(NULL));
+        if (fresh != HIT_STALE){
+            if (fresh == HIT_SWR)
+                revalidate_later(c, path);
+            serve_cached(c);
+            return 0;
+        }
+        // too stale to serve: ask the server if it is still current
+        hdr = cached_head(c, &hdr_len);
+        if ((cond = make_conditional(hdr, hdr_len)))
+            c->reval = 1;
+        else
+            drop_cached(c);
+    }
+    c->out = build_request(&c->rp, c->host, path, cond, &c->out_len);
+    c->pool_key = cache_key(c->host, c->portn, "", 0);
+    if (cond)
+        Free(cond);
+    if (c->reval){
+        fetch(c);
+        return 0;
+    }
+
+    // an object already being fetched is not fetched again
+    c->fill = fill_join(c->key, &c->filling);
+    if (!c->filling){
+        if (c->owner)
+            return 1;
+        c->state = ST_FOLLOW;
+        follow(c);
+        return 0;
+    }
+    fetch(c);
+    return 0;
+}
+
+/* is_stats_request : true if the request is for STATS_URI; *jsonp tells
+ * if it asks for JSON ("?json" or Accept: application/json) */
+static int is_stats_request(req_parser_t *rp, int *jsonp){
+    size_t n = strlen(STATS_URI);
+    strview_t *accept;
+    const char *q;
+
+    if (rp->uri.len < n || memcmp(rp->uri.p, STATS_URI, n) ||
+        (rp->uri.len > n && rp->uri.p[n] != '?'))
+        return 0;
+    *jsonp = 0;
+    for (q = rp->uri.p + n; q + 4 <= rp->uri.p + rp->uri.len; q++)
+        if (!memcmp(q, "json", 4))
+            *jsonp = 1;
+    if ((accept = req_header(rp, "Accept")))
+        for (q = accept->p; q + 16 <= accept->p + accept->len; q++)
+            if (!strncasecmp(q, "application/json", 16))
+                *jsonp = 1;
+    return 1;
+}
+
+/* start_stats : answer with the statistics of the proxy */
+static void start_stats(conn_t *c, int json){
+    char *body;
+    size_t len;
+
+    body = stats_report(json, &len);
+    start_local(c, "200 OK", json ? "Content-Type: application/json\r\nCache-Control: no-store\r\n" :
+                "Content-Type: text/plain\r\nCache-Control: no-store\r\n", body, len);
+}
+
+/* too_many : answer a request over the rate of its client */
+static void too_many(conn_t *c){
+    const char *msg = "Too many requests\n";
+    char *body = (char *)Malloc(strlen(msg));
+
+    memcpy(body, msg, strlen(msg));
+    start_local(c, "429 Too Many Requests", "Content-Type: text/plain\r\nRetry-After: 1\r\n",
+                body, strlen(msg));
+}
+
+/* start_local : answer the request with a response of the proxy itself:
+ * the status, the headers in hdrs and the malloc'ed body of len bytes */
+static void start_local(conn_t *c, const char *status, const char *hdrs, char *body, size_t len){
+    char hdr[256];
+    size_t n;
+
+    c->keepalive = req_keepalive(&c->rp);
+    set_events(c->loop, &c->client, 0);
+    c->obj = body;
+    c->obj_len = len;
+    n = snprintf(hdr, sizeof(hdr), "HTTP/1.1 %s\r\n%sContent-Length: %zu\r\n", status, hdrs, len);
+    c->head = make_head(hdr, n, c->keepalive, &c->head_len);
+    c->head_off = c->hit_off = 0;
+    c->state = ST_SERVE_LOCAL;
+    serve_local(c);
+}
+
+/* serve_local : send the response of the proxy to the client */
+static void serve_local(conn_t *c){
+    if (write_pair(c, c->head, c->head_len, &c->head_off, c->obj, c->obj_len, &c->hit_off) <= 0)
+        return;
+    next_request(c);
+}
+
+/* look_ahead : start fetching the complete requests queued in c->req
+ * behind those already started, keepalive telling if the last of those
+ * lets more follow */
+static void look_ahead(conn_t *c, int keepalive){
+    conn_t *p, **tail;
+    req_parser_t rp;
+    int n = 0, rc;
+
+    for (tail = &c->ahead; *tail; tail = &(*tail)->next_ahead){
+        keepalive = (*tail)->keepalive;
+        n++;
+    }
+    if (c->ahead_end < c->req_end)
+        c->ahead_end = c->req_end;
+
+    while (keepalive && n < AHEAD_MAX){
+        req_init(&rp);
+        if (req_parse(&rp, c->req + c->ahead_end, c->req_len - c->ahead_end) != REQ_DONE)
+            return;
+        // the token of a request left to the client connection is taken there
+        if (!client_admit(c->cl))
+            return;
+        p = new_conn(c->loop, -1);
+        p->owner = c;
+        p->cl = c->cl;
+        memcpy(p->req, c->req + c->ahead_end, rp.head_len);
+        p->req_len = p->req_end = rp.head_len;
+        c->ahead_end += rp.head_len;
+        *tail = p;
+        tail = &p->next_ahead;
+        n++;
+
+        req_parse(&p->rp, p->req, p->req_len);
+        if ((rc = start_request(p)) != 0){
+            p->state = ST_AHEAD_SKIP;
+            client_refund(c->cl);
+        }
+        else
+            stats_count(&c->loop->stats.requests, 1);
+        // the client connection will fail on a bad request; none follow
+        if (rc < 0)
+            return;
+        keepalive = p->keepalive;
+    }
+}
+
+/* send_ahead : send the response queued by the request fetched ahead, as
+ * far as it is in, and go on with the next request when it is all sent */
+static void send_ahead(conn_t *c){
+    conn_t *p = c->sending;
+
+    while(1){
+        if (write_out(c, p->q, p->q_len, &p->q_off) <= 0)
+            return;
+        p->q_len = p->q_off = 0;
+        if (p->state == ST_AHEAD_DONE){
+            c->keepalive = p->keepalive;
+            c->sending = NULL;
+            drop_ahead(p);
+            next_request(c);
+            return;
+        }
+        // the response was cut short (or a 502 was queued): close too
+        if (p->state == ST_CLOSED){
+            close_conn(c);
+            return;
+        }
+        if (!p->stalled)
+            break;
+        // there is room in the queue again
+        p->stalled = 0;
+        relay(p);
+    }
+    // wait until p queues more
+    set_events(c->loop, &c->client, 0);
+}
+
+/* drop_ahead : let go of a request fetched ahead */
+static void drop_ahead(conn_t *p){
+    p->owner = NULL;
+    if (p->state == ST_RESOLVE){
+        // the resolver still holds it: it is closed when handed back
+        p->abandoned = 1;
+        return;
+    }
+    if (p->state != ST_CLOSED){
+        close_conn(p);
+        return;
+    }
+    p->next_dead = p->loop->dead;
+    p->loop->dead = p;
+}
+
+/* wake_owner : p queued more, or is done; make sure its client connection
+ * looks at it if it is sending its response */
+static void wake_owner(conn_t *p){
+    if (p->owner && p->owner->sending == p)
+        set_events(p->loop, &p->owner->client, EPOLLOUT);
+}
+
+/* queue_out : write_out for a request fetched ahead: queue the data for the
+ * client connection. When the queue is full, stop reading the server until
+ * the client connection has sent it. */
+static int queue_out(conn_t *p, char *data, size_t len, size_t *offp){
+    size_t n = len - *offp;
+
+    if (!p->q)
+        p->q = (char *)Malloc(AHEAD_BUFSIZE);
+    if (n > AHEAD_BUFSIZE - p->q_len)
+        n = AHEAD_BUFSIZE - p->q_len;
+    memcpy(p->q + p->q_len, data + *offp, n);
+    p->q_len += n;
+    *offp += n;
+    if (n)
+        wake_owner(p);
+    if (*offp < len){
+        p->stalled = 1;
+        if (p->server.fd >= 0)
+            set_events(p->loop, &p->server, 0);
+        return 0;
+    }
+    return 1;
+}
+
+/* fetch : send the request to the server, or wait for a turn if the
+ * loop runs all the fetches it may */
+static void fetch(conn_t *c){
+    // behind the requests already waiting, if any
+    if (c->loop->fetching >= fetch_max || c->loop->flows){
+        enqueue(c);
+        return;
+    }
+    start_fetch(c);
+}
+
+/* start_fetch : send the request to the server, as one of the loop's fetches */
+static void start_fetch(conn_t *c){
+    c->fetching = 1;
+    c->loop->fetching++;
+    // kept for the following requests of the connection
+    if (!c->buf)
+        c->buf = (char *)Malloc(RELAY_BUFSIZE);
+
+    // reuse an idle connection to the server if there is one
+    if ((c->server.fd = pool_get(c->loop, c->pool_key)) >= 0){
+        c->reused = 1;
+        c->server.events = 0;
+        c->state = ST_SEND_REQ;
+        arm(c, TM_TTFB);
+        send_request(c);
+        return;
+    }
+    connect_server(c);
+}
+
+/* end_fetch : the request no longer holds a fetch of the loop */
+static void end_fetch(conn_t *c){
+    if (!c->fetching)
+        return;
+    c->fetching = 0;
+    c->loop->fetching--;
+}
+
+/* enqueue : make c wait for a fetch, behind the other requests of its client */
+static void enqueue(conn_t *c){
+    loop_t *loop = c->loop;
+    flow_t **bucket = &loop->flow_buckets[((unsigned long)c->cl / sizeof(client_t)) % FLOW_BUCKETS];
+    flow_t *f;
+
+    for (f = *bucket; f && f->cl != c->cl; f = f->hnext)
+        ;
+    // a client with nothing waiting yet goes last
+    if (!f){
+        f = (flow_t *)Malloc(sizeof(flow_t));
+        f->cl = c->cl;
+        f->head = f->tail = NULL;
+        f->hnext = *bucket;
+        *bucket = f;
+        f->next = NULL;
+        f->prev = loop->flows_tail;
+        if (f->prev)
+            f->prev->next = f;
+        else
+            loop->flows = f;
+        loop->flows_tail = f;
+    }
+    c->flow = f;
+    c->qnext = NULL;
+    c->qprev = f->tail;
+    if (c->qprev)
+        c->qprev->qnext = c;
+    else
+        f->head = c;
+    f->tail = c;
+    c->state = ST_QUEUED;
+    set_events(loop, &c->client, 0);
+    stats_count(&loop->stats.queued, 1);
+}
+
+/* dequeue : take c out of the queue of its client, and the client out of
+ * the turns if it has nothing left waiting */
+static void dequeue(conn_t *c){
+    loop_t *loop = c->loop;
+    flow_t *f = c->flow, **pp;
+
+    if (c->qprev)
+        c->qprev->qnext = c->qnext;
+    else
+        f->head = c->qnext;
+    if (c->qnext)
+        c->qnext->qprev = c->qprev;
+    else
+        f->tail = c->qprev;
+    c->flow = NULL;
+    if (f->head)
+        return;
+
+    for (pp = &loop->flow_buckets[((unsigned long)f->cl / sizeof(client_t)) % FLOW_BUCKETS];
+         *pp != f; pp = &(*pp)->hnext)
+        ;
+    *pp = f->hnext;
+    if (f->prev)
+        f->prev->next = f->next;
+    else
+        loop->flows = f->next;
+    if (f->next)
+        f->next->prev = f->prev;
+    else
+        loop->flows_tail = f->prev;
+    Free(f);
+}
+
+/* run_queued : start as many waiting requests as there are fetches free,
+ * one of each client in turn */
+static void run_queued(loop_t *loop){
+    flow_t *f;
+    conn_t *c;
+
+    while (loop->fetching < fetch_max && (f = loop->flows)){
+        c = f->head;
+        // the client goes to the back of the line
+        if (c->qnext && f->next){
+            loop->flows = f->next;
+            loop->flows->prev = NULL;
+            f->prev = loop->flows_tail;
+            f->next = NULL;
+            loop->flows_tail->next = f;
+            loop->flows_tail = f;
+        }
+        dequeue(c);
+        start_fetch(c);
+    }
+}
+
+/* connect_server : look up the server and start connecting to it */
+static void connect_server(conn_t *c){
+    // the lookup has deadlines of its own (resolver.c)
+    disarm(c);
+    c->state = ST_RESOLVE;
+    c->t_stage = stats_now();
+    if (resolve(c, c->pool_key, c->host, c->portn))
+        resolved(c);
+}
+
+/* take_woken : go on with the connections handed back by other threads,
+ * and take those the acceptor queued */
+static void take_woken(loop_t *loop){
+    uint64_t n;
+    conn_t *c, *next;
+    unsigned long accepted;
+    int connfd;
+
+    if (read(loop->notify.fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        unix_error("eventfd read error");
+    pthread_mutex_lock(&loop->woken_lock);
+    c = loop->woken;
+    loop->woken = NULL;
+    pthread_mutex_unlock(&loop->woken_lock);
+
+    for (; c; c = next){
+        next = c->next_woken;
+        if (c->state == ST_RESOLVE)
+            resolved(c);
+        else
+            follow(c);
+    }
+    while ((connfd = acceptor_take(&accepted)) >= 0)
+        adopt(loop, connfd, accepted);
+}
+
+/* resolved : the addresses of the server are known (or not) */
+static void resolved(conn_t *c){
+    if (c->abandoned){
+        close_conn(c);
+        return;
+    }
+    stats_record(&c->loop->stats, STAGE_RESOLVE, stats_now() - c->t_stage);
+    if (c->resolve_err){
+        fail_conn(c);
+        return;
+    }
+    c->t_stage = stats_now();
+    c->addr_i = 0;
+    start_connect(c);
+}
+
+/* start_connect : begin a non-blocking connect to the next server address */
+static void start_connect(conn_t *c){
+    for (; c->addr_i < c->addrs.n; c->addr_i++){
+        int fd = socket(c->addrs.a[c->addr_i].family,
+                        SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+            continue;
+        c->server.fd = fd;
+        c->server.events = 0;
+        if (connect(fd, (SA *)&c->addrs.a[c->addr_i].sa, c->addrs.a[c->addr_i].len) == 0){
+            stats_record(&c->loop->stats, STAGE_CONNECT, stats_now() - c->t_stage);
+            c->state = ST_SEND_REQ;
+            arm(c, TM_TTFB);
+            set_events(c->loop, &c->server, EPOLLOUT);
+            return;
+        }
+        if (errno == EINPROGRESS){
+            // writable once the connection is established or has failed
+            c->state = ST_CONNECT;
+            arm(c, TM_CONNECT);
+            set_events(c->loop, &c->server, EPOLLOUT);
+            return;
+        }
+        close(fd);
+        c->server.fd = -1;
+    }
+    // no address worked
+    fail_conn(c);
+}
+
+/* finish_connect : check the outcome of a connect, else try the next address */
+static void finish_connect(conn_t *c){
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(c->server.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        err = errno;
+    if (err){
+        close(c->server.fd);
+        c->server.fd = -1;
+        c->addr_i++;
+        start_connect(c);
+        return;
+    }
+    stats_record(&c->loop->stats, STAGE_CONNECT, stats_now() - c->t_stage);
+    c->state = ST_SEND_REQ;
+    arm(c, TM_TTFB);
+    send_request(c);
+}
+
+/* retry_fresh : the pooled connection turned out to be closed by the
+ * server; send the request again over a new connection */
+static void retry_fresh(conn_t *c){
+    drop_hedge(c);
+    close(c->server.fd);
+    c->server.fd = -1;
+    c->server.events = 0;
+    c->reused = 0;
+    c->out_off = 0;
+    c->buf_len = 0;
+    connect_server(c);
+}
+
+/* arm : put the fetch under a deadline of that kind, from now on */
+static void arm(conn_t *c, timer_kind_t kind){
+    loop_t *loop = c->loop;
+
+    disarm(c);
+    c->timer = kind;
+    c->armed = stats_now();
+    c->tnext = NULL;
+    c->tprev = loop->timers[kind].tail;
+    if (c->tprev)
+        c->tprev->tnext = c;
+    else
+        loop->timers[kind].head = c;
+    loop->timers[kind].tail = c;
+}
+
+/* disarm : take the fetch out of its deadline, if it has one */
+static void disarm(conn_t *c){
+    loop_t *loop = c->loop;
+
+    if (c->timer == TM_NONE)
+        return;
+    if (c->tprev)
+        c->tprev->tnext = c->tnext;
+    else
+        loop->timers[c->timer].head = c->tnext;
+    if (c->tnext)
+        c->tnext->tprev = c->tprev;
+    else
+        loop->timers[c->timer].tail = c->tprev;
+    c->timer = TM_NONE;
+}
+
+/* timeout_ns : the timeout of a kind of deadline */
+static unsigned long timeout_ns(timer_kind_t kind){
+    int s = kind == TM_CONNECT ? connect_timeout : kind == TM_TTFB ? ttfb_timeout : idle_timeout;
+
+    return s * 1000000000UL;
+}
+
+/* next_timeout : ms until the next deadline or hedge of the loop, or -1 */
+static int next_timeout(loop_t *loop){
+    unsigned long now = stats_now(), due = ULONG_MAX;
+    conn_t *c;
+    int kind;
+
+    for (kind = 0; kind < NTIMERS; kind++)
+        if ((c = loop->timers[kind].head) && c->armed + timeout_ns(kind) < due)
+            due = c->armed + timeout_ns(kind);
+    // the oldest request that was not hedged is the next to be
+    if (loop->hedge_after)
+        for (c = loop->timers[TM_TTFB].head; c; c = c->tnext)
+            if (!c->hedged){
+                if (c->armed + loop->hedge_after < due)
+                    due = c->armed + loop->hedge_after;
+                break;
+            }
+    if (due == ULONG_MAX)
+        return -1;
+    return due <= now ? 0 : (due - now + 999999) / 1000000;
+}
+
+/* expire_timers : end the fetches past their deadline, and hedge those
+ * past the percentile */
+static void expire_timers(loop_t *loop){
+    unsigned long now = stats_now();
+    conn_t *c, *next;
+    int kind;
+
+    for (kind = 0; kind < NTIMERS; kind++)
+        while ((c = loop->timers[kind].head) && c->armed + timeout_ns(kind) <= now){
+            // not idle: the server is not read while the client is slow
+            if (kind == TM_IDLE && !(c->server.events & EPOLLIN)){
+                arm(c, TM_IDLE);
+                continue;
+            }
+            disarm(c);
+            stats_count(&loop->stats.timeouts, 1);
+            timed_out(c, kind);
+        }
+
+    update_hedge(loop, now);
+    if (!loop->hedge_after)
+        return;
+    for (c = loop->timers[TM_TTFB].head; c && c->armed + loop->hedge_after <= now; c = next){
+        next = c->tnext;
+        if (!c->hedged)
+            start_hedge(c);
+    }
+}
+
+/* timed_out : the fetch of c is past a deadline of that kind */
+static void timed_out(conn_t *c, timer_kind_t kind){
+    switch (kind){
+    case TM_CONNECT:
+        // as if the connect had failed: try the next address
+        close(c->server.fd);
+        c->server.fd = -1;
+        c->addr_i++;
+        start_connect(c);
+        break;
+    case TM_TTFB:
+        fail_conn(c);
+        break;
+    default:
+        // a response cut short is passed on by closing the client too
+        close_conn(c);
+        break;
+    }
+}
+
+/* update_hedge : take the percentile of the times to first byte that
+ * requests are hedged after, at most every HEDGE_REFRESH_MS */
+static void update_hedge(loop_t *loop, unsigned long now){
+    hist_t *h = &loop->stats.stages[STAGE_TTFB];
+    unsigned long after;
+
+    if (!hedge_pct || now < loop->hedge_taken + HEDGE_REFRESH_MS * 1000000UL)
+        return;
+    loop->hedge_taken = now;
+    if (h->count < HEDGE_MIN_SAMPLES)
+        return;
+    after = stats_percentile(h, hedge_pct);
+    loop->hedge_after = after > HEDGE_MIN_MS * 1000000UL ? after : HEDGE_MIN_MS * 1000000UL;
+}
+
+/* start_hedge : the server is slow to send the response head: send the
+ * request again over a new connection, to another of its addresses if it
+ * has more than one */
+static void start_hedge(conn_t *c){
+    struct sockaddr_storage peer;
+    socklen_t len = sizeof(peer);
+    int i = 0, fd;
+
+    c->hedged = 1;
+    if (c->state != ST_READ_RESP || c->buf_len)
+        return;
+    // a pooled connection was not looked up: the answer may be cached
+    if (!c->addrs.n && !resolve_cached(c->pool_key, c->host, c->portn, &c->addrs))
+        return;
+    if (getpeername(c->server.fd, (SA *)&peer, &len) == 0)
+        for (i = 0; i < c->addrs.n; i++)
+            if (c->addrs.a[i].len != len || memcmp(&c->addrs.a[i].sa, &peer, len))
+                break;
+    if (i == c->addrs.n)
+        i = 0;
+
+    fd = socket(c->addrs.a[i].family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return;
+    if (connect(fd, (SA *)&c->addrs.a[i].sa, c->addrs.a[i].len) < 0 && errno != EINPROGRESS){
+        close(fd);
+        return;
+    }
+    // the request is sent once it is connected
+    c->hedge.fd = fd;
+    c->hedge.events = 0;
+    set_events(c->loop, &c->hedge, EPOLLOUT);
+    stats_count(&c->loop->stats.hedged, 1);
+}
+
+/* hedge_event : the hedge is connected, or has an answer */
+static void hedge_event(conn_t *c){
+    int err = 0;
+    socklen_t len = sizeof(err);
+    ssize_t n;
+    char b;
+
+    if (c->hedge.events & EPOLLOUT){
+        // the request is short: all of it goes in one write, or the hedge
+        // is given up
+        if (getsockopt(c->hedge.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err ||
+            write(c->hedge.fd, c->out, c->out_len) != (ssize_t)c->out_len){
+            drop_hedge(c);
+            return;
+        }
+        set_events(c->loop, &c->hedge, EPOLLIN);
+        return;
+    }
+    if ((n = recv(c->hedge.fd, &b, 1, MSG_PEEK)) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+    if (n <= 0){
+        drop_hedge(c);
+        return;
+    }
+    // it answered first: it becomes the server connection
+    set_events(c->loop, &c->hedge, 0);
+    close(c->server.fd);
+    c->server.fd = c->hedge.fd;
+    c->server.events = 0;
+    c->hedge.fd = -1;
+    c->reused = 0;
+    stats_count(&c->loop->stats.hedge_wins, 1);
+    set_events(c->loop, &c->server, EPOLLIN);
+    read_response(c);
+}
+
+/* drop_hedge : close the hedge of the request, if there is one */
+static void drop_hedge(conn_t *c){
+    if (c->hedge.fd < 0)
+        return;
+    close(c->hedge.fd);
+    c->hedge.fd = -1;
+    c->hedge.events = 0;
+}
+
+/* send_request : write the rewritten request to the server */
+static void send_request(conn_t *c){
+    ssize_t n;
+
+    while (c->out_off < c->out_len){
+        n = write(c->server.fd, c->out + c->out_off, c->out_len - c->out_off);
+        if (n < 0){
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
+                set_events(c->loop, &c->server, EPOLLOUT);
+                return;
+            }
+            if (c->reused)
+                retry_fresh(c);
+            else
+                fail_conn(c);
+            return;
+        }
+        c->out_off += n;
+    }
+    c->t_stage = stats_now();
+    c->state = ST_READ_RESP;
+    arm(c, TM_TTFB);
+    set_events(c->loop, &c->server, EPOLLIN);
+}
+
+/* read_response : read the response head and start relaying the response */
+static void read_response(conn_t *c){
+    char *end;
+    size_t hlen;
+    ssize_t n;
+    freshness_t f;
+    time_t now;
+
+    while(1){
+        if (c->buf_len == RELAY_BUFSIZE - 1){
+            // head too long for the buffer
+            fail_conn(c);
+            return;
+        }
+        n = read(c->server.fd, c->buf + c->buf_len, RELAY_BUFSIZE - 1 - c->buf_len);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0){
+            // GET is idempotent: a stale pooled connection is retried
+            if (c->reused && c->buf_len == 0)
+                retry_fresh(c);
+            else
+                fail_conn(c);
+            return;
+        }
+        // the server answered: a hedge is not needed any more
+        drop_hedge(c);
+        c->buf_len += n;
+        c->buf[c->buf_len] = 0;
+        if ((end = strstr(c->buf, "\r\n\r\n")))
+            break;
+    }
+    hlen = end + 4 - c->buf;
+    if (parse_response(c->buf, hlen, &c->resp) < 0){
+        c->resp.hdr = NULL;
+        fail_conn(c);
+        return;
+    }
+    stats_record(&c->loop->stats, STAGE_TTFB, stats_now() - c->t_stage);
+    c->t_stage = stats_now();
+    arm(c, TM_IDLE);
+    // without framing, only the end of the connection ends the response
+    if (c->resp.body.mode == BODY_EOF)
+        c->keepalive = 0;
+    now = time(NULL);
+    get_freshness(c->resp.hdr, c->resp.hdr_len, now, &f);
+    if (c->reval){
+        if (c->resp.status == 304){
+            // bytes after the head: the connection is out of step
+            if (c->buf_len > hlen)
+                c->resp.keepalive = 0;
+            c->buf_len = 0;
+            revalidated(c, &f, now);
+            return;
+        }
+        // a new response replaces the stale copy
+        drop_cached(c);
+    }
+    c->cacheable = (c->resp.status == 200 && f.store);
+    if (c->resp.body.mode == BODY_LENGTH &&
+        c->resp.hdr_len + c->resp.body.left + 64 > MAX_OBJECT_SIZE)
+        c->cacheable = 0;
+    set_expiry(c, &f, now);
+    // too large for the memory cache: kept on disk, if it is there
+    if (!c->cacheable && c->resp.status == 200 && f.store &&
+        c->resp.body.mode == BODY_LENGTH && disk_enabled())
+        start_disk(c);
+    // a revalidation in the background that has nothing to keep is over
+    if (c->background && !c->cacheable && !c->dw){
+        close_conn(c);
+        return;
+    }
+    c->head = make_head(c->resp.hdr, c->resp.hdr_len, c->keepalive, &c->head_len);
+    if (c->fill){
+        if (c->cacheable)
+            start_fill(c);
+        else
+            drop_fill(c);
+    }
+
+    // the body bytes that came with the head (for BODY_EOF, none means none yet)
+    c->buf_len -= hlen;
+    memmove(c->buf, c->buf + hlen, c->buf_len);
+    c->state = ST_RELAY;
+    if (c->buf_len && take_body(c, c->buf_len) < 0){
+        close_conn(c);
+        return;
+    }
+    relay(c);
+}
+
+/* take_body : account for the n response bytes just put in c->buf. Return
+ * -1 if the body is malformed. */
+static int take_body(conn_t *c, size_t n){
+    size_t used = body_consume(&c->resp.body, c->buf, n, keep_copy, c);
+
+    if (c->resp.body.done < 0)
+        return -1;
+    c->relayed += used;
+    // bytes after the end of the response: the connection is out of step
+    if (used < n)
+        c->resp.keepalive = 0;
+    c->buf_len = used;
+    c->buf_off = 0;
+    return 0;
+}
+
+/* relay : forward the response from the server to the client.
+ * When the client cannot take more, stop reading the server until it can. */
+static void relay(conn_t *c){
+    int rounds = 0, rc;
+    ssize_t n;
+
+    while(1){
+        // flush what is buffered first
+        if (write_pair(c, c->head, c->head_len, &c->head_off, c->buf, c->buf_len, &c->buf_off) <= 0 ||
+            drain_pipe(c) <= 0)
+            return;
+        if (c->resp.body.done){
+            finish_response(c);
+            return;
+        }
+        // let the other connections of the loop run
+        if (rounds++ == RELAY_ROUNDS)
+            break;
+
+        if (can_splice(c)){
+            if ((rc = splice_body(c)) < 0)
+                return;
+            if (rc == 0)
+                break;
+            continue;
+        }
+
+        n = read(c->server.fd, c->buf, RELAY_BUFSIZE);
+        if (n < 0){
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            close_conn(c);
+            return;
+        }
+        // a response cut short is passed on by closing the client too
+        if (n == 0 && c->resp.body.mode != BODY_EOF){
+            close_conn(c);
+            return;
+        }
+        if (take_body(c, n) < 0){
+            close_conn(c);
+            return;
+        }
+    }
+    set_events(c->loop, &c->client, 0);
+    set_events(c->loop, &c->server, EPOLLIN);
+    arm(c, TM_IDLE);
+}
+
+/* can_splice : true if the rest of the body can bypass user space: it is
+ * not copied for the cache or the disk tier, and its end is found by
+ * counting bytes */
+static int can_splice(conn_t *c){
+    // a request fetched ahead queues the body for its client connection
+    if (!zero_copy || c->no_splice || c->cacheable || c->dw || c->owner || c->background)
+        return 0;
+    if (c->resp.body.mode != BODY_LENGTH && c->resp.body.mode != BODY_EOF)
+        return 0;
+    if (c->pipe[0] < 0 && zc_pipe(c->pipe) < 0){
+        c->no_splice = 1;
+        return 0;
+    }
+    return 1;
+}
+
+/* splice_body : move the next body bytes from the server into the pipe.
+ * Return 1 if some were moved, 0 if none are ready, -1 if the connection
+ * was closed. */
+static int splice_body(conn_t *c){
+    size_t want = ZC_PIPE_SIZE;
+    ssize_t n;
+
+    // never take bytes past the end of the response
+    if (c->resp.body.mode == BODY_LENGTH && c->resp.body.left < want)
+        want = c->resp.body.left;
+    if ((n = zc_fill(c->server.fd, c->pipe[1], want)) < 0){
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+        if (errno == EINVAL){
+            // not a socket splice can read; copy instead
+            c->no_splice = 1;
+            return 1;
+        }
+        close_conn(c);
+        return -1;
+    }
+    if (n == 0 && c->resp.body.mode != BODY_EOF){
+        close_conn(c);
+        return -1;
+    }
+    body_consume(&c->resp.body, NULL, n, NULL, NULL);
+    c->relayed += n;
+    c->piped = n;
+    return 1;
+}
+
+/* drain_pipe : move the bytes in the pipe to the client. Return like
+ * write_out. */
+static int drain_pipe(conn_t *c){
+    ssize_t n;
+
+    while (c->piped > 0){
+        n = zc_drain(c->pipe[0], c->client.fd, c->piped);
+        if (n < 0){
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
+                if (c->server.fd >= 0)
+                    set_events(c->loop, &c->server, 0);
+                set_events(c->loop, &c->client, EPOLLOUT);
+                return 0;
+            }
+            close_conn(c);
+            return -1;
+        }
+        c->piped -= n;
+    }
+    return 1;
+}
+
+/* finish_response : the response was relayed; keep or close the server
+ * connection, cache the response and go on with the client */
+static void finish_response(conn_t *c){
+    stats_record(&c->loop->stats, STAGE_RELAY, stats_now() - c->t_stage);
+    stats_count(&c->loop->stats.relayed, c->head_len + c->relayed);
+    release_server(c);
+    if (c->cacheable)
+        cache_response(c);
+    if (c->dw){
+        disk_commit(c->dw);
+        c->dw = NULL;
+    }
+    // after caching, so that later requests find the object somewhere
+    if (c->fill)
+        fill_done(c->fill);
+    next_request(c);
+}
+
+/* release_server : the response is all in; keep the server connection
+ * for the next request to the server, or close it */
+static void release_server(conn_t *c){
+    disarm(c);
+    end_fetch(c);
+    if (c->resp.keepalive){
+        set_events(c->loop, &c->server, 0);
+        pool_put(c->loop, c->pool_key, c->server.fd);
+    }
+    else
+        close(c->server.fd);
+    c->server.fd = -1;
+    c->server.events = 0;
+}
+
+/* hit_freshness : how fresh the copy in c->hit or c->dhit is at now */
+static int hit_freshness(conn_t *c, time_t now){
+    time_t expires;
+    int swr;
+
+    // a revalidation elsewhere may be renewing them
+    if (c->hit){
+        expires = __atomic_load_n(&c->hit->expires, __ATOMIC_RELAXED);
+        swr = __atomic_load_n(&c->hit->swr, __ATOMIC_RELAXED);
+    }
+    else{
+        expires = __atomic_load_n(&c->dhit->expires, __ATOMIC_RELAXED);
+        swr = __atomic_load_n(&c->dhit->swr, __ATOMIC_RELAXED);
+    }
+    if (now < expires)
+        return HIT_FRESH;
+    return now < expires + swr ? HIT_SWR : HIT_STALE;
+}
+
+/* cached_head : the head (up to the empty line) of the copy in c->hit or
+ * c->dhit, and its length in *lenp */
+static char *cached_head(conn_t *c, size_t *lenp){
+    if (c->hit){
+        *lenp = c->hit->hdr_len;
+        return c->hit->data;
+    }
+    *lenp = c->dhit->hdr_len;
+    return c->dhit->hdr;
+}
+
+/* serve_cached : send the copy in c->hit or c->dhit to the client */
+static void serve_cached(conn_t *c){
+    size_t hdr_len;
+    char *hdr = cached_head(c, &hdr_len);
+
+    c->head = make_head(hdr, hdr_len, c->keepalive, &c->head_len);
+    c->head_off = c->hit_off = 0;
+    if (c->hit){
+        c->state = ST_SERVE_HIT;
+        serve_hit(c);
+    }
+    else{
+        c->state = ST_SERVE_DISK;
+        serve_disk(c);
+    }
+}
+
+/* drop_cached : let go of the copy in c->hit or c->dhit */
+static void drop_cached(conn_t *c){
+    // a revalidation given up: a later request may try again
+    if (c->background && c->reval){
+        if (c->hit)
+            __atomic_store_n(&c->hit->revalidating, 0, __ATOMIC_RELEASE);
+        else if (c->dhit)
+            __atomic_store_n(&c->dhit->revalidating, 0, __ATOMIC_RELEASE);
+    }
+    if (c->hit)
+        cache_release(c->hit);
+    if (c->dhit)
+        disk_release(c->dhit);
+    c->hit = NULL;
+    c->dhit = NULL;
+    c->reval = 0;
+}
+
+/* revalidate_later : revalidate the stale copy c serves on a connection
+ * of its own, with no client, unless one is already at it. path is that
+ * of the request of c. */
+static void revalidate_later(conn_t *c, strview_t path){
+    int *busy = c->hit ? &c->hit->revalidating : &c->dhit->revalidating;
+    char *cond, *hdr;
+    size_t hdr_len;
+    conn_t *b;
+
+    if (__atomic_exchange_n(busy, 1, __ATOMIC_ACQ_REL))
+        return;
+    b = new_conn(c->loop, -1);
+    b->background = 1;
+    b->reval = 1;
+    if ((b->hit = c->hit))
+        cache_hold(b->hit);
+    if ((b->dhit = c->dhit))
+        disk_hold(b->dhit);
+    b->host = (char *)Malloc(strlen(c->host) + 1);
+    strcpy(b->host, c->host);
+    memcpy(b->portn, c->portn, sizeof(b->portn));
+    b->key = (char *)Malloc(strlen(c->key) + 1);
+    strcpy(b->key, c->key);
+    b->pool_key = cache_key(b->host, b->portn, "", 0);
+
+    // with no validator, the object is fetched again
+    hdr = cached_head(b, &hdr_len);
+    cond = make_conditional(hdr, hdr_len);
+    b->out = build_request(&c->rp, b->host, path, cond, &b->out_len);
+    if (cond)
+        Free(cond);
+    fetch(b);
+}
+
+/* revalidated : the server said (304) that the stale copy c holds is still
+ * current; renew its expiry and serve it, unless c revalidates it in the
+ * background */
+static void revalidated(conn_t *c, freshness_t *f, time_t now){
+    freshness_t old;
+    size_t hdr_len;
+    char *hdr = cached_head(c, &hdr_len);
+
+    // a 304 need not repeat how long the response stays fresh
+    if (f->lifetime < 0){
+        get_freshness(hdr, hdr_len, now, &old);
+        f->lifetime = old.lifetime;
+        if (f->swr < 0)
+            f->swr = old.swr;
+        f->revalidate |= old.revalidate;
+    }
+    set_expiry(c, f, now);
+    if (c->hit)
+        cache_refresh(c->hit, c->expires, c->swr);
+    else
+        disk_refresh(c->dhit, c->expires, c->swr);
+    c->reval = 0;
+
+    release_server(c);
+    if (c->background){
+        close_conn(c);
+        return;
+    }
+    serve_cached(c);
+}
+
+/* set_expiry : until when the response, received at now, is fresh, and
+ * for how long after that it may be served while it is revalidated */
+static void set_expiry(conn_t *c, freshness_t *f, time_t now){
+    c->expires = now + (f->lifetime >= 0 ? f->lifetime : default_ttl);
+    c->swr = f->revalidate ? 0 : f->swr >= 0 ? f->swr : default_swr;
+}
+
+/* serve_hit : send the cached object to the client */
+static void serve_hit(conn_t *c){
+    size_t body = c->hit->hdr_len + 2;
+
+    if (write_pair(c, c->head, c->head_len, &c->head_off,
+                   c->hit->data + body, c->hit->size - body, &c->hit_off) <= 0)
+        return;
+    next_request(c);
+}
+
+/* serve_disk : send the object of the disk tier to the client, the body
+ * straight from its segment file */
+static void serve_disk(conn_t *c){
+    disk_obj_t *d = c->dhit;
+    off_t off;
+    ssize_t n;
+
+    if (write_out(c, c->head, c->head_len, &c->head_off) <= 0)
+        return;
+    while (c->hit_off < d->body_len){
+        off = d->body_off + c->hit_off;
+        n = zc_sendfile(c->client.fd, d->seg->fd, &off, d->body_len - c->hit_off);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)){
+            set_events(c->loop, &c->client, EPOLLOUT);
+            return;
+        }
+        // n == 0: the segment file is shorter than the index says
+        if (n <= 0){
+            close_conn(c);
+            return;
+        }
+        c->hit_off += n;
+    }
+    next_request(c);
+}
+
+/* follow : send the object another connection is fetching, as far as it
+ * is in. If the fetch is given up before anything was sent, fetch the
+ * object from the server instead. */
+static void follow(conn_t *c){
+    fill_t *f = c->fill;
+    fill_state_t state;
+    size_t avail;
+
+    while(1){
+        // nothing is written while waiting for more of the object
+        set_events(c->loop, &c->client, 0);
+        state = fill_poll(f, c, c->hit_off, &avail);
+        if (state == FILL_ABORTED){
+            if (c->head){
+                // part of the object was sent: cut the response short
+                close_conn(c);
+                return;
+            }
+            drop_fill(c);
+            fetch(c);
+            return;
+        }
+        if (state == FILL_HEAD || (state == FILL_BODY && avail == c->hit_off))
+            return;
+
+        if (!c->head)
+            c->head = make_head(f->hdr, f->hdr_len, c->keepalive, &c->head_len);
+        if (write_pair(c, c->head, c->head_len, &c->head_off, f->body, avail, &c->hit_off) <= 0)
+            return;
+        if (state == FILL_DONE)
+            break;
+    }
+    next_request(c);
+}
+
+/* drop_fill : stop fetching or following a fill */
+static void drop_fill(conn_t *c){
+    if (!c->fill)
+        return;
+    if (c->filling)
+        fill_abort(c->fill);
+    fill_release(c->fill);
+    c->fill = NULL;
+    c->filling = 0;
+}
+
+/* next_request : wait for the next request of the client, if it keeps the
+ * connection open */
+static void next_request(conn_t *c){
+    conn_t *p;
+
+    // a request fetched ahead waits for its client connection
+    if (c->owner){
+        c->state = ST_AHEAD_DONE;
+        wake_owner(c);
+        return;
+    }
+    if (!c->keepalive){
+        close_conn(c);
+        return;
+    }
+    clear_request(c);
+    c->req_len -= c->req_end;
+    memmove(c->req, c->req + c->req_end, c->req_len);
+    c->ahead_end = c->ahead_end > c->req_end ? c->ahead_end - c->req_end : 0;
+    c->req_end = 0;
+    req_init(&c->rp);
+
+    // the next request may have been fetched ahead
+    if ((p = c->ahead)){
+        c->ahead = p->next_ahead;
+        if (p->state != ST_AHEAD_SKIP){
+            c->req_end = p->req_len;
+            c->sending = p;
+            c->state = ST_PIPELINED;
+            look_ahead(c, p->keepalive);
+            send_ahead(c);
+            return;
+        }
+        drop_ahead(p);
+    }
+    c->state = ST_READ_REQ;
+    set_events(c->loop, &c->client, EPOLLIN);
+    read_request(c);
+}
+
+/* write_out : write data[*offp..len) to the client. Return 1 when all of
+ * it is written; 0 if the client cannot take more now, after switching
+ * from the server to waiting for the client; -1 after an error closed the
+ * connection. */
+static int write_out(conn_t *c, char *data, size_t len, size_t *offp){
+    ssize_t n;
+
+    if (c->owner)
+        return queue_out(c, data, len, offp);
+    // a revalidation in the background has no client to send to
+    if (c->background){
+        *offp = len;
+        return 1;
+    }
+    while (*offp < len){
+        n = write(c->client.fd, data + *offp, len - *offp);
+        if (n < 0){
+            if (errno == EAGAIN || errno == EWOULDBLOCK){
+                if (c->server.fd >= 0)
+                    set_events(c->loop, &c->server, 0);
+                set_events(c->loop, &c->client, EPOLLOUT);
+                return 0;
+            }
+            close_conn(c);
+            return -1;
+        }
+        *offp += n;
+    }
+    return 1;
+}
+
+/* write_pair : write_out of a head and then a body, with a single writev
+ * for both while neither is written */
+static int write_pair(conn_t *c, char *head, size_t head_len, size_t *head_offp,
+                      char *body, size_t body_len, size_t *body_offp){
+    struct iovec iov[2];
+    ssize_t n;
+    int rc;
+
+    if (!c->owner && !c->background && *head_offp < head_len && *body_offp < body_len){
+        iov[0].iov_base = head + *head_offp;
+        iov[0].iov_len = head_len - *head_offp;
+        iov[1].iov_base = body + *body_offp;
+        iov[1].iov_len = body_len - *body_offp;
+        // errors and the rest are left to write_out
+        if ((n = writev(c->client.fd, iov, 2)) > 0){
+            if ((size_t)n < iov[0].iov_len)
+                *head_offp += n;
+            else{
+                *head_offp = head_len;
+                *body_offp += n - iov[0].iov_len;
+            }
+        }
+    }
+    if ((rc = write_out(c, head, head_len, head_offp)) <= 0)
+        return rc;
+    return write_out(c, body, body_len, body_offp);
+}
+
+/* make_head : the response head sent to the client: the status line and
+ * headers in hdr, our Connection header and the empty line */
+static char *make_head(char *hdr, size_t hdr_len, int keepalive, size_t *lenp){
+    const char *conn = keepalive ? "Connection: keep-alive\r\n\r\n"
+                                 : "Connection: close\r\n\r\n";
+    char *head = (char *)Malloc(hdr_len + strlen(conn));
+
+    memcpy(head, hdr, hdr_len);
+    memcpy(head + hdr_len, conn, strlen(conn));
+    *lenp = hdr_len + strlen(conn);
+    return head;
+}
+
+/* keep_copy : add n bytes of the response body to the copy kept for the
+ * cache, as long as the whole object fits in MAX_OBJECT_SIZE, or to the
+ * object being stored in the disk tier */
+static void keep_copy(void *arg, char *data, size_t n){
+    conn_t *c = (conn_t *)arg;
+
+    if (c->dw && disk_append(c->dw, data, n) < 0){
+        disk_abort(c->dw);
+        c->dw = NULL;
+    }
+    if (!c->cacheable)
+        return;
+    if (c->resp.hdr_len + c->obj_len + n + 64 > MAX_OBJECT_SIZE){
+        c->cacheable = 0;
+        drop_fill(c);
+        return;
+    }
+    if (c->obj_len + n > c->obj_cap){
+        c->obj_cap = c->obj_cap ? 2 * c->obj_cap : RELAY_BUFSIZE;
+        if (c->obj_len + n > c->obj_cap)
+            c->obj_cap = c->obj_len + n;
+        c->obj = (char *)Realloc(c->obj, c->obj_cap);
+    }
+    memcpy(c->obj + c->obj_len, data, n);
+    c->obj_len += n;
+    if (c->fill)
+        fill_append(c->fill, data, n);
+}
+
+/* start_fill : publish the head of the response to the requests following
+ * the fetch; the body is then appended by keep_copy */
+static void start_fill(conn_t *c){
+    char *hdr = (char *)Malloc(c->resp.hdr_len + 64);
+    int known = (c->resp.body.mode == BODY_LENGTH || c->resp.body.mode == BODY_NONE);
+    size_t n, cap;
+
+    n = strip_headers(hdr, c->resp.hdr, c->resp.hdr_len, framing_headers);
+    if (known){
+        cap = c->resp.body.mode == BODY_LENGTH ? c->resp.body.left : 0;
+        n += sprintf(hdr + n, "Content-Length: %zu\r\n", cap);
+    }
+    else
+        cap = MAX_OBJECT_SIZE - c->resp.hdr_len - 64;
+    fill_head(c->fill, hdr, n, known, cap);
+}
+
+/* start_disk : start storing the response in the disk tier, with the
+ * head a hit will be sent */
+static void start_disk(conn_t *c){
+    char *hdr = (char *)Malloc(c->resp.hdr_len + 64);
+    size_t n;
+
+    n = strip_headers(hdr, c->resp.hdr, c->resp.hdr_len, framing_headers);
+    n += sprintf(hdr + n, "Content-Length: %zu\r\n", c->resp.body.left);
+    c->dw = disk_begin(c->key, hdr, n, c->resp.body.left, c->expires, c->swr);
+    Free(hdr);
+}
+
+/* cache_response : cache the relayed response with the chunking removed, so
+ * that every cached object has a Content-Length */
+static void cache_response(conn_t *c){
+    char *data = (char *)Malloc(c->resp.hdr_len + 64 + c->obj_len);
+    size_t n;
+
+    n = strip_headers(data, c->resp.hdr, c->resp.hdr_len, framing_headers);
+    n += sprintf(data + n, "Content-Length: %zu\r\n", c->obj_len);
+    memcpy(data + n, "\r\n", 2);
+    if (c->obj_len)
+        memcpy(data + n + 2, c->obj, c->obj_len);
+    cache_insert(c->key, data, n + 2 + c->obj_len, n, c->expires, c->swr);
+}
@@ -0,0 +1,204 @@
+/*
+ * loop.h - per-core epoll event loops of the proxy
+ */
+#ifndef __LOOP_H__
+#define __LOOP_H__
+
+#include "proxy.h"
+#include "cache.h"
+#include "http.h"
+#include "resolver.h"
+#include "fill.h"
+#include "disk.h"
+#include "stats.h"
+#include "clients.h"
+
+#define MAX_EVENTS 256          /* events taken from epoll at once */
+#define REQ_BUFSIZE 16384       /* max size of a request line + headers */
+#define RELAY_BUFSIZE 65536     /* response bytes relayed at once */
+#define POOL_MAX 64             /* idle server connections per loop... */
+#define POOL_PER_HOST 8         /* ... and per server */
+#define AHEAD_MAX 8             /* pipelined requests fetched ahead... */
+#define AHEAD_BUFSIZE 65536     /* ... and response bytes queued for each */
+#define HEDGE_MIN_SAMPLES 20    /* responses timed before any is hedged... */
+#define HEDGE_MIN_MS 5          /* ... the least wait that is hedged... */
+#define HEDGE_REFRESH_MS 1000   /* ... and how often the percentile is taken */
+#define FLOW_BUCKETS 256        /* hash buckets of the queued clients of a loop */
+
+/* States of a client connection */
+typedef enum {
+    ST_READ_REQ,    /* reading the request from the client */
+    ST_RESOLVE,     /* waiting for the resolver threads */
+    ST_CONNECT,     /* non-blocking connect to the server in progress */
+    ST_SEND_REQ,    /* writing the rewritten request to the server */
+    ST_READ_RESP,   /* reading the response head from the server */
+    ST_RELAY,       /* relaying the response to the client */
+    ST_SERVE_HIT,   /* sending a cached object to the client */
+    ST_SERVE_DISK,  /* sending an object of the disk tier to the client */
+    ST_SERVE_LOCAL, /* sending a response of the proxy itself */
+    ST_QUEUED,      /* waiting for a fetch of the loop to be free */
+    ST_FOLLOW,      /* sending an object another connection is fetching */
+    ST_PIPELINED,   /* sending the response a request ahead fetched */
+    ST_AHEAD_DONE,  /* ahead: the response is all queued */
+    ST_AHEAD_SKIP,  /* ahead: left to the client connection */
+    ST_CLOSED       /* closed, freed at the end of the event batch */
+} conn_state_t;
+
+/* What a descriptor registered with epoll is */
+typedef enum {
+    EP_LISTEN,      /* the listening socket of the loop */
+    EP_CLIENT,      /* a client connection */
+    EP_SERVER,      /* the server connection of a client connection */
+    EP_HEDGE,       /* the second server connection of a hedged request */
+    EP_IDLE,        /* a server connection waiting in the pool */
+    EP_NOTIFY       /* eventfd other threads wake the loop with */
+} endpoint_kind_t;
+
+/* Deadlines of a fetch (proxy.h) */
+typedef enum {
+    TM_NONE = -1,
+    TM_CONNECT,     /* connecting to the server */
+    TM_TTFB,        /* waiting for the response head */
+    TM_IDLE,        /* waiting for more of the body */
+    NTIMERS
+} timer_kind_t;
+
+struct conn;
+struct loop;
+
+/* One descriptor registered with epoll; epoll hands back its address */
+typedef struct endpoint {
+    int fd;
+    endpoint_kind_t kind;
+    unsigned int events;        /* events we currently wait for */
+    struct conn *conn;          /* owning connection (EP_CLIENT/EP_SERVER) */
+} endpoint_t;
+
+/* A client connection and the server connection made for it */
+typedef struct conn {
+    conn_state_t state;
+    struct loop *loop;
+    endpoint_t client, server;
+    char req[REQ_BUFSIZE];      /* requests as read from the client */
+    size_t req_len;
+    size_t req_end;             /* end of the request being served */
+    req_parser_t rp;            /* its head, parsed in place */
+    int keepalive;              /* the client keeps the connection open */
+    char *host;                 /* server of the request */
+    char portn[20];
+    char *pool_key;             /* "host:port" of the server */
+    char *out;                  /* rewritten request for the server */
+    size_t out_len, out_off;
+    addr_list_t addrs;          /* addresses of the server... */
+    int addr_i;                 /* ... and the one being connected to */
+    int resolve_err;            /* getaddrinfo error of the lookup */
+    struct conn *next_woken;    /* list of connections waiting or woken */
+    client_t *cl;               /* client of the connection (clients.c), or NULL */
+    int fetching;               /* the request holds one of the loop's fetches... */
+    struct flow *flow;          /* ... or waits for one with the others of its client */
+    struct conn *qprev, *qnext;
+    int reused;                 /* the server connection came from the pool */
+    timer_kind_t timer;         /* deadline the fetch is under... */
+    unsigned long armed;        /* ... since then (stats_now)... */
+    struct conn *tprev, *tnext; /* ... in the list of the loop for it */
+    endpoint_t hedge;           /* request sent again to another address */
+    int hedged;                 /* a hedge was tried for the request */
+    response_t resp;            /* head of the response */
+    char *head;                 /* response head as sent to the client */
+    size_t head_len, head_off;
+    char *buf;                  /* response bytes not yet sent to the client */
+    size_t buf_len, buf_off;
+    int pipe[2];                /* body bytes spliced past user space... */
+    size_t piped;               /* ... and how many are in the pipe */
+    int no_splice;              /* splice failed on this connection */
+    unsigned long t_req;        /* when the request began to arrive... */
+    unsigned long t_stage;      /* ... and its current stage began (stats.h) */
+    size_t relayed;             /* response bytes relayed from the server */
+    char *key;                  /* cache key of the request */
+    cache_obj_t *hit;           /* cached object being sent... */
+    disk_obj_t *dhit;           /* ... or object of the disk tier ... */
+    size_t hit_off;             /* ... and how much of its body was sent */
+    int reval;                  /* the copy in hit or dhit is stale and the
+                                 * request revalidates it */
+    int background;             /* revalidates it for no client */
+    char *obj;                  /* copy of the response body for the cache */
+    size_t obj_len, obj_cap;
+    int cacheable;              /* the response still fits in the cache */
+    time_t expires;             /* the response is fresh until then... */
+    int swr;                    /* ... then served while revalidated for */
+    disk_write_t *dw;           /* the response stored in the disk tier */
+    fill_t *fill;               /* fill fetched or followed by the request */
+    int filling;                /* this connection fetches it */
+    struct conn *ahead;         /* pipelined requests being fetched ahead */
+    size_t ahead_end;           /* end of the requests in req fetched ahead */
+    struct conn *sending;       /* the one whose response is being sent */
+    struct conn *owner;         /* ahead: the client connection it is for, */
+    struct conn *next_ahead;    /* the next request ahead, */
+    char *q;                    /* the response bytes queued for the client */
+    size_t q_len, q_off;
+    int stalled;                /* the queue was full */
+    int abandoned;              /* the client went away during the lookup */
+    struct conn *next_dead;     /* list of connections to free */
+} conn_t;
+
+/* The requests of one client waiting for a fetch of the loop */
+typedef struct flow {
+    client_t *cl;
+    struct conn *head, *tail;   /* in the order they came */
+    struct flow *prev, *next;   /* clients of the loop with requests waiting, in turn */
+    struct flow *hnext;
+} flow_t;
+
+/* An idle server connection kept for the next request to the server */
+typedef struct idle {
+    endpoint_t ep;              /* must come first */
+    char *key;                  /* "host:port" of the server */
+    struct idle *prev, *next;   /* most recently used first */
+    struct idle *next_dead;
+} idle_t;
+
+/* The idle server connections of a loop */
+typedef struct {
+    idle_t *head, *tail;
+    int count;
+    idle_t *dead;               /* taken out in this batch */
+} pool_t;
+
+/* An event loop, run by one thread with a listening socket of its own
+ * (or fed by the acceptor, see acceptor.c) */
+typedef struct loop {
+    int id;
+    int cpu;                    /* core the loop is pinned to, or -1 */
+    int epfd;
+    endpoint_t listen;
+    pthread_t tid;
+    conn_t *dead;               /* connections closed in this batch */
+    pool_t pool;
+    endpoint_t notify;
+    pthread_mutex_t woken_lock;
+    conn_t *woken;              /* handed back by other threads */
+    stats_t stats;              /* written by this loop only */
+    struct {
+        struct conn *head, *tail;
+    } timers[NTIMERS];          /* fetches under each deadline, oldest first */
+    unsigned long hedge_after;  /* ns to first byte past which to hedge, or 0 */
+    unsigned long hedge_taken;  /* when it was last taken */
+    int fetching;               /* fetches under way, at most fetch_max */
+    flow_t *flows, *flows_tail; /* clients waiting for one, next first */
+    flow_t *flow_buckets[FLOW_BUCKETS];
+} loop_t;
+
+/* Event loops (loop.c) */
+void loop_init(loop_t *loop, int id, char *port);
+void *loop_run(void *vargp);
+void set_events(loop_t *loop, endpoint_t *ep, unsigned int events);
+void loop_wake(loop_t *loop, conn_t *c);
+
+/* Upstream connection pool (pool.c) */
+void pool_init(pool_t *pool);
+int pool_get(loop_t *loop, char *key);
+void pool_put(loop_t *loop, char *key, int fd);
+void pool_event(loop_t *loop, idle_t *idle);
+void pool_free_dead(pool_t *pool);
+
+#endif /* __LOOP_H__ */
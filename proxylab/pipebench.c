@@ -0,0 +1,237 @@
+/*
+ * pipebench.c - pipelining load generator for the proxy
+ *
+ * usage: ./pipebench -p <proxy port> -s <server host:port> [-u <uri>]
+ *                    [-c <connections>] [-n <requests>] [-d <depth>]
+ *
+ * Each of the connections to the proxy sends <requests> GETs for
+ * http://<server><uri>, keeping up to <depth> of them sent ahead of the
+ * responses (1 is no pipelining), and checks that the responses, framed
+ * by their Content-Length, come back one per request. A "%d" in the uri
+ * is replaced by the number of the request, so that every request can
+ * miss the cache, e.g. -u '/cgi-bin/adder?%d&1' against tiny.
+ *
+ * Prints the requests per second and the mean time per request.
+ */
+#define _GNU_SOURCE             /* memmem */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#define BUFSIZE 65536
+
+static char *proxy_port, *server, *uri = "/home.html";
+static int nrequests = 100, depth = 1;
+static int serial;                      /* requests numbered so far */
+
+/* A connection and what it has sent and received */
+typedef struct {
+    int fd;
+    int sent, done;
+    char buf[BUFSIZE];
+    size_t len;
+} client_t;
+
+static double now(void);
+static int open_proxy(void);
+static void *run(void *arg);
+static int send_request(client_t *cl);
+static int read_response(client_t *cl);
+static size_t content_length(char *head, size_t len, int *okp);
+
+int main(int argc, char **argv){
+    int c, nconns = 1, i;
+    pthread_t *tids;
+    client_t *clients;
+    double start, secs;
+
+    while ((c = getopt(argc, argv, "p:s:u:c:n:d:")) != -1){
+        switch (c){
+        case 'p':
+            proxy_port = optarg;
+            break;
+        case 's':
+            server = optarg;
+            break;
+        case 'u':
+            uri = optarg;
+            break;
+        case 'c':
+            nconns = atoi(optarg);
+            break;
+        case 'n':
+            nrequests = atoi(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s -p <proxy port> -s <server host:port> [-u <uri>] "
+                    "[-c <connections>] [-n <requests>] [-d <depth>]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (!proxy_port || !server || nconns < 1 || nrequests < 1 || depth < 1){
+        fprintf(stderr, "%s: need -p and -s; counts must be positive\n", argv[0]);
+        exit(1);
+    }
+
+    tids = malloc(nconns * sizeof(pthread_t));
+    clients = calloc(nconns, sizeof(client_t));
+    if (!tids || !clients){
+        fprintf(stderr, "%s: out of memory\n", argv[0]);
+        exit(1);
+    }
+    for (i = 0; i < nconns; i++)
+        if ((clients[i].fd = open_proxy()) < 0)
+            exit(1);
+
+    start = now();
+    for (i = 0; i < nconns; i++)
+        pthread_create(&tids[i], NULL, run, &clients[i]);
+    for (i = 0; i < nconns; i++)
+        pthread_join(tids[i], NULL);
+    secs = now() - start;
+
+    for (i = 0; i < nconns; i++)
+        if (clients[i].done != nrequests){
+            fprintf(stderr, "connection %d: %d of %d responses\n", i,
+                    clients[i].done, nrequests);
+            exit(1);
+        }
+    printf("depth %d: %d requests on %d connections in %.3f s, "
+           "%.0f requests/s, %.3f ms per request\n",
+           depth, nconns * nrequests, nconns, secs, nconns * nrequests / secs,
+           secs * 1e3 / nrequests);
+    return 0;
+}
+
+/* run : the requests of one connection, depth of them in flight */
+static void *run(void *arg){
+    client_t *cl = arg;
+
+    while (cl->done < nrequests){
+        while (cl->sent < nrequests && cl->sent - cl->done < depth)
+            if (send_request(cl) < 0)
+                return NULL;
+        if (read_response(cl) < 0)
+            return NULL;
+    }
+    close(cl->fd);
+    return NULL;
+}
+
+/* send_request : send the next request */
+static int send_request(client_t *cl){
+    char path[1024], req[2048];
+    size_t len, off = 0;
+    ssize_t n;
+
+    snprintf(path, sizeof(path), uri, __atomic_add_fetch(&serial, 1, __ATOMIC_RELAXED));
+    len = snprintf(req, sizeof(req), "GET http://%s%s HTTP/1.1\r\nHost: %s\r\n\r\n",
+                   server, path, server);
+    while (off < len){
+        if ((n = write(cl->fd, req + off, len - off)) < 0){
+            perror("write");
+            return -1;
+        }
+        off += n;
+    }
+    cl->sent++;
+    return 0;
+}
+
+/* read_response : read one response, which must have a Content-Length */
+static int read_response(client_t *cl){
+    char *end;
+    size_t head_len, total;
+    ssize_t n;
+    int ok;
+
+    while (!(end = memmem(cl->buf, cl->len, "\r\n\r\n", 4))){
+        if (cl->len == BUFSIZE || (n = read(cl->fd, cl->buf + cl->len, BUFSIZE - cl->len)) <= 0){
+            fprintf(stderr, "response head not read\n");
+            return -1;
+        }
+        cl->len += n;
+    }
+    head_len = end + 4 - cl->buf;
+    if (strncmp(cl->buf, "HTTP/1.", 7) || strncmp(cl->buf + 8, " 200", 4)){
+        fprintf(stderr, "%.*s\n", (int)(strchr(cl->buf, '\r') - cl->buf), cl->buf);
+        return -1;
+    }
+    total = head_len + content_length(cl->buf, head_len, &ok);
+    if (!ok){
+        fprintf(stderr, "response without a Content-Length\n");
+        return -1;
+    }
+
+    // the body may not fit in the buffer: skip what is read of it
+    while (total > cl->len){
+        total -= cl->len;
+        cl->len = 0;
+        if ((n = read(cl->fd, cl->buf, BUFSIZE)) <= 0){
+            fprintf(stderr, "response body cut short\n");
+            return -1;
+        }
+        cl->len = n;
+    }
+    cl->len -= total;
+    memmove(cl->buf, cl->buf + total, cl->len);
+    cl->done++;
+    return 0;
+}
+
+/* content_length : the Content-Length in a response head; *okp is 0 if
+ * there is none */
+static size_t content_length(char *head, size_t len, int *okp){
+    char *p = head, *end = head + len;
+
+    *okp = 0;
+    while ((p = memchr(p, '\n', end - p)) && ++p < end)
+        if (end - p > 15 && !strncasecmp(p, "Content-Length:", 15)){
+            *okp = 1;
+            return strtoul(p + 15, NULL, 10);
+        }
+    return 0;
+}
+
+/* open_proxy : connect to the proxy on localhost */
+static int open_proxy(void){
+    struct addrinfo hints, *listp, *p;
+    int fd = -1, rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rc = getaddrinfo("localhost", proxy_port, &hints, &listp)) != 0){
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rc));
+        return -1;
+    }
+    for (p = listp; p; p = p->ai_next){
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(listp);
+    if (fd < 0)
+        fprintf(stderr, "cannot connect to the proxy: %s\n", strerror(errno));
+    return fd;
+}
+
+/* now : seconds on the monotonic clock */
+static double now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,112 @@
+/*
+ * pool.c - idle server connections kept open for reuse
+ *
+ * Each loop keeps the persistent server connections it is done with,
+ * keyed by "host:port", so that the next request to the same server
+ * does not pay for a new TCP handshake. Like everything else in a loop,
+ * the pool is only used by the loop's own thread.
+ *
+ * Idle connections stay registered with epoll: any event on one means
+ * the server closed it (or sent something it should not have), and it
+ * is dropped. At most POOL_PER_HOST connections are kept per server and
+ * POOL_MAX per loop, the least recently used going first.
+ */
+#include <sys/epoll.h>
+#include "loop.h"
+
+static void unlink_idle(pool_t *pool, idle_t *idle);
+
+/* pool_init : initialize an empty pool */
+void pool_init(pool_t *pool){
+    pool->head = pool->tail = NULL;
+    pool->count = 0;
+    pool->dead = NULL;
+}
+
+/* pool_get : take an idle connection to the server key, or return -1 */
+int pool_get(loop_t *loop, char *key){
+    idle_t *idle;
+    int fd;
+
+    for (idle = loop->pool.head; idle; idle = idle->next){
+        if (strcmp(idle->key, key))
+            continue;
+        fd = idle->ep.fd;
+        set_events(loop, &idle->ep, 0);
+        unlink_idle(&loop->pool, idle);
+        return fd;
+    }
+    return -1;
+}
+
+/* pool_put : keep the connection fd to the server key for later requests */
+void pool_put(loop_t *loop, char *key, int fd){
+    pool_t *pool = &loop->pool;
+    idle_t *idle, *oldest = NULL;
+    int same = 0;
+
+    for (idle = pool->head; idle; idle = idle->next){
+        if (!strcmp(idle->key, key)){
+            same++;
+            oldest = idle;
+        }
+    }
+    // make room: the oldest connection to this server, or the oldest of all
+    if (same >= POOL_PER_HOST || (pool->count >= POOL_MAX && (oldest = pool->tail))){
+        close(oldest->ep.fd);
+        unlink_idle(pool, oldest);
+    }
+
+    idle = (idle_t *)Malloc(sizeof(idle_t));
+    idle->ep.fd = fd;
+    idle->ep.kind = EP_IDLE;
+    idle->ep.events = 0;
+    idle->ep.conn = NULL;
+    idle->key = (char *)Malloc(strlen(key) + 1);
+    strcpy(idle->key, key);
+    idle->prev = NULL;
+    idle->next = pool->head;
+    if (pool->head)
+        pool->head->prev = idle;
+    else
+        pool->tail = idle;
+    pool->head = idle;
+    pool->count++;
+    set_events(loop, &idle->ep, EPOLLIN | EPOLLRDHUP);
+}
+
+/* pool_event : the server closed an idle connection; drop it */
+void pool_event(loop_t *loop, idle_t *idle){
+    // taken or dropped earlier in this batch
+    if (idle->ep.fd < 0)
+        return;
+    close(idle->ep.fd);
+    unlink_idle(&loop->pool, idle);
+}
+
+/* pool_free_dead : free the entries taken out during an event batch */
+void pool_free_dead(pool_t *pool){
+    while (pool->dead){
+        idle_t *idle = pool->dead;
+        pool->dead = idle->next_dead;
+        Free(idle->key);
+        Free(idle);
+    }
+}
+
+/* unlink_idle : take an entry out of the pool. Events of the current batch
+ * may still point to it, so it is only freed after the batch. */
+static void unlink_idle(pool_t *pool, idle_t *idle){
+    if (idle->prev)
+        idle->prev->next = idle->next;
+    else
+        pool->head = idle->next;
+    if (idle->next)
+        idle->next->prev = idle->prev;
+    else
+        pool->tail = idle->prev;
+    pool->count--;
+    idle->ep.fd = -1;
+    idle->next_dead = pool->dead;
+    pool->dead = idle;
+}
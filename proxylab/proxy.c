@@ -1,191 +1,276 @@
 #include <stdio.h>
-#include "csapp.h"
-
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+#include "proxy.h"
+#include "loop.h"
+#include "cache.h"
+#include "http.h"
+#include "resolver.h"
+#include "acceptor.h"
+#include "disk.h"
+#include "clients.h"
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *http_msg = "HTTP/1.0\r\n";
+static const char *http11_msg = "HTTP/1.1\r\n";
 static const char *host_msg = "Host: ";
-static const char *connection_msg = "Connection: close\r\n";
-static const char *proxyconnection_msg = "Proxy-Connection: close\r\n";
+static const char *connection_msg = "Connection: keep-alive\r\n";
+
+volatile sig_atomic_t print_stats = 0;
+int zero_copy = 1;
+int default_ttl = DEFAULT_TTL, default_swr = DEFAULT_SWR;
+int connect_timeout = CONNECT_TIMEOUT, ttfb_timeout = TTFB_TIMEOUT, idle_timeout = IDLE_TIMEOUT;
+int hedge_pct = 0;
+int fetch_max = FETCH_MAX;
+static loop_t *loops;
 
 /* Helper functions */
-void *thread_func(void *vargp);
-void thread_assist(int connfd);
-void parse_uri(char *uri, char *host, char *portn, char *detailed);
+static void usage(char *prog);
+static void sigusr1_handler(int sig);
 
-/* main */
+/* main : start one event loop per core, all listening on the same port,
+ * or all fed by one acceptor thread */
 int main(int argc, char **argv) {
-    struct sockaddr_in clientaddr;
-    pthread_t tid; 
-
-    int clientlen = sizeof(clientaddr);
-    int listenfd = Open_listenfd(argv[1]);
-    while(1){
-        // to avoid unintentional sharing
-        int *connfdp = (int *)Malloc(sizeof(int));
-        *connfdp = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        // to handle multiple concurrent requests
-         Pthread_create(&tid, NULL, thread_func, connfdp);
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN), nloops = ncpus;
+    char *hosts_file = NULL;
+    int ttl = DNS_TTL, neg_ttl = DNS_NEG_TTL;
+    int prethreaded = 0;
+    long slots = ACCEPT_SLOTS;
+    char *disk_dir = NULL;
+    long disk_mb = DISK_BUDGET;
+    double rate = 0, burst = 0;
+    int max_conns = 0;
+    int c, i;
+
+    while((c = getopt(argc, argv, "t:AQ:CD:B:F:W:E:R:N:S:H:T:h")) != -1){
+        switch (c){
+        case 't':
+            nloops = atoi(optarg);
+            break;
+        case 'A':
+            prethreaded = 1;
+            break;
+        case 'Q':
+            slots = atol(optarg);
+            if (slots < 2 || (slots & (slots - 1)))
+                usage(argv[0]);
+            break;
+        case 'C':
+            zero_copy = 0;
+            break;
+        case 'D':
+            disk_dir = optarg;
+            break;
+        case 'B':
+            if ((disk_mb = atol(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'F':
+            // <ttl>[:<stale-while-revalidate>]
+            if (sscanf(optarg, "%d:%d", &default_ttl, &default_swr) < 1 ||
+                default_ttl < 0 || default_swr < 0)
+                usage(argv[0]);
+            break;
+        case 'W':
+            // <connect>[:<ttfb>[:<idle>]]
+            if (sscanf(optarg, "%d:%d:%d", &connect_timeout, &ttfb_timeout, &idle_timeout) < 1 ||
+                connect_timeout < 1 || ttfb_timeout < 1 || idle_timeout < 1)
+                usage(argv[0]);
+            break;
+        case 'E':
+            if ((hedge_pct = atoi(optarg)) < 1 || hedge_pct > 99)
+                usage(argv[0]);
+            break;
+        case 'R':
+            // <rate>[:<burst>]
+            if (sscanf(optarg, "%lf:%lf", &rate, &burst) < 1 || rate <= 0 || burst < 0)
+                usage(argv[0]);
+            if (!burst)
+                burst = rate;
+            break;
+        case 'N':
+            if ((max_conns = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'S':
+            if ((fetch_max = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'H':
+            hosts_file = optarg;
+            break;
+        case 'T':
+            // <ttl>[:<negative ttl>]
+            if (sscanf(optarg, "%d:%d", &ttl, &neg_ttl) < 1)
+                usage(argv[0]);
+            break;
+        default:
+            usage(argv[0]);
+        }
     }
+    if (optind != argc - 1 || nloops < 1)
+        usage(argv[0]);
+
+    // a client that goes away must not kill the proxy
+    Signal(SIGPIPE, SIG_IGN);
+    cache_init();
+    clients_init(rate, burst, max_conns);
+    if (disk_dir)
+        disk_init(disk_dir, disk_mb);
+    resolver_init(RESOLVER_THREADS, hosts_file, ttl, neg_ttl);
+
+    // bind every listening socket before any loop starts accepting; in
+    // the prethreaded mode the loops are the workers, one per core, and
+    // this thread accepts for them
+    loops = (loop_t *)Malloc(nloops * sizeof(loop_t));
+    for (i = 0; i < nloops; i++){
+        loop_init(&loops[i], i, prethreaded ? NULL : argv[optind]);
+        if (prethreaded)
+            loops[i].cpu = i % ncpus;
+    }
+    // "kill -USR1 <pid>" prints the cache statistics
+    Signal(SIGUSR1, sigusr1_handler);
+
+    if (prethreaded){
+        acceptor_init(loops, nloops, slots);
+        for (i = 0; i < nloops; i++)
+            Pthread_create(&loops[i].tid, NULL, loop_run, &loops[i]);
+        acceptor_run(argv[optind]);
+        return 0;
+    }
+    for (i = 1; i < nloops; i++)
+        Pthread_create(&loops[i].tid, NULL, loop_run, &loops[i]);
+    loops[0].tid = pthread_self();
+    loop_run(&loops[0]);
     return 0;
 }
 
-/* thread_func : handle one request */
-void *thread_func(void *vargp){
-    int connfd = *((int *)vargp);
-    // run in detached mode to avoid fatal memory leak
-    Pthread_detach(Pthread_self());
-    // to close parent's connfd (threaded program)
-    Free(vargp);
-    thread_assist(connfd);
-    Close(connfd);
-    return NULL;
+/* usage : print the command line options and exit */
+static void usage(char *prog){
+    fprintf(stderr, "usage: %s [-t <loops>] [-A [-Q <slots>]] [-C] [-D <dir> [-B <MB>]] [-F <ttl>[:<swr>]] [-W <s>[:<s>[:<s>]]] [-E <pct>] [-R <rate>[:<burst>]] [-N <conns>] [-S <fetches>] [-H <hosts>] [-T <ttl>[:<neg>]] <port>\n", prog);
+    fprintf(stderr, "  -t <loops>  number of event loops (default: one per core)\n");
+    fprintf(stderr, "  -A          prethreaded: one thread accepts, the loops are pinned to cores\n");
+    fprintf(stderr, "  -Q <slots>  connections -A queues before it sheds them with 503 (%d)\n",
+            ACCEPT_SLOTS);
+    fprintf(stderr, "  -C          copy bodies through user space instead of splice\n");
+    fprintf(stderr, "  -D <dir>    keep objects too large for the cache in segment files in dir\n");
+    fprintf(stderr, "  -B <MB>     size of the segment files of -D (%d)\n", DISK_BUDGET);
+    fprintf(stderr, "  -F <ttl>[:<swr>]  seconds responses without freshness information are\n"
+                    "              fresh, then served while revalidated (%d:%d)\n",
+            DEFAULT_TTL, DEFAULT_SWR);
+    fprintf(stderr, "  -W <connect>[:<ttfb>[:<idle>]]  seconds to connect to a server, then\n"
+                    "              for its response head, then between reads of the body (%d:%d:%d)\n",
+            CONNECT_TIMEOUT, TTFB_TIMEOUT, IDLE_TIMEOUT);
+    fprintf(stderr, "  -E <pct>    hedge requests whose response head takes longer than the\n"
+                    "              <pct> percentile: send them again to another address\n");
+    fprintf(stderr, "  -R <rate>[:<burst>]  requests per second each client address may make,\n"
+                    "              in bursts of up to <burst>; more are answered with 429\n");
+    fprintf(stderr, "  -N <conns>  connections each client address may hold open\n");
+    fprintf(stderr, "  -S <fetches>  fetches each loop runs at once; more wait, each client\n"
+                    "              in turn (%d)\n", FETCH_MAX);
+    fprintf(stderr, "  -H <hosts>  resolve names from this hosts file instead of the DNS\n");
+    fprintf(stderr, "  -T <ttl>[:<neg>]  seconds answers (and failures) are cached (%d:%d)\n",
+            DNS_TTL, DNS_NEG_TTL);
+    exit(1);
 }
 
-/* thread_assist: read and parse requests, forward requests to web servers, 
- * read the servers' responses and forward those responses to clients */
-void thread_assist(int connfd){
-    int n, serverfd;
-    char buf[MAXLINE], buf2[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char host[MAXLINE], portn[20], detailed[MAXLINE];
-    rio_t rio, rio2;
-
-    // to initialize struct rio_t and readline from it
-    Rio_readinitb(&rio, connfd);
-    if (!Rio_readlineb(&rio, buf, MAXLINE))
-        return;
-
-    // e.g. If "GET http://localhost:12345/home.html HTTP/1.1" is stored in buf,
-    // method = "GET", uri = "http://localhost:12345/home.html", version = 'HTTP/1.1'
-    sscanf(buf, "%s %s %s", method, uri, version);
-
-    // Only 'GET' method is implemented in this lab
-    if (strcasecmp(method, "GET")){
-        printf("%s is not implemented\n", method);
-        return;
-    }
+/* sigusr1_handler : ask the event loops to print the statistics. Any
+ * thread may take the signal, so wake the first loop. */
+static void sigusr1_handler(int sig){
+    int olderrno = errno;
+    uint64_t one = 1;
 
-    // parse uri "http://localhost:12345/home.html" into host('localhost'), portn('12345'), and detailed('/home.html')
-    parse_uri(uri, host, portn, detailed);
-    
-    // to create connection with server and initialize struct rio_t
-    serverfd = Open_clientfd(host, portn);
-    Rio_readinitb(&rio2, serverfd);
-
-    // to write 'GET /home.html HTTP/1.0' in the server
-    sprintf(buf2, "%s %s %s", "GET", detailed, http_msg);
-    Rio_writen(serverfd, buf2, strlen(buf2));
-
-    // to send http requests header to the server
-    int flagu = 0, flaga = 0, flagc = 0, flagpc = 0;
-    while((n = Rio_readlineb(&rio, buf, MAXLINE)) != 0){
-        // end of line
-        if (!strncmp(buf, "\r\n", 2)){
-            Rio_writen(serverfd, buf, strlen(buf));
-            break;
-        }
-        // host
-        else if (!strncasecmp(buf, "Host", 4)){
-            flagu = 1;
-            Rio_writen(serverfd, buf, strlen(buf));  
-        }
-        // user-agent
-        else if (!strncasecmp(buf, "User-Agent", 10)){
-            flaga = 1;
-            Rio_writen(serverfd, user_agent_hdr, strlen(user_agent_hdr));
-        }
-        // connection
-        else if (!strncasecmp(buf, "Connection", 10)){
-            flagc = 1;
-            Rio_writen(serverfd, connection_msg, strlen(connection_msg));
-        }
-        // proxy-connection
-        else if (!strncasecmp(buf, "Proxy-Connection", 15)){
-            flagpc = 1;
-            Rio_writen(serverfd, proxyconnection_msg, strlen(proxyconnection_msg));
-        }
-        // other headers
-        else{
-            Rio_writen(serverfd, buf, strlen(buf));
-        }
-    }
-    // send 'Host' request header if didn't
-    if (!flagu){
-        char temp[20];
-        sprintf(temp, "%s%s\r\n", host_msg, host);
-        Rio_writen(serverfd, temp, strlen(temp));
-    }
-    // send 'User-Agent' request header if didn't
-    if (!flaga){
-        Rio_writen(serverfd, user_agent_hdr, strlen(user_agent_hdr));
-    }
-    // send 'Connection' request header if didn't
-    if (!flagc){
-        Rio_writen(serverfd, connection_msg, strlen(connection_msg));
-    }
-    // send 'Proxy-Connection' request header if didn't
-    if (!flagpc){
-        Rio_writen(serverfd, proxyconnection_msg, strlen(proxyconnection_msg));
-    }
+    print_stats = 1;
+    write(loops[0].notify.fd, &one, sizeof(one));
+    errno = olderrno;
+}
 
-    // to forward responses from the server to the client
-    while((n = Rio_readlineb(&rio2, buf, MAXLINE)) != 0){
-        Rio_writen(connfd, buf, n);
-    }
-    Close(serverfd);
+/* append : append len bytes to a request being built */
+static void append(char *out, size_t *lenp, const char *s, size_t len){
+    memcpy(out + *lenp, s, len);
+    *lenp += len;
 }
 
-/* parse_uri : parse uri into host name, port number and file path */
-void parse_uri(char *uri, char *host, char *portn, char *detailed){
-    
-    char *ptr;
+/* append_str : append a string to a request being built */
+static void append_str(char *out, size_t *lenp, const char *s){
+    append(out, lenp, s, strlen(s));
+}
 
-    if (!(ptr = strstr(uri, "http://"))){
-        ptr = uri;
-        if (*ptr == '/')
-            ptr++;
-    }
-    else
-        ptr += 7;
-
-    // host name
-    int i = 0;
-    while(*ptr != ':' && *ptr != '/'){
-        host[i] = *ptr;
-        ptr++;
-        i++;
-    }
-    host[i] = 0;
+/* build_request : rewrite the parsed request head rp, for path on host,
+ * into the request sent to the server, over a connection the proxy keeps
+ * open. cond, if not NULL, are the conditional headers that revalidate
+ * the cached copy, in place of those of the client. Return the request in
+ * a malloc'ed buffer and its length in *lenp. */
+char *build_request(req_parser_t *rp, char *host, strview_t path, char *cond,
+                    size_t *lenp){
+    char *out;
+    size_t size, len = 0;
+    int i, flagu = 0, flaga = 0, flagc = 0;
 
-    // port number
-    if (*ptr != ':'){
-        portn[0] = '8';
-        portn[1] = '0';
-        portn[2] = 0;
-    }
-    else{
-        i = 0;
-        ptr++;
-        while (*ptr != '/' && *ptr != ' '){
-            portn[i] = *ptr;
-            i++;
-            ptr++;
-        }
-        portn[i] = 0;
-    }
+    // a header grows by at most the User-Agent header it may become (or
+    // the ": " put back between name and value), and at most three
+    // headers are added
+    size = rp->head_len + path.len + strlen(host) + 64 +
+           (rp->nheaders + 3) * (strlen(user_agent_hdr) + 2) + (cond ? strlen(cond) : 0);
+    out = (char *)Malloc(size);
 
-    // file path   
-    i = 0;
-    if (*ptr == '/'){
-        while(*ptr){
-            detailed[i] = *ptr;
-            i++;
-            ptr++;
+    // 'GET /home.html HTTP/1.1', in the version of the client: an
+    // HTTP/1.0 client could not read a chunked response
+    append_str(out, &len, "GET ");
+    append(out, &len, path.p, path.len);
+    append_str(out, &len, " ");
+    append_str(out, &len, rp->minor >= 1 ? http11_msg : http_msg);
+
+    // the parser has already told the headers apart (hdr_id_t)
+    for (i = 0; i < rp->nheaders; i++){
+        req_header_t *h = &rp->headers[i];
+
+        switch (h->id){
+            // user-agent
+            case HDR_USER_AGENT:
+                flaga = 1;
+                append_str(out, &len, user_agent_hdr);
+                continue;
+            // connection: ours to the server is kept open
+            case HDR_CONNECTION:
+                flagc = 1;
+                append_str(out, &len, connection_msg);
+                continue;
+            // other hop-by-hop headers are not forwarded
+            case HDR_PROXY_CONNECTION:
+            case HDR_KEEP_ALIVE:
+                continue;
+            // the copy the client has is not the one being revalidated
+            case HDR_IF_NONE_MATCH:
+            case HDR_IF_MODIFIED_SINCE:
+                if (cond)
+                    continue;
+                break;
+            case HDR_HOST:
+                flagu = 1;
+                break;
+            default:
+                break;
         }
+        // host and the other headers
+        append(out, &len, h->name.p, h->name.len);
+        append_str(out, &len, ": ");
+        append(out, &len, h->value.p, h->value.len);
+        append_str(out, &len, "\r\n");
+    }
+    // add the headers the client did not send, before the empty line
+    if (!flagu){
+        append_str(out, &len, host_msg);
+        append_str(out, &len, host);
+        append_str(out, &len, "\r\n");
     }
-    detailed[i] = 0;
-}
\ No newline at end of file
+    if (!flaga)
+        append_str(out, &len, user_agent_hdr);
+    if (!flagc)
+        append_str(out, &len, connection_msg);
+    if (cond)
+        append_str(out, &len, cond);
+    append_str(out, &len, "\r\n");
+
+    *lenp = len;
+    return out;
+}
@@ -0,0 +1,47 @@
+/*
+ * proxy.h - definitions shared by the modules of the proxy
+ */
+#ifndef __PROXY_H__
+#define __PROXY_H__
+
+#include "csapp.h"
+#include "reqparse.h"
+
+/* Recommended max cache and object sizes */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+/* Freshness of the responses that do not give theirs, s */
+#define DEFAULT_TTL 60          /* fresh for... */
+#define DEFAULT_SWR 10          /* ... then served while revalidated for */
+
+/* Deadlines of a fetch, s */
+#define CONNECT_TIMEOUT 5       /* to connect to the server, */
+#define TTFB_TIMEOUT 30         /* then for the response head, */
+#define IDLE_TIMEOUT 30         /* then between reads of the body */
+
+/* Fetches a loop runs at once; more requests wait their client's turn */
+#define FETCH_MAX 256
+
+/* Set by SIGUSR1: print the statistics of the proxy (proxy.c) */
+extern volatile sig_atomic_t print_stats;
+
+/* Relay bodies with splice rather than read/write (proxy.c) */
+extern int zero_copy;
+
+/* Freshness of the responses that do not give theirs ("-F", proxy.c) */
+extern int default_ttl, default_swr;
+
+/* Deadlines of a fetch ("-W", proxy.c), and the percentile of the times
+ * to first byte past which a request is hedged ("-E", 0 for never) */
+extern int connect_timeout, ttfb_timeout, idle_timeout;
+extern int hedge_pct;
+
+/* Fetches a loop runs at once ("-S", proxy.c) */
+extern int fetch_max;
+
+/* Request rewriting (proxy.c) */
+char *build_request(req_parser_t *rp, char *host, strview_t path, char *cond,
+                    size_t *lenp);
+
+#endif /* __PROXY_H__ */
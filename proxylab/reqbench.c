@@ -0,0 +1,185 @@
+/*
+ * reqbench.c - parse throughput of the request parser
+ *
+ * usage: ./reqbench [-n <iterations>] [-c <chunk>]
+ *
+ * Parses a set of typical request heads many times and prints requests
+ * and megabytes per second for:
+ *   whole  - req_parse on the complete head
+ *   split  - req_parse called after every <chunk> bytes, as when a head
+ *            arrives over several reads
+ *   lines  - the line at a time parsing req_parse replaced: copy each
+ *            line into a MAXLINE buffer, sscanf the request line and
+ *            compare every header name with strncasecmp
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include "reqparse.h"
+
+#define MAXLINE 8192
+
+static const char *requests[] = {
+    "GET http://localhost:15213/home.html HTTP/1.0\r\n"
+    "Host: localhost:15213\r\n"
+    "\r\n",
+
+    "GET http://www.example.com/index.html HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "\r\n",
+
+    "GET http://cdn.example.com/static/js/app.3f9c2d1e.js?v=20240101 HTTP/1.1\r\n"
+    "Host: cdn.example.com\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "Referer: http://www.example.com/index.html\r\n"
+    "Cookie: session=4b1d0e6f2c9a8e7d6c5b4a39281706f5; theme=dark; lang=en\r\n"
+    "If-None-Match: \"5f3c-1a2b3c4d\"\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "\r\n",
+};
+
+#define NREQUESTS (sizeof(requests) / sizeof(requests[0]))
+
+/* A parser: 1 if it parsed the request and found its Host */
+typedef int (*parse_func_t)(const char *req, size_t len);
+
+static size_t chunk = 64;       /* bytes added per call of the split parser */
+
+static double now(void);
+static int parse_whole(const char *req, size_t len);
+static int parse_split(const char *req, size_t len);
+static int parse_lines(const char *req, size_t len);
+static void run(const char *name, parse_func_t parse, long iters);
+
+int main(int argc, char **argv){
+    long iters = 1000000;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:c:")) != -1){
+        switch (c){
+        case 'n':
+            iters = atol(optarg);
+            break;
+        case 'c':
+            chunk = atol(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n <iterations>] [-c <chunk>]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (iters < 1 || chunk < 1){
+        fprintf(stderr, "%s: iterations and chunk must be positive\n", argv[0]);
+        exit(1);
+    }
+    printf("%-6s %12s %10s %10s\n", "parser", "requests/s", "MB/s", "ns/req");
+    run("whole", parse_whole, iters);
+    run("split", parse_split, iters);
+    run("lines", parse_lines, iters);
+    return 0;
+}
+
+/* run : time iters rounds of parsing every request with one parser */
+static void run(const char *name, parse_func_t parse, long iters){
+    size_t lens[NREQUESTS], bytes = 0;
+    long i, ok = 0;
+    unsigned j;
+    double start, secs;
+
+    for (j = 0; j < NREQUESTS; j++)
+        lens[j] = strlen(requests[j]);
+
+    start = now();
+    for (i = 0; i < iters; i++){
+        for (j = 0; j < NREQUESTS; j++){
+            ok += parse(requests[j], lens[j]);
+            bytes += lens[j];
+        }
+    }
+    secs = now() - start;
+
+    if (ok != iters * (long)NREQUESTS){
+        fprintf(stderr, "%s: %ld of %ld requests not parsed\n",
+                name, iters * (long)NREQUESTS - ok, iters * (long)NREQUESTS);
+        exit(1);
+    }
+    printf("%-6s %12.0f %10.1f %10.1f\n", name, ok / secs, bytes / secs / 1e6,
+           secs * 1e9 / ok);
+}
+
+/* parse_whole : parse a complete head; 1 if it is a request with a Host */
+static int parse_whole(const char *req, size_t len){
+    req_parser_t rp;
+
+    req_init(&rp);
+    if (req_parse(&rp, req, len) != REQ_DONE)
+        return 0;
+    return req_header(&rp, "Host") != NULL;
+}
+
+/* parse_split : parse a head as it grows chunk bytes at a time */
+static int parse_split(const char *req, size_t len){
+    req_parser_t rp;
+    size_t have = 0;
+    int rc = REQ_PARTIAL;
+
+    req_init(&rp);
+    while (rc == REQ_PARTIAL && have < len){
+        have = have + chunk < len ? have + chunk : len;
+        rc = req_parse(&rp, req, have);
+    }
+    if (rc != REQ_DONE)
+        return 0;
+    return req_header(&rp, "Host") != NULL;
+}
+
+/* parse_lines : the old way, a line at a time through MAXLINE buffers */
+static int parse_lines(const char *req, size_t len){
+    char line[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char host[MAXLINE];
+    const char *p = req, *end = req + len, *nl;
+    int first = 1, found = 0;
+
+    while (p < end && (nl = memchr(p, '\n', end - p))){
+        size_t n = nl + 1 - p;
+
+        memcpy(line, p, n);
+        line[n] = 0;
+        p = nl + 1;
+        if (first){
+            if (sscanf(line, "%s %s %s", method, uri, version) != 3)
+                return 0;
+            first = 0;
+            continue;
+        }
+        if (!strcmp(line, "\r\n"))
+            return found;
+        if (!strncasecmp(line, "Host:", 5)){
+            strcpy(host, line + 5);
+            found = 1;
+        }
+    }
+    return 0;
+}
+
+/* now : seconds on the monotonic clock */
+static double now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
@@ -0,0 +1,305 @@
+/*
+ * reqparse.c - incremental HTTP/1.x request head parser, shared by the
+ *              proxy and tiny
+ *
+ * req_parse is called on a buffer each time more of the request has been
+ * read into it, and picks up at the first line it has not parsed yet, so
+ * a head split across any number of reads is scanned only once. It copies
+ * nothing: the method, URI, version and headers are views into the buffer,
+ * valid as long as the buffer is. Lines may end with CRLF or a bare LF.
+ *
+ * Each header name is looked up once, in a perfect hash of the names the
+ * proxy and tiny care about (hdr_id_t): one table slot and at most one
+ * strncasecmp, instead of a strncasecmp against every name wanted.
+ *
+ * The delimiters are found 16 bytes at a time with SSE2 where the
+ * compiler provides it (every x86-64 compiler does), and with memchr
+ * elsewhere.
+ */
+#include <string.h>
+#include <strings.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "reqparse.h"
+
+/* States of the parser */
+enum { RP_LINE, RP_HEADERS, RP_DONE, RP_ERROR };
+
+/* The slot of a header name: its length plus its first letter, which
+ * happens to be different for every name of hdr_id_t. A name added there
+ * must get a slot of its own (gcc -Woverride-init tells). */
+#define HDR_SLOTS 32
+#define HDR_SLOT(len, c) (((len) + ((c) | 0x20)) & (HDR_SLOTS - 1))
+
+static const char *hdr_names[NHDRS] = {
+    [HDR_HOST] = "Host",
+    [HDR_USER_AGENT] = "User-Agent",
+    [HDR_ACCEPT] = "Accept",
+    [HDR_CONNECTION] = "Connection",
+    [HDR_PROXY_CONNECTION] = "Proxy-Connection",
+    [HDR_KEEP_ALIVE] = "Keep-Alive",
+    [HDR_IF_NONE_MATCH] = "If-None-Match",
+    [HDR_IF_MODIFIED_SINCE] = "If-Modified-Since",
+};
+
+static const unsigned char hdr_slots[HDR_SLOTS] = {
+    [HDR_SLOT(4, 'H')] = HDR_HOST,
+    [HDR_SLOT(10, 'U')] = HDR_USER_AGENT,
+    [HDR_SLOT(6, 'A')] = HDR_ACCEPT,
+    [HDR_SLOT(10, 'C')] = HDR_CONNECTION,
+    [HDR_SLOT(16, 'P')] = HDR_PROXY_CONNECTION,
+    [HDR_SLOT(10, 'K')] = HDR_KEEP_ALIVE,
+    [HDR_SLOT(13, 'I')] = HDR_IF_NONE_MATCH,
+    [HDR_SLOT(17, 'I')] = HDR_IF_MODIFIED_SINCE,
+};
+
+static const char *scan(const char *p, const char *end, char c);
+static int parse_line(req_parser_t *rp, const char *line, const char *eol);
+static int parse_header(req_parser_t *rp, const char *line, const char *eol);
+static strview_t trim(const char *p, const char *end);
+
+/* req_init : prepare rp for a new request */
+void req_init(req_parser_t *rp){
+    rp->state = RP_LINE;
+    rp->off = rp->scanned = 0;
+    rp->nheaders = 0;
+    rp->head_len = 0;
+}
+
+/* req_parse : parse the request head in the len bytes of buf, from where
+ * the last call on the same buffer stopped. The bytes before len must not
+ * change between calls. Return REQ_DONE once the empty line is in,
+ * REQ_PARTIAL if more bytes are needed, or REQ_ERROR. */
+int req_parse(req_parser_t *rp, const char *buf, size_t len){
+    const char *end = buf + len, *line, *nl, *eol;
+
+    while (rp->state == RP_LINE || rp->state == RP_HEADERS){
+        line = buf + rp->off;
+        if (!(nl = scan(line + rp->scanned, end, '\n'))){
+            rp->scanned = end - line;
+            return REQ_PARTIAL;
+        }
+        rp->off = nl + 1 - buf;
+        rp->scanned = 0;
+        eol = (nl > line && nl[-1] == '\r') ? nl - 1 : nl;
+
+        if (rp->state == RP_LINE){
+            // empty lines before a request are ignored (RFC 7230 3.5)
+            if (eol == line)
+                continue;
+            if (parse_line(rp, line, eol) < 0)
+                rp->state = RP_ERROR;
+            else
+                rp->state = RP_HEADERS;
+        }
+        else if (eol == line){
+            rp->state = RP_DONE;
+            rp->head_len = rp->off;
+        }
+        else if (parse_header(rp, line, eol) < 0)
+            rp->state = RP_ERROR;
+    }
+    return rp->state == RP_DONE ? REQ_DONE : REQ_ERROR;
+}
+
+/* hdr_id : which of hdr_id_t the header name of len bytes is */
+hdr_id_t hdr_id(const char *name, size_t len){
+    hdr_id_t id;
+
+    if (!len)
+        return HDR_OTHER;
+    id = hdr_slots[HDR_SLOT(len, (unsigned char)name[0])];
+    if (id && strlen(hdr_names[id]) == len && !strncasecmp(name, hdr_names[id], len))
+        return id;
+    return HDR_OTHER;
+}
+
+/* req_header : the value of the first header called name, or NULL */
+strview_t *req_header(req_parser_t *rp, const char *name){
+    hdr_id_t id = hdr_id(name, strlen(name));
+    int i;
+
+    if (id != HDR_OTHER){
+        for (i = 0; i < rp->nheaders; i++)
+            if (rp->headers[i].id == id)
+                return &rp->headers[i].value;
+        return NULL;
+    }
+    for (i = 0; i < rp->nheaders; i++)
+        if (sv_caseeq(rp->headers[i].name, name))
+            return &rp->headers[i].value;
+    return NULL;
+}
+
+/* req_keepalive : true if the client keeps its connection open after the
+ * response, by default from HTTP/1.1 on */
+int req_keepalive(req_parser_t *rp){
+    int i, closing = 0, keepalive = 0;
+
+    for (i = 0; i < rp->nheaders; i++){
+        req_header_t *h = &rp->headers[i];
+
+        if (h->id == HDR_CONNECTION || h->id == HDR_PROXY_CONNECTION){
+            closing |= sv_has_token(h->value, "close");
+            keepalive |= sv_has_token(h->value, "keep-alive");
+        }
+    }
+    return rp->minor >= 1 ? !closing : keepalive;
+}
+
+/* req_split_uri : split "http://host[:port]/path" into its parts. A URI
+ * that is only a path ("/path", as sent to servers) gives an empty host.
+ * An empty path is "/"; a missing port is "80". */
+void req_split_uri(strview_t uri, strview_t *host, strview_t *port, strview_t *path){
+    strview_t authority;
+    const char *end = uri.p + uri.len, *slash;
+
+    if (uri.len < 7 || strncasecmp(uri.p, "http://", 7)){
+        host->p = uri.p;
+        host->len = 0;
+        port->p = "80";
+        port->len = 2;
+        *path = uri;
+    }
+    else{
+        authority.p = uri.p + 7;
+        if (!(slash = scan(authority.p, end, '/')))
+            slash = end;
+        authority.len = slash - authority.p;
+        req_split_host(authority, host, port);
+        path->p = slash;
+        path->len = end - slash;
+    }
+    if (!path->len){
+        path->p = "/";
+        path->len = 1;
+    }
+}
+
+/* req_split_host : split "host[:port]" (or "[v6 address][:port]"), as in
+ * a URI or a Host header; a missing port is "80" */
+void req_split_host(strview_t authority, strview_t *host, strview_t *port){
+    const char *end = authority.p + authority.len, *colon, *close = NULL;
+
+    if (authority.len && authority.p[0] == '[')
+        close = scan(authority.p, end, ']');
+    if (close){
+        host->p = authority.p + 1;
+        host->len = close - host->p;
+        colon = (close + 1 < end && close[1] == ':') ? close + 1 : NULL;
+    }
+    else{
+        colon = scan(authority.p, end, ':');
+        host->p = authority.p;
+        host->len = (colon ? colon : end) - authority.p;
+    }
+    if (colon && colon + 1 < end){
+        port->p = colon + 1;
+        port->len = end - port->p;
+    }
+    else{
+        port->p = "80";
+        port->len = 2;
+    }
+}
+
+/* sv_eq : true if v holds the string s */
+int sv_eq(strview_t v, const char *s){
+    return strlen(s) == v.len && !memcmp(v.p, s, v.len);
+}
+
+/* sv_caseeq : true if v holds the string s, ignoring case */
+int sv_caseeq(strview_t v, const char *s){
+    return strlen(s) == v.len && !strncasecmp(v.p, s, v.len);
+}
+
+/* sv_has_token : true if the comma-separated list v holds token */
+int sv_has_token(strview_t v, const char *token){
+    const char *p = v.p, *end = v.p + v.len, *comma;
+
+    while (p < end){
+        if (!(comma = scan(p, end, ',')))
+            comma = end;
+        if (sv_caseeq(trim(p, comma), token))
+            return 1;
+        p = comma + 1;
+    }
+    return 0;
+}
+
+/* scan : the first c in [p, end), or NULL */
+static const char *scan(const char *p, const char *end, char c){
+#ifdef __SSE2__
+    __m128i want = _mm_set1_epi8(c);
+
+    for (; end - p >= 16; p += 16){
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, want));
+
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    for (; p < end; p++)
+        if (*p == c)
+            return p;
+    return NULL;
+#else
+    return p < end ? memchr(p, c, end - p) : NULL;
+#endif
+}
+
+/* parse_line : parse the request line, e.g. "GET /home.html HTTP/1.1" */
+static int parse_line(req_parser_t *rp, const char *line, const char *eol){
+    const char *sp1, *sp2;
+
+    if (!(sp1 = scan(line, eol, ' ')) || !(sp2 = scan(sp1 + 1, eol, ' ')))
+        return -1;
+    rp->method.p = line;
+    rp->method.len = sp1 - line;
+    rp->uri.p = sp1 + 1;
+    rp->uri.len = sp2 - (sp1 + 1);
+    rp->version.p = sp2 + 1;
+    rp->version.len = eol - (sp2 + 1);
+    if (!rp->method.len || !rp->uri.len || rp->version.len != 8 ||
+        memcmp(rp->version.p, "HTTP/1.", 7) ||
+        rp->version.p[7] < '0' || rp->version.p[7] > '9')
+        return -1;
+    rp->minor = rp->version.p[7] - '0';
+    return 0;
+}
+
+/* parse_header : parse a "Name: value" header line */
+static int parse_header(req_parser_t *rp, const char *line, const char *eol){
+    const char *colon, *p;
+    req_header_t *h;
+
+    if (rp->nheaders == REQ_MAX_HEADERS)
+        return -1;
+    // names have no blanks: this also refuses continuation lines, which
+    // are obsolete (RFC 7230 3.2.4), and blanks before the colon
+    if (!(colon = scan(line, eol, ':')) || colon == line)
+        return -1;
+    for (p = line; p < colon; p++)
+        if (*p == ' ' || *p == '\t')
+            return -1;
+    h = &rp->headers[rp->nheaders++];
+    h->name.p = line;
+    h->name.len = colon - line;
+    h->value = trim(colon + 1, eol);
+    h->id = hdr_id(h->name.p, h->name.len);
+    return 0;
+}
+
+/* trim : [p, end) without leading and trailing blanks */
+static strview_t trim(const char *p, const char *end){
+    strview_t v;
+
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+    v.p = p;
+    v.len = end - p;
+    return v;
+}
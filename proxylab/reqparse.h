@@ -0,0 +1,66 @@
+/*
+ * reqparse.h - incremental HTTP/1.x request head parser, shared by the
+ *              proxy and tiny
+ */
+#ifndef __REQPARSE_H__
+#define __REQPARSE_H__
+
+#include <stddef.h>
+
+#define REQ_MAX_HEADERS 64      /* headers a request may have */
+
+/* Results of req_parse */
+#define REQ_ERROR -1            /* not an HTTP/1.x request head */
+#define REQ_PARTIAL 0           /* the head is not complete yet */
+#define REQ_DONE 1              /* the head is complete */
+
+/* A string inside the buffer being parsed: not NUL terminated, not copied */
+typedef struct {
+    const char *p;
+    size_t len;
+} strview_t;
+
+/* Header names looked for by the proxy and tiny, told apart by the
+ * parser once so that no one compares names again */
+typedef enum {
+    HDR_OTHER,
+    HDR_HOST,
+    HDR_USER_AGENT,
+    HDR_ACCEPT,
+    HDR_CONNECTION,
+    HDR_PROXY_CONNECTION,
+    HDR_KEEP_ALIVE,
+    HDR_IF_NONE_MATCH,
+    HDR_IF_MODIFIED_SINCE,
+    NHDRS
+} hdr_id_t;
+
+typedef struct {
+    strview_t name, value;
+    hdr_id_t id;
+} req_header_t;
+
+/* A request head, parsed as far as the buffer went */
+typedef struct {
+    int state;                  /* request line, headers, or done */
+    size_t off;                 /* start of the first line not parsed */
+    size_t scanned;             /* bytes after off known to hold no '\n' */
+    strview_t method, uri, version;
+    int minor;                  /* HTTP/1.<minor> */
+    int nheaders;
+    req_header_t headers[REQ_MAX_HEADERS];
+    size_t head_len;            /* bytes of the head, with the empty line */
+} req_parser_t;
+
+void req_init(req_parser_t *rp);
+int req_parse(req_parser_t *rp, const char *buf, size_t len);
+hdr_id_t hdr_id(const char *name, size_t len);
+strview_t *req_header(req_parser_t *rp, const char *name);
+int req_keepalive(req_parser_t *rp);
+void req_split_uri(strview_t uri, strview_t *host, strview_t *port, strview_t *path);
+void req_split_host(strview_t authority, strview_t *host, strview_t *port);
+int sv_eq(strview_t v, const char *s);
+int sv_caseeq(strview_t v, const char *s);
+int sv_has_token(strview_t v, const char *token);
+
+#endif /* __REQPARSE_H__ */
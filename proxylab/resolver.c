@@ -0,0 +1,356 @@
+/*
+ * resolver.c - resolver threads and cache of server addresses
+ *
+ * getaddrinfo blocks, so the event loops never call it. A connection
+ * that needs the addresses of a server asks resolve(): a fresh answer
+ * in the cache (or a numeric address) is returned at once; otherwise
+ * the connection waits while one of the resolver threads looks the name
+ * up, and is handed back to its loop with loop_wake(). Connections
+ * asking for a name that is already being looked up wait for the same
+ * lookup.
+ *
+ * Answers are kept for DNS_TTL seconds and failures for DNS_NEG_TTL
+ * seconds (getaddrinfo does not tell the TTL of the records). With a
+ * hosts file, names are looked up in that file instead of the DNS; the
+ * file is read again for every lookup, so editing it shows how the
+ * cache expires.
+ */
+#include "resolver.h"
+#include "loop.h"
+
+#define DNS_BUCKETS 256
+
+/* States of a cached name */
+typedef enum {
+    DNS_PENDING,    /* being looked up */
+    DNS_OK,         /* addresses known */
+    DNS_FAILED      /* the lookup failed */
+} dns_state_t;
+
+typedef struct dns_entry {
+    char *key;                  /* "host:port" */
+    char *host;
+    char portn[20];
+    unsigned long hash;
+    dns_state_t state;
+    int err;                    /* getaddrinfo error of a failure */
+    time_t expires;
+    addr_list_t addrs;
+    conn_t *waiters;            /* connections waiting for the lookup */
+    struct dns_entry *hnext;    /* next entry in the hash bucket */
+    struct dns_entry *newer;    /* entries in the order they were made */
+    struct dns_entry *next_job; /* lookups waiting for a thread */
+} dns_entry_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work = PTHREAD_COND_INITIALIZER;
+static dns_entry_t *buckets[DNS_BUCKETS];
+static dns_entry_t *oldest, *newest;
+static int count;
+static dns_entry_t *jobs, *last_job;
+static char *hosts;             /* hosts file used instead of the DNS */
+static int pos_ttl = DNS_TTL, neg_ttl = DNS_NEG_TTL;
+static resolver_stats_t stats;
+
+static void *resolver_thread(void *vargp);
+static int numeric(char *host, char *portn, addr_list_t *list);
+static int lookup(char *host, char *portn, addr_list_t *list);
+static int lookup_hosts(char *host, char *portn, addr_list_t *list);
+static void add_addr(addr_list_t *list, int family, void *sa, socklen_t len);
+static void start_lookup(dns_entry_t *e);
+static void trim(int max);
+static time_t now(void);
+
+/* resolver_init : start nthreads resolver threads. hosts_file, if not
+ * NULL, stands in for the DNS. ttl and nttl are how long answers and
+ * failures are cached. */
+void resolver_init(int nthreads, char *hosts_file, int ttl, int nttl){
+    pthread_t tid;
+    int i;
+
+    hosts = hosts_file;
+    pos_ttl = ttl;
+    neg_ttl = nttl;
+    for (i = 0; i < nthreads; i++){
+        Pthread_create(&tid, NULL, resolver_thread, NULL);
+        Pthread_detach(tid);
+    }
+}
+
+/* resolve : find the addresses of host:portn (key) for the connection c.
+ * Return 1 if the answer is known now: it is in c->addrs, or the error in
+ * c->resolve_err. Return 0 if c has to wait; the resolver hands it back to
+ * its loop with loop_wake() once the answer is known. */
+int resolve(conn_t *c, char *key, char *host, char *portn){
+    unsigned long h = 5381;
+    dns_entry_t *e;
+    char *p;
+
+    // numeric addresses need no lookup
+    if (numeric(host, portn, &c->addrs)){
+        c->resolve_err = 0;
+        return 1;
+    }
+
+    for (p = key; *p; p++)
+        h = h * 33 + (unsigned char)*p;
+
+    pthread_mutex_lock(&lock);
+    stats.lookups++;
+    for (e = buckets[h % DNS_BUCKETS]; e; e = e->hnext)
+        if (e->hash == h && !strcmp(e->key, key))
+            break;
+
+    if (e && e->state != DNS_PENDING && e->expires > now()){
+        if (e->state == DNS_OK){
+            stats.hits++;
+            c->addrs = e->addrs;
+            c->resolve_err = 0;
+        }
+        else{
+            stats.negative_hits++;
+            c->resolve_err = e->err;
+        }
+        pthread_mutex_unlock(&lock);
+        return 1;
+    }
+
+    if (!e){
+        trim(DNS_CACHE_MAX - 1);
+        e = (dns_entry_t *)Malloc(sizeof(dns_entry_t));
+        e->key = (char *)Malloc(strlen(key) + 1);
+        strcpy(e->key, key);
+        e->host = (char *)Malloc(strlen(host) + 1);
+        strcpy(e->host, host);
+        strcpy(e->portn, portn);
+        e->hash = h;
+        e->waiters = NULL;
+        e->hnext = buckets[h % DNS_BUCKETS];
+        buckets[h % DNS_BUCKETS] = e;
+        e->newer = NULL;
+        if (newest)
+            newest->newer = e;
+        else
+            oldest = e;
+        newest = e;
+        count++;
+        start_lookup(e);
+    }
+    else if (e->state == DNS_PENDING)
+        stats.joined++;
+    else
+        // expired: look it up again
+        start_lookup(e);
+
+    c->next_woken = e->waiters;
+    e->waiters = c;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+/* resolve_cached : the addresses of host:portn (key) in list, if they
+ * are known without a lookup. Return 1 if they are, else 0. */
+int resolve_cached(char *key, char *host, char *portn, addr_list_t *list){
+    unsigned long h = 5381;
+    dns_entry_t *e;
+    char *p;
+    int found = 0;
+
+    if (numeric(host, portn, list))
+        return 1;
+    for (p = key; *p; p++)
+        h = h * 33 + (unsigned char)*p;
+
+    pthread_mutex_lock(&lock);
+    for (e = buckets[h % DNS_BUCKETS]; e; e = e->hnext)
+        if (e->hash == h && !strcmp(e->key, key))
+            break;
+    if (e && e->state == DNS_OK && e->expires > now()){
+        *list = e->addrs;
+        found = 1;
+    }
+    pthread_mutex_unlock(&lock);
+    return found;
+}
+
+/* resolver_print_stats : print the counters of the resolver */
+void resolver_print_stats(FILE *fp){
+    resolver_stats_t st;
+
+    pthread_mutex_lock(&lock);
+    st = stats;
+    pthread_mutex_unlock(&lock);
+    fprintf(fp, "dns: %lu lookups, %lu hits, %lu negative hits, %lu joined\n",
+            st.lookups, st.hits, st.negative_hits, st.joined);
+    fprintf(fp, "dns: %lu resolved, %lu failed, %d names cached\n",
+            st.resolved, st.failed, count);
+}
+
+/* resolver_thread : look up the names that connections wait for */
+static void *resolver_thread(void *vargp){
+    dns_entry_t *e;
+    conn_t *c, *next;
+    addr_list_t addrs;
+    int err;
+
+    while(1){
+        pthread_mutex_lock(&lock);
+        while (!jobs)
+            pthread_cond_wait(&work, &lock);
+        e = jobs;
+        if (!(jobs = e->next_job))
+            last_job = NULL;
+        pthread_mutex_unlock(&lock);
+
+        // pending entries are never freed, so e->host stays valid
+        err = lookup(e->host, e->portn, &addrs);
+
+        pthread_mutex_lock(&lock);
+        e->state = err ? DNS_FAILED : DNS_OK;
+        e->err = err;
+        e->addrs = addrs;
+        e->expires = now() + (err ? neg_ttl : pos_ttl);
+        c = e->waiters;
+        e->waiters = NULL;
+        if (err)
+            stats.failed++;
+        else
+            stats.resolved++;
+        pthread_mutex_unlock(&lock);
+
+        for (; c; c = next){
+            next = c->next_woken;
+            c->addrs = addrs;
+            c->resolve_err = err;
+            loop_wake(c->loop, c);
+        }
+    }
+    return NULL;
+}
+
+/* numeric : fill list if host is a numeric IPv4 or IPv6 address */
+static int numeric(char *host, char *portn, addr_list_t *list){
+    struct sockaddr_in sin;
+    struct sockaddr_in6 sin6;
+
+    list->n = 0;
+    memset(&sin, 0, sizeof(sin));
+    memset(&sin6, 0, sizeof(sin6));
+    if (inet_pton(AF_INET, host, &sin.sin_addr) == 1){
+        sin.sin_family = AF_INET;
+        sin.sin_port = htons(atoi(portn));
+        add_addr(list, AF_INET, &sin, sizeof(sin));
+    }
+    else if (inet_pton(AF_INET6, host, &sin6.sin6_addr) == 1){
+        sin6.sin6_family = AF_INET6;
+        sin6.sin6_port = htons(atoi(portn));
+        add_addr(list, AF_INET6, &sin6, sizeof(sin6));
+    }
+    return list->n;
+}
+
+/* lookup : resolve host:portn into list; return 0 or a getaddrinfo error */
+static int lookup(char *host, char *portn, addr_list_t *list){
+    struct addrinfo hints, *res, *p;
+    int rc;
+
+    if (hosts)
+        return lookup_hosts(host, portn, list);
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    list->n = 0;
+    if ((rc = getaddrinfo(host, portn, &hints, &res)) != 0)
+        return rc;
+    for (p = res; p; p = p->ai_next)
+        add_addr(list, p->ai_family, p->ai_addr, p->ai_addrlen);
+    freeaddrinfo(res);
+    return list->n ? 0 : EAI_NONAME;
+}
+
+/* lookup_hosts : resolve host:portn from the lines "address name..." of
+ * the hosts file */
+static int lookup_hosts(char *host, char *portn, addr_list_t *list){
+    char line[MAXLINE], *addr, *name, *save;
+    addr_list_t one;
+    FILE *fp;
+
+    list->n = 0;
+    if (!(fp = fopen(hosts, "r")))
+        return EAI_FAIL;
+    while (fgets(line, MAXLINE, fp)){
+        line[strcspn(line, "#")] = 0;
+        if (!(addr = strtok_r(line, " \t\r\n", &save)))
+            continue;
+        while ((name = strtok_r(NULL, " \t\r\n", &save))){
+            if (strcasecmp(name, host))
+                continue;
+            if (numeric(addr, portn, &one))
+                add_addr(list, one.a[0].family, &one.a[0].sa, one.a[0].len);
+            break;
+        }
+    }
+    fclose(fp);
+    return list->n ? 0 : EAI_NONAME;
+}
+
+/* add_addr : append an address to list, if there is room */
+static void add_addr(addr_list_t *list, int family, void *sa, socklen_t len){
+    if (list->n == DNS_MAX_ADDRS || len > sizeof(struct sockaddr_storage))
+        return;
+    list->a[list->n].family = family;
+    list->a[list->n].len = len;
+    memcpy(&list->a[list->n].sa, sa, len);
+    list->n++;
+}
+
+/* start_lookup : queue a lookup for a resolver thread. Called with the
+ * lock held. */
+static void start_lookup(dns_entry_t *e){
+    e->state = DNS_PENDING;
+    e->next_job = NULL;
+    if (last_job)
+        last_job->next_job = e;
+    else
+        jobs = e;
+    last_job = e;
+    pthread_cond_signal(&work);
+}
+
+/* trim : drop the oldest names that are not being looked up while there
+ * are more than max. Called with the lock held. */
+static void trim(int max){
+    dns_entry_t *e, *prev = NULL, **pp;
+
+    for (e = oldest; e && count > max; ){
+        if (e->state == DNS_PENDING){
+            prev = e;
+            e = e->newer;
+            continue;
+        }
+        for (pp = &buckets[e->hash % DNS_BUCKETS]; *pp != e; pp = &(*pp)->hnext)
+            ;
+        *pp = e->hnext;
+        if (prev)
+            prev->newer = e->newer;
+        else
+            oldest = e->newer;
+        if (newest == e)
+            newest = prev;
+        count--;
+
+        Free(e->key);
+        Free(e->host);
+        Free(e);
+        e = prev ? prev->newer : oldest;
+    }
+}
+
+/* now : seconds on the monotonic clock */
+static time_t now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
@@ -0,0 +1,40 @@
+/*
+ * resolver.h - resolver threads and cache of server addresses
+ */
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+#include "csapp.h"
+
+#define RESOLVER_THREADS 4      /* threads running getaddrinfo */
+#define DNS_TTL 60              /* seconds an answer is kept... */
+#define DNS_NEG_TTL 5           /* ... and a failure */
+#define DNS_CACHE_MAX 1024      /* names kept at most */
+#define DNS_MAX_ADDRS 8         /* addresses kept per name */
+
+/* The addresses of a server, copied out of the cache for a connection */
+typedef struct {
+    int n;
+    struct {
+        int family;
+        socklen_t len;
+        struct sockaddr_storage sa;
+    } a[DNS_MAX_ADDRS];
+} addr_list_t;
+
+/* Counters reported by the resolver */
+typedef struct {
+    unsigned long lookups;
+    unsigned long hits, negative_hits;  /* answered from the cache */
+    unsigned long joined;       /* waited for a lookup already running */
+    unsigned long resolved, failed;     /* lookups made by the threads */
+} resolver_stats_t;
+
+struct conn;
+
+void resolver_init(int nthreads, char *hosts_file, int ttl, int neg_ttl);
+int resolve(struct conn *c, char *key, char *host, char *portn);
+int resolve_cached(char *key, char *host, char *portn, addr_list_t *list);
+void resolver_print_stats(FILE *fp);
+
+#endif /* __RESOLVER_H__ */
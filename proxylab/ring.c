@@ -0,0 +1,81 @@
+/*
+ * ring.c - bounded lock-free multi-producer multi-consumer queue of ints
+ *
+ * Each slot carries a sequence number that says whose turn it is: slot i
+ * is free for the push at position p (p & mask == i) when seq == p, and
+ * holds the value for the pop at position p when seq == p + 1. A pusher
+ * (popper) claims its position with a compare-and-swap on head (tail),
+ * fills (empties) the slot, then publishes it by storing the next
+ * sequence number: p + 1 for the pop, p + slots for the push one lap on.
+ * Neither side ever waits for a lock, and the only shared writes are the
+ * CAS on the position and the store of seq.
+ */
+#include "csapp.h"
+#include "ring.h"
+
+/* ring_init : make r a queue of slots entries, a power of two */
+void ring_init(ring_t *r, size_t slots){
+    size_t i;
+
+    if (slots < 2 || (slots & (slots - 1)))
+        app_error("ring size must be a power of two");
+    r->cells = (ring_cell_t *)Malloc(slots * sizeof(ring_cell_t));
+    for (i = 0; i < slots; i++)
+        r->cells[i].seq = i;
+    r->mask = slots - 1;
+    r->head = r->tail = 0;
+}
+
+/* ring_push : queue val; return -1 if the ring is full */
+int ring_push(ring_t *r, int val){
+    size_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED), seq;
+    ring_cell_t *cell;
+    long diff;
+
+    while(1){
+        cell = &r->cells[pos & r->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        diff = (long)seq - (long)pos;
+        if (diff == 0){
+            if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+            // another pusher took pos; pos now holds the new head
+        }
+        else if (diff < 0)
+            // the slot still holds the value pushed a lap ago
+            return -1;
+        else
+            pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+    }
+    cell->val = val;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* ring_pop : take the oldest value into *valp; return -1 if the ring is
+ * empty */
+int ring_pop(ring_t *r, int *valp){
+    size_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED), seq;
+    ring_cell_t *cell;
+    long diff;
+
+    while(1){
+        cell = &r->cells[pos & r->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        diff = (long)seq - (long)(pos + 1);
+        if (diff == 0){
+            if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+            // nothing pushed at pos yet
+            return -1;
+        else
+            pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    }
+    *valp = cell->val;
+    __atomic_store_n(&cell->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
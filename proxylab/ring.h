@@ -0,0 +1,30 @@
+/*
+ * ring.h - bounded lock-free multi-producer multi-consumer queue of ints
+ */
+#ifndef __RING_H__
+#define __RING_H__
+
+#include <stddef.h>
+
+#define CACHE_LINE 64
+
+/* A slot: seq tells whose turn it is (see ring.c) */
+typedef struct {
+    size_t seq;
+    int val;
+} ring_cell_t;
+
+/* The positions are on lines of their own, so that producers and
+ * consumers do not invalidate each other's caches */
+typedef struct {
+    ring_cell_t *cells;
+    size_t mask;                /* slots - 1; slots is a power of two */
+    size_t head __attribute__((aligned(CACHE_LINE)));   /* next to push */
+    size_t tail __attribute__((aligned(CACHE_LINE)));   /* next to pop */
+} ring_t;
+
+void ring_init(ring_t *r, size_t slots);
+int ring_push(ring_t *r, int val);
+int ring_pop(ring_t *r, int *valp);
+
+#endif /* __RING_H__ */
@@ -0,0 +1,193 @@
+/*
+ * stats.c - per-loop latency histograms of the stages of a request
+ *
+ * Every event loop times the stages of the requests it serves (stats.h)
+ * into a stats_t of its own. Only that loop writes it, so an update is a
+ * plain load and store (atomic, so that a reader never sees a torn
+ * value) with no lock and no shared cache line. A request for
+ * STATS_URI sums the loops up, still without a lock: the sum of counters
+ * each read atomically is not a snapshot of one instant, which is good
+ * enough for monitoring.
+ *
+ * The histograms are log-linear, 8 buckets per power of two of
+ * nanoseconds, so a percentile is off by 6% at most.
+ */
+#include "stats.h"
+#include "cache.h"
+#include "clients.h"
+
+#define REPORT_SIZE 8192
+
+#define GET(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define ADD(x, n) __atomic_store_n(&(x), (x) + (n), __ATOMIC_RELAXED)
+
+static const char *stage_names[NSTAGES] = {
+    "accept", "parse", "lookup", "resolve", "connect", "ttfb", "relay"
+};
+
+static stats_t *threads[STATS_MAX];
+static int nthreads;
+
+static int bucket(unsigned long ns);
+static double bucket_value(int b);
+static double percentile(hist_t *h, double p);
+
+/* stats_now : the monotonic clock, in nanoseconds */
+unsigned long stats_now(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/* stats_register : add the statistics of a thread to the reports */
+void stats_register(stats_t *st){
+    int i = __atomic_fetch_add(&nthreads, 1, __ATOMIC_RELAXED);
+
+    if (i >= STATS_MAX)
+        app_error("stats: too many threads");
+    memset(st, 0, sizeof(stats_t));
+    __atomic_store_n(&threads[i], st, __ATOMIC_RELEASE);
+}
+
+/* stats_record : count a stage that took ns nanoseconds. Called by the
+ * thread st belongs to. */
+void stats_record(stats_t *st, stage_t stage, unsigned long ns){
+    hist_t *h = &st->stages[stage];
+
+    ADD(h->count, 1);
+    ADD(h->sum, ns);
+    ADD(h->buckets[bucket(ns)], 1);
+    if (ns > h->max)
+        __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+}
+
+/* stats_count : add n to a counter of the statistics of the calling thread */
+void stats_count(unsigned long *counter, unsigned long n){
+    ADD(*counter, n);
+}
+
+/* stats_report : the statistics of all the threads, as text or JSON, in a
+ * malloc'ed buffer, and its length in *lenp */
+char *stats_report(int json, size_t *lenp){
+    hist_t *sum = (hist_t *)Calloc(NSTAGES, sizeof(hist_t));
+    char *out = (char *)Malloc(REPORT_SIZE);
+    unsigned long requests = 0, relayed = 0, timeouts = 0, hedged = 0, wins = 0, queued = 0;
+    clients_stats_t cls;
+    cache_stats_t cs;
+    stats_t *st;
+    hist_t *h;
+    double secs;
+    size_t n = 0;
+    int i, s, b, count;
+
+    count = GET(nthreads);
+    for (i = 0; i < count && i < STATS_MAX; i++){
+        if (!(st = __atomic_load_n(&threads[i], __ATOMIC_ACQUIRE)))
+            continue;
+        requests += GET(st->requests);
+        relayed += GET(st->relayed);
+        timeouts += GET(st->timeouts);
+        hedged += GET(st->hedged);
+        wins += GET(st->hedge_wins);
+        queued += GET(st->queued);
+        for (s = 0; s < NSTAGES; s++){
+            sum[s].count += GET(st->stages[s].count);
+            sum[s].sum += GET(st->stages[s].sum);
+            if (GET(st->stages[s].max) > sum[s].max)
+                sum[s].max = GET(st->stages[s].max);
+            for (b = 0; b < STATS_BUCKETS; b++)
+                sum[s].buckets[b] += GET(st->stages[s].buckets[b]);
+        }
+    }
+    cache_get_stats(&cs);
+    clients_get_stats(&cls);
+    secs = sum[STAGE_RELAY].sum / 1e9;
+
+    // times in milliseconds
+    if (json){
+        n += snprintf(out + n, REPORT_SIZE - n, "{\"requests\": %lu, \"stages\": {", requests);
+        for (s = 0; s < NSTAGES; s++){
+            h = &sum[s];
+            n += snprintf(out + n, REPORT_SIZE - n,
+                          "%s\"%s\": {\"count\": %lu, \"mean_ms\": %.3f, \"p50_ms\": %.3f, "
+                          "\"p90_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f}",
+                          s ? ", " : "", stage_names[s], h->count,
+                          h->count ? h->sum / 1e6 / h->count : 0.0, percentile(h, 50),
+                          percentile(h, 90), percentile(h, 99), h->max / 1e6);
+        }
+        n += snprintf(out + n, REPORT_SIZE - n,
+                      "}, \"relay\": {\"bytes\": %lu, \"bytes_per_sec\": %.0f}, "
+                      "\"fetches\": {\"timed_out\": %lu, \"hedged\": %lu, \"hedge_wins\": %lu, "
+                      "\"queued\": %lu}, "
+                      "\"clients\": {\"tracked\": %lu, \"refused\": %lu, \"limited\": %lu}, "
+                      "\"cache\": {\"hits\": %lu, \"misses\": %lu, \"objects\": %lu, "
+                      "\"bytes\": %zu}}\n",
+                      relayed, secs > 0 ? relayed / secs : 0.0, timeouts, hedged, wins, queued,
+                      cls.tracked, cls.refused, cls.limited,
+                      cs.hits, cs.misses, cs.objects, cs.bytes);
+    }
+    else{
+        n += snprintf(out + n, REPORT_SIZE - n, "%-8s %10s %10s %10s %10s %10s %10s\n",
+                      "stage", "count", "mean ms", "p50 ms", "p90 ms", "p99 ms", "max ms");
+        for (s = 0; s < NSTAGES; s++){
+            h = &sum[s];
+            n += snprintf(out + n, REPORT_SIZE - n,
+                          "%-8s %10lu %10.3f %10.3f %10.3f %10.3f %10.3f\n",
+                          stage_names[s], h->count,
+                          h->count ? h->sum / 1e6 / h->count : 0.0, percentile(h, 50),
+                          percentile(h, 90), percentile(h, 99), h->max / 1e6);
+        }
+        n += snprintf(out + n, REPORT_SIZE - n,
+                      "requests: %lu\nrelay: %lu bytes, %.1f MB/s while relaying\n"
+                      "fetches: %lu timed out, %lu hedged, %lu won by the hedge, %lu queued\n"
+                      "clients: %lu tracked, %lu connections refused, %lu requests limited\n"
+                      "cache: %lu hits, %lu misses, %lu objects, %zu bytes\n",
+                      requests, relayed, secs > 0 ? relayed / secs / 1e6 : 0.0,
+                      timeouts, hedged, wins, queued,
+                      cls.tracked, cls.refused, cls.limited, cs.hits, cs.misses, cs.objects, cs.bytes);
+    }
+    Free(sum);
+    *lenp = n < REPORT_SIZE ? n : REPORT_SIZE - 1;
+    return out;
+}
+
+/* bucket : the histogram bucket of a time in nanoseconds */
+static int bucket(unsigned long ns){
+    int shift;
+
+    if (ns < 16)
+        return ns;
+    shift = 63 - __builtin_clzl(ns) - 3;
+    return 16 + (shift - 1) * 8 + (int)((ns >> shift) - 8);
+}
+
+/* bucket_value : the middle of a bucket, in nanoseconds */
+static double bucket_value(int b){
+    int shift;
+
+    if (b < 16)
+        return b + 0.5;
+    shift = (b - 16) / 8 + 1;
+    return ((double)((b - 16) % 8 + 8) + 0.5) * (1UL << shift);
+}
+
+/* stats_percentile : the time (ns) within which p percent of the
+ * stages of h were. Called by the thread h belongs to, or on a sum. */
+unsigned long stats_percentile(hist_t *h, double p){
+    unsigned long want = (unsigned long)(h->count * p / 100), seen = 0;
+    int b;
+
+    for (b = 0; b < STATS_BUCKETS; b++){
+        seen += h->buckets[b];
+        // the middle of the bucket, but never above the slowest one
+        if (seen > want)
+            return bucket_value(b) < h->max ? bucket_value(b) : h->max;
+    }
+    return 0;
+}
+
+/* percentile : stats_percentile in ms */
+static double percentile(hist_t *h, double p){
+    return stats_percentile(h, p) / 1e6;
+}
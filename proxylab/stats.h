@@ -0,0 +1,50 @@
+/*
+ * stats.h - per-loop latency histograms of the stages of a request
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "csapp.h"
+
+#define STATS_URI "/__proxy_stats"      /* served by the proxy itself */
+#define STATS_MAX 256                   /* threads that keep statistics */
+#define STATS_BUCKETS (16 + 60 * 8)     /* 8 per power of two of ns */
+
+/* Stages of a request */
+typedef enum {
+    STAGE_ACCEPT,   /* accept, and with -A the wait in the ring */
+    STAGE_PARSE,    /* first byte of the request to its empty line */
+    STAGE_LOOKUP,   /* memory cache and disk tier lookups */
+    STAGE_RESOLVE,  /* server name to addresses */
+    STAGE_CONNECT,  /* connect to the server (not for pooled connections) */
+    STAGE_TTFB,     /* request sent to response head read */
+    STAGE_RELAY,    /* response head read to response relayed */
+    NSTAGES
+} stage_t;
+
+/* Latencies of a stage, in nanoseconds */
+typedef struct {
+    unsigned long count, sum, max;
+    unsigned long buckets[STATS_BUCKETS];
+} hist_t;
+
+/* The statistics of one thread. Only that thread writes them, so it
+ * needs no atomic read-modify-write; readers sum the threads up. */
+typedef struct {
+    hist_t stages[NSTAGES];
+    unsigned long requests;     /* requests started */
+    unsigned long relayed;      /* response bytes relayed from servers */
+    unsigned long timeouts;     /* fetches past a deadline (loop.c) */
+    unsigned long hedged;       /* requests sent again to another address... */
+    unsigned long hedge_wins;   /* ... that it answered first */
+    unsigned long queued;       /* requests that waited for a fetch */
+} stats_t;
+
+unsigned long stats_now(void);
+void stats_register(stats_t *st);
+void stats_record(stats_t *st, stage_t stage, unsigned long ns);
+void stats_count(unsigned long *counter, unsigned long n);
+unsigned long stats_percentile(hist_t *h, double p);
+char *stats_report(int json, size_t *lenp);
+
+#endif /* __STATS_H__ */
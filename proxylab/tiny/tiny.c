@@ -2,13 +2,20 @@
 /*
  * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the 
  *     GET method to serve static and dynamic content.
+ *     Static files carry a Last-Modified and an ETag (from the mtime
+ *     and size of the file), and a request that has either validator
+ *     of the file as it is gets 304 Not Modified.
  */
 #include "csapp.h"
+#include "../reqparse.h"
 
 void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+int read_request(int fd, char *buf, req_parser_t *rp);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
+void serve_static(int fd, char *filename, struct stat *sbuf);
+int not_modified(req_parser_t *rp, struct stat *sbuf);
+void serve_not_modified(int fd, struct stat *sbuf);
+size_t validators(char *buf, size_t size, struct stat *sbuf);
 void get_filetype(char *filename, char *filetype);
 void serve_dynamic(int fd, char *filename, char *cgiargs);
 void clienterror(int fd, char *cause, char *errnum, 
@@ -46,24 +53,35 @@ int main(int argc, char **argv)
 /* $begin doit */
 void doit(int fd) 
 {
-    int is_static;
+    int is_static, rc;
     struct stat sbuf;
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char buf[MAXBUF], method[MAXLINE], uri[MAXLINE];
     char filename[MAXLINE], cgiargs[MAXLINE];
-    rio_t rio;
+    req_parser_t rp;
 
     /* Read request line and headers */
-    Rio_readinitb(&rio, fd);
-    if (!Rio_readlineb(&rio, buf, MAXLINE))  //line:netp:doit:readrequest
+    if (!(rc = read_request(fd, buf, &rp)))              //line:netp:doit:readrequest
         return;
-    printf("%s", buf);
-    sscanf(buf, "%s %s %s", method, uri, version);       //line:netp:doit:parserequest
-    if (strcasecmp(method, "GET")) {                     //line:netp:doit:beginrequesterr
+    if (rc < 0) {
+        clienterror(fd, "request", "400", "Bad Request",
+                    "Tiny couldn't parse the request");
+        return;
+    }
+    printf("%.*s", (int)rp.head_len, buf);
+    if (!sv_caseeq(rp.method, "GET")) {                  //line:netp:doit:beginrequesterr
+        snprintf(method, MAXLINE, "%.*s", (int)rp.method.len, rp.method.p);
         clienterror(fd, method, "501", "Not Implemented",
                     "Tiny does not implement this method");
         return;
     }                                                    //line:netp:doit:endrequesterr
-    read_requesthdrs(&rio);                              //line:netp:doit:readrequesthdrs
+    /* Leave room for "." and "home.html" in filename */
+    if (rp.uri.len > MAXLINE - 16) {
+        clienterror(fd, "URI", "414", "URI Too Long",
+                    "Tiny couldn't take a URI this long");
+        return;
+    }
+    memcpy(uri, rp.uri.p, rp.uri.len);
+    uri[rp.uri.len] = '\0';
 
     /* Parse URI from GET request */
     is_static = parse_uri(uri, filename, cgiargs);       //line:netp:doit:staticcheck
@@ -79,7 +97,11 @@ void doit(int fd)
 			"Tiny couldn't read the file");
 	    return;
 	}
-	serve_static(fd, filename, sbuf.st_size);        //line:netp:doit:servestatic
+	if (not_modified(&rp, &sbuf)) {
+	    serve_not_modified(fd, &sbuf);
+	    return;
+	}
+	serve_static(fd, filename, &sbuf);               //line:netp:doit:servestatic
     }
     else { /* Serve dynamic content */
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) { //line:netp:doit:executable
@@ -93,22 +115,31 @@ void doit(int fd)
 /* $end doit */
 
 /*
- * read_requesthdrs - read HTTP request headers
+ * read_request - read the request line and headers into buf (MAXBUF
+ *     bytes) and parse them as they arrive; return 1 when the head is
+ *     in, 0 if the client closed first, -1 if the head is malformed
+ *     or too long
  */
-/* $begin read_requesthdrs */
-void read_requesthdrs(rio_t *rp) 
+/* $begin read_request */
+int read_request(int fd, char *buf, req_parser_t *rp) 
 {
-    char buf[MAXLINE];
+    size_t len = 0;
+    ssize_t n;
+    int rc;
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
-    while(strcmp(buf, "\r\n")) {          //line:netp:readhdrs:checkterm
-	Rio_readlineb(rp, buf, MAXLINE);
-	printf("%s", buf);
+    req_init(rp);
+    while ((rc = req_parse(rp, buf, len)) == REQ_PARTIAL) {
+	if (len == MAXBUF)
+	    return -1;
+	if ((n = read(fd, buf + len, MAXBUF - len)) < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return 0;
+	len += n;
     }
-    return;
+    return rc == REQ_DONE ? 1 : -1;
 }
-/* $end read_requesthdrs */
+/* $end read_request */
 
 /*
  * parse_uri - parse URI into filename and CGI args
@@ -146,19 +177,21 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
  * serve_static - copy a file back to the client 
  */
 /* $begin serve_static */
-void serve_static(int fd, char *filename, int filesize) 
+void serve_static(int fd, char *filename, struct stat *sbuf) 
 {
-    int srcfd;
+    int srcfd, filesize = sbuf->st_size;
     char *srcp, filetype[MAXLINE], buf[MAXBUF];
+    size_t n;
  
     /* Send response headers to client */
     get_filetype(filename, filetype);       //line:netp:servestatic:getfiletype
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");    //line:netp:servestatic:beginserve
-    sprintf(buf, "%sServer: Tiny Web Server\r\n", buf);
-    sprintf(buf, "%sConnection: close\r\n", buf);
-    sprintf(buf, "%sContent-length: %d\r\n", buf, filesize);
-    sprintf(buf, "%sContent-type: %s\r\n\r\n", buf, filetype);
-    Rio_writen(fd, buf, strlen(buf));       //line:netp:servestatic:endserve
+    n = snprintf(buf, sizeof(buf), "HTTP/1.0 200 OK\r\n"); //line:netp:servestatic:beginserve
+    n += snprintf(buf + n, sizeof(buf) - n, "Server: Tiny Web Server\r\n");
+    n += snprintf(buf + n, sizeof(buf) - n, "Connection: close\r\n");
+    n += validators(buf + n, sizeof(buf) - n, sbuf);
+    n += snprintf(buf + n, sizeof(buf) - n, "Content-length: %d\r\n", filesize);
+    n += snprintf(buf + n, sizeof(buf) - n, "Content-type: %s\r\n\r\n", filetype);
+    Rio_writen(fd, buf, n);                 //line:netp:servestatic:endserve
     printf("Response headers:\n");
     printf("%s", buf);
 
@@ -170,6 +203,63 @@ void serve_static(int fd, char *filename, int filesize)
     Munmap(srcp, filesize);                 //line:netp:servestatic:munmap
 }
 
+/*
+ * validators - write the Last-Modified and ETag headers of a file to buf
+ *     (size bytes), and return their length
+ */
+size_t validators(char *buf, size_t size, struct stat *sbuf)
+{
+    char date[64];
+
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", gmtime(&sbuf->st_mtime));
+    return snprintf(buf, size, "Last-Modified: %s\r\nETag: \"%lx-%lx\"\r\n",
+                    date, (long)sbuf->st_mtime, (long)sbuf->st_size);
+}
+
+/*
+ * not_modified - true if the request has a validator of the file as it
+ *     is: its ETag in If-None-Match, or else exactly its Last-Modified
+ *     in If-Modified-Since
+ */
+int not_modified(req_parser_t *rp, struct stat *sbuf)
+{
+    strview_t *v;
+    char value[MAXLINE], current[MAXLINE], *p;
+
+    if ((v = req_header(rp, "If-None-Match"))) {
+        if (v->len >= MAXLINE)
+            return 0;
+        memcpy(value, v->p, v->len);
+        value[v->len] = '\0';
+        sprintf(current, "\"%lx-%lx\"", (long)sbuf->st_mtime, (long)sbuf->st_size);
+        return !strcmp(value, "*") || strstr(value, current) != NULL;
+    }
+    if ((v = req_header(rp, "If-Modified-Since"))) {
+        validators(current, sizeof(current), sbuf);
+        p = current + strlen("Last-Modified: ");
+        return (size_t)(strchr(p, '\r') - p) == v->len && !strncmp(p, v->p, v->len);
+    }
+    return 0;
+}
+
+/*
+ * serve_not_modified - tell the client its copy of the file is current
+ */
+void serve_not_modified(int fd, struct stat *sbuf)
+{
+    char buf[MAXBUF];
+    size_t n;
+
+    n = snprintf(buf, sizeof(buf), "HTTP/1.0 304 Not Modified\r\n");
+    n += snprintf(buf + n, sizeof(buf) - n, "Server: Tiny Web Server\r\n");
+    n += snprintf(buf + n, sizeof(buf) - n, "Connection: close\r\n");
+    n += validators(buf + n, sizeof(buf) - n, sbuf);
+    n += snprintf(buf + n, sizeof(buf) - n, "\r\n");
+    Rio_writen(fd, buf, n);
+    printf("Response headers:\n");
+    printf("%s", buf);
+}
+
 /*
  * get_filetype - derive file type from file name
  */
@@ -0,0 +1,40 @@
+/*
+ * zcopy.c - zero-copy relay between sockets through a pipe, and from
+ *           files to sockets
+ *
+ * splice() moves the pages of a socket buffer into a pipe and from the
+ * pipe into another socket without copying them to user space. It is
+ * kept in a file of its own because it needs _GNU_SOURCE, under which
+ * <netdb.h> declares a gai_error that clashes with the one of csapp.h.
+ * sendfile() does the same from the page cache of a file (disk.c).
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include "zcopy.h"
+
+/* zc_pipe : open a non-blocking pipe, as large as we may make it */
+int zc_pipe(int fds[2]){
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0)
+        return -1;
+    // best effort: unprivileged processes are limited by pipe-max-size
+    fcntl(fds[1], F_SETPIPE_SZ, ZC_PIPE_SIZE);
+    return 0;
+}
+
+/* zc_fill : move up to n bytes from the socket from into the pipe */
+ssize_t zc_fill(int from, int pipe_w, size_t n){
+    return splice(from, NULL, pipe_w, NULL, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+
+/* zc_drain : move up to n bytes from the pipe into the socket to */
+ssize_t zc_drain(int pipe_r, int to, size_t n){
+    return splice(pipe_r, NULL, to, NULL, n, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
+
+/* zc_sendfile : send up to n bytes of the file from, at *offp, to the
+ * socket to, and advance *offp */
+ssize_t zc_sendfile(int to, int from, off_t *offp, size_t n){
+    return sendfile(to, from, offp, n);
+}
@@ -0,0 +1,17 @@
+/*
+ * zcopy.h - zero-copy relay between sockets through a pipe, and from
+ *           files to sockets
+ */
+#ifndef __ZCOPY_H__
+#define __ZCOPY_H__
+
+#include <sys/types.h>
+
+#define ZC_PIPE_SIZE (256 * 1024)   /* pipe capacity asked for */
+
+int zc_pipe(int fds[2]);
+ssize_t zc_fill(int from, int pipe_w, size_t n);
+ssize_t zc_drain(int pipe_r, int to, size_t n);
+ssize_t zc_sendfile(int to, int from, off_t *offp, size_t n);
+
+#endif /* __ZCOPY_H__ */